@@ -8,8 +8,59 @@ extern "C" {
 #endif
 
 #include <jd_pretty.h>
+#include <stddef.h>
+#include <stdint.h>
 
-  jd_var *hls__get_syntax(jd_var *m3u8);
+#define HLS_SEG_DISCONTINUITY 1   /* preceded by a discontinuity */
+#define HLS_SEG_URI           2
+#define HLS_SEG_EXTINF        4
+#define HLS_SEG_TITLE         8
+
+  /* A playlist's segments as parallel arrays. uri, duration and title
+   * strings live in one arena; any other tags a segment has are kept
+   * as a jd_var in extra. jd_var records are only made on demand.
+   * start holds the running total of durations before each entry, so
+   * the duration of any tail of the list is elapsed - start[i].
+   */
+  typedef struct {
+    unsigned head, count, size;
+    double *duration;
+    double *start;
+    double elapsed;       /* total duration pushed */
+    size_t *str;          /* uri, duration, title in arena */
+    size_t *text;         /* cached rendering in arena */
+    uint8_t *flags;
+    jd_var **extra;
+    int pending_disc;     /* discontinuity before the next segment */
+
+    char *arena;
+    size_t arena_used, arena_size, arena_dead;
+
+    jd_var view, rec;
+  } hls_segs;
+
+  hls_segs *hls_segs_new(void);
+  void hls_segs_free(hls_segs *ss);
+  void hls_segs_push(hls_segs *ss, jd_var *rec);
+  int hls_segs_push_discontinuity(hls_segs *ss);
+  unsigned hls_segs_retire(hls_segs *ss, unsigned num, jd_var *retired);
+  unsigned hls_segs_count(hls_segs *ss);
+  unsigned hls_segs_span(hls_segs *ss, double *limit);
+  unsigned hls_segs_expired(hls_segs *ss, double min_duration);
+  double hls_segs_total(hls_segs *ss);
+  double hls_segs_duration(hls_segs *ss, unsigned i);
+  const char *hls_segs_uri(hls_segs *ss, unsigned i);
+  int hls_segs_discontinuity(hls_segs *ss, unsigned i);
+  jd_var *hls_segs_extra(hls_segs *ss, unsigned i);
+  jd_var *hls_segs_need_extra(hls_segs *ss, unsigned i);
+  void hls_segs_touch(hls_segs *ss, unsigned i);
+  const char *hls_segs_text(hls_segs *ss, unsigned i);
+  void hls_segs_set_text(hls_segs *ss, unsigned i, const char *text);
+  jd_var *hls_segs_record(jd_var *out, hls_segs *ss, unsigned i);
+  jd_var *hls_segs_view(jd_var *out, hls_segs *ss);
+
+  hls_segs *hls__segs(jd_var *m3u8);
+  jd_var *hls__m3u8_parse(jd_var *out, const char *buf, size_t len);
 
   jd_var *hls_m3u8_init(jd_var *out);
 
@@ -17,23 +68,29 @@ extern "C" {
   jd_var *hls_m3u8_vpl(jd_var *m3u8);
   jd_var *hls_m3u8_meta(jd_var *m3u8);
   jd_var *hls_m3u8_retired(jd_var *m3u8);
+  jd_var *hls_m3u8_pending(jd_var *m3u8);
 
   jd_var *hls_m3u8_last_seg(jd_var *m3u8);
   unsigned hls_m3u8_retire(jd_var *m3u8, unsigned count);
   unsigned hls_m3u8_count(jd_var *m3u8);
   unsigned hls_m3u8_rotate(jd_var *m3u8, unsigned max_seg);
   unsigned hls_m3u8_expire(jd_var *m3u8, double min_duration);
+  unsigned hls_m3u8_expire_parts(jd_var *m3u8, double min_duration);
 
   int hls_m3u8_set_closed(jd_var *m3u8, int closed);
 
   int hls_m3u8_push_playlist(jd_var *m3u8, jd_var *pl);
   int hls_m3u8_push_segment(jd_var *m3u8, jd_var *frag);
   int hls_m3u8_push_discontinuity(jd_var *m3u8);
+  int hls_m3u8_push_part(jd_var *m3u8, jd_var *part);
+  int hls_m3u8_set_hint(jd_var *m3u8, jd_var *hint);
+  int hls_m3u8_set_gap(jd_var *m3u8, const char *uri);
 
   double hls_m3u8_duration(jd_var *m3u8);
   unsigned hls_m3u8_expire(jd_var *m3u8, double min_duration);
 
   jd_var *hls_m3u8_parse(jd_var *out, jd_var *m3u8);
+  jd_var *hls_m3u8_parse_bytes(jd_var *out, const char *buf, size_t len);
   jd_var *hls_m3u8_format(jd_var *out, jd_var *m3u8);
 
   jd_var *hls_m3u8_load(jd_var *m3u8, const char *filename);
@@ -1,16 +1,38 @@
 /* hls_m3u8.c */
 
 #include <math.h>
+#include <string.h>
 
 #include "hls.h"
+#include "hls_m3u8_syntax.h"
+
+/* FNV-1a with a seed chosen by syntax.pl */
+uint32_t hls__syntax_hash(uint32_t seed, const char *name, size_t len) {
+  uint32_t h = seed;
+  while (len--) {
+    h ^= (uint8_t) *name++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static int name_is(const char *name, const char *s, size_t len) {
+  return name && !strncmp(name, s, len) && name[len] == '\0';
+}
 
-extern const char *hls__m3u8_syntax;;
+const hls_tag_syntax *hls__syntax_tag(const char *name, size_t len) {
+  const hls_syntax *syn = &hls__m3u8_syntax;
+  const hls_tag_syntax *ts =
+    &syn->tag[hls__syntax_hash(syn->seed, name, len) & syn->mask];
+  return name_is(ts->name, name, len) ? ts : NULL;
+}
 
-jd_var *hls__get_syntax(jd_var *m3u8) {
-  jd_var *syntax = jd_get_ks(m3u8, "syntax", 1);
-  if (syntax->type == VOID)
-    jd_from_jsons(syntax, hls__m3u8_syntax);
-  return syntax;
+const hls_attr_syntax *hls__syntax_attr(const hls_value_syntax *vs,
+                                        const char *name, size_t len) {
+  if (vs->type != HLS_SYN_ATTR) return NULL;
+  const hls_attr_syntax *as =
+    &vs->attr[hls__syntax_hash(vs->seed, name, len) & vs->mask];
+  return name_is(as->name, name, len) ? as : NULL;
 }
 
 static jd_var *get_array(jd_var *m3u8, const char *name) {
@@ -25,8 +47,45 @@ static jd_var *get_hash(jd_var *m3u8, const char *name) {
   return ar;
 }
 
+static void segs_free(void *ss) {
+  hls_segs_free(ss);
+}
+
+/* The native segment list, or NULL if the segments are still
+ * plain jd_vars in "seg".
+ */
+hls_segs *hls__segs(jd_var *m3u8) {
+  jd_var *idx = jd_get_ks(m3u8, "index", 0);
+  return idx ? jd_ptr(idx) : NULL;
+}
+
+/* Segments are kept in an hls_segs; a "seg" array from a parsed or
+ * hand-built playlist is converted the first time it's needed.
+ */
+static hls_segs *get_segs(jd_var *m3u8) {
+  hls_segs *ss = hls__segs(m3u8);
+  if (ss) return ss;
+
+  ss = hls_segs_new();
+  jd_var *seg = jd_get_ks(m3u8, "seg", 0);
+  if (seg && seg->type == ARRAY) {
+    size_t count = jd_count(seg);
+    for (unsigned i = 0; i < count; i++) {
+      jd_var *s = jd_get_idx(seg, i);
+      if (s->type == STRING) hls_segs_push_discontinuity(ss);
+      else hls_segs_push(ss, s);
+    }
+  }
+
+  jd_delete_ks(m3u8, "seg", NULL);
+  jd_set_object(jd_get_ks(m3u8, "index", 1), ss, segs_free);
+  return ss;
+}
+
+/* A jd_var view of the segments, rebuilt on each call. */
 jd_var *hls_m3u8_seg(jd_var *m3u8) {
-  return get_array(m3u8, "seg");
+  hls_segs *ss = get_segs(m3u8);
+  return hls_segs_view(&ss->view, ss);
 }
 
 jd_var *hls_m3u8_vpl(jd_var *m3u8) {
@@ -41,6 +100,10 @@ jd_var *hls_m3u8_retired(jd_var *m3u8) {
   return get_array(m3u8, "retired");
 }
 
+jd_var *hls_m3u8_pending(jd_var *m3u8) {
+  return get_hash(m3u8, "pending");
+}
+
 jd_var *hls_m3u8_init(jd_var *out) {
   jd_set_hash(out, 4);
   jd_set_hash(jd_lv(out, "$.meta"), 10);
@@ -50,53 +113,29 @@ jd_var *hls_m3u8_init(jd_var *out) {
   return out;
 }
 
-#define IS_DISCONTINUITY(s) ((s)->type == STRING)
-#define IS_SEGMENT(s)       ((s)->type == HASH)
-
+/* A view of the last segment, valid until the next call */
 jd_var *hls_m3u8_last_seg(jd_var *m3u8) {
-  jd_var *seg = hls_m3u8_seg(m3u8);
-  unsigned pos = jd_count(seg);
-  while (pos > 0) {
-    jd_var *s = jd_get_idx(seg, --pos);
-    if (IS_SEGMENT(s)) return s;
-  }
-  return NULL;
+  hls_segs *ss = get_segs(m3u8);
+  unsigned count = hls_segs_count(ss);
+  return count ? hls_segs_record(&ss->rec, ss, count - 1) : NULL;
 }
 
 unsigned hls_m3u8_retire(jd_var *m3u8, unsigned num) {
-  jd_var *seg = hls_m3u8_seg(m3u8);
-  jd_var *retired = hls_m3u8_retired(m3u8);
-
-  size_t count = jd_count(seg);
-  unsigned pos, todo = num;
-
-  for (pos = 0; pos < count; pos++) {
-    if (IS_SEGMENT(jd_get_idx(seg, pos))) {
-      if (todo == 0) break;
-      todo--;
-    }
-  }
-
-  jd_set_array(retired, pos);
-  jd_shift(seg, pos, jd_push(retired, pos));
+  hls_segs *ss = get_segs(m3u8);
+  unsigned count = hls_segs_count(ss);
+  jd_var *retired = jd_set_array(hls_m3u8_retired(m3u8),
+                                 (num < count ? num : count) + 1);
+  unsigned done = hls_segs_retire(ss, num, retired);
 
   jd_var *meta = jd_get_ks(m3u8, "meta", 0);
   jd_var *seq = jd_get_ks(meta, "EXT-X-MEDIA-SEQUENCE", 1);
-  jd_set_int(seq, jd_get_int(seq) + num - todo);
+  jd_set_int(seq, jd_get_int(seq) + done);
 
   return num;
 }
 
-static unsigned count_to(jd_var *m3u8, unsigned count) {
-  jd_var *seg = hls_m3u8_seg(m3u8);
-  unsigned got = 0;
-  for (unsigned i = 0; i < count; i++)
-    if (jd_get_idx(seg, i)->type == HASH) got++;
-  return got;
-}
-
 unsigned hls_m3u8_count(jd_var *m3u8) {
-  return count_to(m3u8, jd_count(hls_m3u8_seg(m3u8)));
+  return hls_segs_count(get_segs(m3u8));
 }
 
 unsigned hls_m3u8_rotate(jd_var *m3u8, unsigned max_seg) {
@@ -110,46 +149,114 @@ int hls_m3u8_push_playlist(jd_var *m3u8, jd_var *pl) {
   return 1;
 }
 
+/* Any pending parts become the parts of this segment */
 int hls_m3u8_push_segment(jd_var *m3u8, jd_var *frag) {
-  jd_assign(jd_push(hls_m3u8_seg(m3u8), 1), frag);
+  hls_segs *ss = get_segs(m3u8);
+  jd_var *pending = jd_get_ks(m3u8, "pending", 0);
+  if (pending && jd_get_ks(pending, "EXT-X-PART", 0)) {
+    scope {
+      jd_var *parts = jd_nv();
+      jd_delete_ks(pending, "EXT-X-PART", parts);
+      if (!jd_get_ks(frag, "EXT-X-PART", 0)) {
+        frag = jd_clone(jd_nv(), frag, 0);
+        jd_assign(jd_get_ks(frag, "EXT-X-PART", 1), parts);
+      }
+      hls_segs_push(ss, frag);
+    }
+    return 1;
+  }
+  hls_segs_push(ss, frag);
   return 1;
 }
 
-int hls_m3u8_push_discontinuity(jd_var *m3u8) {
-  jd_var *seg = hls_m3u8_seg(m3u8);
-
-  if (jd_count(seg) == 0 || IS_DISCONTINUITY(jd_get_idx(seg, -1)))
-    return 0;
+int hls_m3u8_push_part(jd_var *m3u8, jd_var *part) {
+  jd_var *parts = get_array(hls_m3u8_pending(m3u8), "EXT-X-PART");
+  jd_assign(jd_push(parts, 1), part);
+  return 1;
+}
 
-  jd_set_string(jd_push(seg, 1), "EXT-X-DISCONTINUITY");
+/* NULL removes the hint */
+int hls_m3u8_set_hint(jd_var *m3u8, jd_var *hint) {
+  jd_var *pending = hls_m3u8_pending(m3u8);
+  if (!hint) return jd_delete_ks(pending, "EXT-X-PRELOAD-HINT", NULL);
+  jd_var *hints = jd_set_array(jd_get_ks(pending, "EXT-X-PRELOAD-HINT", 1), 1);
+  jd_assign(jd_push(hints, 1), hint);
   return 1;
 }
 
-unsigned duration_span(jd_var *m3u8, double *limit) {
-  jd_var *seg = hls_m3u8_seg(m3u8);
-  unsigned pos = jd_count(seg);
-  double elapsed = 0;
-  while (pos != 0) {
-    jd_var *s = jd_get_idx(seg, --pos);
-    if (IS_DISCONTINUITY(s)) continue;
-    double duration = jd_get_real(jd_rv(s, "$.EXTINF.duration"));
-    elapsed += duration;
-    if (*limit && !isnan(*limit) && elapsed >= *limit) break;
+static int uri_is(jd_var *v, const char *uri) {
+  return v && !strcmp(jd_bytes(v, NULL), uri);
+}
+
+/* Mark the part with uri as a gap; true if it's in parts */
+static int part_gap(jd_var *parts, const char *uri) {
+  for (unsigned i = 0; parts && i < jd_count(parts); i++) {
+    jd_var *part = jd_get_idx(parts, i);
+    if (uri_is(jd_get_ks(part, "URI", 0), uri)) {
+      jd_set_string(jd_get_ks(part, "GAP", 1), "YES");
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Mark the segment or part with uri as missing so players skip it.
+ * Newest first; false if it's not listed (any more).
+ */
+int hls_m3u8_set_gap(jd_var *m3u8, const char *uri) {
+  hls_segs *ss = get_segs(m3u8);
+  jd_var *pending = jd_get_ks(m3u8, "pending", 0);
+  if (pending && part_gap(jd_get_ks(pending, "EXT-X-PART", 0), uri))
+    return 1;
+
+  for (unsigned i = hls_segs_count(ss); i-- != 0;) {
+    const char *su = hls_segs_uri(ss, i);
+    if (su && !strcmp(su, uri)) {
+      jd_set_bool(jd_get_ks(hls_segs_need_extra(ss, i), "EXT-X-GAP", 1), 1);
+      hls_segs_touch(ss, i);
+      return 1;
+    }
+    jd_var *extra = hls_segs_extra(ss, i);
+    if (extra && part_gap(jd_get_ks(extra, "EXT-X-PART", 0), uri)) {
+      hls_segs_touch(ss, i);
+      return 1;
+    }
   }
-  if (*limit) *limit = elapsed;
-  return pos;
+  return 0;
+}
+
+int hls_m3u8_push_discontinuity(jd_var *m3u8) {
+  return hls_segs_push_discontinuity(get_segs(m3u8));
 }
 
 double hls_m3u8_duration(jd_var *m3u8) {
-  double limit = NAN;
-  duration_span(m3u8, &limit);
-  return limit;
+  return hls_segs_total(get_segs(m3u8));
 }
 
 unsigned hls_m3u8_expire(jd_var *m3u8, double min_duration) {
-  unsigned pos = duration_span(m3u8, &min_duration);
-  unsigned count = count_to(m3u8, pos);
-  return hls_m3u8_retire(m3u8, count);
+  unsigned count = hls_segs_expired(get_segs(m3u8), min_duration);
+  return count ? hls_m3u8_retire(m3u8, count) : 0;
+}
+
+/* Drop the parts of segments older than min_duration. They're
+ * appended to the retired list as segments without a uri.
+ */
+unsigned hls_m3u8_expire_parts(jd_var *m3u8, double min_duration) {
+  hls_segs *ss = get_segs(m3u8);
+  jd_var *retired = hls_m3u8_retired(m3u8);
+  unsigned pos = hls_segs_span(ss, &min_duration);
+  unsigned count = 0;
+
+  while (pos != 0) {
+    jd_var *extra = hls_segs_extra(ss, --pos);
+    if (!extra || !jd_get_ks(extra, "EXT-X-PART", 0)) break;
+    jd_var *rec = jd_set_hash(jd_push(retired, 1), 1);
+    jd_delete_ks(extra, "EXT-X-PART", jd_get_ks(rec, "EXT-X-PART", 1));
+    hls_segs_touch(ss, pos);
+    count++;
+  }
+
+  return count;
 }
 
 int hls_m3u8_set_closed(jd_var *m3u8, int closed) {
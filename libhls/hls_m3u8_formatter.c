@@ -4,52 +4,59 @@
 #include <string.h>
 
 #include "hls.h"
+#include "hls_m3u8_syntax.h"
 
-static int is(jd_var *v, const char *s) {
-  return 0 == strcmp(jd_bytes(v, NULL), s);
+static const char *key_name(jd_var *key, size_t *len) {
+  const char *name = jd_bytes(key, len);
+  (*len)--;
+  return name;
 }
 
-static int is_in(jd_var *ar, jd_var *v) {
-  size_t count = jd_count(ar);
-  for (unsigned i = 0; i < count; i++)
-    if (jd_compare(jd_get_idx(ar, i), v) == 0)
-      return 1;
+static int is_in(const char *const *values, jd_var *v) {
+  if (v->type != STRING) return 0;
+  const char *s = jd_bytes(v, NULL);
+  for (; *values; values++)
+    if (!strcmp(*values, s)) return 1;
   return 0;
 }
 
-static jd_var *format_value(jd_var *out, jd_var *spec, jd_var *val);
+static jd_var *format_value(jd_var *out, const hls_value_syntax *vs,
+                            jd_var *val);
 
-static jd_var *format_attr(jd_var *out, jd_var *spec, jd_var *val) {
-  scope {
-    /* setup template structures */
-    jd_var *allow = jd_get_ks(spec, "allow", 0);
-    jd_var *require = jd_get_ks(spec, "require", 0);
-    jd_var *need = jd_nhv(20);
-    jd_var *all = jd_nhv(20);
-    if (allow) jd_merge(all, allow, 0);
-    if (require) {
-      jd_merge(all, require, 0);
-      jd_merge(need, require, 0);
-    }
+static jd_var *missing_attrs(jd_var *out, const hls_value_syntax *vs,
+                             jd_var *val) {
+  jd_set_array(out, vs->required);
+  for (unsigned i = 0; i <= vs->mask; i++) {
+    const hls_attr_syntax *as = &vs->attr[i];
+    if (as->name && as->required && !jd_get_ks(val, as->name, 0))
+      jd_set_string(jd_push(out, 1), as->name);
+  }
+  return jd_sort(out);
+}
 
-    /* format value */
+static jd_var *format_attr(jd_var *out, const hls_value_syntax *vs,
+                           jd_var *val) {
+  scope {
     jd_var *keys = jd_sort(jd_keys(jd_nv(), val));
     size_t count = jd_count(keys);
     jd_var *part = jd_nav(count);
+    unsigned required = 0;
 
-    for (unsigned i = 0; i < jd_count(keys); i++) {
+    for (unsigned i = 0; i < count; i++) {
+      size_t len;
       jd_var *key = jd_get_idx(keys, i);
-      jd_var *sp = jd_get_key(all, key, 0);
-      if (!sp) jd_throw("Unknown attribute %V", key);
-      jd_var *rep = format_value(jd_nv(), sp, jd_get_key(val, key, 0));
+      const char *name = key_name(key, &len);
+      const hls_attr_syntax *as = hls__syntax_attr(vs, name, len);
+      if (!as) jd_throw("Unknown attribute %V", key);
+      jd_var *rep = format_value(jd_nv(), &as->value, jd_get_key(val, key, 0));
       jd_sprintf(jd_push(part, 1), "%V=%V", key, rep);
-      jd_delete_key(need, key, NULL);
+      required += as->required;
     }
 
     /* report missing keys */
-    jd_var *missing = jd_sort(jd_keys(jd_nv(), need));
-    if (jd_count(missing)) {
-      jd_var *list = jd_join(jd_nv(), jd_nsv(", "), missing);
+    if (required != vs->required) {
+      jd_var *list = jd_join(jd_nv(), jd_nsv(", "),
+                             missing_attrs(jd_nv(), vs, val));
       jd_throw("Missing mandatory attributes: %V", list);
     }
 
@@ -59,56 +66,62 @@ static jd_var *format_attr(jd_var *out, jd_var *spec, jd_var *val) {
   return out;
 }
 
-static jd_var *format_value(jd_var *out, jd_var *spec, jd_var *val) {
-  if (spec->type == STRING) {
-    if (is(spec, "br")) {
-      jd_sprintf(out, "%V@%V",
-                 jd_get_ks(val, "length", 0),
-                 jd_get_ks(val, "offset", 0));
-    }
-    else if (is(spec, "extinf")) {
-      jd_sprintf(out, "%V,%V",
-                 jd_get_ks(val, "duration", 0),
-                 jd_get_ks(val, "title", 0));
-    }
-    else if (is(spec, "bs") || is(spec, "f") || is(spec, "i") || is(spec, "res")) {
-      jd_assign(out, val);
-    }
-    else if (is(spec, "zqs")) {
-      jd_to_json(out, val);
-    }
-    else jd_throw("Unknown type: %V", spec);
-  }
-  else if (spec->type == ARRAY) {
-    if (!is_in(spec, val)) jd_throw("Illegal value: %V", val);
+static jd_var *format_value(jd_var *out, const hls_value_syntax *vs,
+                            jd_var *val) {
+  switch (vs->type) {
+  case HLS_SYN_BYTERANGE:
+    jd_sprintf(out, "%V@%V",
+               jd_get_ks(val, "length", 0),
+               jd_get_ks(val, "offset", 0));
+    break;
+  case HLS_SYN_EXTINF:
+    jd_sprintf(out, "%V,%V",
+               jd_get_ks(val, "duration", 0),
+               jd_get_ks(val, "title", 0));
+    break;
+  case HLS_SYN_STRING:
+  case HLS_SYN_FLOAT:
+  case HLS_SYN_INT:
+  case HLS_SYN_RESOLUTION:
     jd_assign(out, val);
-  }
-  else if (spec->type == HASH) {
-    format_attr(out, spec, val);
-  }
-  else {
+    break;
+  case HLS_SYN_QSTRING:
+    jd_to_json(out, val);
+    break;
+  case HLS_SYN_ENUM:
+    if (!is_in(vs->values, val)) jd_throw("Illegal value: %V", val);
+    jd_assign(out, val);
+    break;
+  case HLS_SYN_FLAG:
+    jd_throw("Illegal value: %V", val);
+  case HLS_SYN_ATTR:
+    format_attr(out, vs, val);
+    break;
+  default:
     jd_throw("Bad spec type!");
   }
 
   return out;
 }
 
-static jd_var *format_tag(jd_var *out, jd_var *syn, jd_var *tag, jd_var *val) {
-  scope {
-    jd_var *spec = jd_get_key(syn, tag, 0);
-    if (!spec) jd_throw("Unknown tag: %V", tag);
-    if (spec->type == ARRAY && jd_count(spec) == 0) {
-      jd_sprintf(out, "#%V", tag);
-    }
-    else {
-      jd_var *rep = format_value(jd_nv(), spec, val);
+static jd_var *format_tag(jd_var *out, jd_var *tag, jd_var *val) {
+  size_t len;
+  const char *name = key_name(tag, &len);
+  const hls_tag_syntax *ts = hls__syntax_tag(name, len);
+  if (!ts) jd_throw("Unknown tag: %V", tag);
+  if (ts->value.type == HLS_SYN_FLAG) {
+    jd_sprintf(out, "#%V", tag);
+  }
+  else {
+    scope {
+      jd_var *rep = format_value(jd_nv(), &ts->value, val);
       jd_sprintf(out, "#%V:%V", tag, rep);
     }
   }
   return out;
 };
 
-static void format_record(jd_var *lb, jd_var *syn, jd_var *rec, jd_var *order) {
+static void format_record(jd_var *lb, jd_var *rec, jd_var *order) {
   if (!rec) return;
 
   if (rec->type == STRING) {
@@ -120,6 +133,7 @@ static void format_record(jd_var *lb, jd_var *syn, jd_var *rec, jd_var *order) {
     jd_var *rv = jd_clone(jd_nv(), rec, 0);
     jd_var *uri = jd_nv();
     jd_delete_ks(rv, "uri", uri);
+    jd_delete_ks(rv, "text", NULL);
 
     jd_var *keys = jd_sort(jd_keys(jd_nv(), rv));
     if (order) keys = jd_append(jd_clone(jd_nv(), order, 0), keys);
@@ -131,10 +145,10 @@ static void format_record(jd_var *lb, jd_var *syn, jd_var *rec, jd_var *order) {
       if (!val) continue;
       if (val->type == ARRAY) {
         for (unsigned j = 0; j < jd_count(val); j++)
-          format_tag(jd_push(lb, 1), syn, key, jd_get_idx(val, j));
+          format_tag(jd_push(lb, 1), key, jd_get_idx(val, j));
       }
       else {
-        format_tag(jd_push(lb, 1), syn, key, val);
+        format_tag(jd_push(lb, 1), key, val);
       }
       jd_delete_key(rv, key, NULL);
     }
@@ -144,21 +158,65 @@ static void format_record(jd_var *lb, jd_var *syn, jd_var *rec, jd_var *order) {
   }
 }
 
-static void format_list(jd_var *lb, jd_var *syn, jd_var *list, jd_var *order) {
+/* Records in a list don't change once they've been added so their
+ * rendered text is kept in the record and reused; only new records
+ * are formatted. Anything that does modify a record must delete its
+ * "text".
+ */
+static void format_cached(jd_var *lb, jd_var *rec, jd_var *order) {
+  if (rec->type != HASH) {
+    format_record(lb, rec, order);
+    return;
+  }
+
+  jd_var *text = jd_get_ks(rec, "text", 0);
+  if (!text) {
+    scope {
+      jd_var *rl = jd_nav(4);
+      format_record(rl, rec, order);
+      text = jd_join(jd_get_ks(rec, "text", 1), jd_nsv("\n"), rl);
+    }
+  }
+  jd_assign(jd_push(lb, 1), text);
+}
+
+static void format_list(jd_var *lb, jd_var *list, jd_var *order) {
   for (unsigned i = 0; i < jd_count(list); i++)
-    format_record(lb, syn, jd_get_idx(list, i), order);
+    format_cached(lb, jd_get_idx(list, i), order);
+}
+
+/* As format_cached for segments held in an hls_segs */
+static void format_segs(jd_var *lb, hls_segs *ss, jd_var *order) {
+  unsigned count = hls_segs_count(ss);
+  for (unsigned i = 0; i <= count; i++) {
+    if (hls_segs_discontinuity(ss, i))
+      jd_set_string(jd_push(lb, 1), "#EXT-X-DISCONTINUITY");
+    if (i == count) break;
+
+    if (!hls_segs_text(ss, i)) {
+      scope {
+        jd_var *rl = jd_nav(4);
+        format_record(rl, hls_segs_record(jd_nv(), ss, i), order);
+        hls_segs_set_text(ss, i, jd_bytes(jd_join(jd_nv(), jd_nsv("\n"), rl), NULL));
+      }
+    }
+    jd_set_string(jd_push(lb, 1), hls_segs_text(ss, i));
+  }
 }
 
 jd_var *hls_m3u8_format(jd_var *out, jd_var *m3u8) {
   scope {
-    jd_var *syn = hls__get_syntax(m3u8);
     jd_var *lb = jd_nav(4000);
     jd_set_string(jd_push(lb, 1), "#EXTM3U");
-    jd_var *seg_order = jd_set_array_with(jd_nv(), jd_nsv("EXTINF"), NULL);
-
-    format_record(lb, syn, jd_get_ks(m3u8, "meta", 0), NULL);
-    format_list(lb, syn, jd_get_ks(m3u8, "vpl", 0), NULL);
-    format_list(lb, syn, jd_get_ks(m3u8, "seg", 0), seg_order);
+    jd_var *seg_order = jd_set_array_with(jd_nv(), jd_nsv("EXT-X-PART"),
+                                          jd_nsv("EXTINF"), NULL);
+
+    format_record(lb, jd_get_ks(m3u8, "meta", 0), NULL);
+    format_list(lb, jd_get_ks(m3u8, "vpl", 0), NULL);
+    hls_segs *ss = hls__segs(m3u8);
+    if (ss) format_segs(lb, ss, seg_order);
+    else format_list(lb, jd_get_ks(m3u8, "seg", 0), seg_order);
+    format_record(lb, jd_get_ks(m3u8, "pending", 0), seg_order);
 
     if (jd_get_int(jd_get_ks(m3u8, "closed", 0)))
       jd_set_string(jd_push(lb, 1), "#EXT-X-ENDLIST");
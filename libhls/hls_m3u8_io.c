@@ -1,29 +1,63 @@
 /* hls_m3u8_io.c */
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "hls.h"
 
+typedef struct {
+  void *buf;
+  size_t len;
+} mapping;
 
-static jd_var *load_string(jd_var *out, FILE *f) {
-  char buf[0x10000];
-  size_t got;
+static void unmap(void *ctx) {
+  mapping *map = ctx;
+  if (map->len) munmap(map->buf, map->len);
+  free(map);
+}
 
-  jd_set_empty_string(out, 1);
-  while (got = fread(buf, 1, sizeof(buf), f), got)
-    jd_append_bytes(out, buf, got);
+/* Map a file read only; it's unmapped when the returned var is
+ * released.
+ */
+static jd_var *map_file(jd_var *out, const char *fn, mapping **mp) {
+  int fd = open(fn, O_RDONLY);
+  if (fd < 0) jd_throw("Can't read %s: %m\n", fn);
 
-  if (ferror(f)) jd_throw("I/O error: %m");
+  struct stat st;
+  if (fstat(fd, &st)) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    jd_throw("Can't stat %s: %m\n", fn);
+  }
 
-  return out;
-}
+  void *buf = NULL;
+  if (st.st_size) {
+    buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (buf == MAP_FAILED) {
+      int err = errno;
+      close(fd);
+      errno = err;
+      jd_throw("Can't map %s: %m\n", fn);
+    }
+  }
+  close(fd);
 
-static jd_var *load_file(jd_var *out, const char *fn) {
-  FILE *fl = fopen(fn, "r");
-  if (!fl) jd_throw("Can't read %s: %m\n", fn);
-  jd_var *v = load_string(out, fl);
-  fclose(fl);
-  return v;
+  mapping *map = malloc(sizeof(*map));
+  if (!map) {
+    if (buf) munmap(buf, st.st_size);
+    jd_throw("Out of memory");
+  }
+  map->buf = buf;
+  map->len = st.st_size;
+  jd_set_object(out, map, unmap);
+  *mp = map;
+  return out;
 }
 
 static jd_var *save_string(jd_var *s, FILE *f) {
@@ -43,8 +77,15 @@ static jd_var *save_file(jd_var *s, const char *fn) {
   return s;
 }
 
+/* Segments stay in the native store; use hls_m3u8_parse for plain
+ * jd_vars.
+ */
 jd_var *hls_m3u8_load(jd_var *m3u8, const char *filename) {
-  scope hls_m3u8_parse(m3u8, load_file(jd_nv(), filename));
+  scope {
+    mapping *map;
+    map_file(jd_nv(), filename, &map);
+    hls__m3u8_parse(m3u8, map->buf, map->len);
+  }
   return m3u8;
 }
 
@@ -6,63 +6,75 @@
 
 #include "hls.h"
 
-#define SKIP(lp) while (*(lp) && isspace(*(lp))) (lp)++
-
 #define isattr(c) (((c) >= 'A' && (c) <= 'Z') || (c) == '-')
 #define istag(c)  (isattr(c) || ((c) >= '0' && (c) <= '9'))
 
-static jd_var *parse_string(jd_var *out, const char **lp) {
-  const char *sp = *lp;
-  (*lp)++;
-  while (*(*lp) && *(*lp) != '\"') {
-    if (*(*lp) == '\\')(*lp)++;
-    (*lp)++;
+#define MAX_ATTR 64
+
+/* The parser works on [lp, le) spans of the input buffer, which needn't
+ * be NUL terminated. Values are copied straight into the records being
+ * built; nothing is allocated per line.
+ */
+
+static const char *skip_space(const char *lp, const char *le) {
+  while (lp != le && isspace((unsigned char) *lp)) lp++;
+  return lp;
+}
+
+static const char *parse_string(jd_var *out, const char *lp, const char *le) {
+  const char *sp = lp++;
+  int escaped = 0;
+  while (lp != le && *lp != '\"') {
+    if (*lp == '\\') {
+      escaped = 1;
+      if (++lp == le) break;
+    }
+    lp++;
   }
-  if (*(*lp) != '\"') jd_throw("Missing closing quote");
-  (*lp)++;
-  return jd_from_json(out, jd_set_bytes(jd_nv(), sp, *lp - sp));
+  if (lp == le) jd_throw("Missing closing quote");
+  lp++;
+  if (escaped)
+    scope jd_from_json(out, jd_set_bytes(jd_nv(), sp, lp - sp));
+  else
+    jd_set_bytes(out, sp + 1, lp - sp - 2);
+  return lp;
 }
 
-static jd_var *parse_attr(jd_var *out, const char *linep) {
+static jd_var *parse_attr(jd_var *out, const char *lp, const char *le) {
   jd_set_hash(out, 10);
-  const char *lp = linep; /* avoid longjmp clobber warning */
 
-  scope {
-    for (;;) {
-      jd_var *k, *v;
+  for (;;) {
+    char name[MAX_ATTR];
 
-      SKIP(lp);
-      const char *np = lp;
-      while (*lp && isattr(*lp)) lp++;
-      if (np == lp) jd_throw("Missing attr name");
-      k = jd_set_bytes(jd_nv(), np, lp - np);
+    lp = skip_space(lp, le);
+    const char *np = lp;
+    while (lp != le && isattr(*lp)) lp++;
+    if (np == lp) jd_throw("Missing attr name");
+    if (lp - np >= MAX_ATTR) jd_throw("Attr name too long");
+    memcpy(name, np, lp - np);
+    name[lp - np] = '\0';
 
-      if (*lp != '=') jd_throw("Missing '='");
-      lp++;
+    if (lp == le || *lp != '=') jd_throw("Missing '='");
+    lp++;
 
-      if (*lp == '"') {
-        v = parse_string(jd_nv(), &lp);
-      }
-      else {
-        const char *vp = lp;
-        while (*lp && *lp != ',') lp++;
-        v = jd_set_bytes(jd_nv(), vp, lp - vp);
-      }
-      jd_assign(jd_get_key(out, k, 1), v);
-      if (!*lp) break;
-      if (*lp++ != ',') jd_throw("Missing comma");
+    jd_var *v = jd_get_ks(out, name, 1);
+    if (lp != le && *lp == '"') {
+      lp = parse_string(v, lp, le);
+    }
+    else {
+      const char *vp = lp;
+      while (lp != le && *lp != ',') lp++;
+      jd_set_bytes(v, vp, lp - vp);
     }
+    if (lp == le) break;
+    if (*lp++ != ',') jd_throw("Missing comma");
   }
   return out;
 }
 
-static jd_var *need_attr(jd_var *out, const char *lp) {
-  if (*lp != ':') jd_throw("Missing attibute list");
-  return parse_attr(out, lp + 1);
-}
-
-static int is(jd_var *v, const char *s) {
-  return 0 == strcmp(jd_bytes(v, NULL), s);
+static jd_var *need_attr(jd_var *out, const char *lp, const char *le) {
+  if (lp == le || *lp != ':') jd_throw("Missing attibute list");
+  return parse_attr(out, lp + 1, le);
 }
 
 static jd_int last_offset(jd_var *out) {
@@ -76,123 +88,209 @@ static jd_int last_offset(jd_var *out) {
   return jd_get_int(lbro) + jd_get_int(lbrl);
 }
 
-static void parse_lines(jd_var *out, jd_var *lines) {
+enum {
+  UNKNOWN,
+  EXTM3U,
+  GLOBAL,       /* applies to the segments / playlists that follow */
+  META,         /* playlist level value */
+  META_ATTR,    /* playlist level attribute list */
+  META_LIST,    /* list of playlist level attribute lists */
+  META_FLAG,
+  ENDLIST,
+  STREAM_INF,
+  DISCONTINUITY,
+  EXTINF,
+  SEG_VALUE,
+  SEG_FLAG,
+  SEG_LIST,     /* list of attribute lists before a segment */
+  BYTERANGE
+};
+
+static const struct {
+  const char *name;
+  int kind;
+} tags[] = {
+  { "EXTINF", EXTINF },
+  { "EXT-X-BYTERANGE", BYTERANGE },
+  { "EXT-X-PART", SEG_LIST },
+  { "EXT-X-PROGRAM-DATE-TIME", SEG_VALUE },
+  { "EXT-X-PRELOAD-HINT", SEG_LIST },
+  { "EXT-X-GAP", SEG_FLAG },
+  { "EXT-X-DISCONTINUITY", DISCONTINUITY },
+  { "EXT-X-STREAM-INF", STREAM_INF },
+  { "EXT-X-MAP", GLOBAL },
+  { "EXT-X-KEY", GLOBAL },
+  { "EXT-X-ALLOW-CACHE", META },
+  { "EXT-X-MEDIA-SEQUENCE", META },
+  { "EXT-X-PLAYLIST-TYPE", META },
+  { "EXT-X-TARGETDURATION", META },
+  { "EXT-X-VERSION", META },
+  { "EXT-X-PART-INF", META_ATTR },
+  { "EXT-X-SERVER-CONTROL", META_ATTR },
+  { "EXT-X-MEDIA", META_LIST },
+  { "EXT-X-I-FRAME-STREAM-INF", META_LIST },
+  { "EXT-X-I-FRAMES-ONLY", META_FLAG },
+  { "EXT-X-ENDLIST", ENDLIST },
+  { "EXTM3U", EXTM3U },
+  { NULL, UNKNOWN }
+};
+
+/* Find a tag; the commonest per-segment ones come first. */
+static unsigned find_tag(const char *tp, size_t len) {
+  unsigned i;
+  for (i = 0; tags[i].name; i++)
+    if (!strncmp(tags[i].name, tp, len) && tags[i].name[len] == '\0')
+      break;
+  return i;
+}
+
+static void unknown_tag(const char *tp, size_t len) {
+  scope jd_throw("Unknown tag: %V", jd_set_bytes(jd_nv(), tp, len));
+}
+
+static jd_var *get_list(jd_var *hash, const char *name) {
+  jd_var *slot = jd_get_ks(hash, name, 1);
+  if (slot->type != ARRAY) jd_set_array(slot, 10);
+  return jd_push(slot, 1);
+}
+
+static void parse_buffer(jd_var *out, const char *buf, size_t len) {
   enum { INIT, HLS, HLSSEG, HLSPL, IGNORE } state = INIT;
+  const char *end = buf + len;
 
   scope {
     jd_var *global = jd_nhv(10);
+    jd_var *rec = jd_nv();
     jd_var *seg = NULL;
 
-    for (unsigned ln = 0; ln < jd_count(lines); ln++) {
-      jd_var *line = jd_trim(jd_nv(), jd_get_idx(lines, ln));
-      const char *lp = jd_bytes(line, NULL);
-      if (!*lp) continue;
+    for (const char *next = buf; next != end;) {
+      const char *lp = next;
+      const char *le = memchr(lp, '\n', end - lp);
+      if (le) next = le + 1;
+      else next = le = end;
+
+      lp = skip_space(lp, le);
+      while (le != lp && isspace((unsigned char) le[-1])) le--;
+      if (lp == le) continue;
 
       if (*lp == '#') {
         const char *tp = ++lp;
-        if (!isattr(*lp)) jd_throw("Bad attribute name");
-        while (*lp && istag(*lp)) lp++;
-        jd_var *tag = jd_set_bytes(jd_nv(), tp, lp - tp);
+        if (lp == le || !isattr(*lp)) jd_throw("Bad attribute name");
+        while (lp != le && istag(*lp)) lp++;
+        unsigned t = find_tag(tp, lp - tp);
+        const char *tag = tags[t].name;
+        int kind = tags[t].kind;
+
         switch (state) {
         case INIT:
-          if (is(tag, "EXTM3U"))
+          if (kind == EXTM3U)
             state = HLS;
           break;
         case HLS:
-          if (is(tag, "EXT-X-MAP") || is(tag, "EXT-X-KEY")) {
-            need_attr(jd_get_key(global, tag, 1), lp);
-            break;
-          }
+          switch (kind) {
+          case GLOBAL:
+            need_attr(jd_get_ks(global, tag, 1), lp, le);
+            continue;
 
-          if (is(tag, "EXT-X-ALLOW-CACHE") || is(tag, "EXT-X-MEDIA-SEQUENCE") ||
-              is(tag, "EXT-X-PLAYLIST-TYPE") || is(tag, "EXT-X-TARGETDURATION") ||
-              is(tag, "EXT-X-VERSION")) {
-            if (*lp++ != ':') jd_throw("Missing attribute after %V", tag);
-            jd_set_string(jd_get_key(jd_get_ks(out, "meta", 1), tag, 1), lp);
-            break;
-          }
+          case META:
+            if (lp == le || *lp++ != ':')
+              jd_throw("Missing attribute after %s", tag);
+            jd_set_bytes(jd_get_ks(hls_m3u8_meta(out), tag, 1), lp, le - lp);
+            continue;
 
-          if (is(tag, "EXT-X-MEDIA") || is(tag, "EXT-X-I-FRAME-STREAM-INF")) {
-            jd_var *slot = jd_get_key(jd_get_ks(out, "meta", 1), tag, 1);
-            if (slot->type != ARRAY) jd_set_array(slot, 10);
-            need_attr(jd_push(slot, 1), lp);
-            break;
-          }
+          case META_ATTR:
+            need_attr(jd_get_ks(hls_m3u8_meta(out), tag, 1), lp, le);
+            continue;
 
-          if (is(tag, "EXT-X-I-FRAMES-ONLY")) {
-            if (*lp) jd_throw("Extra text after %V", tag);
-            jd_set_bool(jd_get_key(jd_get_ks(out, "meta", 1), tag, 1), 1);
-            break;
-          }
+          case META_LIST:
+            need_attr(get_list(hls_m3u8_meta(out), tag), lp, le);
+            continue;
+
+          case META_FLAG:
+            if (lp != le) jd_throw("Extra text after %s", tag);
+            jd_set_bool(jd_get_ks(hls_m3u8_meta(out), tag, 1), 1);
+            continue;
 
-          if (is(tag, "EXT-X-ENDLIST")) {
-            if (*lp) jd_throw("Extra text after %V", tag);
-            jd_set_bool(jd_get_ks(out, "closed", 1), 1);
+          case ENDLIST:
+            if (lp != le) jd_throw("Extra text after %s", tag);
+            hls_m3u8_set_closed(out, 1);
             state = IGNORE;
-            break;
-          }
+            continue;
 
-          if (is(tag, "EXT-X-STREAM-INF")) {
-            seg = jd_clone(jd_nv(), global, 0);
-            need_attr(jd_get_key(seg, tag, 1), lp);
+          case STREAM_INF:
+            seg = jd_clone(rec, global, 0);
+            need_attr(jd_get_ks(seg, tag, 1), lp, le);
             state = HLSPL;
-            break;
-          }
+            continue;
 
-          if (is(tag, "EXT-X-DISCONTINUITY")) {
+          case DISCONTINUITY:
             hls_m3u8_push_discontinuity(out);
-            break;
+            continue;
           }
 
           /* fall through */
         case HLSSEG:
-          if (is(tag, "EXTINF")) {
-            if (!seg) seg = jd_nhv(5);
-            if (*lp++ != ':') jd_throw("Missing attributes after %V", tag);
-            jd_var *inf = jd_get_key(seg, tag, 1);
+          switch (kind) {
+          case EXTINF: {
+            if (!seg) seg = jd_set_hash(rec, 5);
+            if (lp == le || *lp++ != ':')
+              jd_throw("Missing attributes after %s", tag);
+            jd_var *inf = jd_get_ks(seg, tag, 1);
             if (inf->type != HASH) jd_set_hash(inf, 2);
-            char *comma = strchr(lp, ',');
-            if (comma) {
-              jd_set_bytes(jd_get_ks(inf, "duration", 1), lp, comma - lp);
-              jd_set_string(jd_get_ks(inf, "title", 1), comma + 1);
-            }
-            else {
-              jd_set_string(jd_get_ks(inf, "duration", 1), lp);
-              jd_set_string(jd_get_ks(inf, "title", 1), "");
-            }
+            const char *comma = memchr(lp, ',', le - lp);
+            if (!comma) comma = le;
+            jd_set_bytes(jd_get_ks(inf, "duration", 1), lp, comma - lp);
+            if (comma != le) comma++;
+            jd_set_bytes(jd_get_ks(inf, "title", 1), comma, le - comma);
             state = HLSSEG;
-            break;
+            continue;
           }
 
-          if (is(tag, "EXT-X-PROGRAM-DATE-TIME")) {
-            if (!seg) seg = jd_nhv(5);
-            if (*lp++ != ':') jd_throw("Missing attributes after %V", tag);
-            jd_set_string(jd_get_key(seg, tag, 1), lp);
+          case SEG_VALUE:
+            if (!seg) seg = jd_set_hash(rec, 5);
+            if (lp == le || *lp++ != ':')
+              jd_throw("Missing attributes after %s", tag);
+            jd_set_bytes(jd_get_ks(seg, tag, 1), lp, le - lp);
             state = HLSSEG;
-            break;
-          }
+            continue;
 
-          if (is(tag, "EXT-X-BYTERANGE")) {
-            if (!seg) seg = jd_nhv(5);
-            if (*lp++ != ':') jd_throw("Missing attributes after %V", tag);
-            jd_var *br = jd_get_key(seg, tag, 1);
+          case SEG_FLAG:
+            if (!seg) seg = jd_set_hash(rec, 5);
+            if (lp != le) jd_throw("Extra text after %s", tag);
+            jd_set_bool(jd_get_ks(seg, tag, 1), 1);
+            state = HLSSEG;
+            continue;
+
+          /* parts come before the segment they belong to */
+          case SEG_LIST:
+            if (!seg) seg = jd_set_hash(rec, 5);
+            need_attr(get_list(seg, tag), lp, le);
+            state = HLSSEG;
+            continue;
+
+          case BYTERANGE: {
+            if (!seg) seg = jd_set_hash(rec, 5);
+            if (lp == le || *lp++ != ':')
+              jd_throw("Missing attributes after %s", tag);
+            jd_var *br = jd_get_ks(seg, tag, 1);
             if (br->type != HASH) jd_set_hash(br, 2);
-            char *sep = strchr(lp, '@');
+            const char *sep = memchr(lp, '@', le - lp);
             if (sep) {
               jd_set_bytes(jd_get_ks(br, "length", 1), lp, sep - lp);
-              jd_set_string(jd_get_ks(br, "offset", 1), sep + 1);
+              jd_set_bytes(jd_get_ks(br, "offset", 1), sep + 1, le - sep - 1);
             }
             else {
-              jd_set_string(jd_get_ks(br, "length", 1), lp);
+              jd_set_bytes(jd_get_ks(br, "length", 1), lp, le - lp);
               jd_set_int(jd_get_ks(br, "offset", 1), last_offset(out));
             }
             state = HLSSEG;
-            break;
+            continue;
+          }
           }
-          jd_throw("Unknown tag: %V", tag);
+          unknown_tag(tp, lp - tp);
           break;
         case HLSPL:
-          jd_throw("Unknown tag: %V", tag);
+          unknown_tag(tp, lp - tp);
           break;
         case IGNORE:
           break;
@@ -204,8 +302,8 @@ static void parse_lines(jd_var *out, jd_var *lines) {
         case HLS:
         case HLSSEG:
         case HLSPL:
-          if (!seg) seg = jd_nhv(5);
-          jd_set_string(jd_get_ks(seg, "uri", 1), lp);
+          if (!seg) seg = jd_set_hash(rec, 5);
+          jd_set_bytes(jd_get_ks(seg, "uri", 1), lp, le - lp);
           if (state == HLSSEG)
             hls_m3u8_push_segment(out, seg);
           else
@@ -220,16 +318,37 @@ static void parse_lines(jd_var *out, jd_var *lines) {
       }
     }
     if (state == INIT) jd_throw("No valid input found");
+
+    /* parts of a segment that isn't finished yet */
+    if (state == HLSSEG && seg)
+      jd_assign(jd_get_ks(out, "pending", 1), seg);
   }
 }
 
-jd_var *hls_m3u8_parse(jd_var *out, jd_var *m3u8) {
-  scope {
-    hls_m3u8_init(out);
-    parse_lines(out, jd_split(jd_nv(), m3u8, jd_nsv("\n")));
+/* Parse into the native segment store */
+jd_var *hls__m3u8_parse(jd_var *out, const char *buf, size_t len) {
+  hls_m3u8_init(out);
+  parse_buffer(out, buf, len);
+  return out;
+}
+
+/* Parse len bytes of buf, which needn't be NUL terminated */
+jd_var *hls_m3u8_parse_bytes(jd_var *out, const char *buf, size_t len) {
+  hls__m3u8_parse(out, buf, len);
+
+  /* return plain jd_vars */
+  if (hls__segs(out)) {
+    jd_assign(jd_get_ks(out, "seg", 1), hls_m3u8_seg(out));
+    jd_delete_ks(out, "index", NULL);
   }
   return out;
 }
 
+jd_var *hls_m3u8_parse(jd_var *out, jd_var *m3u8) {
+  size_t len;
+  const char *buf = jd_bytes(m3u8, &len);
+  return hls_m3u8_parse_bytes(out, buf, len - 1);
+}
+
 /* vim:ts=2:sw=2:sts=2:et:ft=c
  */
@@ -0,0 +1,72 @@
+/* hls_m3u8_syntax.h */
+
+#ifndef HLS_M3U8_SYNTAX_H_
+#define HLS_M3U8_SYNTAX_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+  /* The M3U8 syntax as static tables, generated from syntax.pl into
+   * hls_m3u8_syntax.c. Tags and each tag's attributes are in perfect
+   * hash tables: hls__syntax_hash(seed, name) & mask is the only slot a
+   * name can be in.
+   */
+
+  typedef enum {
+    HLS_SYN_INT,        /* i */
+    HLS_SYN_FLOAT,      /* f */
+    HLS_SYN_QSTRING,    /* zqs - quoted string */
+    HLS_SYN_RESOLUTION, /* res */
+    HLS_SYN_STRING,     /* bs - bare string */
+    HLS_SYN_BYTERANGE,  /* br */
+    HLS_SYN_EXTINF,
+    HLS_SYN_ENUM,
+    HLS_SYN_FLAG,       /* tag with no value */
+    HLS_SYN_ATTR        /* attribute list */
+  } hls_syntax_type;
+
+  typedef struct hls_attr_syntax hls_attr_syntax;
+
+  typedef struct {
+    hls_syntax_type type;
+    const char *const *values;    /* HLS_SYN_ENUM: NULL terminated */
+    const hls_attr_syntax *attr;  /* HLS_SYN_ATTR */
+    uint32_t seed, mask;
+    unsigned required;            /* number of required attributes */
+  } hls_value_syntax;
+
+  struct hls_attr_syntax {
+    const char *name;             /* NULL for an empty slot */
+    int required;
+    hls_value_syntax value;
+  };
+
+  typedef struct {
+    const char *name;             /* NULL for an empty slot */
+    hls_value_syntax value;
+  } hls_tag_syntax;
+
+  typedef struct {
+    const hls_tag_syntax *tag;
+    uint32_t seed, mask;
+  } hls_syntax;
+
+  extern const hls_syntax hls__m3u8_syntax;
+
+  uint32_t hls__syntax_hash(uint32_t seed, const char *name, size_t len);
+  const hls_tag_syntax *hls__syntax_tag(const char *name, size_t len);
+  const hls_attr_syntax *hls__syntax_attr(const hls_value_syntax *vs,
+                                          const char *name, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
@@ -0,0 +1,391 @@
+/* hls_segs.c */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "hls.h"
+
+#define NO_TEXT   ((size_t) -1)
+#define MIN_SIZE  64
+#define MIN_ARENA 4096
+
+static void *grow(void *p, size_t size) {
+  void *np = realloc(p, size);
+  if (!np) jd_throw("Out of memory");
+  return np;
+}
+
+hls_segs *hls_segs_new(void) {
+  hls_segs *ss = grow(NULL, sizeof(*ss));
+  jd_var init = JD_INIT;
+  memset(ss, 0, sizeof(*ss));
+  ss->view = init;
+  ss->rec = init;
+  return ss;
+}
+
+static void free_extra(hls_segs *ss, unsigned i) {
+  if (ss->extra[i]) {
+    jd_release(ss->extra[i]);
+    free(ss->extra[i]);
+    ss->extra[i] = NULL;
+  }
+}
+
+void hls_segs_free(hls_segs *ss) {
+  if (ss) {
+    for (unsigned i = 0; i < ss->count; i++)
+      free_extra(ss, ss->head + i);
+    jd_release(&ss->view);
+    jd_release(&ss->rec);
+    free(ss->duration);
+    free(ss->start);
+    free(ss->str);
+    free(ss->text);
+    free(ss->flags);
+    free(ss->extra);
+    free(ss->arena);
+    free(ss);
+  }
+}
+
+/****************************************************
+ *                                                  *
+ * String arena                                     *
+ *                                                  *
+ ****************************************************/
+
+static size_t str_len(const char *s) {
+  size_t len = strlen(s) + 1;
+  len += strlen(s + len) + 1;
+  return len + strlen(s + len) + 1;
+}
+
+/* Retired entries and stale renderings leave holes; once they're
+ * the bulk of the arena copy the live strings down.
+ */
+static void arena_compact(hls_segs *ss) {
+  size_t size = MIN_ARENA, used = 0;
+  for (unsigned i = ss->head; i < ss->head + ss->count; i++) {
+    used += str_len(ss->arena + ss->str[i]);
+    if (ss->text[i] != NO_TEXT) used += strlen(ss->arena + ss->text[i]) + 1;
+  }
+  while (size < used) size *= 2;
+
+  char *arena = grow(NULL, size);
+  used = 0;
+
+  for (unsigned i = ss->head; i < ss->head + ss->count; i++) {
+    size_t len = str_len(ss->arena + ss->str[i]);
+    memcpy(arena + used, ss->arena + ss->str[i], len);
+    ss->str[i] = used;
+    used += len;
+
+    if (ss->text[i] != NO_TEXT) {
+      len = strlen(ss->arena + ss->text[i]) + 1;
+      memcpy(arena + used, ss->arena + ss->text[i], len);
+      ss->text[i] = used;
+      used += len;
+    }
+  }
+
+  free(ss->arena);
+  ss->arena = arena;
+  ss->arena_size = size;
+  ss->arena_used = used;
+  ss->arena_dead = 0;
+}
+
+static size_t arena_add(hls_segs *ss, const char *s, size_t len) {
+  if (ss->arena_dead > MIN_ARENA && ss->arena_dead > ss->arena_used / 2)
+    arena_compact(ss);
+
+  if (ss->arena_used + len > ss->arena_size) {
+    size_t size = ss->arena_size ? ss->arena_size : MIN_ARENA;
+    while (size < ss->arena_used + len) size *= 2;
+    ss->arena = grow(ss->arena, size);
+    ss->arena_size = size;
+  }
+
+  size_t pos = ss->arena_used;
+  memcpy(ss->arena + pos, s, len);
+  ss->arena_used += len;
+  return pos;
+}
+
+/****************************************************
+ *                                                  *
+ * Entries                                          *
+ *                                                  *
+ ****************************************************/
+
+/* Make room for one more entry at the end */
+static unsigned make_room(hls_segs *ss) {
+  if (ss->head + ss->count == ss->size) {
+    if (ss->head >= ss->size / 2) {
+      /* slide down over retired entries */
+      unsigned h = ss->head, n = ss->count;
+      memmove(ss->duration, ss->duration + h, n * sizeof(*ss->duration));
+      memmove(ss->start, ss->start + h, n * sizeof(*ss->start));
+      memmove(ss->str, ss->str + h, n * sizeof(*ss->str));
+      memmove(ss->text, ss->text + h, n * sizeof(*ss->text));
+      memmove(ss->flags, ss->flags + h, n * sizeof(*ss->flags));
+      memmove(ss->extra, ss->extra + h, n * sizeof(*ss->extra));
+      ss->head = 0;
+    }
+    else {
+      unsigned size = ss->size ? ss->size * 2 : MIN_SIZE;
+      ss->duration = grow(ss->duration, size * sizeof(*ss->duration));
+      ss->start = grow(ss->start, size * sizeof(*ss->start));
+      ss->str = grow(ss->str, size * sizeof(*ss->str));
+      ss->text = grow(ss->text, size * sizeof(*ss->text));
+      ss->flags = grow(ss->flags, size * sizeof(*ss->flags));
+      ss->extra = grow(ss->extra, size * sizeof(*ss->extra));
+      ss->size = size;
+    }
+  }
+  return ss->head + ss->count++;
+}
+
+static const char *scalar(jd_var *out, jd_var *v) {
+  if (!v) return "";
+  if (v->type != STRING) v = jd_sprintf(out, "%V", v);
+  return jd_bytes(v, NULL);
+}
+
+/* uri, duration and title, each NUL terminated */
+static size_t add_strings(hls_segs *ss, const char *uri, const char *dur,
+                          const char *title) {
+  size_t ul = strlen(uri) + 1, dl = strlen(dur) + 1, tl = strlen(title) + 1;
+  char buf[ul + dl + tl];
+  memcpy(buf, uri, ul);
+  memcpy(buf + ul, dur, dl);
+  memcpy(buf + ul + dl, title, tl);
+  return arena_add(ss, buf, sizeof(buf));
+}
+
+/* Keep uri and the EXTINF duration and title natively and anything
+ * else in extra.
+ */
+void hls_segs_push(hls_segs *ss, jd_var *rec) {
+  scope {
+    jd_var *uri = jd_get_ks(rec, "uri", 0);
+    jd_var *inf = jd_get_ks(rec, "EXTINF", 0);
+    jd_var *dur = inf && inf->type == HASH ? jd_get_ks(inf, "duration", 0) : NULL;
+    jd_var *title = dur ? jd_get_ks(inf, "title", 0) : NULL;
+
+    size_t str = add_strings(ss, scalar(jd_nv(), uri), scalar(jd_nv(), dur),
+                             scalar(jd_nv(), title));
+
+    unsigned i = make_room(ss);
+    ss->str[i] = str;
+    ss->text[i] = NO_TEXT;
+    ss->extra[i] = NULL;
+    ss->duration[i] = dur ? jd_get_real(dur) : 0;
+    ss->start[i] = ss->elapsed;
+    ss->elapsed += ss->duration[i];
+    ss->flags[i] = (ss->pending_disc ? HLS_SEG_DISCONTINUITY : 0) |
+                   (uri ? HLS_SEG_URI : 0) | (dur ? HLS_SEG_EXTINF : 0) |
+                   (title ? HLS_SEG_TITLE : 0);
+    ss->pending_disc = 0;
+
+    jd_var *rest = jd_clone(jd_nv(), rec, 0);
+    jd_delete_ks(rest, "uri", NULL);
+    jd_delete_ks(rest, "text", NULL);
+    if (dur) {
+      jd_var *more = jd_clone(jd_nv(), inf, 0);
+      jd_delete_ks(more, "duration", NULL);
+      jd_delete_ks(more, "title", NULL);
+      if (jd_count(more)) jd_assign(jd_get_ks(rest, "EXTINF", 1), more);
+      else jd_delete_ks(rest, "EXTINF", NULL);
+    }
+    if (jd_count(rest)) {
+      jd_var init = JD_INIT;
+      ss->extra[i] = grow(NULL, sizeof(jd_var));
+      *ss->extra[i] = init;
+      jd_assign(ss->extra[i], rest);
+    }
+  }
+}
+
+int hls_segs_push_discontinuity(hls_segs *ss) {
+  if (ss->count == 0 || ss->pending_disc) return 0;
+  ss->pending_disc = 1;
+  return 1;
+}
+
+unsigned hls_segs_count(hls_segs *ss) {
+  return ss->count;
+}
+
+double hls_segs_duration(hls_segs *ss, unsigned i) {
+  return ss->duration[ss->head + i];
+}
+
+const char *hls_segs_uri(hls_segs *ss, unsigned i) {
+  unsigned p = ss->head + i;
+  return (ss->flags[p] & HLS_SEG_URI) ? ss->arena + ss->str[p] : NULL;
+}
+
+int hls_segs_discontinuity(hls_segs *ss, unsigned i) {
+  if (i == ss->count) return ss->pending_disc;
+  return ss->flags[ss->head + i] & HLS_SEG_DISCONTINUITY;
+}
+
+/* The tags we don't store natively, NULL if there aren't any */
+jd_var *hls_segs_extra(hls_segs *ss, unsigned i) {
+  return ss->extra[ss->head + i];
+}
+
+/* As hls_segs_extra but makes an empty hash if there isn't one */
+jd_var *hls_segs_need_extra(hls_segs *ss, unsigned i) {
+  unsigned p = ss->head + i;
+  if (!ss->extra[p]) {
+    jd_var init = JD_INIT;
+    ss->extra[p] = grow(NULL, sizeof(jd_var));
+    *ss->extra[p] = init;
+    jd_set_hash(ss->extra[p], 2);
+  }
+  return ss->extra[p];
+}
+
+/* Call after changing an entry's extra tags */
+void hls_segs_touch(hls_segs *ss, unsigned i) {
+  unsigned p = ss->head + i;
+  if (ss->text[p] != NO_TEXT) {
+    ss->arena_dead += strlen(ss->arena + ss->text[p]) + 1;
+    ss->text[p] = NO_TEXT;
+  }
+  if (ss->extra[p] && jd_count(ss->extra[p]) == 0) free_extra(ss, p);
+}
+
+const char *hls_segs_text(hls_segs *ss, unsigned i) {
+  unsigned p = ss->head + i;
+  return ss->text[p] == NO_TEXT ? NULL : ss->arena + ss->text[p];
+}
+
+void hls_segs_set_text(hls_segs *ss, unsigned i, const char *text) {
+  hls_segs_touch(ss, i);
+  size_t pos = arena_add(ss, text, strlen(text) + 1);
+  ss->text[ss->head + i] = pos;
+}
+
+/* Total duration of the list */
+double hls_segs_total(hls_segs *ss) {
+  return ss->count ? ss->elapsed - ss->start[ss->head] : 0;
+}
+
+/* Walk back from the end until at least *limit seconds are covered.
+ * Returns the index of the oldest entry needed. With a NaN limit
+ * (or if the limit isn't reached) the whole list is covered.
+ * *limit is set to the duration covered. Cheap for short spans; use
+ * hls_segs_expired to trim a long list.
+ */
+unsigned hls_segs_span(hls_segs *ss, double *limit) {
+  double need = *limit;
+  unsigned pos = ss->count;
+
+  if (!need || need != need || hls_segs_total(ss) < need) pos = 0;
+  else
+    while (pos != 0 && ss->elapsed - ss->start[ss->head + pos] < need)
+      pos--;
+
+  if (*limit) *limit = ss->elapsed - (pos < ss->count ? ss->start[ss->head + pos]
+                                      : ss->elapsed);
+  return pos;
+}
+
+/* How many entries can go from the front while leaving at least
+ * min_duration. Each entry is only looked at once before it's
+ * retired so trimming after every push is amortised O(1).
+ */
+unsigned hls_segs_expired(hls_segs *ss, double min_duration) {
+  const double *start = ss->start + ss->head;
+  unsigned pos = 0;
+  if (!min_duration || min_duration != min_duration) return 0;
+  while (pos + 1 < ss->count && ss->elapsed - start[pos + 1] >= min_duration)
+    pos++;
+  return pos;
+}
+
+/****************************************************
+ *                                                  *
+ * jd_var views                                     *
+ *                                                  *
+ ****************************************************/
+
+/* A segment as a jd_var hash, in the same shape it was pushed. */
+jd_var *hls_segs_record(jd_var *out, hls_segs *ss, unsigned i) {
+  unsigned p = ss->head + i;
+  const char *sp = ss->arena + ss->str[p];
+
+  jd_set_hash(out, 4);
+  if (ss->extra[p]) jd_merge(out, ss->extra[p], 0);
+  if (ss->flags[p] & HLS_SEG_URI)
+    jd_set_string(jd_get_ks(out, "uri", 1), sp);
+  if (ss->flags[p] & HLS_SEG_EXTINF) {
+    /* any other EXTINF keys are in extra; don't change its copy */
+    jd_var *inf = jd_get_ks(out, "EXTINF", 1);
+    if (inf->type == HASH) jd_clone(inf, jd_get_ks(ss->extra[p], "EXTINF", 0), 0);
+    else jd_set_hash(inf, 2);
+    sp += strlen(sp) + 1;
+    jd_set_string(jd_get_ks(inf, "duration", 1), sp);
+    sp += strlen(sp) + 1;
+    if (ss->flags[p] & HLS_SEG_TITLE)
+      jd_set_string(jd_get_ks(inf, "title", 1), sp);
+  }
+  return out;
+}
+
+static void push_entry(jd_var *out, hls_segs *ss, unsigned i) {
+  if (hls_segs_discontinuity(ss, i))
+    jd_set_string(jd_push(out, 1), "EXT-X-DISCONTINUITY");
+  hls_segs_record(jd_push(out, 1), ss, i);
+}
+
+/* The whole list as an array of records and discontinuities */
+jd_var *hls_segs_view(jd_var *out, hls_segs *ss) {
+  jd_set_array(out, ss->count + 1);
+  for (unsigned i = 0; i < ss->count; i++)
+    push_entry(out, ss, i);
+  if (ss->pending_disc)
+    jd_set_string(jd_push(out, 1), "EXT-X-DISCONTINUITY");
+  return out;
+}
+
+/* Remove the oldest num entries; their records and any discontinuity
+ * left at the front are pushed onto retired.
+ */
+unsigned hls_segs_retire(hls_segs *ss, unsigned num, jd_var *retired) {
+  if (num > ss->count) num = ss->count;
+
+  for (unsigned i = 0; i < num; i++) {
+    unsigned p = ss->head + i;
+    push_entry(retired, ss, i);
+    ss->arena_dead += str_len(ss->arena + ss->str[p]);
+    if (ss->text[p] != NO_TEXT)
+      ss->arena_dead += strlen(ss->arena + ss->text[p]) + 1;
+    free_extra(ss, p);
+  }
+
+  ss->head += num;
+  ss->count -= num;
+
+  /* a playlist doesn't start with a discontinuity */
+  if (hls_segs_discontinuity(ss, 0)) {
+    jd_set_string(jd_push(retired, 1), "EXT-X-DISCONTINUITY");
+    if (ss->count) ss->flags[ss->head] &= ~HLS_SEG_DISCONTINUITY;
+    else ss->pending_disc = 0;
+  }
+
+  if (ss->count == 0) {
+    ss->head = 0;
+    ss->elapsed = 0;
+    ss->arena_used = ss->arena_dead = 0;
+  }
+
+  return num;
+}
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
@@ -3,7 +3,8 @@
 use strict;
 use warnings;
 
-use JSON;
+# Generates hls_m3u8_syntax.c: the syntax below as static tables with
+# perfect hashed tag and attribute lookup. See hls_m3u8_syntax.h.
 
 my $stminf = {
   'PROGRAM-ID' => 'i',
@@ -47,11 +48,146 @@ my %spec = (
   },
   'EXT-X-BYTERANGE'         => 'br',
   EXTINF                    => 'extinf',
+  'EXT-X-GAP'               => [],
   'EXT-X-PROGRAM-DATE-TIME' => 'bs',
   'EXT-X-I-FRAMES-ONLY'     => [],
+  'EXT-X-PART-INF'          => {
+    require => { 'PART-TARGET' => 'f', },
+    allow   => {},
+  },
+  'EXT-X-SERVER-CONTROL' => {
+    require => {},
+    allow   => {
+      'CAN-BLOCK-RELOAD' => ['YES'],
+      'CAN-SKIP-UNTIL'   => 'f',
+      'HOLD-BACK'        => 'f',
+      'PART-HOLD-BACK'   => 'f',
+    },
+  },
+  'EXT-X-PART' => {
+    require => {
+      DURATION => 'f',
+      URI      => 'zqs',
+    },
+    allow => {
+      BYTERANGE   => 'zqs',
+      GAP         => ['YES'],
+      INDEPENDENT => ['YES'],
+    },
+  },
+  'EXT-X-PRELOAD-HINT' => {
+    require => {
+      TYPE => ['PART', 'MAP'],
+      URI  => 'zqs',
+    },
+    allow => {
+      'BYTERANGE-START'  => 'i',
+      'BYTERANGE-LENGTH' => 'i',
+    },
+  },
 );
 
-print JSON->new->pretty->canonical->encode( \%spec );
+my %type = (
+  i      => 'HLS_SYN_INT',
+  f      => 'HLS_SYN_FLOAT',
+  zqs    => 'HLS_SYN_QSTRING',
+  res    => 'HLS_SYN_RESOLUTION',
+  bs     => 'HLS_SYN_STRING',
+  br     => 'HLS_SYN_BYTERANGE',
+  extinf => 'HLS_SYN_EXTINF',
+);
+
+my @decl    = ();
+my %enum    = ();
+my $next_id = 0;
+
+print "/* hls_m3u8_syntax.c - generated by syntax.pl, do not edit */\n\n";
+print "#include <stddef.h>\n\n";
+print "#include \"hls_m3u8_syntax.h\"\n\n";
+
+my ( $tags, $seed, $mask ) = table(
+  \%spec,
+  sub {
+    my ( $name, $spec ) = @_;
+    return sprintf '{ "%s", %s }', $name, value($spec);
+  }
+);
+
+print join "\n", @decl, '';
+print "static const hls_tag_syntax tags[] = {\n$tags};\n\n";
+print "const hls_syntax hls__m3u8_syntax = { tags, ${seed}u, $mask };\n\n";
+print "/* vim:ts=2:sw=2:sts=2:et:ft=c\n */\n";
+
+# Must match hls__syntax_hash
+sub hash {
+  my ( $seed, $name ) = @_;
+  my $h = $seed;
+  for my $c ( unpack 'C*', $name ) {
+    $h ^= $c;
+    $h = ( $h * 16777619 ) & 0xffffffff;
+  }
+  return $h;
+}
+
+# Find a seed that gives every name its own slot
+sub perfect {
+  my @names = @_;
+  my $size  = 1;
+  $size *= 2 while $size < @names;
+  while (1) {
+    for my $seed ( 0 .. 999 ) {
+      my %slot = ();
+      my $h    = 2166136261 + $seed;
+      $slot{ hash( $h, $_ ) & ( $size - 1 ) }++ for @names;
+      return ( $h, $size - 1 ) if keys %slot == @names;
+    }
+    $size *= 2;
+  }
+}
+
+sub table {
+  my ( $spec, $cb ) = @_;
+  my @names = sort keys %$spec;
+  my ( $seed, $mask ) = perfect(@names);
+  my @slot = ('  { NULL },') x ( $mask + 1 );
+  $slot[ hash( $seed, $_ ) & $mask ] = '  ' . $cb->( $_, $spec->{$_} ) . ','
+   for @names;
+  return ( join( "\n", @slot, '' ), $seed, $mask );
+}
+
+sub value {
+  my $spec = shift;
+
+  unless ( ref $spec ) {
+    my $type = $type{$spec} // die "Unknown type: $spec";
+    return "{ $type, NULL, NULL, 0, 0, 0 }";
+  }
+
+  if ( 'ARRAY' eq ref $spec ) {
+    return '{ HLS_SYN_FLAG, NULL, NULL, 0, 0, 0 }' unless @$spec;
+    my $list = join ', ', map { qq{"$_"} } @$spec;
+    my $id = $enum{$list} //= do {
+      my $id = 'enum_' . $next_id++;
+      push @decl, "static const char *const ${id}[] = { $list, NULL };\n";
+      $id;
+    };
+    return "{ HLS_SYN_ENUM, $id, NULL, 0, 0, 0 }";
+  }
+
+  my %attr = ( %{ $spec->{allow} }, %{ $spec->{require} } );
+  my $required = keys %{ $spec->{require} };
+  my ( $body, $seed, $mask ) = table(
+    \%attr,
+    sub {
+      my ( $name, $as ) = @_;
+      return sprintf '{ "%s", %d, %s }', $name,
+       exists $spec->{require}{$name} ? 1 : 0, value($as);
+    }
+  );
+  my $id = 'attr_' . $next_id++;
+  push @decl, "static const hls_attr_syntax ${id}[] = {\n$body};\n";
+  return "{ HLS_SYN_ATTR, NULL, $id, ${seed}u, $mask, $required }";
+}
 
 # vim:ts=2:sw=2:sts=2:et:ft=perl
 
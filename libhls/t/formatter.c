@@ -17,6 +17,7 @@ struct {
   {"data/discontinuity.json", "data/discontinuity.m3u8"},
   {"data/endlist.json", "data/endlist.m3u8"},
   {"data/iframe_index.json", "data/iframe_index.m3u8"},
+  {"data/ll.json", "data/ll.m3u8"},
   {"data/simple_root.json", "data/simple_root.m3u8"},
   {"data/simple_var.json", "data/simple_var.m3u8"}
 };
@@ -2,6 +2,8 @@
 
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
 
 #include "framework.h"
 #include "tap.h"
@@ -105,10 +107,166 @@ void test_time(void) {
   }
 }
 
+static jd_var *make_part(jd_var *out, const char *uri) {
+  jd_set_hash(out, 2);
+  jd_set_real(jd_lv(out, "$.DURATION"), 0.5);
+  jd_set_string(jd_lv(out, "$.URI"), uri);
+  return out;
+}
+
+/* formatting as we go (and so caching) must give the same result as
+ * formatting once at the end.
+ */
+void test_cache(void) {
+  scope {
+    jd_var *inc = hls_m3u8_init(jd_nv());
+    jd_var *once = hls_m3u8_init(jd_nv());
+    jd_var *pl[] = { inc, once };
+    char uri[32];
+
+    for (unsigned i = 0; i < 50; i++) {
+      for (unsigned p = 0; p < 2; p++) {
+        for (unsigned j = 0; j < 2; j++) {
+          sprintf(uri, "%08d.%u.ts", i, j);
+          hls_m3u8_push_part(pl[p], make_part(jd_nv(), uri));
+        }
+        sprintf(uri, "%08d.ts", i);
+        hls_m3u8_push_segment(pl[p], make_segment(jd_nv(), uri, 1, ""));
+        if (i % 7 == 6) hls_m3u8_push_discontinuity(pl[p]);
+        hls_m3u8_expire(pl[p], 20);
+        hls_m3u8_expire_parts(pl[p], 3);
+      }
+      hls_m3u8_format(jd_nv(), inc);
+    }
+
+    jdt_is(hls_m3u8_format(jd_nv(), inc), hls_m3u8_format(jd_nv(), once),
+           "cached rendering matches");
+  }
+}
+
+/* segments come back out the way they went in */
+void test_view(void) {
+  scope {
+    jd_var *m3u8 = hls_m3u8_init(jd_nv());
+    jd_var *seg = make_segment(jd_nv(), "a.ts", 4, "first");
+    jd_set_string(jd_lv(seg, "$.EXT-X-PROGRAM-DATE-TIME"), "2013-09-03T12:00:00Z");
+    hls_m3u8_push_segment(m3u8, seg);
+    hls_m3u8_push_discontinuity(m3u8);
+    hls_m3u8_push_segment(m3u8, make_segment(jd_nv(), "b.ts", 4, ""));
+
+    jd_var *want = jd_nav(3);
+    jd_assign(jd_push(want, 1), seg);
+    jd_set_string(jd_push(want, 1), "EXT-X-DISCONTINUITY");
+    jd_assign(jd_push(want, 1), make_segment(jd_nv(), "b.ts", 4, ""));
+
+    jd_var *got = jd_clone(jd_nv(), hls_m3u8_seg(m3u8), 1);
+    /* durations come back as strings */
+    for (unsigned i = 0; i < jd_count(want); i += 2)
+      jd_set_string(jd_rv(jd_get_idx(want, i), "$.EXTINF.duration"), "4");
+    jdt_is(got, want, "view matches");
+
+    hls_m3u8_retire(m3u8, 1);
+    ok(jd_count(hls_m3u8_retired(m3u8)) == 2, "retired segment and discontinuity");
+    ok(!strcmp(jd_bytes(jd_get_ks(hls_m3u8_last_seg(m3u8), "uri", 0), NULL), "b.ts"),
+       "last segment");
+  }
+}
+
+/* the duration counts even if EXTINF has more than duration and title */
+void test_extinf(void) {
+  scope {
+    jd_var *m3u8 = hls_m3u8_init(jd_nv());
+    jd_var *seg = make_segment(jd_nv(), "a.ts", 4, "");
+    jd_set_string(jd_lv(seg, "$.EXTINF.extra"), "x");
+    hls_m3u8_push_segment(m3u8, seg);
+    jd_var *bare = jd_nhv(2);
+    jd_set_string(jd_lv(bare, "$.uri"), "b.ts");
+    jd_set_real(jd_lv(bare, "$.EXTINF.duration"), 2);
+    hls_m3u8_push_segment(m3u8, bare);
+
+    ok(fabs(hls_m3u8_duration(m3u8) - 6) < 0.01, "durations kept");
+
+    jd_var *got = jd_clone(jd_nv(), hls_m3u8_seg(m3u8), 1);
+    jd_set_string(jd_lv(seg, "$.EXTINF.duration"), "4");
+    jd_set_string(jd_lv(bare, "$.EXTINF.duration"), "2");
+    jdt_is(jd_get_idx(got, 0), seg, "extra EXTINF keys kept");
+    jdt_is(jd_get_idx(got, 1), bare, "no title made up");
+  }
+}
+
+/* segments and parts that couldn't be written are marked as gaps */
+void test_gap(void) {
+  scope {
+    jd_var *m3u8 = hls_m3u8_init(jd_nv());
+    hls_m3u8_push_part(m3u8, make_part(jd_nv(), "a.0.ts"));
+    hls_m3u8_push_segment(m3u8, make_segment(jd_nv(), "a.ts", 4, ""));
+    hls_m3u8_push_segment(m3u8, make_segment(jd_nv(), "b.ts", 4, ""));
+    hls_m3u8_push_part(m3u8, make_part(jd_nv(), "c.0.ts"));
+    hls_m3u8_format(jd_nv(), m3u8);
+
+    ok(hls_m3u8_set_gap(m3u8, "a.ts"), "segment marked");
+    ok(hls_m3u8_set_gap(m3u8, "a.0.ts"), "part marked");
+    ok(hls_m3u8_set_gap(m3u8, "c.0.ts"), "pending part marked");
+    ok(!hls_m3u8_set_gap(m3u8, "z.ts"), "unknown uri");
+
+    const char *pl = jd_bytes(hls_m3u8_format(jd_nv(), m3u8), NULL);
+    ok(strstr(pl, "#EXT-X-GAP\na.ts") != NULL, "segment is a gap");
+    ok(strstr(pl, "#EXT-X-GAP\nb.ts") == NULL, "other segment isn't");
+    ok(strstr(pl, "GAP=YES,URI=\"a.0.ts\"") != NULL, "part is a gap");
+    ok(strstr(pl, "GAP=YES,URI=\"c.0.ts\"") != NULL, "pending part is a gap");
+  }
+}
+
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+#define BENCH_PUSHES 20000
+
+/* push + expire should cost the same however long the window is */
+static void bench(unsigned window) {
+  scope {
+    jd_var *m3u8 = hls_m3u8_init(jd_nv());
+    unsigned total = window + BENCH_PUSHES;
+    double start = 0;
+    char uri[32];
+
+    for (unsigned i = 0; i < total; i++) {
+      if (i == window) start = now();
+      scope {
+        sprintf(uri, "%08u.ts", i);
+        hls_m3u8_push_segment(m3u8, make_segment(jd_nv(), uri, 4, ""));
+        hls_m3u8_expire(m3u8, window * 4);
+      }
+    }
+
+    double elapsed = now() - start;
+
+    ok(hls_m3u8_count(m3u8) == window, "window of %u segments", window);
+    ok(get_sequence(m3u8) == BENCH_PUSHES, "%u segments expired", BENCH_PUSHES);
+    diag("window %u: %.2f us per push + expire", window,
+         elapsed * 1000000 / BENCH_PUSHES);
+  }
+}
+
+void test_bench(void) {
+  /* up to a 24 hour DVR window of 4 second segments */
+  unsigned window[] = { 10, 100, 1000, 10000, 21600 };
+  for (unsigned i = 0; i < sizeof(window) / sizeof(window[0]); i++)
+    bench(window[i]);
+}
+
 void test_main(void) {
   scope {
     test_push();
     test_time();
+    test_cache();
+    test_view();
+    test_extinf();
+    test_gap();
+    test_bench();
   }
 }
 
@@ -1,5 +1,8 @@
 /* parser.t */
 
+#include <string.h>
+#include <sys/time.h>
+
 #include "framework.h"
 #include "tap.h"
 
@@ -17,6 +20,7 @@ struct {
   {"data/ref/discontinuity.m3u8", "data/discontinuity.json"},
   {"data/ref/endlist.m3u8", "data/endlist.json"},
   {"data/ref/iframe_index.m3u8", "data/iframe_index.json"},
+  {"data/ref/ll.m3u8", "data/ll.json"},
   {"data/ref/simple_root.m3u8", "data/simple_root.json"},
   {"data/ref/simple_var.m3u8", "data/simple_var.json"}
 };
@@ -54,9 +58,51 @@ static void test_parser(void) {
     check_parser(tests[i].in, tests[i].out);
 }
 
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+#define BENCH_FILE  "data/event.m3u8"
+#define BENCH_SEGS  900
+#define BENCH_LOADS 20
+#define BENCH_HOURS 24
+
+static void test_bench(void) {
+  scope {
+    unsigned count = 0;
+    double start = now();
+    for (unsigned i = 0; i < BENCH_LOADS; i++)
+      scope count = hls_m3u8_count(hls_m3u8_load(jd_nv(), BENCH_FILE));
+    double elapsed = now() - start;
+
+    ok(count == BENCH_SEGS, "loaded %u segments", count);
+    diag("%s: %.2f ms per load", BENCH_FILE, elapsed * 1000 / BENCH_LOADS);
+
+    /* a day's worth: the header followed by the segments, repeated */
+    size_t len;
+    const char *buf = jd_bytes(load_file(jd_nv(), BENCH_FILE), &len);
+    const char *body = strstr(buf, "#EXT-X-PROGRAM-DATE-TIME");
+    jd_var *day = jd_set_bytes(jd_nv(), buf, body - buf);
+    for (unsigned i = 0; i < BENCH_HOURS; i++)
+      jd_append_bytes(day, body, buf + len - 1 - body);
+
+    start = now();
+    jd_var *m3u8 = hls_m3u8_parse(jd_nv(), day);
+    elapsed = now() - start;
+
+    count = hls_m3u8_count(m3u8);
+    ok(count == BENCH_SEGS * BENCH_HOURS, "parsed %u segments", count);
+    diag("%u hour playlist: %.2f ms, %.0f segments/sec", BENCH_HOURS,
+         elapsed * 1000, count / elapsed);
+  }
+}
+
 void test_main(void) {
   scope {
     test_parser();
+    test_bench();
   }
 }
 
@@ -9,15 +9,14 @@
 
 #include "multicoder.h"
 
-void mc_demux(AVFormatContext *ic, jd_var *cfg, mc_queue *aq, mc_queue *vq) {
+/* Each packet goes to the queue of every route for its stream. The
+ * payload is made refcounted once and shared by all of them.
+ */
+void mc_demux(AVFormatContext *ic, const mc_demux_route *routes,
+              unsigned nroute) {
   AVPacket pkt;
 
-  (void) cfg;
-
-  int aud = av_find_best_stream(ic, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
-  int vid = av_find_best_stream(ic, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
-
-  if (aud < 0 && vid < 0) jd_throw("Can't find audio or video");
+  if (!nroute) jd_throw("Nothing to demux");
 
   av_init_packet(&pkt);
   pkt.data = NULL;
@@ -27,10 +26,9 @@ void mc_demux(AVFormatContext *ic, jd_var *cfg, mc_queue *aq, mc_queue *vq) {
     if (av_dup_packet(&pkt))
       jd_throw("Can't duplicate packet");
 
-    if (pkt.stream_index == aud)
-      mc_queue_packet_put(aq, &pkt);
-    else if (pkt.stream_index == vid)
-      mc_queue_packet_put(vq, &pkt);
+    for (unsigned i = 0; i < nroute; i++)
+      if (pkt.stream_index == routes[i].stream)
+        mc_queue_packet_put(routes[i].q, &pkt);
 
     av_free_packet(&pkt);
   }
@@ -0,0 +1,342 @@
+/* mc_failover.c */
+
+#include <jd_pretty.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <libavformat/avformat.h>
+#include <libavutil/mathematics.h>
+
+#include "multicoder.h"
+#include "mc_failover.h"
+
+#define AUDIO 0
+#define VIDEO 1
+
+/* assumed video frame duration until we've seen one (40ms) */
+#define FRAME_DUR 40000
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static unsigned add_track(mc_failover *fo, const mc_track *t, mc_queue *q) {
+  if (fo->ntrack == MC_FAILOVER_TRACKS)
+    jd_throw("No more than %d tracks", MC_FAILOVER_TRACKS);
+
+  mc_failover_track *tr = &fo->track[fo->ntrack];
+  tr->sel = *t;
+  tr->ref = mc_track_find(fo->ref, t);
+  tr->q = q;
+  tr->last_out = tr->resume = AV_NOPTS_VALUE;
+  return fo->ntrack++;
+}
+
+/* timeout is how long (in seconds) the active input may go without
+ * a packet before the next takes over. Inputs whose timestamps are
+ * within align seconds of each other are assumed to share a timeline
+ * and are switched without moving their timestamps.
+ */
+mc_failover *mc_failover_new(AVFormatContext *ref, mc_queue *aq,
+                             mc_queue *vq, double timeout, double align) {
+  mc_failover *fo = mc_alloc(sizeof(*fo));
+  mc_track t;
+
+  pthread_mutex_init(&fo->mutex, NULL);
+  pthread_mutex_init(&fo->put_mutex, NULL);
+
+  fo->ref = ref;
+  add_track(fo, mc_track_parse(&t, AVMEDIA_TYPE_AUDIO, NULL), aq);
+  add_track(fo, mc_track_parse(&t, AVMEDIA_TYPE_VIDEO, NULL), vq);
+  if (fo->track[AUDIO].ref < 0 && fo->track[VIDEO].ref < 0)
+    jd_throw("Can't find audio or video");
+
+  fo->pending = -1;
+  fo->frame_dur = FRAME_DUR;
+  fo->timeout_ns = timeout * 1e9;
+  fo->align = align * AV_TIME_BASE;
+  fo->clock = now_ns;
+
+  return fo;
+}
+
+void mc_failover_free(mc_failover *fo) {
+  if (fo) {
+    pthread_mutex_destroy(&fo->mutex);
+    pthread_mutex_destroy(&fo->put_mutex);
+    free(fo);
+  }
+}
+
+/* Another track to follow from input to input; add tracks before
+ * any inputs.
+ */
+unsigned mc_failover_track_add(mc_failover *fo, const mc_track *t,
+                               mc_queue *q) {
+  char name[64];
+  if (fo->ninput) jd_throw("Tracks must be added before inputs");
+  unsigned tn = add_track(fo, t, q);
+  if (fo->track[tn].ref < 0)
+    mc_warning("No %s in %s", mc_track_name(name, sizeof(name), t),
+               fo->ref->filename);
+  return tn;
+}
+
+/* The muxers were set up from the reference input's streams */
+static void check_stream(mc_failover *fo, AVFormatContext *ic,
+                         unsigned tn, int ii) {
+  char name[64];
+  int ri = fo->track[tn].ref;
+  if (ri < 0) return;
+
+  mc_track_name(name, sizeof(name), &fo->track[tn].sel);
+  if (ii < 0) {
+    mc_warning("Input %s has no %s", ic->filename, name);
+    return;
+  }
+
+  AVCodecContext *rc = fo->ref->streams[ri]->codec;
+  AVCodecContext *cc = ic->streams[ii]->codec;
+  if (rc->codec_id != cc->codec_id || rc->width != cc->width ||
+      rc->height != cc->height || rc->sample_rate != cc->sample_rate ||
+      rc->channels != cc->channels)
+    mc_warning("Input %s %s doesn't match %s", ic->filename, name,
+               fo->ref->filename);
+}
+
+/* The first input added is active to start with */
+unsigned mc_failover_add(mc_failover *fo, AVFormatContext *ic) {
+  if (fo->ninput == MC_FAILOVER_INPUTS)
+    jd_throw("No more than %d inputs", MC_FAILOVER_INPUTS);
+
+  unsigned idx = fo->ninput;
+  mc_failover_input *in = &fo->in[idx];
+  in->ic = ic;
+  in->last_seen = fo->clock();
+  in->live = 1;
+
+  for (unsigned tn = 0; tn < fo->ntrack; tn++) {
+    in->stream[tn] = mc_track_find(ic, &fo->track[tn].sel);
+    if (ic != fo->ref) check_stream(fo, ic, tn, in->stream[tn]);
+  }
+
+  pthread_mutex_lock(&fo->mutex);
+  fo->ninput++;
+  pthread_mutex_unlock(&fo->mutex);
+
+  return idx;
+}
+
+static int64_t packet_ts(AVPacket *pkt) {
+  return pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+}
+
+static int64_t to_us(int64_t ts, AVStream *st) {
+  return ts == AV_NOPTS_VALUE ? ts : av_rescale_q(ts, st->time_base, AV_TIME_BASE_Q);
+}
+
+/* Put in->ic's timeline onto the one sent so far. Returns 0 if the
+ * keyframe at ts (us) is too early to switch at.
+ */
+static int align_input(mc_failover *fo, mc_failover_input *in, int64_t ts) {
+  int64_t last = fo->track[VIDEO].last_out != AV_NOPTS_VALUE
+                 ? fo->track[VIDEO].last_out : fo->track[AUDIO].last_out;
+
+  if (last == AV_NOPTS_VALUE) {
+    in->offset = 0;
+    return 1;
+  }
+
+  if (llabs(ts - last) <= fo->align) {
+    /* same timeline: wait for a keyframe we haven't sent */
+    if (ts <= last) return 0;
+    in->offset = 0;
+  }
+  else {
+    /* unrelated timeline: follow straight on */
+    in->offset = last + fo->frame_dur - ts;
+  }
+  return 1;
+}
+
+/* Called with the mutex held for each packet from a standby input */
+static void consider_switch(mc_failover *fo, unsigned idx, unsigned tn,
+                            AVPacket *pkt, int64_t ts, uint64_t now) {
+  mc_failover_input *act = &fo->in[fo->active];
+  mc_failover_input *in = &fo->in[idx];
+
+  int healthy = act->live && now - act->last_seen <= fo->timeout_ns;
+  if (healthy) {
+    if (fo->pending == (int) idx) {
+      mc_info("Input %u recovered; staying with it", fo->active);
+      fo->pending = -1;
+    }
+    return;
+  }
+
+  if (fo->pending != (int) idx) {
+    if (act->live) fo->stats.stalls++;
+    mc_warning("Input %u %s; switching to input %u at its next keyframe",
+               fo->active, act->live ? "stalled" : "ended", idx);
+    fo->pending = idx;
+  }
+
+  int key = in->stream[VIDEO] < 0 ||
+            (tn == VIDEO && (pkt->flags & AV_PKT_FLAG_KEY));
+  if (!key || ts == AV_NOPTS_VALUE || !align_input(fo, in, ts)) return;
+
+  mc_info("Switched to input %u (offset %lldus)", idx, (long long) in->offset);
+  fo->active = idx;
+  fo->pending = -1;
+  fo->gen++;
+  fo->stats.switches++;
+  for (unsigned i = 0; i < fo->ntrack; i++)
+    fo->track[i].resume = fo->track[i].last_out;
+}
+
+/* Rewrite a packet from input idx to look like one from the
+ * reference input.
+ */
+static void map_packet(mc_failover *fo, mc_failover_input *in, unsigned tn,
+                       AVPacket *pkt) {
+  int ri = fo->track[tn].ref;
+  AVStream *is = in->ic->streams[pkt->stream_index];
+  AVStream *os = fo->ref->streams[ri];
+
+  pkt->stream_index = ri;
+  if (in->ic == fo->ref && !in->offset) return;
+
+  if (pkt->pts != AV_NOPTS_VALUE)
+    pkt->pts = av_rescale_q(to_us(pkt->pts, is) + in->offset,
+                            AV_TIME_BASE_Q, os->time_base);
+  if (pkt->dts != AV_NOPTS_VALUE)
+    pkt->dts = av_rescale_q(to_us(pkt->dts, is) + in->offset,
+                            AV_TIME_BASE_Q, os->time_base);
+  pkt->duration = av_rescale_q(pkt->duration, is->time_base, os->time_base);
+}
+
+/* first is set for the first track a packet is fed to */
+static void feed(mc_failover *fo, unsigned idx, unsigned tn, AVPacket *pkt,
+                 int first) {
+  mc_failover_input *in = &fo->in[idx];
+  mc_failover_track *tr = &fo->track[tn];
+  AVStream *is = in->ic->streams[pkt->stream_index];
+  int64_t ts = to_us(packet_ts(pkt), is);
+  uint64_t now = fo->clock();
+  unsigned gen;
+  int fwd;
+
+  pthread_mutex_lock(&fo->mutex);
+  in->last_seen = now;
+  if (first) {
+    fo->stats.in[idx].packets++;
+    if (tn == VIDEO && (pkt->flags & AV_PKT_FLAG_KEY))
+      fo->stats.in[idx].keyframes++;
+  }
+
+  if (idx != fo->active) consider_switch(fo, idx, tn, pkt, ts, now);
+
+  fwd = idx == fo->active;
+  if (fwd && ts != AV_NOPTS_VALUE) {
+    int64_t out = ts + in->offset;
+    /* after a switch skip anything already sent from the old input */
+    if (tr->resume != AV_NOPTS_VALUE) {
+      if (out <= tr->resume) fwd = 0;
+      else tr->resume = AV_NOPTS_VALUE;
+    }
+    if (fwd) {
+      tr->last_out = out;
+      if (tn == VIDEO && pkt->duration > 0)
+        fo->frame_dur = av_rescale_q(pkt->duration, is->time_base, AV_TIME_BASE_Q);
+    }
+  }
+  gen = fo->gen;
+  pthread_mutex_unlock(&fo->mutex);
+
+  if (!fwd) return;
+
+  map_packet(fo, in, tn, pkt);
+
+  /* only one input feeds the queues; a switch may have happened
+   * since we decided to send this.
+   */
+  pthread_mutex_lock(&fo->put_mutex);
+  pthread_mutex_lock(&fo->mutex);
+  fwd = idx == fo->active && gen == fo->gen;
+  if (fwd && first) fo->stats.in[idx].forwarded++;
+  pthread_mutex_unlock(&fo->mutex);
+  if (fwd) mc_queue_packet_put(tr->q, pkt);
+  pthread_mutex_unlock(&fo->put_mutex);
+}
+
+/* Offer a packet read from input idx. A stream that several tracks
+ * select goes to each; the payload is shared.
+ */
+void mc_failover_put(mc_failover *fo, unsigned idx, AVPacket *pkt) {
+  mc_failover_input *in = &fo->in[idx];
+  int first = 1;
+  for (unsigned tn = 0; tn < fo->ntrack; tn++) {
+    if (pkt->stream_index != in->stream[tn] || fo->track[tn].ref < 0)
+      continue;
+    AVPacket tp = *pkt;
+    feed(fo, idx, tn, &tp, first);
+    first = 0;
+  }
+}
+
+/* Input idx has nothing more to offer */
+void mc_failover_end(mc_failover *fo, unsigned idx) {
+  pthread_mutex_lock(&fo->mutex);
+  fo->in[idx].live = 0;
+  if (fo->active == idx) {
+    for (unsigned i = 0; i < fo->ninput; i++) {
+      if (fo->in[i].live) {
+        mc_warning("Input %u ended; switching to input %u at its next keyframe",
+                   idx, i);
+        fo->pending = i;
+        break;
+      }
+    }
+  }
+  pthread_mutex_unlock(&fo->mutex);
+}
+
+/* Read input idx until it ends. Each input is read on a thread of
+ * its own.
+ */
+void mc_failover_demux(mc_failover *fo, unsigned idx) {
+  AVPacket pkt;
+
+  av_init_packet(&pkt);
+  pkt.data = NULL;
+  pkt.size = 0;
+
+  while (av_read_frame(fo->in[idx].ic, &pkt) >= 0) {
+    if (av_dup_packet(&pkt)) {
+      mc_error("Can't duplicate packet from input %u", idx);
+      av_free_packet(&pkt);
+      break;
+    }
+    mc_failover_put(fo, idx, &pkt);
+    av_free_packet(&pkt);
+  }
+
+  mc_info("Input %u ended", idx);
+  mc_failover_end(fo, idx);
+}
+
+mc_failover_stats *mc_failover_stats_get(mc_failover *fo,
+                                         mc_failover_stats *st) {
+  pthread_mutex_lock(&fo->mutex);
+  *st = fo->stats;
+  st->active = fo->active;
+  pthread_mutex_unlock(&fo->mutex);
+  return st;
+}
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
@@ -0,0 +1,99 @@
+/* mc_failover.h */
+
+#ifndef MC_FAILOVER_H_
+#define MC_FAILOVER_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <libavformat/avformat.h>
+
+#include "mc_queue.h"
+#include "mc_track.h"
+
+#define MC_FAILOVER_INPUTS 2
+#define MC_FAILOVER_TRACKS 8
+
+  typedef struct {
+    uint64_t packets, forwarded, keyframes;
+  } mc_failover_input_stats;
+
+  typedef struct {
+    unsigned active;
+    uint64_t switches, stalls;
+    mc_failover_input_stats in[MC_FAILOVER_INPUTS];
+  } mc_failover_stats;
+
+  /* Track 0 is the audio and track 1 the video the muxers time by;
+   * any others are extra audio or subtitle tracks.
+   */
+  typedef struct {
+    mc_track sel;
+    int ref;                /* stream in the reference input; -1 if missing */
+    mc_queue *q;
+    int64_t last_out;       /* last dts sent (AV_TIME_BASE) */
+    int64_t resume;         /* drop anything up to this after a switch */
+  } mc_failover_track;
+
+  typedef struct {
+    AVFormatContext *ic;
+    int stream[MC_FAILOVER_TRACKS];   /* each track's stream; -1 if missing */
+    int64_t offset;         /* added to timestamps (AV_TIME_BASE) */
+    uint64_t last_seen;     /* when it last delivered a packet */
+    int live;               /* still being read */
+  } mc_failover_input;
+
+  /* Feeds one channel's track queues from whichever of
+   * several copies of the same input is healthy. Every input is read
+   * all the time but only the active one's packets are passed on. If
+   * the active input ends or stalls the next one takes over at its
+   * next keyframe, with its timestamps moved onto the timeline of
+   * what has been sent so far.
+   */
+  typedef struct {
+    pthread_mutex_t mutex;
+    pthread_mutex_t put_mutex;    /* held while feeding the queues */
+
+    AVFormatContext *ref;         /* the muxers' view of the streams */
+    mc_failover_track track[MC_FAILOVER_TRACKS];
+    unsigned ntrack;
+
+    mc_failover_input in[MC_FAILOVER_INPUTS];
+    unsigned ninput;
+    unsigned active;
+    int pending;                  /* waiting to take over; -1 for none */
+    unsigned gen;                 /* bumped at each switch */
+
+    int64_t frame_dur;
+
+    uint64_t timeout_ns;
+    int64_t align;
+    uint64_t (*clock)(void);      /* monotonic ns; tests may replace it */
+
+    mc_failover_stats stats;
+  } mc_failover;
+
+  mc_failover *mc_failover_new(AVFormatContext *ref, mc_queue *aq,
+                               mc_queue *vq, double timeout, double align);
+  void mc_failover_free(mc_failover *fo);
+  unsigned mc_failover_track_add(mc_failover *fo, const mc_track *t,
+                                 mc_queue *q);
+  unsigned mc_failover_add(mc_failover *fo, AVFormatContext *ic);
+  void mc_failover_put(mc_failover *fo, unsigned idx, AVPacket *pkt);
+  void mc_failover_end(mc_failover *fo, unsigned idx);
+  void mc_failover_demux(mc_failover *fo, unsigned idx);
+  mc_failover_stats *mc_failover_stats_get(mc_failover *fo,
+                                           mc_failover_stats *st);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
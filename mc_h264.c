@@ -3,6 +3,7 @@
 #include <jd_pretty.h>
 #include <math.h>
 #include <stdint.h>
+#include <string.h>
 
 #include <libavutil/opt.h>
 #include <libavcodec/avcodec.h>
@@ -11,10 +12,20 @@
 #include <libavutil/imgutils.h>
 #include <libavutil/mathematics.h>
 #include <libavutil/samplefmt.h>
+#include <libswscale/swscale.h>
 
 #include "multicoder.h"
 
-#define INBUF_SIZE 4096
+/* Returns true if the decoder took some of pkt or gave us a frame;
+ * a decoder that does neither won't on a retry either.
+ */
+/* The video stream cfg's track selects, -1 if there's none */
+static int video_stream(AVFormatContext *fcx, jd_var *cfg) {
+  mc_track t;
+  if (!fcx) return -1;
+  return mc_track_find(fcx, mc_track_parse(&t, AVMEDIA_TYPE_VIDEO,
+                                           jd_get_ks(cfg, "track", 0)));
+}
 
 static unsigned decode(mc_queue *q,
                        AVCodecContext *avctx,
@@ -26,30 +37,46 @@ static unsigned decode(mc_queue *q,
   mc_debug("decode(%p, %u)", pkt->data, (unsigned) pkt->size);
 
   len = avcodec_decode_video2(avctx, frame, &got_frame, pkt);
-  if (len < 0) mc_error("Decode error");
+  if (len < 0) {
+    mc_error("Decode error");
+    pkt->size = 0;
+  }
 
   if (got_frame) {
+    /* encoders downstream take their timing from this */
+    frame->pts = av_frame_get_best_effort_timestamp(frame);
     mc_queue_frame_put(q, frame);
     av_frame_unref(frame);
   }
 
-  if (pkt->data && len > 0) {
+  int used = pkt->data && len > 0;
+  if (used) {
     pkt->size -= len;
     pkt->data += len;
   }
 
-  return got_frame ? 1 : 0;
+  return got_frame || used;
 }
 
+static int thread_type(const char *name) {
+  if (!strcmp(name, "frame")) return FF_THREAD_FRAME;
+  if (!strcmp(name, "slice")) return FF_THREAD_SLICE;
+  if (!strcmp(name, "auto")) return FF_THREAD_FRAME | FF_THREAD_SLICE;
+  jd_throw("Unknown thread type: %s", name);
+}
+
+/* Decode the packets from qi into frames on qo. cfg may set
+ * thread_count (0 for one per cpu) and thread_type ("frame", "slice"
+ * or "auto"). Frame threading adds a frame of latency per thread;
+ * the decoder is fed whole packets as fast as it takes them and
+ * drained once they run out.
+ */
 void mc_h264_decode(AVFormatContext *fcx, jd_var *cfg, mc_queue_merger *qi, mc_queue *qo) {
   AVCodec *codec;
   AVCodecContext *c;
   AVFrame *frame;
   AVPacket avpkt;
 
-  (void) fcx;
-  (void) cfg;
-
   av_init_packet(&avpkt);
 
   codec = avcodec_find_decoder(AV_CODEC_ID_H264);
@@ -58,35 +85,182 @@ void mc_h264_decode(AVFormatContext *fcx, jd_var *cfg, mc_queue_merger *qi, mc_q
   c = avcodec_alloc_context3(codec);
   if (!c) jd_throw("Can't allocate video codec context");
 
-  if (codec->capabilities & CODEC_CAP_TRUNCATED)
-    c->flags |= CODEC_FLAG_TRUNCATED; /* we do not send complete frames */
+  /* out of band parameter sets, e.g. from mp4 */
+  int vid = video_stream(fcx, cfg);
+  if (vid >= 0) {
+    AVCodecContext *icc = fcx->streams[vid]->codec;
+    if (icc->extradata_size) {
+      c->extradata = av_mallocz(icc->extradata_size + FF_INPUT_BUFFER_PADDING_SIZE);
+      memcpy(c->extradata, icc->extradata, icc->extradata_size);
+      c->extradata_size = icc->extradata_size;
+    }
+  }
 
   c->refcounted_frames = 1;
+  c->thread_count = mc_model_get_int(cfg, 0, "$.thread_count");
+  c->thread_type = thread_type(mc_model_get_str(cfg, "frame", "$.thread_type"));
 
-  /* For some codecs, such as msmpeg4 and mpeg4, width and height
-     MUST be initialized there because this information is not
-     available in the bitstream. */
-
-  /* open it */
   if (avcodec_open2(c, codec, NULL) < 0)
     jd_throw("Can't open codec");
 
+  mc_info("Decoding with %d %s thread%s", c->thread_count,
+          c->active_thread_type == FF_THREAD_FRAME ? "frame" :
+          c->active_thread_type == FF_THREAD_SLICE ? "slice" : "decode",
+          c->thread_count == 1 ? "" : "s");
+
   frame = avcodec_alloc_frame();
   if (!frame) jd_throw("Can't allocate frame");
 
-  while (mc_queue_merger_packet_get(qi, &avpkt))
-    decode(qo, c, frame, &avpkt);
+  while (mc_queue_merger_packet_get(qi, &avpkt)) {
+    AVPacket pkt = avpkt;
+    while (pkt.size > 0 && decode(qo, c, frame, &pkt))
+      ;
+    av_free_packet(&avpkt);
+  }
 
   avpkt.data = NULL;
   avpkt.size = 0;
-  decode(qo, c, frame, &avpkt);
+  while (decode(qo, c, frame, &avpkt))
+    ;
 
   mc_queue_frame_put(qo, NULL);
 
   avcodec_close(c);
+  av_freep(&c->extradata);
   av_free(c);
   avcodec_free_frame(&frame);
 }
 
+static int encode(mc_queue *q, AVCodecContext *avctx, AVFrame *frame,
+                  AVStream *is) {
+  AVPacket pkt;
+  int got_packet;
+
+  av_init_packet(&pkt);
+  pkt.data = NULL;
+  pkt.size = 0;
+
+  if (avcodec_encode_video2(avctx, &pkt, frame, &got_packet) < 0)
+    jd_throw("Encode error");
+
+  if (got_packet) {
+    /* the muxer works in the input stream's time base */
+    pkt.pts = av_rescale_q(pkt.pts, avctx->time_base, is->time_base);
+    pkt.dts = av_rescale_q(pkt.dts, avctx->time_base, is->time_base);
+    pkt.duration = av_rescale_q(pkt.duration, avctx->time_base, is->time_base);
+    pkt.stream_index = is->index;
+    mc_queue_packet_put(q, &pkt);
+    av_free_packet(&pkt);
+  }
+
+  return got_packet;
+}
+
+static AVCodecContext *open_encoder(AVStream *is, jd_var *cfg) {
+  AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_H264);
+  if (!codec) jd_throw("H.264 encoder not found");
+
+  AVCodecContext *c = avcodec_alloc_context3(codec);
+  if (!c) jd_throw("Can't allocate video codec context");
+
+  /* failing a frame rate the input's own ticks will do */
+  AVRational rate = is->r_frame_rate;
+  if (!rate.num || !rate.den) rate = is->avg_frame_rate;
+  if (!rate.num || !rate.den) rate = av_inv_q(is->time_base);
+
+  c->width = mc_model_get_int(cfg, is->codec->width, "$.width");
+  c->height = mc_model_get_int(cfg, is->codec->height, "$.height");
+  c->bit_rate = mc_model_get_int(cfg, 0, "$.bit_rate");
+  c->pix_fmt = AV_PIX_FMT_YUV420P;
+  c->time_base = av_inv_q(rate);
+  c->sample_aspect_ratio = is->codec->sample_aspect_ratio;
+
+  /* keyframes follow the input's so every rendition's segments line
+   * up; the gop is only a backstop.
+   */
+  c->gop_size = mc_model_get_int(cfg, 600, "$.gop");
+  av_opt_set(c->priv_data, "preset",
+             mc_model_get_str(cfg, "veryfast", "$.preset"), 0);
+  av_opt_set(c->priv_data, "forced-idr", "1", 0);
+
+  if (avcodec_open2(c, codec, NULL) < 0)
+    jd_throw("Can't open encoder");
+
+  return c;
+}
+
+/* Scale and encode decoded frames from qi into packets on qo. Frames
+ * arrive by reference from a shared decoder, or from a bigger
+ * rendition's qf, so each rendition only pays for its own scale and
+ * encode. If qf isn't NULL the scaled frames go there too. A frame
+ * that's already the right size isn't scaled at all.
+ */
+void mc_h264_encode(AVFormatContext *fcx, jd_var *cfg, mc_queue *qi, mc_queue *qo,
+                    mc_queue *qf) {
+  int vid = video_stream(fcx, cfg);
+  if (vid < 0) jd_throw("Can't find video");
+
+  AVStream *is = fcx->streams[vid];
+  AVCodecContext *c = open_encoder(is, cfg);
+  struct SwsContext *sws = NULL;
+  int64_t last_pts = AV_NOPTS_VALUE;
+  AVFrame in;
+
+  AVFrame *out = av_frame_alloc();
+  if (!out) jd_throw("Can't allocate frame");
+  out->width = c->width;
+  out->height = c->height;
+  out->format = c->pix_fmt;
+  if (av_frame_get_buffer(out, 32) < 0)
+    jd_throw("Can't allocate picture");
+
+  mc_info("Encoding %dx%d at %d bps", c->width, c->height, c->bit_rate);
+
+  while (mc_queue_frame_get(qi, &in)) {
+    AVFrame *pic = &in;
+
+    if (in.width != c->width || in.height != c->height ||
+        in.format != c->pix_fmt) {
+      sws = sws_getCachedContext(sws, in.width, in.height, in.format,
+                                 c->width, c->height, c->pix_fmt,
+                                 SWS_BICUBIC, NULL, NULL, NULL);
+      if (!sws) jd_throw("Can't scale %dx%d", in.width, in.height);
+
+      /* the encoder or a smaller rendition may still hold the last one */
+      if (av_frame_make_writable(out) < 0)
+        jd_throw("Can't allocate picture");
+
+      sws_scale(sws, (const uint8_t * const *) in.data, in.linesize, 0,
+                in.height, out->data, out->linesize);
+      out->pts = in.pts;
+      out->key_frame = in.key_frame;
+      pic = out;
+    }
+
+    if (qf) mc_queue_frame_put(qf, pic);
+
+    int64_t pts = pic->pts;
+    pic->pts = av_rescale_q(pts, is->time_base, c->time_base);
+    if (last_pts != AV_NOPTS_VALUE && pic->pts <= last_pts)
+      pic->pts = last_pts + 1;
+    last_pts = pic->pts;
+    pic->pict_type = in.key_frame ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+
+    encode(qo, c, pic, is);
+    av_frame_unref(&in);
+  }
+
+  while (encode(qo, c, NULL, is))
+    ;
+
+  mc_queue_packet_put(qo, NULL);
+  if (qf) mc_queue_frame_put(qf, NULL);
+
+  sws_freeContext(sws);
+  av_frame_free(&out);
+  avcodec_close(c);
+  av_free(c);
+}
+
 /* vim:ts=2:sw=2:sts=2:et:ft=c
  */
@@ -12,7 +12,7 @@ static unsigned bit_rate(jd_var *stm) {
   unsigned total = 0;
   for (unsigned i = 0; i < sizeof(kinds) / sizeof(kinds[0]); i++) {
     jd_var *spec = jd_get_ks(stm, kinds[i], 0);
-    if (spec) {
+    if (spec && spec->type == HASH) {
       jd_var *br = jd_get_ks(spec, "bit_rate", 0);
       if (br) total += jd_get_int(br);
     }
@@ -20,31 +20,117 @@ static unsigned bit_rate(jd_var *stm) {
   return total;
 }
 
+static const char *yes_no(int flag) {
+  return flag ? "YES" : "NO";
+}
+
+static jd_var *find_stream(jd_var *ctx, jd_var *name) {
+  jd_var *stm = jd_get_key(jd_get_ks(ctx, "by_name", 0), name, 0);
+  if (!stm) mc_warning("No active stream %V", name);
+  return stm;
+}
+
+static jd_var *need_playlist(jd_var *name, jd_var *stm) {
+  jd_var *uri = jd_rv(stm, "$.output.playlist");
+  if (!uri) jd_throw("Stream %V has no playlist", name);
+  return uri;
+}
+
+/* An alternative audio rendition; its "media" names the group it's
+ * in. Returns its bit rate.
+ */
+static unsigned push_media(jd_var *m3u8, jd_var *name, jd_var *stm,
+                           jd_var *media) {
+  jd_var *group = jd_get_ks(media, "group", 0);
+  if (!group) jd_throw("Stream %V has no media group", name);
+  jd_var *label = jd_get_ks(media, "name", 0);
+  jd_var *lang = jd_get_ks(media, "language", 0);
+
+  jd_var *rec = jd_nhv(8);
+  jd_set_string(jd_get_ks(rec, "TYPE", 1), "AUDIO");
+  jd_assign(jd_get_ks(rec, "GROUP-ID", 1), group);
+  jd_assign(jd_get_ks(rec, "NAME", 1), label ? label : name);
+  if (lang) jd_assign(jd_get_ks(rec, "LANGUAGE", 1), lang);
+  jd_set_string(jd_get_ks(rec, "DEFAULT", 1),
+                yes_no(mc_model_get_int(media, 0, "$.default")));
+  jd_set_string(jd_get_ks(rec, "AUTOSELECT", 1),
+                yes_no(mc_model_get_int(media, 1, "$.autoselect")));
+  jd_assign(jd_get_ks(rec, "URI", 1), need_playlist(name, stm));
+
+  jd_var *meta = hls_m3u8_meta(m3u8);
+  jd_var *list = jd_get_ks(meta, "EXT-X-MEDIA", 0);
+  if (!list) list = jd_set_array(jd_get_ks(meta, "EXT-X-MEDIA", 1), 4);
+  jd_assign(jd_push(list, 1), rec);
+  jd_set_int(jd_get_ks(meta, "EXT-X-VERSION", 1), 4);
+
+  return bit_rate(stm);
+}
+
+/* A keyframe only rendition for trick play */
+static void push_iframes(jd_var *m3u8, jd_var *name, jd_var *stm) {
+  unsigned br = bit_rate(stm);
+  if (br == 0) jd_throw("Stream %V has 0 bit rate", name);
+
+  jd_var *rec = jd_nhv(3);
+  jd_set_int(jd_get_ks(rec, "BANDWIDTH", 1), br);
+  jd_set_int(jd_get_ks(rec, "PROGRAM-ID", 1), 1);
+  jd_assign(jd_get_ks(rec, "URI", 1), need_playlist(name, stm));
+
+  jd_var *meta = hls_m3u8_meta(m3u8);
+  jd_var *list = jd_get_ks(meta, "EXT-X-I-FRAME-STREAM-INF", 0);
+  if (!list)
+    list = jd_set_array(jd_get_ks(meta, "EXT-X-I-FRAME-STREAM-INF", 1), 4);
+  jd_assign(jd_push(list, 1), rec);
+  jd_set_int(jd_get_ks(meta, "EXT-X-VERSION", 1), 4);
+}
+
+/* Streams with "media" are listed as alternative renditions and
+ * I-frame streams as trick play renditions; the others are variants.
+ * A variant's "audio_group" names the group its audio comes from,
+ * whose biggest member counts towards its bandwidth.
+ */
 jd_var *mc_hls_make_root(jd_var *m3u8, jd_var *ctx, jd_var *spec) {
   scope {
     hls_m3u8_init(m3u8);
 
     jd_var *inc = jd_get_ks(spec, "include", 0);
     if (!inc) jd_throw("Missing include");
-    jd_var *by_name = jd_get_ks(ctx, "by_name", 0);
 
+    jd_var *groups = jd_nhv(4);
     for (unsigned i = 0; i < jd_count(inc); i++) {
       jd_var *name = jd_get_idx(inc, i);
-      jd_var *stm = jd_get_key(by_name, name, 0);
-      if (!stm) {
-        mc_warning("No active stream %V", name);
+      jd_var *stm = find_stream(ctx, name);
+      jd_var *media = stm ? jd_get_ks(stm, "media", 0) : NULL;
+      if (!media) continue;
+      unsigned br = push_media(m3u8, name, stm, media);
+      jd_var *max = jd_get_key(groups, jd_get_ks(media, "group", 0), 1);
+      if (max->type == VOID || jd_get_int(max) < br) jd_set_int(max, br);
+    }
+
+    for (unsigned i = 0; i < jd_count(inc); i++) {
+      jd_var *name = jd_get_idx(inc, i);
+      jd_var *stm = jd_get_key(jd_get_ks(ctx, "by_name", 0), name, 0);
+      if (!stm || jd_get_ks(stm, "media", 0)) continue;
+      if (mc_model_get_int(stm, 0, "$.output.iframes")) {
+        push_iframes(m3u8, name, stm);
         continue;
       }
+
       unsigned br = bit_rate(stm);
+      jd_var *group = jd_get_ks(stm, "audio_group", 0);
+      if (group) {
+        jd_var *max = jd_get_key(groups, group, 0);
+        if (!max) jd_throw("Stream %V: no audio group %V", name, group);
+        br += jd_get_int(max);
+      }
       if (br == 0) jd_throw("Stream %V has 0 bit rate", name);
-      jd_var *uri = jd_rv(stm, "$.output.playlist");
-      if (!uri) jd_throw("Stream %V has no playlist", name);
 
       jd_var *rec = jd_nhv(2);
-      jd_assign(jd_get_ks(rec, "uri", 1), uri);
+      jd_assign(jd_get_ks(rec, "uri", 1), need_playlist(name, stm));
       jd_var *meta = jd_set_hash(jd_get_ks(rec, "EXT-X-STREAM-INF", 1), 5);
       jd_set_int(jd_get_ks(meta, "BANDWIDTH", 1), br);
       jd_set_int(jd_get_ks(meta, "PROGRAM-ID", 1), 1);
+      if (group) jd_assign(jd_get_ks(meta, "AUDIO", 1), group);
       hls_m3u8_push_playlist(m3u8, rec);
     }
   }
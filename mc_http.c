@@ -0,0 +1,376 @@
+/* mc_http.c */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <jd_pretty.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "multicoder.h"
+#include "mc_http.h"
+
+#define MAX_REQUEST 8192
+#define IDLE_TIMEOUT 30
+#define BLOCK_TIMEOUT 12000
+
+struct mc_http_conn {
+  mc_http_conn *prev, *next;
+  mc_http *h;
+  int fd;
+};
+
+#define STAT_ADD(v, n) __atomic_fetch_add(&(v), (n), __ATOMIC_RELAXED)
+#define STAT_GET(v)    __atomic_load_n(&(v), __ATOMIC_RELAXED)
+
+static const struct {
+  const char *ext;
+  const char *type;
+  const char *cache;
+} mime[] = {
+  { ".m3u8", "application/vnd.apple.mpegurl", "no-cache" },
+  { ".ts", "video/mp2t", "max-age=3600" },
+  { ".aac", "audio/aac", "max-age=3600" },
+  { NULL, "application/octet-stream", "no-cache" }
+};
+
+static unsigned mime_for(const char *name) {
+  size_t nl = strlen(name);
+  unsigned i;
+  for (i = 0; mime[i].ext; i++) {
+    size_t el = strlen(mime[i].ext);
+    if (nl >= el && !strcmp(name + nl - el, mime[i].ext)) break;
+  }
+  return i;
+}
+
+static int send_all(int fd, const void *buf, size_t len) {
+  const char *bp = buf;
+  while (len) {
+    ssize_t put = send(fd, bp, len, MSG_NOSIGNAL);
+    if (put < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    bp += put;
+    len -= put;
+  }
+  return 0;
+}
+
+static int send_status(int fd, int code, const char *reason, int keep) {
+  char hdr[256];
+  int len = snprintf(hdr, sizeof(hdr),
+                     "HTTP/1.1 %d %s\r\n"
+                     "Content-Type: text/plain\r\n"
+                     "Content-Length: %lu\r\n"
+                     "Connection: %s\r\n"
+                     "\r\n"
+                     "%s\n",
+                     code, reason, (unsigned long) strlen(reason) + 1,
+                     keep ? "keep-alive" : "close", reason);
+  return send_all(fd, hdr, len);
+}
+
+/* Find _HLS_msn / _HLS_part in the query string and work out the
+ * playlist version they need. Returns -1 for a bad request.
+ */
+static int blocking_version(char *query, uint64_t *version) {
+  long long msn = -1, part = -1;
+
+  *version = 0;
+  for (char *arg = query; arg && *arg;) {
+    char *next = strchr(arg, '&');
+    if (next) *next++ = '\0';
+    if (!strncmp(arg, "_HLS_msn=", 9)) msn = strtoll(arg + 9, NULL, 10);
+    else if (!strncmp(arg, "_HLS_part=", 10)) part = strtoll(arg + 10, NULL, 10);
+    arg = next;
+  }
+
+  if (msn < 0) return part < 0 ? 0 : -1;
+  /* a whole segment is there once its successor is being written */
+  *version = part < 0 ? MC_HTTP_VERSION(msn + 1, 0)
+             : MC_HTTP_VERSION(msn, part + 1);
+  return 0;
+}
+
+static mc_store_obj *lookup(mc_http *h, const char *path, uint64_t version,
+                            int *status) {
+  *status = 200;
+  if (version) {
+    /* don't wait for things that are too far in the future */
+    mc_store_obj *obj = mc_store_get(h->st, path);
+    if (obj && (version >> 16) > (obj->version >> 16) + 2) {
+      mc_store_release(h->st, obj);
+      *status = 400;
+      return NULL;
+    }
+    mc_store_release(h->st, obj);
+  }
+
+  mc_store_obj *obj = mc_store_wait(h->st, path, version, h->block_timeout);
+  if (!obj) *status = version ? 503 : 404;
+  return obj;
+}
+
+static int serve(mc_http *h, int fd, const char *method, char *path, int keep) {
+  int head = !strcmp(method, "HEAD");
+  if (!head && strcmp(method, "GET"))
+    return send_status(fd, 405, "Method Not Allowed", keep);
+
+  uint64_t version = 0;
+  char *query = strchr(path, '?');
+  if (query) *query++ = '\0';
+  while (*path == '/') path++;
+
+  if (blocking_version(query, &version))
+    return send_status(fd, 400, "Bad Request", keep);
+
+  int status;
+  mc_store_obj *obj = lookup(h, path, version, &status);
+  switch (status) {
+  case 400:
+    return send_status(fd, 400, "Bad Request", keep);
+  case 404:
+    STAT_ADD(h->stats.not_found, 1);
+    return send_status(fd, 404, "Not Found", keep);
+  case 503:
+    return send_status(fd, 503, "Service Unavailable", keep);
+  }
+
+  unsigned mt = mime_for(path);
+  char hdr[512];
+  int len = snprintf(hdr, sizeof(hdr),
+                     "HTTP/1.1 200 OK\r\n"
+                     "Content-Type: %s\r\n"
+                     "Content-Length: %lu\r\n"
+                     "Cache-Control: %s\r\n"
+                     "Access-Control-Allow-Origin: *\r\n"
+                     "Connection: %s\r\n"
+                     "\r\n",
+                     mime[mt].type, (unsigned long) obj->len, mime[mt].cache,
+                     keep ? "keep-alive" : "close");
+
+  int rc = send_all(fd, hdr, len);
+  if (!rc && !head) {
+    rc = send_all(fd, obj->data, obj->len);
+    STAT_ADD(h->stats.bytes, obj->len);
+  }
+
+  mc_store_release(h->st, obj);
+  return rc;
+}
+
+/* Does the request want the connection kept open? */
+static int keep_alive(const char *version, char *headers) {
+  int keep = !strcmp(version, "HTTP/1.1");
+  for (char *ln = headers; ln && *ln;) {
+    char *next = strstr(ln, "\r\n");
+    if (next) *next = '\0';
+    if (!strncasecmp(ln, "Connection:", 11)) {
+      const char *v = ln + 11;
+      while (*v == ' ' || *v == '\t') v++;
+      if (!strncasecmp(v, "close", 5)) keep = 0;
+      else if (!strncasecmp(v, "keep-alive", 10)) keep = 1;
+    }
+    ln = next ? next + 2 : NULL;
+  }
+  return keep;
+}
+
+static void handle(mc_http *h, int fd) {
+  char buf[MAX_REQUEST + 1];
+  size_t have = 0;
+
+  for (;;) {
+    char *end;
+    buf[have] = '\0';
+    while (!(end = strstr(buf, "\r\n\r\n"))) {
+      if (have == MAX_REQUEST) {
+        send_status(fd, 431, "Request Header Fields Too Large", 0);
+        return;
+      }
+      ssize_t got = recv(fd, buf + have, MAX_REQUEST - have, 0);
+      if (got < 0 && errno == EINTR) continue;
+      if (got <= 0) return;
+      have += got;
+      buf[have] = '\0';
+    }
+
+    size_t used = end + 4 - buf;
+    end[2] = '\0';
+
+    char *line_end = strstr(buf, "\r\n");
+    *line_end = '\0';
+
+    char *method = buf;
+    char *path = strchr(method, ' ');
+    char *version = path ? strchr(path + 1, ' ') : NULL;
+    if (!version) {
+      send_status(fd, 400, "Bad Request", 0);
+      return;
+    }
+    *path++ = '\0';
+    *version++ = '\0';
+
+    STAT_ADD(h->stats.requests, 1);
+
+    int keep = keep_alive(version, line_end + 2);
+    if (serve(h, fd, method, path, keep) || !keep) return;
+
+    memmove(buf, buf + used, have - used);
+    have -= used;
+  }
+}
+
+static void *connection(void *ctx) {
+  mc_http_conn *c = ctx;
+  mc_http *h = c->h;
+
+  mc_log_set_thread("http");
+  handle(h, c->fd);
+
+  pthread_mutex_lock(&h->mutex);
+  if (c->prev) c->prev->next = c->next;
+  else h->conn = c->next;
+  if (c->next) c->next->prev = c->prev;
+  h->active--;
+  pthread_cond_broadcast(&h->idle);
+  pthread_mutex_unlock(&h->mutex);
+
+  close(c->fd);
+  free(c);
+  return NULL;
+}
+
+static void *listener(void *ctx) {
+  mc_http *h = ctx;
+
+  mc_log_set_thread("http");
+
+  for (;;) {
+    int fd = accept(h->fd, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      break;
+    }
+
+    struct timeval tv = { IDLE_TIMEOUT, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    mc_http_conn *c = mc_alloc(sizeof(*c));
+    c->h = h;
+    c->fd = fd;
+
+    pthread_mutex_lock(&h->mutex);
+    if (h->stop) {
+      pthread_mutex_unlock(&h->mutex);
+      close(fd);
+      free(c);
+      break;
+    }
+    if ((c->next = h->conn)) c->next->prev = c;
+    h->conn = c;
+    h->active++;
+    pthread_mutex_unlock(&h->mutex);
+
+    STAT_ADD(h->stats.connections, 1);
+
+    pthread_t t;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_create(&t, &attr, connection, c);
+    pthread_attr_destroy(&attr);
+  }
+
+  return NULL;
+}
+
+/* Listen on addr (NULL for any) and port (0 for any free port) */
+mc_http *mc_http_new(mc_store *st, const char *addr, int port) {
+  struct sockaddr_in sa;
+  int one = 1;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons(port);
+  sa.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (addr && !inet_pton(AF_INET, addr, &sa.sin_addr))
+    jd_throw("Bad listen address: %s", addr);
+
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) jd_throw("Can't create socket: %m");
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  if (bind(fd, (struct sockaddr *) &sa, sizeof(sa)) || listen(fd, 64)) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    jd_throw("Can't listen on port %d: %m", port);
+  }
+
+  mc_http *h = mc_alloc(sizeof(*h));
+  h->st = st;
+  h->fd = fd;
+  h->block_timeout = BLOCK_TIMEOUT;
+  pthread_mutex_init(&h->mutex, NULL);
+  pthread_cond_init(&h->idle, NULL);
+  pthread_create(&h->t, NULL, listener, h);
+
+  return h;
+}
+
+int mc_http_port(mc_http *h) {
+  struct sockaddr_in sa;
+  socklen_t len = sizeof(sa);
+  if (getsockname(h->fd, (struct sockaddr *) &sa, &len))
+    jd_throw("Can't get socket name: %m");
+  return ntohs(sa.sin_port);
+}
+
+/* How long blocking playlist reloads and preload hints are held */
+void mc_http_set_block_timeout(mc_http *h, unsigned ms) {
+  h->block_timeout = ms;
+}
+
+void mc_http_free(mc_http *h) {
+  if (h) {
+    pthread_mutex_lock(&h->mutex);
+    h->stop = 1;
+    pthread_mutex_unlock(&h->mutex);
+
+    shutdown(h->fd, SHUT_RDWR);
+    pthread_join(h->t, NULL);
+    close(h->fd);
+
+    pthread_mutex_lock(&h->mutex);
+    for (mc_http_conn *c = h->conn; c; c = c->next)
+      shutdown(c->fd, SHUT_RDWR);
+    while (h->active)
+      pthread_cond_wait(&h->idle, &h->mutex);
+    pthread_mutex_unlock(&h->mutex);
+
+    pthread_mutex_destroy(&h->mutex);
+    pthread_cond_destroy(&h->idle);
+    free(h);
+  }
+}
+
+mc_http_stats *mc_http_stats_get(mc_http *h, mc_http_stats *stats) {
+  stats->connections = STAT_GET(h->stats.connections);
+  stats->requests = STAT_GET(h->stats.requests);
+  stats->not_found = STAT_GET(h->stats.not_found);
+  stats->bytes = STAT_GET(h->stats.bytes);
+  return stats;
+}
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
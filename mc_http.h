@@ -0,0 +1,60 @@
+/* mc_http.h */
+
+#ifndef MC_HTTP_H_
+#define MC_HTTP_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "mc_store.h"
+
+  typedef struct mc_http_conn mc_http_conn;
+
+  /* Playlists are stored with a version made from the media sequence
+   * number of the segment being written and the number of its parts
+   * published so far. That's what LL-HLS blocking reloads
+   * (?_HLS_msn=N&_HLS_part=M) wait for.
+   */
+#define MC_HTTP_VERSION(msn, parts) (((uint64_t) (msn) << 16) | (parts))
+
+  typedef struct {
+    uint64_t connections, requests, not_found, bytes;
+  } mc_http_stats;
+
+  /* A minimal HTTP/1.1 origin that serves GET / HEAD requests
+   * straight from an mc_store. One thread per connection.
+   */
+  typedef struct {
+    mc_store *st;
+    int fd;
+    pthread_t t;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t idle;
+    mc_http_conn *conn;
+    unsigned active;
+    int stop;
+
+    unsigned block_timeout;   /* ms */
+
+    mc_http_stats stats;
+  } mc_http;
+
+  mc_http *mc_http_new(mc_store *st, const char *addr, int port);
+  void mc_http_free(mc_http *h);
+  int mc_http_port(mc_http *h);
+  void mc_http_set_block_timeout(mc_http *h, unsigned ms);
+  mc_http_stats *mc_http_stats_get(mc_http *h, mc_http_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
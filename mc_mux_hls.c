@@ -3,6 +3,7 @@
 #include <jd_pretty.h>
 #include <math.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <libavformat/avformat.h>
@@ -16,6 +17,7 @@
 
 #include "hls.h"
 
+#include "mc_http.h"
 #include "multicoder.h"
 
 #define RETIRE 4
@@ -28,6 +30,16 @@ typedef struct {
   int open;
   jd_int min_time;
   jd_var *retire_queue;
+  int rmdir;              /* segment directories are numbered */
+  mc_writer *w;
+  mc_publisher *pub;      /* NULL to publish on our own */
+  double time;            /* media time of the last segment boundary */
+
+  /* LL-HLS */
+  double part_duration;   /* 0 for whole segments only */
+  unsigned part;          /* parts cut from the open segment */
+  int independent;        /* the current part starts with a keyframe */
+  int fresh;              /* no timed packet in the current part yet */
 } context;
 
 static AVStream *add_output(AVFormatContext *oc, AVStream *is) {
@@ -86,32 +98,195 @@ static AVStream *add_output(AVFormatContext *oc, AVStream *is) {
   return os;
 }
 
-static void seg_close(context *ctx, AVFormatContext *oc) {
+/* A transcoded video stream looks like the input's but with the
+ * encoder's size and rate; its packets still use the input's time
+ * base.
+ */
+static AVStream *add_transcoded(AVFormatContext *oc, AVStream *is,
+                                jd_var *spec) {
+  AVStream *os = add_output(oc, is);
+  AVCodecContext *occ = os->codec;
+
+  occ->codec_id = AV_CODEC_ID_H264;
+  occ->codec_tag = 0;
+  occ->extradata = NULL;
+  occ->extradata_size = 0;
+  occ->pix_fmt = AV_PIX_FMT_YUV420P;
+  occ->width = mc_model_get_int(spec, is->codec->width, "$.width");
+  occ->height = mc_model_get_int(spec, is->codec->height, "$.height");
+  occ->bit_rate = mc_model_get_int(spec, 0, "$.bit_rate");
+
+  return os;
+}
+
+static int transcoded(jd_var *spec) {
+  return spec && strcmp(mc_model_get_str(spec, "direct", "$.type"), "direct");
+}
+
+/* The input stream a spec takes its packets from; encoders only
+ * work from the best video stream.
+ */
+static int find_track(AVFormatContext *ic, enum AVMediaType type,
+                      jd_var *spec) {
+  mc_track t;
+  jd_var *sel = transcoded(spec) ? NULL : jd_get_ks(spec, "track", 0);
+  int idx = mc_track_find(ic, mc_track_parse(&t, type, sel));
+  if (idx < 0) {
+    char name[64];
+    mc_warning("No %s in %s", mc_track_name(name, sizeof(name), &t),
+               ic->filename);
+  }
+  return idx;
+}
+
+/* A null spec (e.g. "video": null over a default) means none */
+static jd_var *get_spec(jd_var *cfg, const char *kind) {
+  jd_var *spec = jd_get_ks(cfg, kind, 0);
+  return spec && spec->type != VOID ? spec : NULL;
+}
+
+/* "ts" for MPEG-TS segments or "aac" for packed audio */
+static const char *format_name(jd_var *cfg, int *packed) {
+  const char *fmt = mc_model_get_str(cfg, "ts", "$.output.format");
+  *packed = 0;
+  if (!strcmp(fmt, "ts")) return "mpegts";
+  if (!strcmp(fmt, "aac")) {
+    *packed = 1;
+    return "adts";
+  }
+  jd_throw("Unknown output format: %s", fmt);
+}
+
+static AVStream *add_track(AVFormatContext *oc, AVStream *is, jd_var *spec) {
+  AVStream *os = transcoded(spec) ? add_transcoded(oc, is, spec)
+                 : add_output(oc, is);
+  AVDictionaryEntry *lang = av_dict_get(is->metadata, "language", NULL, 0);
+  if (lang) av_dict_set(&os->metadata, "language", lang->value, 0);
+  return os;
+}
+
+/* hd/0001.ts -> hd/0001.2.ts */
+static char *part_uri(context *ctx, unsigned part) {
+  const char *uri = mc_segname_uri(ctx->segn);
+  const char *ext = strrchr(uri, '.');
+  if (!ext || strchr(ext, '/')) ext = uri + strlen(uri);
+  size_t len = strlen(uri) + 12;
+  char *pu = mc_alloc(len);
+  snprintf(pu, len, "%.*s.%u%s", (int)(ext - uri), uri, part, ext);
+  return pu;
+}
+
+/* Everything muxed since the last part becomes a part of its own */
+static void part_cut(context *ctx, AVFormatContext *oc, double duration) {
+  avio_flush(oc->pb);
+  scope {
+    char *uri = part_uri(ctx, ctx->part++);
+    char *name = mc_segname_prefix(ctx->segn, uri);
+    char *temp = mc_tmp_name(name);
+
+    mc_writer_part(ctx->w, temp, name, uri);
+
+    jd_var *part = jd_nhv(3);
+    jd_set_real(jd_get_ks(part, "DURATION", 1), duration);
+    jd_set_string(jd_get_ks(part, "URI", 1), uri);
+    if (ctx->independent)
+      jd_set_string(jd_get_ks(part, "INDEPENDENT", 1), "YES");
+    hls_m3u8_push_part(ctx->m3u8, part);
+    ctx->independent = 0;
+    ctx->fresh = 1;
+
+    free(uri);
+    free(name);
+    free(temp);
+  }
+}
+
+/* Advertise the next part; the store holds requests for it until
+ * it arrives.
+ */
+static void part_hint(context *ctx, int more) {
+  if (!more) {
+    hls_m3u8_set_hint(ctx->m3u8, NULL);
+    return;
+  }
+  scope {
+    char *uri = part_uri(ctx, ctx->part);
+    jd_var *hint = jd_nhv(2);
+    jd_set_string(jd_get_ks(hint, "TYPE", 1), "PART");
+    jd_set_string(jd_get_ks(hint, "URI", 1), uri);
+    hls_m3u8_set_hint(ctx->m3u8, hint);
+    mc_writer_expect(ctx->w, uri);
+    free(uri);
+  }
+}
+
+/* The file I/O for segments and playlists happens on the writer
+ * pool. All of an output's files go through the same writer so
+ * a segment is in place before the playlist that names it.
+ */
+static void seg_close(context *ctx, AVFormatContext *oc, double part) {
   if (ctx->open) {
     av_write_trailer(oc);
-    avio_flush(oc->pb);
-    avio_close(oc->pb);
+    if (ctx->part_duration) part_cut(ctx, oc, part);
+    mc_writer_avio_close(oc->pb, mc_segname_temp(ctx->segn),
+                         mc_segname_name(ctx->segn), mc_segname_uri(ctx->segn));
+    oc->pb = NULL;
     ctx->open = 0;
+    ctx->part = 0;
 
-    mc_segname_rename(ctx->segn);
     mc_segname_inc(ctx->segn);
   }
 }
 
-static void seg_open(context *ctx, AVFormatContext *oc) {
+/* True if a new segment was started */
+static int seg_open(context *ctx, AVFormatContext *oc) {
   if (!ctx->open) {
     const char *name = mc_segname_name(ctx->segn);
     const char *temp = mc_segname_temp(ctx->segn);
 
     mc_info("Writing %s (as %s)", name, temp);
-    mc_mkfilepath(temp, 0777);
 
-    if (avio_open(&oc->pb, temp, AVIO_FLAG_WRITE) < 0)
-      jd_throw("Can't write %s: %m", temp);
+    oc->pb = mc_writer_avio_open(ctx->w, temp);
     if (avformat_write_header(oc, NULL))
       jd_throw("Can't write header");
     ctx->open = 1;
+    return 1;
   }
+  return 0;
+}
+
+static void put_syncsafe(AVIOContext *pb, unsigned v) {
+  for (int shift = 21; shift >= 0; shift -= 7)
+    avio_w8(pb, (v >> shift) & 0x7f);
+}
+
+/* Packed audio has no timestamps of its own so each segment starts
+ * with an ID3 PRIV frame giving the 90kHz timestamp of its first
+ * sample.
+ */
+static void put_timestamp(AVIOContext *pb, int64_t ts) {
+  static const char owner[] = "com.apple.streaming.transportStreamTimestamp";
+  unsigned size = sizeof(owner) + 8;
+
+  avio_write(pb, (const unsigned char *) "ID3\x04\x00\x00", 6);
+  put_syncsafe(pb, size + 10);
+  avio_write(pb, (const unsigned char *) "PRIV", 4);
+  put_syncsafe(pb, size);
+  avio_wb16(pb, 0);
+  avio_write(pb, (const unsigned char *) owner, sizeof(owner));
+  avio_wb64(pb, ts & 0x1ffffffffLL);
+}
+
+/* Without a store we must write to disk */
+static unsigned writer_flags(jd_var *cfg, mc_store *store) {
+  unsigned flags = 0;
+  if (!store || mc_model_get_int(cfg, 1, "$.output.disk"))
+    flags |= MC_WRITER_DISK;
+  if (!strcmp("close", mc_model_get_str(cfg, "none", "$.output.fsync")))
+    flags |= MC_WRITER_FSYNC;
+  if (mc_model_get_real(cfg, 0, "$.output.part_duration") > 0)
+    flags |= MC_WRITER_PARTS;
+  return flags;
 }
 
 static const char *cfg_need(jd_var *cfg, const char *path) {
@@ -126,6 +301,8 @@ static jd_var *m3u8_init(context *ctx) {
   if (mc_is_file(name)) {
     mc_info("Attempting to load existing %s", name);
     hls_m3u8_load(ctx->m3u8, name);
+    /* parts of an unfinished segment are gone */
+    jd_delete_ks(ctx->m3u8, "pending", NULL);
     /* TODO conditional? */
     hls_m3u8_push_discontinuity(ctx->m3u8);
   }
@@ -134,7 +311,23 @@ static jd_var *m3u8_init(context *ctx) {
   jd_set_int(jd_get_ks(meta, "EXT-X-TARGETDURATION", 1),
              mc_model_get_int(ctx->cfg, 8, "$.output.gop"));
   jd_set_string(jd_get_ks(meta, "EXT-X-PLAYLIST-TYPE", 1), "EVENT");
-  jd_set_int(jd_get_ks(meta, "EXT-X-VERSION", 1), 3);
+  jd_set_int(jd_get_ks(meta, "EXT-X-VERSION", 1), ctx->part_duration ? 6 : 3);
+
+  if (mc_model_get_int(ctx->cfg, 0, "$.output.iframes")) {
+    jd_set_bool(jd_get_ks(meta, "EXT-X-I-FRAMES-ONLY", 1), 1);
+    jd_set_int(jd_get_ks(meta, "EXT-X-VERSION", 1), 4);
+  }
+
+  if (ctx->part_duration) {
+    jd_var *pi = jd_set_hash(jd_get_ks(meta, "EXT-X-PART-INF", 1), 1);
+    jd_set_real(jd_get_ks(pi, "PART-TARGET", 1), ctx->part_duration);
+
+    jd_var *sc = jd_set_hash(jd_get_ks(meta, "EXT-X-SERVER-CONTROL", 1), 2);
+    jd_set_real(jd_get_ks(sc, "PART-HOLD-BACK", 1), 3 * ctx->part_duration);
+    /* only our origin can hold requests */
+    if (ctx->w->store)
+      jd_set_string(jd_get_ks(sc, "CAN-BLOCK-RELOAD", 1), "YES");
+  }
 
   hls_m3u8_set_closed(ctx->m3u8, 0);
 
@@ -152,6 +345,21 @@ static jd_var *make_segment(jd_var *out,
   return out;
 }
 
+/* True if the directory part of a segment name template changes from
+ * segment to segment (e.g. "sd/%08d/%04d.ts"), in which case
+ * directories empty out as their segments retire.
+ */
+static int numbered_dirs(const char *fmt) {
+  const char *slash = strrchr(fmt, '/');
+  return slash && memchr(fmt, '%', slash - fmt);
+}
+
+static void unlink_uri(context *ctx, jd_var *uri) {
+  char *fn = mc_segname_prefix(ctx->segn, jd_bytes(uri, NULL));
+  mc_writer_retire(ctx->w, fn, jd_bytes(uri, NULL), ctx->rmdir);
+  free(fn);
+}
+
 static void cleanup(context *ctx) {
   scope {
     jd_var *rq = ctx->retire_queue;
@@ -163,18 +371,50 @@ static void cleanup(context *ctx) {
         jd_var *seg = jd_get_idx(segs, i);
         if (seg->type == HASH) {
           jd_var *uri = jd_get_ks(seg, "uri", 0);
-          if (uri) {
-            char *fn = mc_segname_prefix(ctx->segn, jd_bytes(uri, NULL));
-            mc_info("Purging %s", fn);
-            if (unlink(fn)) mc_warning("Failed to delete %s: %m", fn);
-            free(fn);
-          }
+          if (uri) unlink_uri(ctx, uri);
+          jd_var *parts = jd_get_ks(seg, "EXT-X-PART", 0);
+          for (unsigned j = 0; parts && j < jd_count(parts); j++)
+            unlink_uri(ctx, jd_get_ks(jd_get_idx(parts, j), "URI", 0));
         }
       }
     }
   }
 }
 
+/* Players skip gaps; they need version 8 */
+static void mark_gap(const char *uri, void *vctx) {
+  context *ctx = vctx;
+  if (!hls_m3u8_set_gap(ctx->m3u8, uri)) return;
+  mc_warning("Marking %s as a gap", uri);
+  jd_var *ver = jd_get_ks(hls_m3u8_meta(ctx->m3u8), "EXT-X-VERSION", 1);
+  if (jd_get_int(ver) < 8) jd_set_int(ver, 8);
+}
+
+/* The version lets blocking reloads wait for a particular part. With
+ * a publisher the playlist goes out once the other renditions have
+ * reached the same point.
+ */
+static void m3u8_publish(context *ctx) {
+  mc_writer_failed(ctx->w, mark_gap, ctx);
+  scope {
+    jd_var *seq = jd_get_ks(hls_m3u8_meta(ctx->m3u8), "EXT-X-MEDIA-SEQUENCE", 0);
+    uint64_t msn = (seq ? jd_get_int(seq) : 0) + hls_m3u8_count(ctx->m3u8);
+
+    size_t len;
+    const char *buf = jd_bytes(hls_m3u8_format(jd_nv(), ctx->m3u8), &len);
+    if (ctx->pub)
+      mc_publisher_submit(ctx->pub, ctx->w, ctx->time, buf, len - 1,
+                          mc_segname_temp(ctx->pln), mc_segname_name(ctx->pln),
+                          mc_segname_uri(ctx->pln),
+                          MC_HTTP_VERSION(msn, ctx->part));
+    else
+      mc_writer_save_version(ctx->w, buf, len - 1, mc_segname_temp(ctx->pln),
+                             mc_segname_name(ctx->pln), mc_segname_uri(ctx->pln),
+                             MC_HTTP_VERSION(msn, ctx->part));
+    mc_segname_inc(ctx->pln);
+  }
+}
+
 static void m3u8_push_segment(context *ctx,
                               const char *uri,
                               double duration,
@@ -183,12 +423,14 @@ static void m3u8_push_segment(context *ctx,
     jd_var *seg = make_segment(jd_nv(), uri, duration, title);
     hls_m3u8_push_segment(ctx->m3u8, seg);
     hls_m3u8_expire(ctx->m3u8, ctx->min_time);
+    /* parts are only listed for the last few segments */
+    if (ctx->part_duration)
+      hls_m3u8_expire_parts(ctx->m3u8,
+                            3 * mc_model_get_int(ctx->cfg, 8, "$.output.gop"));
     jd_assign(jd_push(ctx->retire_queue, 1), hls_m3u8_retired(ctx->m3u8));
     cleanup(ctx);
-    hls_m3u8_save(ctx->m3u8, mc_segname_temp(ctx->pln));
-    mc_segname_rename(ctx->pln);
-    mc_info("Updated %s", mc_segname_name(ctx->pln));
-    mc_segname_inc(ctx->pln);
+
+    m3u8_publish(ctx);
   }
 }
 
@@ -201,111 +443,298 @@ static void parse_previous(context *ctx) {
   }
 }
 
+/* part is the duration of the segment's final part; more is false
+ * at the end of the stream.
+ */
 static void push_segment(context *ctx,
                          AVFormatContext *oc,
-                         double duration) {
+                         double duration,
+                         double part,
+                         int more) {
   char *name = mc_strdup(mc_segname_uri(ctx->segn));
-  seg_close(ctx, oc);
+  seg_close(ctx, oc, part);
+  if (ctx->part_duration) part_hint(ctx, more);
   m3u8_push_segment(ctx, name, duration, "");
   free(name);
 }
 
-void mc_mux_hls(AVFormatContext *ic, jd_var *cfg, mc_queue_merger *qm) {
-  scope {
-    AVFormatContext *oc;
-    AVPacket pkt;
-    AVStream *vs = NULL, *as = NULL;
-    context ctx;
-    int vi = -1;
+/* Packets can still be in the interleaver or buffered by the muxer
+ * itself; they belong in this part.
+ */
+static void push_part(context *ctx, AVFormatContext *oc, double duration) {
+  if (av_interleaved_write_frame(oc, NULL) < 0 || av_write_frame(oc, NULL) < 0)
+    mc_error("Can't flush muxer");
+  part_cut(ctx, oc, duration);
+  part_hint(ctx, 1);
+  m3u8_publish(ctx);
+}
 
-    const char *prefix = cfg_need(cfg, "$.output.prefix");
+struct mc_hls_muxer {
+  context ctx;
+  jd_var cfg, m3u8, retire_queue;
+  mc_queue_merger *qm;
+  AVFormatContext *ic, *oc;
+  int *map;               /* output stream for each input stream; -1 for none */
+  int vi, ai;             /* input video and audio; -1 if not muxed */
+  int ti;                 /* input stream segments are timed and cut by */
+  int cut_any;            /* any ti packet may start a segment, not just keys */
+  int iframes;            /* keyframes only, each a segment of its own */
+  int packed;             /* packed audio rather than a transport stream */
+
+  mc_writer_fn wake;      /* told when the writer has room; NULL to wait */
+  void *wake_ctx;
+
+  double min_gop;
+  double last_duration;
+  double gop_time, part_time, now;
+};
+
+/* Nothing is read from qm until the muxer is run */
+mc_hls_muxer *mc_hls_muxer_new(AVFormatContext *ic, jd_var *cfg,
+                               mc_queue_merger *qm, mc_writer_pool *wp,
+                               mc_store *store, mc_publisher *pub) {
+  mc_hls_muxer *mx = mc_alloc(sizeof(*mx));
+  context *ctx = &mx->ctx;
 
-    double min_gop = mc_model_get_real(cfg, 4, "$.output.min_gop");
-    int gop = mc_model_get_int(cfg, 8, "$.output.gop");
-    double last_duration = gop;
-    double gop_time = NAN;
+  scope {
+    jd_clone(&mx->cfg, cfg, 1);
+    cfg = &mx->cfg;
 
-    ctx.cfg = cfg;
-    ctx.open = 0;
-    ctx.segn = mc_segname_new_prefixed(cfg_need(cfg, "$.output.segment"), prefix);
-    ctx.pln = mc_segname_new_prefixed(cfg_need(cfg, "$.output.playlist"), prefix);
-    ctx.retire_queue = jd_nav(RETIRE);
-    ctx.min_time = mc_model_get_int(cfg, 3600, "$.output.min_time");
-    ctx.m3u8 = jd_nv();
+    const char *prefix = cfg_need(cfg, "$.output.prefix");
 
-    m3u8_init(&ctx);
-    parse_previous(&ctx);
+    mx->qm = qm;
+    mx->ic = ic;
+    mx->vi = mx->ai = -1;
+    mx->iframes = mc_model_get_int(cfg, 0, "$.output.iframes");
+    mx->min_gop = mc_model_get_real(cfg, 4, "$.output.min_gop");
+    mx->last_duration = mc_model_get_int(cfg, 8, "$.output.gop");
+    mx->gop_time = mx->part_time = mx->now = NAN;
 
-    mc_info("Next segment is %s", mc_segname_name(ctx.segn));
+    ctx->cfg = cfg;
+    ctx->open = 0;
+    ctx->segn = mc_segname_new_prefixed(cfg_need(cfg, "$.output.segment"), prefix);
+    ctx->pln = mc_segname_new_prefixed(cfg_need(cfg, "$.output.playlist"), prefix);
+    ctx->retire_queue = jd_set_array(&mx->retire_queue, RETIRE);
+    ctx->rmdir = numbered_dirs(cfg_need(cfg, "$.output.segment"));
+    ctx->min_time = mc_model_get_int(cfg, 3600, "$.output.min_time");
+    ctx->m3u8 = &mx->m3u8;
+    ctx->w = mc_writer_new(wp, store, writer_flags(cfg, store));
+    mc_writer_set_space(ctx->w, mc_model_get_str(cfg, NULL, "$.output.space"));
+    ctx->part_duration = mc_model_get_real(cfg, 0, "$.output.part_duration");
+    /* parts are published as they're cut, not per segment */
+    ctx->pub = ctx->part_duration ? NULL : pub;
+    ctx->part = 0;
+    ctx->independent = 0;
+    ctx->fresh = 1;
+
+    m3u8_init(ctx);
+    parse_previous(ctx);
+
+    mc_info("Next segment is %s", mc_segname_name(ctx->segn));
 
+    AVFormatContext *oc;
     if (oc = avformat_alloc_context(), !oc)
       jd_throw("Can't allocate output context");
+    mx->oc = oc;
+
+    const char *fmt = format_name(cfg, &mx->packed);
+    if (oc->oformat = av_guess_format(fmt, NULL, NULL), !oc->oformat)
+      jd_throw("Can't find %s multiplexer", fmt);
+
+    /* only the tracks this stream's spec asks for */
+    mx->map = mc_alloc(sizeof(int) * (ic->nb_streams + 1));
+    for (unsigned i = 0; i < ic->nb_streams; i++) mx->map[i] = -1;
+
+    jd_var *spec = get_spec(cfg, "video");
+    if (spec && (mx->vi = find_track(ic, AVMEDIA_TYPE_VIDEO, spec)) >= 0)
+      mx->map[mx->vi] = add_track(oc, ic->streams[mx->vi], spec)->index;
+
+    spec = get_spec(cfg, "audio");
+    if (spec && (mx->ai = find_track(ic, AVMEDIA_TYPE_AUDIO, spec)) >= 0)
+      mx->map[mx->ai] = add_track(oc, ic->streams[mx->ai], spec)->index;
+
+    jd_var *subs = jd_get_ks(cfg, "subtitles", 0);
+    for (unsigned i = 0; subs && i < jd_count(subs); i++) {
+      spec = jd_get_idx(subs, i);
+      int si = find_track(ic, AVMEDIA_TYPE_SUBTITLE, spec);
+      if (si >= 0 && mx->map[si] < 0)
+        mx->map[si] = add_track(oc, ic->streams[si], spec)->index;
+    }
 
-    if (oc->oformat = av_guess_format("mpegts", NULL, NULL), !oc->oformat)
-      jd_throw("Can't find mpegts multiplexer");
+    if (!oc->nb_streams) jd_throw("No streams to mux");
+
+    /* audio only renditions are timed by, and cut at any packet of,
+     * their audio.
+     */
+    mx->ti = mx->vi >= 0 ? mx->vi : mx->ai;
+    mx->cut_any = mx->vi < 0;
+    if (mx->ti < 0) jd_throw("No audio or video to cut segments by");
+
+    if (mx->packed &&
+        (oc->nb_streams != 1 || mx->ai < 0
+         || oc->streams[0]->codec->codec_id != AV_CODEC_ID_AAC))
+      jd_throw("Packed audio needs a single AAC track");
+
+    if (mx->iframes) {
+      if (oc->nb_streams != 1 || mx->vi < 0)
+        jd_throw("I-frame renditions need video and nothing else");
+      if (ctx->part_duration)
+        jd_throw("I-frame renditions can't have parts");
+      mx->min_gop = 0;
+    }
 
-    for (unsigned i = 0; i < ic->nb_streams; i++) {
-      AVStream *is = ic->streams[i];
-      is->discard = AVDISCARD_NONE;
+    ic->flags |= AVFMT_FLAG_IGNDTS;
+  }
 
-      if (!vs && is->codec->codec_type == AVMEDIA_TYPE_VIDEO) {
-        vs = add_output(oc, is);
-        vi = i;
-        continue;
-      }
+  return mx;
+}
 
-      if (!as && is->codec->codec_type == AVMEDIA_TYPE_AUDIO) {
-        as = add_output(oc, is);
-        continue;
-      }
+static void mux_packet(mc_hls_muxer *mx, AVPacket *pkt) {
+  context *ctx = &mx->ctx;
+  AVFormatContext *oc = mx->oc;
+
+  mc_debug("HLS got %d (flags=%08x, pts=%llu, dts=%llu, duration=%d)",
+           pkt->stream_index, pkt->flags,
+           (unsigned long long) pkt->pts,
+           (unsigned long long) pkt->dts,
+           pkt->duration);
+
+  int os = pkt->stream_index < (int) mx->ic->nb_streams
+           ? mx->map[pkt->stream_index] : -1;
+  int timed = pkt->stream_index == mx->ti;
+  int sync = timed && (mx->cut_any || (pkt->flags & AV_PKT_FLAG_KEY));
+  if (os < 0 || (mx->iframes && !sync)) {
+    av_free_packet(pkt);
+    return;
+  }
+
+  double tb = av_q2d(oc->streams[os]->time_base);
+  double st = pkt->pts * tb;
+  if (timed) mx->now = st;
 
-      is->discard = AVDISCARD_ALL;
+  if (sync) {
+    if (isnan(mx->gop_time)) {
+      mx->gop_time = mx->part_time = st;
     }
+    else if (st - mx->gop_time >= mx->min_gop) {
+      mx->last_duration = st - mx->gop_time;
+      ctx->time = st;
+      push_segment(ctx, oc, mx->last_duration, st - mx->part_time, 1);
+      mx->gop_time = mx->part_time = st;
+    }
+  }
 
-    ic->flags |= AVFMT_FLAG_IGNDTS;
+  /* cut before this packet would take the part past its target */
+  if (ctx->part_duration && ctx->open && timed &&
+      st + pkt->duration * tb - mx->part_time > ctx->part_duration) {
+    push_part(ctx, oc, st - mx->part_time);
+    mx->part_time = st;
+  }
 
-    av_init_packet(&pkt);
+  if (seg_open(ctx, oc) && mx->packed) {
+    AVRational mpeg = { 1, 90000 };
+    put_timestamp(oc->pb, av_rescale_q(pkt->pts,
+                                       mx->ic->streams[pkt->stream_index]->time_base,
+                                       mpeg));
+  }
 
-    while (mc_queue_merger_packet_get(qm, &pkt)) {
-      mc_debug("HLS got %d (flags=%08x, pts=%llu, dts=%llu, duration=%d)",
-               pkt.stream_index, pkt.flags,
-               (unsigned long long) pkt.pts,
-               (unsigned long long) pkt.dts,
-               pkt.duration);
-
-      if ((pkt.stream_index == vi && (pkt.flags & AV_PKT_FLAG_KEY)) || vi == -1) {
-        double st = pkt.pts * av_q2d((pkt.stream_index == vi ? vs : as)->time_base);
-        if (isnan(gop_time)) {
-          gop_time = st;
-        }
-        else if (st - gop_time >= min_gop) {
-          last_duration = st - gop_time;
-          push_segment(&ctx, oc, last_duration);
-          gop_time = st;
-        }
-      }
+  /* a part is independent if its first frame is */
+  if (timed && ctx->fresh) {
+    ctx->independent = sync;
+    ctx->fresh = 0;
+  }
 
-      seg_open(&ctx, oc);
+  pkt->stream_index = os;
+  if (av_interleaved_write_frame(oc, pkt))
+    mc_error("Can't write frame");
 
-      if (av_interleaved_write_frame(oc, &pkt))
-        mc_error("Can't write frame");
+  av_free_packet(pkt);
+}
 
-      av_free_packet(&pkt);
-    }
+static void mux_finish(mc_hls_muxer *mx) {
+  context *ctx = &mx->ctx;
+  if (!isnan(mx->now)) ctx->time = mx->now;
+  push_segment(ctx, mx->oc, mx->last_duration,
+               isnan(mx->now - mx->part_time) ? 0 : mx->now - mx->part_time, 0);
+  if (ctx->pub) mc_publisher_leave(ctx->pub, ctx->w);
+  mc_debug("HLS EOF");
+}
+
+/* Rather than block when the writer pool is full, mc_hls_muxer_run
+ * returns MC_SCHED_WAIT and wake(ctx) is called when it has room.
+ */
+void mc_hls_muxer_set_notify(mc_hls_muxer *mx, mc_writer_fn wake, void *ctx) {
+  mx->wake = wake;
+  mx->wake_ctx = ctx;
+  mx->ctx.w->flags |= MC_WRITER_NOWAIT;
+}
 
-    push_segment(&ctx, oc, last_duration);
+/* Mux up to budget packets, or as many as are ready if budget is
+ * 0, without waiting for more. At the end of the input the final
+ * segment is written and MC_SCHED_DONE returned.
+ */
+mc_sched_result mc_hls_muxer_run(mc_hls_muxer *mx, unsigned budget) {
+  mc_sched_result rc = MC_SCHED_YIELD;
+  scope {
+    AVPacket pkt;
+    av_init_packet(&pkt);
+    for (unsigned n = 0; !budget || n < budget; n++) {
+      if (mx->wake && !mc_writer_ready(mx->ctx.w, mx->wake, mx->wake_ctx)) {
+        rc = MC_SCHED_WAIT;
+        break;
+      }
+      int got = mc_queue_merger_packet_poll(mx->qm, &pkt);
+      if (got < 0) {
+        rc = MC_SCHED_WAIT;
+        break;
+      }
+      if (!got) {
+        mux_finish(mx);
+        rc = MC_SCHED_DONE;
+        break;
+      }
+      mux_packet(mx, &pkt);
+    }
+  }
+  return rc;
+}
 
-    for (unsigned i = 0; i < oc->nb_streams; i++) {
-      av_freep(&oc->streams[i]->codec);
-      av_freep(&oc->streams[i]);
+void mc_hls_muxer_free(mc_hls_muxer *mx) {
+  if (mx) {
+    AVFormatContext *oc = mx->oc;
+    if (oc) {
+      for (unsigned i = 0; i < oc->nb_streams; i++) {
+        av_dict_free(&oc->streams[i]->metadata);
+        av_freep(&oc->streams[i]->codec);
+        av_freep(&oc->streams[i]);
+      }
+      av_free(oc);
     }
 
-    av_free(oc);
+    free(mx->map);
+    mc_writer_free(mx->ctx.w);
+    mc_segname_free(mx->ctx.segn);
+    mc_segname_free(mx->ctx.pln);
+    jd_release(&mx->cfg);
+    jd_release(&mx->m3u8);
+    jd_release(&mx->retire_queue);
+    free(mx);
+  }
+}
 
-    mc_segname_free(ctx.segn);
-    mc_segname_free(ctx.pln);
+/* Mux the whole of qm on the calling thread */
+void mc_mux_hls(AVFormatContext *ic, jd_var *cfg, mc_queue_merger *qm,
+                mc_writer_pool *wp, mc_store *store, mc_publisher *pub) {
+  scope {
+    mc_hls_muxer *mx = mc_hls_muxer_new(ic, cfg, qm, wp, store, pub);
+    AVPacket pkt;
+
+    av_init_packet(&pkt);
+    while (mc_queue_merger_packet_get(qm, &pkt))
+      mux_packet(mx, &pkt);
 
-    mc_debug("HLS EOF");
+    mux_finish(mx);
+    mc_hls_muxer_free(mx);
   }
 }
 
@@ -0,0 +1,284 @@
+/* mc_publisher.c */
+
+#include <jd_pretty.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "multicoder.h"
+#include "mc_publisher.h"
+
+struct mc_publisher_entry {
+  mc_publisher_entry *next;
+  mc_publisher *pub;
+  mc_writer *w;            /* the member's writer */
+  double time;
+  int leave;
+  int stale;              /* lists a file that failed; not written */
+  void *data;
+  size_t len;
+  char *temp, *name, *uri;
+  uint64_t version;
+};
+
+static mc_publisher_entry *new_entry(mc_publisher *pub, const void *buf,
+                                     size_t len, const char *temp,
+                                     const char *name, const char *uri) {
+  mc_publisher_entry *e = mc_alloc(sizeof(*e));
+  e->pub = pub;
+  if (buf) {
+    e->data = mc_alloc(len ? len : 1);
+    memcpy(e->data, buf, len);
+    e->len = len;
+  }
+  e->temp = mc_strdup(temp);
+  e->name = mc_strdup(name);
+  e->uri = mc_strdup(uri);
+  return e;
+}
+
+static void free_entries(mc_publisher_entry *e) {
+  while (e) {
+    mc_publisher_entry *next = e->next;
+    free(e->data);
+    free(e->temp);
+    free(e->name);
+    free(e->uri);
+    free(e);
+    e = next;
+  }
+}
+
+static unsigned count_entries(mc_publisher_entry *e) {
+  unsigned n = 0;
+  for (; e; e = e->next)
+    if (!e->stale) n++;
+  return n;
+}
+
+static mc_writer_file *add_files(mc_writer_file *f, mc_publisher_entry *e) {
+  for (; e; e = e->next) {
+    if (e->stale) continue;
+    f->buf = e->data;
+    f->len = e->len;
+    f->temp = e->temp;
+    f->name = e->name;
+    f->uri = e->uri;
+    f->version = e->version;
+    f++;
+  }
+  return f;
+}
+
+static int same(const char *a, const char *b) {
+  return a && b ? !strcmp(a, b) : a == b;
+}
+
+/* Take the pending entries up to time, keeping only the newest
+ * version of each playlist.
+ */
+static mc_publisher_entry *take_until(mc_publisher *pub, double time) {
+  mc_publisher_entry *batch = NULL;
+  while (pub->pending && pub->pending->time <= time) {
+    mc_publisher_entry *e = pub->pending;
+    pub->pending = e->next;
+    e->next = NULL;
+
+    mc_publisher_entry **ep;
+    for (ep = &batch; *ep; ep = &(*ep)->next)
+      if (same((*ep)->name, e->name) && same((*ep)->uri, e->uri)) break;
+
+    if (*ep) {
+      e->next = (*ep)->next;
+      (*ep)->next = NULL;
+      free_entries(*ep);
+    }
+    *ep = e;
+  }
+  return batch;
+}
+
+/* Called with the lock held. entries may be NULL to send just the
+ * extras.
+ */
+static void publish(mc_publisher *pub, mc_publisher_entry *entries) {
+  unsigned n = count_entries(pub->extra) + count_entries(entries);
+
+  if (n) {
+    mc_writer_file *files = mc_alloc(sizeof(mc_writer_file) * n);
+    add_files(add_files(files, pub->extra), entries);
+    mc_writer_save_batch(pub->w, files, n);
+    free(files);
+    pub->stats.batches++;
+    pub->stats.files += n;
+  }
+
+  free_entries(pub->extra);
+  pub->extra = NULL;
+  free_entries(entries);
+}
+
+/* Called with the lock held. Publish everything every member has
+ * reached; if a member is lagging by more than max_pending segments
+ * publish what it's holding up without it.
+ */
+static void flush(mc_publisher *pub) {
+  double reached = INFINITY, newest = -INFINITY, longest = 0;
+  for (unsigned i = 0; i < pub->nmember; i++) {
+    mc_publisher_member *m = &pub->member[i];
+    if (m->time < reached) reached = m->time;
+    if (m->time > newest) newest = m->time;
+    if (m->longest > longest) longest = m->longest;
+  }
+  if (pub->nmember < pub->members) reached = -INFINITY;
+
+  if (pub->pending && pub->pending->time <= reached)
+    publish(pub, take_until(pub, reached));
+
+  while (pub->pending && longest > 0 &&
+         newest - pub->pending->time > pub->max_pending * longest) {
+    double time = pub->pending->time;
+    unsigned behind = pub->members - pub->nmember;
+    for (unsigned i = 0; i < pub->nmember; i++)
+      if (pub->member[i].time < time) behind++;
+    mc_warning("Publishing playlists for %.3f without %u of %u renditions",
+               time, behind, pub->members);
+    pub->stats.partial++;
+    publish(pub, take_until(pub, time));
+  }
+}
+
+static mc_publisher_member *get_member(mc_publisher *pub, mc_writer *w) {
+  for (unsigned i = 0; i < pub->nmember; i++)
+    if (pub->member[i].w == w) return &pub->member[i];
+
+  size_t size = sizeof(mc_publisher_member) * (pub->nmember + 1);
+  if (pub->member = realloc(pub->member, size), !pub->member) abort();
+  mc_publisher_member *m = &pub->member[pub->nmember++];
+  m->w = w;
+  m->time = NAN;
+  m->longest = 0;
+  return m;
+}
+
+static void drop_member(mc_publisher *pub, mc_writer *w) {
+  for (unsigned i = 0; i < pub->nmember; i++)
+    if (pub->member[i].w == w) {
+      pub->member[i] = pub->member[--pub->nmember];
+      break;
+    }
+  pub->members--;
+}
+
+/* Runs on the member's writer, so after the segment it lists is in
+ * place.
+ */
+static void arrive(void *ctx) {
+  mc_publisher_entry *e = ctx;
+  mc_publisher *pub = e->pub;
+
+  pthread_mutex_lock(&pub->mutex);
+
+  if (e->leave) {
+    drop_member(pub, e->w);
+    free_entries(e);
+  }
+  else {
+    /* it still stands for the member's progress */
+    if (mc_writer_behind(e->w)) {
+      mc_warning("Not updating %s: it lists a file that failed",
+                 e->name ? e->name : e->uri);
+      e->stale = 1;
+    }
+
+    mc_publisher_member *m = get_member(pub, e->w);
+    if (!isnan(m->time) && e->time - m->time > m->longest)
+      m->longest = e->time - m->time;
+    m->time = e->time;
+
+    mc_publisher_entry **ep = &pub->pending;
+    while (*ep && (*ep)->time <= e->time) ep = &(*ep)->next;
+    e->next = *ep;
+    *ep = e;
+  }
+
+  flush(pub);
+  pthread_mutex_unlock(&pub->mutex);
+}
+
+mc_publisher *mc_publisher_new(mc_writer_pool *wp, mc_store *store,
+                               unsigned flags, unsigned members,
+                               unsigned max_pending) {
+  mc_publisher *pub = mc_alloc(sizeof(*pub));
+  pub->w = mc_writer_new(wp, store, flags);
+  pub->members = members;
+  pub->max_pending = max_pending;
+  pthread_mutex_init(&pub->mutex, NULL);
+  return pub;
+}
+
+/* Publishes anything still pending. Call after the members' writers
+ * have been freed.
+ */
+void mc_publisher_free(mc_publisher *pub) {
+  if (pub) {
+    pthread_mutex_lock(&pub->mutex);
+    if (pub->pending || pub->extra) publish(pub, take_until(pub, INFINITY));
+    pthread_mutex_unlock(&pub->mutex);
+
+    mc_writer_free(pub->w);
+    pthread_mutex_destroy(&pub->mutex);
+    free(pub->member);
+    free(pub);
+  }
+}
+
+/* A file (such as a root playlist) to go out with the next batch */
+void mc_publisher_add(mc_publisher *pub, const void *buf, size_t len,
+                      const char *temp, const char *name, const char *uri) {
+  mc_publisher_entry *e = new_entry(pub, buf, len, temp, name, uri);
+  pthread_mutex_lock(&pub->mutex);
+  mc_publisher_entry **ep = &pub->extra;
+  while (*ep) ep = &(*ep)->next;
+  *ep = e;
+  pthread_mutex_unlock(&pub->mutex);
+}
+
+/* Submit a member's playlist for the segment boundary at time. It
+ * counts once w has finished the jobs already submitted to it.
+ */
+void mc_publisher_submit(mc_publisher *pub, mc_writer *w, double time,
+                         const void *buf, size_t len, const char *temp,
+                         const char *name, const char *uri,
+                         uint64_t version) {
+  mc_publisher_entry *e = new_entry(pub, buf, len, temp, name, uri);
+  e->w = w;
+  e->time = time;
+  e->version = version;
+  mc_writer_call(w, arrive, e);
+}
+
+/* A member has finished; batches stop waiting for it */
+void mc_publisher_leave(mc_publisher *pub, mc_writer *w) {
+  mc_publisher_entry *e = new_entry(pub, NULL, 0, NULL, NULL, NULL);
+  e->w = w;
+  e->leave = 1;
+  mc_writer_call(w, arrive, e);
+}
+
+/* Wait for published batches to be written */
+void mc_publisher_sync(mc_publisher *pub) {
+  mc_writer_sync(pub->w);
+}
+
+mc_publisher_stats *mc_publisher_stats_get(mc_publisher *pub,
+                                           mc_publisher_stats *stats) {
+  pthread_mutex_lock(&pub->mutex);
+  *stats = pub->stats;
+  pthread_mutex_unlock(&pub->mutex);
+  return stats;
+}
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
@@ -0,0 +1,76 @@
+/* mc_publisher.h */
+
+#ifndef MC_PUBLISHER_H_
+#define MC_PUBLISHER_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mc_writer.h"
+
+  typedef struct mc_publisher_entry mc_publisher_entry;
+
+  /* How far a member has got */
+  typedef struct {
+    mc_writer *w;
+    double time;            /* its latest segment boundary */
+    double longest;         /* its longest segment */
+  } mc_publisher_member;
+
+  typedef struct {
+    uint64_t batches, files, partial;
+  } mc_publisher_stats;
+
+  /* Collects the playlists of a number of renditions and publishes
+   * them together, so players never see one rendition ahead of
+   * another. Submissions are keyed by the media time of the segment
+   * boundary they follow, so renditions needn't have the same number
+   * of segments or cut them at the same times: playlists go out once
+   * every member has reached their boundary. If a member lags by more
+   * than max_pending of the longest segments, the others go out
+   * without it.
+   */
+  typedef struct {
+    pthread_mutex_t mutex;
+    mc_writer *w;
+    unsigned members, max_pending;
+
+    mc_publisher_member *member;    /* those that have submitted */
+    unsigned nmember;
+
+    mc_publisher_entry *pending;    /* by time, oldest first */
+    mc_publisher_entry *extra;      /* goes out with the next batch */
+
+    mc_publisher_stats stats;
+  } mc_publisher;
+
+  mc_publisher *mc_publisher_new(mc_writer_pool *wp, mc_store *store,
+                                 unsigned flags, unsigned members,
+                                 unsigned max_pending);
+  void mc_publisher_free(mc_publisher *pub);
+
+  void mc_publisher_add(mc_publisher *pub, const void *buf, size_t len,
+                        const char *temp, const char *name, const char *uri);
+  void mc_publisher_submit(mc_publisher *pub, mc_writer *w, double time,
+                           const void *buf, size_t len, const char *temp,
+                           const char *name, const char *uri,
+                           uint64_t version);
+  void mc_publisher_leave(mc_publisher *pub, mc_writer *w);
+  void mc_publisher_sync(mc_publisher *pub);
+
+  mc_publisher_stats *mc_publisher_stats_get(mc_publisher *pub,
+                                             mc_publisher_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
@@ -0,0 +1,219 @@
+/* mc_purger.c */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <jd_pretty.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "multicoder.h"
+#include "mc_purger.h"
+
+struct mc_purger_item {
+  mc_purger_item *next;
+  char *name;
+  const char *base;       /* after the last '/' in name */
+  int rmdir;              /* remove the directory if it's now empty */
+  uint64_t queued;
+};
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static size_t dir_len(const mc_purger_item *it) {
+  return it->base - it->name;
+}
+
+static int by_name(const void *a, const void *b) {
+  const mc_purger_item *ia = *(const mc_purger_item **) a;
+  const mc_purger_item *ib = *(const mc_purger_item **) b;
+  return strcmp(ia->name, ib->name);
+}
+
+static int same_dir(const mc_purger_item *a, const mc_purger_item *b) {
+  return dir_len(a) == dir_len(b) && !memcmp(a->name, b->name, dir_len(a));
+}
+
+/* Unlink a run of files that share a directory. The directory is
+ * opened once and the files unlinked relative to it.
+ */
+static void purge_dir(mc_purger_stats *st, mc_purger_item **it, size_t n) {
+  size_t dl = dir_len(it[0]);
+  char *dir = mc_alloc(dl + 2);
+  if (dl) memcpy(dir, it[0]->name, dl - 1);
+  else strcpy(dir, ".");
+  if (dl == 1) strcpy(dir, "/");
+
+  int dfd = open(dir, O_RDONLY | O_DIRECTORY);
+  int rm = 0;
+  for (size_t i = 0; i < n; i++) {
+    mc_info("Purging %s", it[i]->name);
+    if (dfd < 0 ? unlink(it[i]->name) : unlinkat(dfd, it[i]->base, 0)) {
+      mc_warning("Failed to delete %s: %m", it[i]->name);
+      st->errors++;
+    }
+    else {
+      st->purged++;
+    }
+    rm |= it[i]->rmdir;
+  }
+  if (dfd >= 0) close(dfd);
+
+  /* fails harmlessly if there's anything left in it */
+  if (rm && dl > 1 && !rmdir(dir)) {
+    mc_info("Removed %s", dir);
+    st->dirs++;
+  }
+
+  free(dir);
+}
+
+static void purge(mc_purger *p, mc_purger_item *list) {
+  size_t n = 0;
+  for (mc_purger_item *it = list; it; it = it->next) n++;
+
+  mc_purger_item **items = mc_alloc(sizeof(mc_purger_item *) * n);
+  n = 0;
+  for (mc_purger_item *it = list; it; it = it->next) items[n++] = it;
+  qsort(items, n, sizeof(items[0]), by_name);
+
+  mc_purger_stats st;
+  memset(&st, 0, sizeof(st));
+
+  for (size_t i = 0, j; i < n; i = j) {
+    for (j = i + 1; j < n && same_dir(items[i], items[j]); j++)
+      ;
+    purge_dir(&st, items + i, j - i);
+  }
+
+  uint64_t done = now_ns();
+  for (size_t i = 0; i < n; i++) {
+    uint64_t lag = done - items[i]->queued;
+    st.lag_ns += lag;
+    if (lag > st.max_lag_ns) st.max_lag_ns = lag;
+    free(items[i]->name);
+    free(items[i]);
+  }
+  free(items);
+
+  pthread_mutex_lock(&p->mutex);
+  p->stats.purged += st.purged;
+  p->stats.errors += st.errors;
+  p->stats.dirs += st.dirs;
+  p->stats.lag_ns += st.lag_ns;
+  if (st.max_lag_ns > p->stats.max_lag_ns)
+    p->stats.max_lag_ns = st.max_lag_ns;
+  p->used -= n;
+  pthread_cond_broadcast(&p->can_add);
+  pthread_mutex_unlock(&p->mutex);
+}
+
+static void *purger_thread(void *ctx) {
+  mc_purger *p = ctx;
+
+  mc_log_set_thread("purger");
+
+  pthread_mutex_lock(&p->mutex);
+  for (;;) {
+    while (!p->head && !p->stop)
+      pthread_cond_wait(&p->can_work, &p->mutex);
+    if (!p->head) break;
+
+    /* take everything that's waiting */
+    mc_purger_item *list = p->head;
+    p->head = p->tail = NULL;
+    p->busy = 1;
+    pthread_mutex_unlock(&p->mutex);
+
+    purge(p, list);
+
+    pthread_mutex_lock(&p->mutex);
+    p->busy = 0;
+    if (!p->head) pthread_cond_broadcast(&p->idle);
+  }
+  pthread_mutex_unlock(&p->mutex);
+
+  return NULL;
+}
+
+/* size bounds the number of files waiting to be deleted */
+mc_purger *mc_purger_new(size_t size) {
+  if (!size) jd_throw("Purger queue needs room for at least one file");
+
+  mc_purger *p = mc_alloc(sizeof(*p));
+  p->size = size;
+  pthread_mutex_init(&p->mutex, NULL);
+  pthread_cond_init(&p->can_work, NULL);
+  pthread_cond_init(&p->can_add, NULL);
+  pthread_cond_init(&p->idle, NULL);
+  pthread_create(&p->t, NULL, purger_thread, p);
+  return p;
+}
+
+/* Deletes anything still queued */
+void mc_purger_free(mc_purger *p) {
+  if (p) {
+    pthread_mutex_lock(&p->mutex);
+    p->stop = 1;
+    pthread_cond_broadcast(&p->can_work);
+    pthread_mutex_unlock(&p->mutex);
+
+    pthread_join(p->t, NULL);
+
+    pthread_mutex_destroy(&p->mutex);
+    pthread_cond_destroy(&p->can_work);
+    pthread_cond_destroy(&p->can_add);
+    pthread_cond_destroy(&p->idle);
+    free(p);
+  }
+}
+
+/* Queue a file for deletion, waiting if the queue is full. With
+ * rmdir its directory is removed too once it's empty.
+ */
+void mc_purger_add(mc_purger *p, const char *name, int rmdir) {
+  mc_purger_item *it = mc_alloc(sizeof(*it));
+  it->name = mc_strdup(name);
+  const char *slash = strrchr(it->name, '/');
+  it->base = slash ? slash + 1 : it->name;
+  it->rmdir = rmdir;
+
+  pthread_mutex_lock(&p->mutex);
+  if (p->used >= p->size) {
+    p->stats.stalls++;
+    while (p->used >= p->size)
+      pthread_cond_wait(&p->can_add, &p->mutex);
+  }
+  it->queued = now_ns();
+  if (p->tail) p->tail->next = it;
+  else p->head = it;
+  p->tail = it;
+  p->used++;
+  p->stats.queued++;
+  pthread_cond_signal(&p->can_work);
+  pthread_mutex_unlock(&p->mutex);
+}
+
+/* Wait until everything queued so far has been deleted */
+void mc_purger_sync(mc_purger *p) {
+  pthread_mutex_lock(&p->mutex);
+  while (p->head || p->busy)
+    pthread_cond_wait(&p->idle, &p->mutex);
+  pthread_mutex_unlock(&p->mutex);
+}
+
+mc_purger_stats *mc_purger_stats_get(mc_purger *p, mc_purger_stats *stats) {
+  pthread_mutex_lock(&p->mutex);
+  *stats = p->stats;
+  pthread_mutex_unlock(&p->mutex);
+  return stats;
+}
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
@@ -0,0 +1,54 @@
+/* mc_purger.h */
+
+#ifndef MC_PURGER_H_
+#define MC_PURGER_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+  typedef struct mc_purger_item mc_purger_item;
+
+  typedef struct {
+    uint64_t queued, purged, errors;
+    uint64_t dirs;              /* emptied directories removed */
+    uint64_t stalls;            /* adds that waited for room */
+    uint64_t lag_ns, max_lag_ns;
+  } mc_purger_stats;
+
+  /* Deletes retired files on a thread of its own so slow unlinks
+   * don't hold up writing. Files are unlinked in batches grouped by
+   * directory.
+   */
+  typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t can_work;
+    pthread_cond_t can_add;
+    pthread_cond_t idle;
+    pthread_t t;
+
+    mc_purger_item *head, *tail;
+    size_t used, size;
+    int busy, stop;
+
+    mc_purger_stats stats;
+  } mc_purger;
+
+  mc_purger *mc_purger_new(size_t size);
+  void mc_purger_free(mc_purger *p);
+  void mc_purger_add(mc_purger *p, const char *name, int rmdir);
+  void mc_purger_sync(mc_purger *p);
+  mc_purger_stats *mc_purger_stats_get(mc_purger *p, mc_purger_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
@@ -2,21 +2,95 @@
 
 #include <jd_pretty.h>
 #include <pthread.h>
+#include <time.h>
 
 #include "mc_queue.h"
+#include "mc_slab.h"
 #include "mc_util.h"
 
+#define LOAD(v)     __atomic_load_n(&(v), __ATOMIC_ACQUIRE)
+#define STORE(v, x) __atomic_store_n(&(v), (x), __ATOMIC_RELEASE)
+#define FENCE()     __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+#define STAT_ADD(v, n) __atomic_fetch_add(&(v), (n), __ATOMIC_RELAXED)
+#define STAT_GET(v)    __atomic_load_n(&(v), __ATOMIC_RELAXED)
+
+/* how long ring_wait polls before parking */
+#define RING_SPIN 100
+
+/* Entries for locked queues come from one shared slab unless the
+ * queue is given its own with mc_queue_set_slab.
+ */
+static mc_slab *entry_slab;
+static pthread_once_t entry_once = PTHREAD_ONCE_INIT;
+
+static void entry_init(void) {
+  entry_slab = mc_slab_new(sizeof(mc_queue_entry), 0);
+}
+
+static mc_slab *get_slab(void) {
+  pthread_once(&entry_once, entry_init);
+  return entry_slab;
+}
+
+/* Cap the memory used by queue entries across all queues */
+void mc_queue_entry_limit(size_t bytes) {
+  mc_slab_set_limit(get_slab(), bytes);
+}
+
+mc_slab_stats *mc_queue_entry_stats(mc_slab_stats *st) {
+  return mc_slab_stats_get(get_slab(), st);
+}
+
+/* Take entries from s, which must outlive q. Call before anything
+ * is put on q.
+ */
+void mc_queue_set_slab(mc_queue *q, mc_slab *s) {
+  q->slab = s;
+}
+
 mc_queue *mc_queue_new(size_t size) {
   mc_queue *q = mc_alloc(sizeof(*q));
   q->pprev = q->pnext = q;
   q->max_size = size;
   q->used = 0;
+  q->tail_ts = AV_NOPTS_VALUE;
+  q->slab = get_slab();
   pthread_mutex_init(&q->mutex, NULL);
   pthread_cond_init(&q->can_get, NULL);
   pthread_cond_init(&q->can_put, NULL);
   return q;
 }
 
+/* A bounded queue for exactly one producer and one consumer thread.
+ * Slots are preallocated and put / get don't touch the mutex unless
+ * the other side is parked waiting for them.
+ */
+mc_queue *mc_queue_new_spsc(size_t size) {
+  if (!size) jd_throw("SPSC queue must have a size");
+  mc_queue *q = mc_queue_new(size);
+  size_t slots = 1;
+  while (slots < size) slots <<= 1;
+  q->ring = mc_alloc(slots * sizeof(mc_queue_entry));
+  q->mask = slots - 1;
+  return q;
+}
+
+/* Limit the bytes and / or the span of timestamps (in the time base
+ * of the stream the queue carries) held in addition to the entry
+ * count. Set before the queue is in use.
+ */
+void mc_queue_set_budget(mc_queue *q, size_t max_bytes, int64_t max_duration) {
+  pthread_mutex_lock(&q->mutex);
+  q->max_bytes = max_bytes;
+  q->max_duration = max_duration;
+  pthread_mutex_unlock(&q->mutex);
+}
+
+void mc_queue_set_policy(mc_queue *q, mc_queue_policy policy) {
+  q->policy = policy;
+}
+
 mc_queue *mc_queue_unhook(mc_queue *q) {
   q->pprev->pnext = q->pnext;
   q->pnext->pprev = q->pprev;
@@ -24,6 +98,11 @@ mc_queue *mc_queue_unhook(mc_queue *q) {
   return q;
 }
 
+/* True if any other queue is hooked onto q */
+int mc_queue_hooked(mc_queue *q) {
+  return q->pnext != q;
+}
+
 mc_queue *mc_queue_hook(mc_queue *q, mc_queue *nq) {
   mc_queue *qn = q->pnext;
   mc_queue_unhook(nq);
@@ -35,38 +114,56 @@ mc_queue *mc_queue_hook(mc_queue *q, mc_queue *nq) {
 }
 
 
-static void free_entries(mc_queue_entry *qe) {
+static void free_entries(mc_queue *q, mc_queue_entry *qe) {
   for (mc_queue_entry *next = qe; next; qe = next) {
     next = qe->next;
     /* TODO!! polymorphism! */
     av_free_packet(&qe->d.pkt);
-    free(qe);
+    mc_slab_put(q->slab, qe);
+  }
+}
+
+static void free_ring(mc_queue *q) {
+  if (q->ring) {
+    for (size_t pos = q->rd; pos != q->wr; pos++)
+      av_free_packet(&q->ring[pos & q->mask].d.pkt);
+    free(q->ring);
   }
 }
 
 void mc_queue_free(mc_queue *q) {
   if (q) {
     mc_queue_unhook(q);
-    free_entries(q->head);
-    free_entries(q->free);
+    free_entries(q, q->head);
+    free_ring(q);
     free(q);
   }
 }
 
 static mc_queue_entry *get_entry(mc_queue *q) {
-  if (q->free) {
-    mc_queue_entry *ent = q->free;
-    q->free = ent->next;
-    ent->eof = 0;
-    return ent;
-  }
+  mc_queue_entry *ent = mc_slab_get(q->slab);
+  ent->eof = 0;
+  return ent;
+}
 
-  return mc_alloc(sizeof(mc_queue_entry));
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* only the producer raises max_used */
+static void note_put(mc_queue *q, size_t used) {
+  STAT_ADD(q->st.puts, 1);
+  if (used > STAT_GET(q->st.max_used))
+    __atomic_store_n(&q->st.max_used, used, __ATOMIC_RELAXED);
 }
 
 typedef void (*put_func)(mc_queue *q, mc_queue_entry *qe, void *ctx);
 typedef void (*get_func)(mc_queue *q, mc_queue_entry *qe, void *ctx);
 
+static void merger_notify(mc_queue *q, int full);
+
 static const char *t_name[] = { "unknown", "packet", "frame" };
 
 static void check_type(mc_queue *q, mc_queue_type t) {
@@ -76,7 +173,46 @@ static void check_type(mc_queue *q, mc_queue_type t) {
     jd_throw("Unexpected %s call on %s queue", t_name[t], t_name[q->t]);
 }
 
-static void queue_only_put(mc_queue *q, put_func pf, void *ctx) {
+static size_t queue_used(mc_queue *q) {
+  return q->ring ? LOAD(q->wr) - LOAD(q->rd) : q->used;
+}
+
+static mc_queue_entry *queue_head(mc_queue *q) {
+  if (!q->ring) return q->head;
+  size_t rd = LOAD(q->rd);
+  return rd == LOAD(q->wr) ? NULL : &q->ring[rd & q->mask];
+}
+
+/* Is q too full to take another entry? An empty queue never is so
+ * that a single oversized packet can't wedge it. Locked queues must be
+ * locked; either end of a ring may ask.
+ */
+static int over_budget(mc_queue *q) {
+  size_t used = queue_used(q);
+  if (!used) return 0;
+  if (used >= q->max_size) return 1;
+  if (q->max_bytes && LOAD(q->bytes) >= q->max_bytes) return 1;
+  if (q->max_duration) {
+    mc_queue_entry *head = queue_head(q);
+    int64_t tail = LOAD(q->tail_ts);
+    if (head && !head->eof && head->ts != AV_NOPTS_VALUE &&
+        tail != AV_NOPTS_VALUE && tail - head->ts >= q->max_duration)
+      return 1;
+  }
+  return 0;
+}
+
+/* Fill in a new entry and account for it; called by the producer */
+static void fill_entry(mc_queue *q, mc_queue_entry *qe, put_func pf, void *ctx) {
+  qe->size = 0;
+  qe->ts = AV_NOPTS_VALUE;
+  qe->eof = ctx == NULL;
+  if (ctx) pf(q, qe, ctx);
+  __atomic_add_fetch(&q->bytes, qe->size, __ATOMIC_RELEASE);
+  if (qe->ts != AV_NOPTS_VALUE) STORE(q->tail_ts, qe->ts);
+}
+
+static int locked_put(mc_queue *q, put_func pf, void *ctx) {
   mc_queue_entry *qe;
 
   pthread_mutex_lock(&q->mutex);
@@ -84,44 +220,127 @@ static void queue_only_put(mc_queue *q, put_func pf, void *ctx) {
   /* A zero sized queue is a dummy - used as the head of a multi-queue set */
   if (!q->max_size) {
     pthread_mutex_unlock(&q->mutex);
-    return;
+    return 0;
   }
 
-  while (q->used == q->max_size)
-    pthread_cond_wait(&q->can_put, &q->mutex);
+  if (over_budget(q)) {
+    uint64_t start = now_ns();
+    while (over_budget(q))
+      pthread_cond_wait(&q->can_put, &q->mutex);
+    STAT_ADD(q->st.put_stall_ns, now_ns() - start);
+  }
 
   qe = get_entry(q);
-
-  if (ctx == NULL) qe->eof = 1;
-  else pf(q, qe, ctx);
+  fill_entry(q, qe, pf, ctx);
 
   qe->next = NULL;
   if (q->tail) q->tail->next = qe;
   else q->head = qe;
   q->tail = qe;
   q->used++;
+  note_put(q, q->used);
+
+  int full = over_budget(q);
 
   pthread_cond_broadcast(&q->can_get);
 
   pthread_mutex_unlock(&q->mutex);
 
-  if (q->m) {
-    pthread_mutex_lock(&q->m->mutex);
-    pthread_cond_broadcast(&q->m->can_get);
-    pthread_mutex_unlock(&q->m->mutex);
+  return full;
+}
+
+/* Wake the other side of a ring if it has parked. The caller has
+ * just published its index; the fence pairs with the one in
+ * ring_wait so that one of us always sees the other.
+ */
+static void ring_wake(mc_queue *q, int *waiting, pthread_cond_t *cond) {
+  FENCE();
+  if (LOAD(*waiting)) {
+    pthread_mutex_lock(&q->mutex);
+    pthread_cond_broadcast(cond);
+    pthread_mutex_unlock(&q->mutex);
+  }
+}
+
+static void ring_wait(mc_queue *q, int *waiting, pthread_cond_t *cond,
+                      size_t *idx, size_t blocked, uint64_t *stall) {
+  for (unsigned spin = 0; spin < RING_SPIN; spin++)
+    if (LOAD(*idx) != blocked) return;
+
+  uint64_t start = now_ns();
+  pthread_mutex_lock(&q->mutex);
+  STORE(*waiting, 1);
+  FENCE();
+  while (LOAD(*idx) == blocked)
+    pthread_cond_wait(cond, &q->mutex);
+  STORE(*waiting, 0);
+  pthread_mutex_unlock(&q->mutex);
+  STAT_ADD(*stall, now_ns() - start);
+}
+
+static int ring_put(mc_queue *q, put_func pf, void *ctx) {
+  size_t wr = q->wr;
+
+  for (;;) {
+    size_t rd = LOAD(q->rd);
+    if (!over_budget(q)) break;
+    ring_wait(q, &q->put_waiting, &q->can_put, &q->rd, rd,
+              &q->st.put_stall_ns);
+  }
+
+  mc_queue_entry *qe = &q->ring[wr & q->mask];
+  fill_entry(q, qe, pf, ctx);
+
+  STORE(q->wr, wr + 1);
+  ring_wake(q, &q->get_waiting, &q->can_get);
+
+  note_put(q, wr + 1 - LOAD(q->rd));
+
+  return over_budget(q);
+}
+
+static int queue_full(mc_queue *q);
+static int queue_empty(mc_queue *q);
+
+/* Decide whether a producer should discard rather than wait for a
+ * full queue. Only the producer touches q->dropping.
+ */
+static int drop_put(mc_queue *q, int key) {
+  if (q->policy == MC_QUEUE_BLOCK) return 0;
+
+  if (q->dropping) {
+    if (key && (q->policy == MC_QUEUE_DROP ? !queue_full(q) : queue_empty(q))) {
+      q->dropping = 0;
+      return 0;
+    }
+    if (key) STAT_ADD(q->st.gops, 1);
+  }
+  else {
+    if (!queue_full(q)) return 0;
+    q->dropping = 1;
+    STAT_ADD(q->st.gops, 1);
   }
+
+  STAT_ADD(q->st.dropped, 1);
+  return 1;
 }
 
-static void queue_put(mc_queue *q, put_func pf, void *ctx) {
+static void queue_only_put(mc_queue *q, put_func pf, void *ctx, int key) {
+  if (ctx && drop_put(q, key)) return;
+  int full = q->ring ? ring_put(q, pf, ctx) : locked_put(q, pf, ctx);
+  if (q->m) merger_notify(q, full);
+}
+
+static void queue_put(mc_queue *q, put_func pf, void *ctx, int key) {
   mc_queue *nq = q;
   do {
-    queue_only_put(nq, pf, ctx);
+    queue_only_put(nq, pf, ctx, key);
     nq = nq->pnext;
   }
   while (nq != q);
 }
 
-static int queue_get(mc_queue *q, get_func gf, void *ctx) {
+static int locked_get(mc_queue *q, get_func gf, void *ctx) {
   mc_queue_entry *qe;
 
   pthread_mutex_lock(&q->mutex);
@@ -132,8 +351,12 @@ static int queue_get(mc_queue *q, get_func gf, void *ctx) {
     return 0;
   }
 
-  while (!q->head)
-    pthread_cond_wait(&q->can_get, &q->mutex);
+  if (!q->head) {
+    uint64_t start = now_ns();
+    while (!q->head)
+      pthread_cond_wait(&q->can_get, &q->mutex);
+    STAT_ADD(q->st.get_stall_ns, now_ns() - start);
+  }
 
   qe = q->head;
   q->head = qe->next;
@@ -142,10 +365,11 @@ static int queue_get(mc_queue *q, get_func gf, void *ctx) {
   if (qe->eof) q->eof = 1;
   else gf(q, qe, ctx);
 
+  q->bytes -= qe->size;
   memset(qe, 0, sizeof(*qe)); /* trample cloned pkt ref */
-  qe->next = q->free;
-  q->free = qe;
+  mc_slab_put(q->slab, qe);
   q->used--;
+  STAT_ADD(q->st.gets, 1);
 
   pthread_cond_broadcast(&q->can_put);
   pthread_mutex_unlock(&q->mutex);
@@ -153,10 +377,80 @@ static int queue_get(mc_queue *q, get_func gf, void *ctx) {
   return !q->eof;
 }
 
+static int ring_get(mc_queue *q, get_func gf, void *ctx) {
+  size_t rd = q->rd;
+
+  if (rd == LOAD(q->wr))
+    ring_wait(q, &q->get_waiting, &q->can_get, &q->wr, rd,
+              &q->st.get_stall_ns);
+
+  mc_queue_entry *qe = &q->ring[rd & q->mask];
+
+  if (qe->eof) q->eof = 1;
+  else gf(q, qe, ctx);
+
+  /* the producer may be looking at size, ts and eof in over_budget;
+   * it will rewrite them when it reuses the slot.
+   */
+  __atomic_sub_fetch(&q->bytes, qe->size, __ATOMIC_RELEASE);
+  memset(&qe->d, 0, sizeof(qe->d)); /* trample cloned pkt ref */
+
+  STORE(q->rd, rd + 1);
+  ring_wake(q, &q->put_waiting, &q->can_put);
+  STAT_ADD(q->st.gets, 1);
+
+  return !q->eof;
+}
+
+static int queue_get(mc_queue *q, get_func gf, void *ctx) {
+  return q->ring ? ring_get(q, gf, ctx) : locked_get(q, gf, ctx);
+}
+
+static int queue_full(mc_queue *q) {
+  if (q->ring) return over_budget(q);
+  pthread_mutex_lock(&q->mutex);
+  int full = over_budget(q);
+  pthread_mutex_unlock(&q->mutex);
+  return full;
+}
+
+static int queue_empty(mc_queue *q) {
+  if (q->ring) return !queue_used(q);
+  pthread_mutex_lock(&q->mutex);
+  int empty = !q->used;
+  pthread_mutex_unlock(&q->mutex);
+  return empty;
+}
+
+mc_queue_stats *mc_queue_stats_get(mc_queue *q, mc_queue_stats *st) {
+  st->puts = STAT_GET(q->st.puts);
+  st->gets = STAT_GET(q->st.gets);
+  st->bytes = STAT_GET(q->st.bytes);
+  st->max_used = STAT_GET(q->st.max_used);
+  st->put_stall_ns = STAT_GET(q->st.put_stall_ns);
+  st->get_stall_ns = STAT_GET(q->st.get_stall_ns);
+  st->selected = STAT_GET(q->st.selected);
+  st->dropped = STAT_GET(q->st.dropped);
+  st->gops = STAT_GET(q->st.gops);
+
+  if (q->ring) {
+    st->used = queue_used(q);
+    st->queued = LOAD(q->bytes);
+  }
+  else {
+    pthread_mutex_lock(&q->mutex);
+    st->used = q->used;
+    st->queued = q->bytes;
+    pthread_mutex_unlock(&q->mutex);
+  }
+
+  return st;
+}
+
 mc_queue_entry *mc_queue_peek(mc_queue *q) {
-  /* probably don't need the lock here */
+  if (q->ring) return queue_head(q);
   pthread_mutex_lock(&q->mutex);
-  mc_queue_entry *head = q->head;
+  mc_queue_entry *head = queue_head(q);
   pthread_mutex_unlock(&q->mutex);
   return head;
 }
@@ -170,110 +464,238 @@ mc_queue_merger *mc_queue_merger_new(mc_queue_packet_comparator qc, void *ctx) {
   return qm;
 }
 
-void mc_queue_merger_add(mc_queue_merger *qm, mc_queue *q) {
-  q->mnext = qm->head;
-  qm->head = q;
-  q->m = qm;
+/* The merger keeps a min-heap of its non-empty queues ordered by
+ * their head entries. EOF markers sort first so they're consumed
+ * promptly; ties go to the queue that has waited longest.
+ */
+static int heap_less(mc_queue_merger *qm, mc_queue *a, mc_queue *b) {
+  mc_queue_entry *ea = queue_head(a);
+  mc_queue_entry *eb = queue_head(b);
+  if (ea->eof != eb->eof) return ea->eof;
+  if (!ea->eof) {
+    int cmp = qm->qc(ea, eb, qm->ctx);
+    if (cmp) return cmp < 0;
+  }
+  return a->mseq < b->mseq;
 }
 
-static void unhook_list(mc_queue *q) {
-  for (mc_queue *next = q; next; q = next) {
-    next = q->mnext;
-    q->mnext = NULL;
-  }
+static void heap_set(mc_queue_merger *qm, unsigned pos, mc_queue *q) {
+  qm->heap[pos] = q;
+  q->mpos = pos;
 }
 
-void mc_queue_merger_empty(mc_queue_merger *qm) {
-  unhook_list(qm->head);
-  qm->head = NULL;
+static void heap_up(mc_queue_merger *qm, unsigned pos) {
+  mc_queue *q = qm->heap[pos];
+  while (pos > 0) {
+    unsigned parent = (pos - 1) / 2;
+    if (!heap_less(qm, q, qm->heap[parent])) break;
+    heap_set(qm, pos, qm->heap[parent]);
+    pos = parent;
+  }
+  heap_set(qm, pos, q);
 }
 
-void mc_queue_merger_free(mc_queue_merger *qm) {
-  if (qm) {
-    mc_queue_merger_empty(qm);
-    free(qm);
+static void heap_down(mc_queue_merger *qm, unsigned pos) {
+  mc_queue *q = qm->heap[pos];
+  for (;;) {
+    unsigned child = pos * 2 + 1;
+    if (child >= qm->nheap) break;
+    if (child + 1 < qm->nheap && heap_less(qm, qm->heap[child + 1], qm->heap[child]))
+      child++;
+    if (!heap_less(qm, qm->heap[child], q)) break;
+    heap_set(qm, pos, qm->heap[child]);
+    pos = child;
   }
+  heap_set(qm, pos, q);
+}
+
+static void heap_push(mc_queue_merger *qm, mc_queue *q) {
+  if (q->sparse) qm->nidle--;
+  q->mseq = qm->seq++;
+  heap_set(qm, qm->nheap++, q);
+  heap_up(qm, q->mpos);
 }
 
-static mc_queue *rotate(mc_queue *lq) {
-  if (!lq) return NULL;
+static void heap_remove(mc_queue_merger *qm, mc_queue *q) {
+  if (q->sparse) qm->nidle++;
+  unsigned pos = q->mpos;
+  mc_queue *last = qm->heap[--qm->nheap];
+  if (last == q) return;
+  heap_set(qm, pos, last);
+  heap_up(qm, pos);
+  heap_down(qm, last->mpos);
+}
 
-  mc_queue *fq, *nq;
-  fq = nq = lq->mnext;
+/* Claim the right to list a queue in its merger's heap. Producer and
+ * consumer both try after publishing their side of the queue so
+ * exactly one of them adds it once it becomes non-empty.
+ */
+static int claim_listing(mc_queue *q) {
+  FENCE();
+  return !LOAD(q->listed) && __sync_bool_compare_and_swap(&q->listed, 0, 1);
+}
 
-  if (!nq) return lq;
+/* With the merger locked, check that a listed queue still has
+ * entries. The entry that prompted a listing may already have been
+ * consumed; if so give the listing up unless a put has just landed.
+ */
+static int keep_listing(mc_queue *q) {
+  if (mc_queue_peek(q)) return 1;
+  STORE(q->listed, 0);
+  FENCE();
+  return mc_queue_peek(q) && __sync_bool_compare_and_swap(&q->listed, 0, 1);
+}
 
-  while (nq->mnext) nq = nq->mnext;
+/* Called by the producer after every put on a merged queue. Only
+ * takes the merger lock when the queue has become ready or full.
+ */
+static void merger_notify(mc_queue *q, int full) {
+  mc_queue_merger *qm = q->m;
+  int ready = claim_listing(q);
 
-  nq->mnext = lq;
-  lq->mnext = NULL;
+  if (!ready && (!full || LOAD(q->full))) return;
 
-  return fq;
-}
+  pthread_mutex_lock(&qm->mutex);
+  if (ready && keep_listing(q)) heap_push(qm, q);
+  if (full && !q->full && queue_full(q)) {
+    STORE(q->full, 1);
+    qm->nfull++;
+  }
+  pthread_cond_broadcast(&qm->can_get);
+  mc_queue_merger_notifier notify = qm->notify;
+  pthread_mutex_unlock(&qm->mutex);
 
-static int better_ent(mc_queue_merger *qm, mc_queue_entry *a, mc_queue_entry *b) {
-  if (a == NULL) return 1;
-  if (b == NULL) return 0;
-  if (a->eof) return 0;
-  if (b->eof) return 1;
-  return qm->qc(a, b, qm->ctx) > 0;
+  if (notify) notify(qm->nctx);
 }
 
-static int merger_get_nb(mc_queue_merger *qm, get_func gf, void *ctx, int *got) {
-  unsigned nready = 0, nfull = 0, neof = 0, nqueue = 0;
+/* Called by the consumer with the merger locked after taking an
+ * entry from the queue at the top of the heap.
+ */
+static void merger_update(mc_queue_merger *qm, mc_queue *q) {
+  if (q->full && !queue_full(q)) {
+    STORE(q->full, 0);
+    qm->nfull--;
+  }
 
-  mc_queue *nq, *bq = NULL;
-  mc_queue_entry *be = NULL;
+  if (!keep_listing(q)) {
+    heap_remove(qm, q);
+    return;
+  }
 
-  *got = 0;
+  q->mseq = qm->seq++;
+  heap_down(qm, q->mpos);
+}
 
-  qm->head = rotate(qm->head);
+static void merger_add(mc_queue_merger *qm, mc_queue *q, int sparse) {
+  pthread_mutex_lock(&qm->mutex);
+  q->mnext = qm->head;
+  qm->head = q;
+  q->m = qm;
+  q->sparse = sparse;
+  qm->nqueue++;
+  if (sparse) qm->nidle++;
+  qm->heap = realloc(qm->heap, qm->nqueue * sizeof(mc_queue *));
+  if (!qm->heap) abort();
+  if (mc_queue_peek(q) && claim_listing(q)) heap_push(qm, q);
+  pthread_mutex_unlock(&qm->mutex);
+}
 
-  for (nq = qm->head; nq; nq = nq->mnext) {
+void mc_queue_merger_add(mc_queue_merger *qm, mc_queue *q) {
+  merger_add(qm, q, 0);
+}
 
-    pthread_mutex_lock(&nq->mutex);
-    if (nq->used == nq->max_size) nfull++;
-    if (nq->eof) neof++;
-    mc_queue_entry *ne = nq->head;
-    if (ne) nready++;
-    nqueue++;
-    pthread_mutex_unlock(&nq->mutex);
+/* A sparse queue, such as subtitles, may go a long time without an
+ * entry; while it's empty the other queues are merged without it.
+ * Anything it gets later than the others is passed on late.
+ */
+void mc_queue_merger_add_sparse(mc_queue_merger *qm, mc_queue *q) {
+  merger_add(qm, q, 1);
+}
 
-    if (!bq || better_ent(qm, be, ne)) {
-      bq = nq;
-      be = ne;
-    }
+/* A consumer that polls rather than waits is called back whenever
+ * one of the merger's queues becomes ready or full. The callback runs
+ * on the producer's thread and must not block.
+ */
+void mc_queue_merger_set_notify(mc_queue_merger *qm,
+                                mc_queue_merger_notifier notify, void *ctx) {
+  pthread_mutex_lock(&qm->mutex);
+  qm->notify = notify;
+  qm->nctx = ctx;
+  pthread_mutex_unlock(&qm->mutex);
+}
+
+static void unhook_list(mc_queue *q) {
+  for (mc_queue *next = q; next; q = next) {
+    next = q->mnext;
+    q->mnext = NULL;
+    q->m = NULL;
+    q->listed = q->full = q->sparse = 0;
   }
+}
 
-  /* read from the best queue if all the queues were
-   * either ready or at eof or if at least one of the
-   * queues is full.
-   */
+void mc_queue_merger_empty(mc_queue_merger *qm) {
+  pthread_mutex_lock(&qm->mutex);
+  unhook_list(qm->head);
+  qm->head = NULL;
+  qm->nqueue = qm->nheap = qm->neof = qm->nfull = qm->nidle = 0;
+  pthread_mutex_unlock(&qm->mutex);
+}
 
-  if (be && (nfull || nready + neof == nqueue)) {
-    *got = queue_get(bq, gf, ctx);
-    if (!*got) return merger_get_nb(qm, gf, ctx, got);
-  }
-  else if (neof == nqueue) {
-    *got = 1; /* synthetic eof */
-  }
+mc_queue_merger_stats *mc_queue_merger_stats_get(mc_queue_merger *qm,
+    mc_queue_merger_stats *st) {
+  st->gets = STAT_GET(qm->st.gets);
+  st->forced = STAT_GET(qm->st.forced);
+  st->eofs = STAT_GET(qm->st.eofs);
+  return st;
+}
 
-  return neof < nqueue;
+void mc_queue_merger_free(mc_queue_merger *qm) {
+  if (qm) {
+    mc_queue_merger_empty(qm);
+    free(qm->heap);
+    free(qm);
+  }
 }
 
-static int merger_get(mc_queue_merger *qm, get_func gf, void *ctx) {
-  int got = 0;
-  int more = merger_get_nb(qm, gf, ctx, &got);
-  if (got) return more;
+/* Read from the best queue once every queue is either ready or at
+ * eof (or is sparse and empty), or as soon as any queue is full. Returns 0 once all queues
+ * have delivered their eof. Without wait returns -1 rather than
+ * waiting for the queues to become ready.
+ */
+static int merger_get(mc_queue_merger *qm, get_func gf, void *ctx, int wait) {
+  int more = 0;
 
   pthread_mutex_lock(&qm->mutex);
 
-  for (;;) {
-    more = merger_get_nb(qm, gf, ctx, &got);
-    if (got) break;
+  while (qm->neof < qm->nqueue) {
+    unsigned waiting = qm->nqueue - qm->nheap - qm->neof - qm->nidle;
+    if (qm->nheap && (qm->nfull || !waiting)) {
+      mc_queue *q = qm->heap[0];
+      if (waiting) STAT_ADD(qm->st.forced, 1);
+      more = queue_get(q, gf, ctx);
+      merger_update(qm, q);
+      if (more) {
+        STAT_ADD(qm->st.gets, 1);
+        STAT_ADD(q->st.selected, 1);
+        break;
+      }
+      /* at eof it's no longer idle */
+      if (q->sparse) {
+        q->sparse = 0;
+        qm->nidle--;
+      }
+      qm->neof++;
+      continue;
+    }
+    if (!wait) {
+      pthread_mutex_unlock(&qm->mutex);
+      return -1;
+    }
     pthread_cond_wait(&qm->can_get, &qm->mutex);
   }
 
+  if (!more) STAT_ADD(qm->st.eofs, 1);
+
   pthread_mutex_unlock(&qm->mutex);
 
   return more;
@@ -285,10 +707,27 @@ static int merger_get(mc_queue_merger *qm, get_func gf, void *ctx) {
  *                                                  *
  ****************************************************/
 
+/* Take a new reference to a refcounted packet. The payload is
+ * shared; only the (small) side data is duplicated.
+ */
+static void ref_packet(AVPacket *dst, AVPacket *src) {
+  *dst = *src;
+  dst->side_data = NULL;
+  dst->side_data_elems = 0;
+  if (dst->buf = av_buffer_ref(src->buf), !dst->buf)
+    jd_throw("Failed to reference packet");
+  if (av_copy_packet_side_data(dst, src))
+    jd_throw("Failed to copy packet side data");
+}
+
 static void put_packet(mc_queue *q, mc_queue_entry *qe, void *ctx) {
   AVPacket *pkt = (AVPacket *) ctx;
   check_type(q, MC_PACKET);
-  if (av_copy_packet(&qe->d.pkt, pkt)) jd_throw("Failed to copy packet");
+  STAT_ADD(q->st.bytes, pkt->size);
+  qe->size = pkt->size;
+  qe->ts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+  if (pkt->buf) ref_packet(&qe->d.pkt, pkt);
+  else if (av_copy_packet(&qe->d.pkt, pkt)) jd_throw("Failed to copy packet");
 }
 
 static void get_packet(mc_queue *q, mc_queue_entry *qe, void *ctx) {
@@ -299,11 +738,16 @@ static void get_packet(mc_queue *q, mc_queue_entry *qe, void *ctx) {
 
 
 void mc_queue_only_packet_put(mc_queue *q, AVPacket *pkt) {
-  queue_only_put(q, put_packet, pkt);
+  queue_only_put(q, put_packet, pkt, pkt && (pkt->flags & AV_PKT_FLAG_KEY));
 }
 
 void mc_queue_packet_put(mc_queue *q, AVPacket *pkt) {
-  queue_put(q, put_packet, pkt);
+  /* make the payload refcounted once so that every queue in the
+   * ring shares it rather than taking its own copy.
+   */
+  if (pkt && !pkt->buf && pkt->data && av_dup_packet(pkt))
+    jd_throw("Failed to duplicate packet");
+  queue_put(q, put_packet, pkt, pkt && (pkt->flags & AV_PKT_FLAG_KEY));
 }
 
 int mc_queue_packet_get(mc_queue *q, AVPacket *pkt) {
@@ -311,7 +755,12 @@ int mc_queue_packet_get(mc_queue *q, AVPacket *pkt) {
 }
 
 int mc_queue_merger_packet_get(mc_queue_merger *qm, AVPacket *pkt) {
-  return merger_get(qm, get_packet, pkt);
+  return merger_get(qm, get_packet, pkt, 1);
+}
+
+/* Like mc_queue_merger_packet_get but returns -1 instead of waiting */
+int mc_queue_merger_packet_poll(mc_queue_merger *qm, AVPacket *pkt) {
+  return merger_get(qm, get_packet, pkt, 0);
 }
 
 /****************************************************
@@ -324,6 +773,9 @@ static void put_frame(mc_queue *q, mc_queue_entry *qe, void *ctx) {
   AVFrame *frame = (AVFrame *) ctx;
   check_type(q, MC_FRAME);
   av_frame_ref(&qe->d.frame, frame);
+  for (unsigned i = 0; i < AV_NUM_DATA_POINTERS && frame->buf[i]; i++)
+    qe->size += frame->buf[i]->size;
+  qe->ts = frame->pts;
 }
 
 static void get_frame(mc_queue *q, mc_queue_entry *qe, void *ctx) {
@@ -333,11 +785,11 @@ static void get_frame(mc_queue *q, mc_queue_entry *qe, void *ctx) {
 }
 
 void mc_queue_only_frame_put(mc_queue *q, AVFrame *frame) {
-  queue_only_put(q, put_frame, frame);
+  queue_only_put(q, put_frame, frame, frame && frame->key_frame);
 }
 
 void mc_queue_frame_put(mc_queue *q, AVFrame *frame) {
-  queue_put(q, put_frame, frame);
+  queue_put(q, put_frame, frame, frame && frame->key_frame);
 }
 
 int mc_queue_frame_get(mc_queue *q, AVFrame *frame) {
@@ -345,7 +797,7 @@ int mc_queue_frame_get(mc_queue *q, AVFrame *frame) {
 }
 
 int mc_queue_merger_frame_get(mc_queue_merger *qm, AVFrame *frame) {
-  return merger_get(qm, get_frame, frame);
+  return merger_get(qm, get_frame, frame, 1);
 }
 
 /* vim:ts=2:sw=2:sts=2:et:ft=c
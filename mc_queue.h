@@ -8,9 +8,12 @@ extern "C" {
 #endif
 
 #include <pthread.h>
+#include <stdint.h>
 #include <libavcodec/avcodec.h>
 #include <libavutil/avutil.h>
 
+#include "mc_slab.h"
+
   typedef enum {
     MC_UNKNOWN,
     MC_PACKET,
@@ -18,20 +21,48 @@ extern "C" {
   }
   mc_queue_type;
 
+  /* What a producer does when a queue is full */
+  typedef enum {
+    MC_QUEUE_BLOCK,   /* wait for the consumer */
+    MC_QUEUE_DROP,    /* drop until the next keyframe that fits */
+    MC_QUEUE_RESYNC   /* drop until drained, then restart at a keyframe */
+  }
+  mc_queue_policy;
+
   typedef struct mc_queue_entry {
     struct mc_queue_entry *next;
     union {
       AVPacket pkt;
       AVFrame frame;
     } d;
+    size_t size;
+    int64_t ts;
     int eof;
   } mc_queue_entry;
 
+  /* counters are updated with relaxed atomics; read them with
+   * mc_queue_stats_get / mc_queue_merger_stats_get.
+   */
+  typedef struct {
+    uint64_t puts, gets, bytes;
+    uint64_t used, max_used, queued;
+    uint64_t put_stall_ns, get_stall_ns;
+    uint64_t selected;
+    uint64_t dropped, gops;
+  } mc_queue_stats;
+
+  typedef struct {
+    uint64_t gets, forced, eofs;
+  } mc_queue_merger_stats;
+
   typedef int (*mc_queue_packet_comparator)(
     mc_queue_entry *a, mc_queue_entry *b, void *ctx);
 
   typedef struct mc_queue_merger mc_queue_merger;
 
+  /* Told when a merger may have something for its consumer */
+  typedef void (*mc_queue_merger_notifier)(void *ctx);
+
   typedef struct mc_queue {
     struct mc_queue *pprev, *pnext, *mnext;
 
@@ -40,8 +71,32 @@ extern "C" {
     size_t max_size;
     int eof;
 
-    mc_queue_entry *head, *tail, *free;
+    /* optional budgets; 0 for unlimited */
+    size_t max_bytes;
+    int64_t max_duration;
+    size_t bytes;
+    int64_t tail_ts;
+
+    mc_queue_policy policy;
+    int dropping;
+
+    mc_queue_entry *head, *tail;
     mc_queue_merger *m;
+    mc_slab *slab;          /* where locked queue entries come from */
+
+    /* merger heap membership */
+    unsigned mpos;
+    uint64_t mseq;
+    int listed, full;
+    int sparse;             /* an empty queue doesn't hold the merger up */
+
+    /* single producer / single consumer ring; NULL for a locked queue */
+    mc_queue_entry *ring;
+    size_t mask;
+    size_t rd, wr;
+    int get_waiting, put_waiting;
+
+    mc_queue_stats st;
 
     pthread_mutex_t mutex;
     pthread_cond_t can_get;
@@ -51,30 +106,55 @@ extern "C" {
   struct mc_queue_merger {
     mc_queue *head;
 
+    /* non-empty queues ordered by their head entry */
+    mc_queue **heap;
+    unsigned nheap, nqueue, neof, nfull;
+    unsigned nidle;         /* sparse queues that are empty but not at eof */
+    uint64_t seq;
+
     mc_queue_packet_comparator qc;
     void *ctx;
 
+    mc_queue_merger_stats st;
+
+    mc_queue_merger_notifier notify;
+    void *nctx;
+
     pthread_mutex_t mutex;
     pthread_cond_t can_get;
   };
 
   mc_queue *mc_queue_new(size_t size);
+  mc_queue *mc_queue_new_spsc(size_t size);
   void mc_queue_free(mc_queue *q);
+  void mc_queue_set_budget(mc_queue *q, size_t max_bytes, int64_t max_duration);
+  void mc_queue_set_policy(mc_queue *q, mc_queue_policy policy);
+  void mc_queue_entry_limit(size_t bytes);
+  mc_slab_stats *mc_queue_entry_stats(mc_slab_stats *st);
+  void mc_queue_set_slab(mc_queue *q, mc_slab *s);
   mc_queue *mc_queue_hook(mc_queue *q, mc_queue *nq);
   mc_queue *mc_queue_unhook(mc_queue *q);
+  int mc_queue_hooked(mc_queue *q);
 
 
   mc_queue_entry *mc_queue_peek(mc_queue *q);
+  mc_queue_stats *mc_queue_stats_get(mc_queue *q, mc_queue_stats *st);
 
   mc_queue_merger *mc_queue_merger_new(mc_queue_packet_comparator qc, void *ctx);
   void mc_queue_merger_add(mc_queue_merger *qm, mc_queue *q);
+  void mc_queue_merger_add_sparse(mc_queue_merger *qm, mc_queue *q);
+  void mc_queue_merger_set_notify(mc_queue_merger *qm,
+                                  mc_queue_merger_notifier notify, void *ctx);
   void mc_queue_merger_empty(mc_queue_merger *qm);
   void mc_queue_merger_free(mc_queue_merger *qm);
+  mc_queue_merger_stats *mc_queue_merger_stats_get(mc_queue_merger *qm,
+      mc_queue_merger_stats *st);
 
   void mc_queue_only_packet_put(mc_queue *q, AVPacket *pkt);
   void mc_queue_packet_put(mc_queue *q, AVPacket *pkt);
   int mc_queue_packet_get(mc_queue *q, AVPacket *pkt);
   int mc_queue_merger_packet_get(mc_queue_merger *qm, AVPacket *pkt);
+  int mc_queue_merger_packet_poll(mc_queue_merger *qm, AVPacket *pkt);
 
   void mc_queue_only_frame_put(mc_queue *q, AVFrame *frame);
   void mc_queue_frame_put(mc_queue *q, AVFrame *frame);
@@ -0,0 +1,315 @@
+/* mc_sched.c */
+
+#define _GNU_SOURCE
+
+#include <jd_pretty.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "multicoder.h"
+#include "mc_sched.h"
+
+#define LOAD(v)     __atomic_load_n(&(v), __ATOMIC_SEQ_CST)
+#define STORE(v, x) __atomic_store_n(&(v), (x), __ATOMIC_SEQ_CST)
+#define CAS(v, o, n) __sync_bool_compare_and_swap(&(v), (o), (n))
+
+#define STAT_ADD(v, n) __atomic_fetch_add(&(v), (n), __ATOMIC_RELAXED)
+#define STAT_GET(v)    __atomic_load_n(&(v), __ATOMIC_RELAXED)
+#define STAT_SET(v, x) __atomic_store_n(&(v), (x), __ATOMIC_RELAXED)
+
+enum {
+  IDLE,       /* waiting to be woken */
+  QUEUED,     /* in a deque */
+  RUNNING,
+  RERUN,      /* woken while running */
+  DONE
+};
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void unlink_task(mc_sched_worker *w, mc_sched_task *t) {
+  if (t->prev) t->prev->next = t->next;
+  else w->head = t->next;
+  if (t->next) t->next->prev = t->prev;
+  else w->tail = t->prev;
+  t->prev = t->next = NULL;
+}
+
+/* Wake a parked worker if there is one. The pending count has just
+ * gone up; a worker that's about to park will see it.
+ */
+static void wake_worker(mc_sched *s) {
+  if (LOAD(s->sleepers)) {
+    pthread_mutex_lock(&s->mutex);
+    pthread_cond_signal(&s->can_work);
+    pthread_mutex_unlock(&s->mutex);
+  }
+}
+
+/* Tasks that yield go to the head of the deque, behind anything else
+ * the worker has to do and first in line for thieves.
+ */
+static void push(mc_sched_worker *w, mc_sched_task *t, int yield) {
+  pthread_mutex_lock(&w->mutex);
+  if (yield) {
+    t->prev = NULL;
+    t->next = w->head;
+    if (w->head) w->head->prev = t;
+    else w->tail = t;
+    w->head = t;
+  }
+  else {
+    t->next = NULL;
+    t->prev = w->tail;
+    if (w->tail) w->tail->next = t;
+    else w->head = t;
+    w->tail = t;
+  }
+  __atomic_add_fetch(&w->s->pending, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&w->mutex);
+
+  wake_worker(w->s);
+}
+
+/* The owner works from the tail, where the most recently woken
+ * tasks are; thieves take from the head.
+ */
+static mc_sched_task *take(mc_sched_worker *w, int steal) {
+  pthread_mutex_lock(&w->mutex);
+  mc_sched_task *t = steal ? w->head : w->tail;
+  if (t) {
+    unlink_task(w, t);
+    __atomic_sub_fetch(&w->s->pending, 1, __ATOMIC_SEQ_CST);
+  }
+  pthread_mutex_unlock(&w->mutex);
+  return t;
+}
+
+static mc_sched_task *find_work(mc_sched_worker *w) {
+  mc_sched *s = w->s;
+  mc_sched_task *t = take(w, 0);
+  for (unsigned i = 1; !t && i < s->nworkers; i++) {
+    t = take(&s->w[(w->id + i) % s->nworkers], 1);
+    if (t) STAT_ADD(s->st.steals, 1);
+  }
+  return t;
+}
+
+/* Returns 0 when the pool is stopping and there's nothing left */
+static int park(mc_sched *s) {
+  pthread_mutex_lock(&s->mutex);
+  __atomic_add_fetch(&s->sleepers, 1, __ATOMIC_SEQ_CST);
+  while (!LOAD(s->pending) && !s->stop) {
+    STAT_ADD(s->st.parks, 1);
+    pthread_cond_wait(&s->can_work, &s->mutex);
+  }
+  __atomic_sub_fetch(&s->sleepers, 1, __ATOMIC_SEQ_CST);
+  int more = LOAD(s->pending) || !s->stop;
+  pthread_mutex_unlock(&s->mutex);
+  return more;
+}
+
+static void run(mc_sched_worker *w, mc_sched_task *t) {
+  mc_sched *s = w->s;
+
+  STORE(t->state, RUNNING);
+  t->home = w->id;
+
+  uint64_t start = now_ns();
+  mc_sched_result rc = t->step(t->ctx);
+  uint64_t elapsed = now_ns() - start;
+
+  STAT_ADD(s->st.runs, 1);
+  STAT_ADD(t->st.runs, 1);
+  STAT_ADD(t->st.run_ns, elapsed);
+  if (elapsed > STAT_GET(t->st.max_run_ns))
+    STAT_SET(t->st.max_run_ns, elapsed);
+
+  switch (rc) {
+  case MC_SCHED_DONE:
+    pthread_mutex_lock(&s->mutex);
+    STORE(t->state, DONE);
+    pthread_cond_broadcast(&s->done);
+    pthread_mutex_unlock(&s->mutex);
+    break;
+
+  case MC_SCHED_YIELD:
+    STORE(t->state, QUEUED);
+    push(w, t, 1);
+    break;
+
+  case MC_SCHED_WAIT:
+    if (!CAS(t->state, RUNNING, IDLE)) {
+      STORE(t->state, QUEUED);
+      push(w, t, 0);
+    }
+    break;
+  }
+}
+
+static void pin(mc_sched_worker *w) {
+  if (w->cpu < 0) return;
+#ifdef CPU_SET
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(w->cpu, &set);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+    mc_warning("Can't pin worker %u to CPU %d", w->id, w->cpu);
+#else
+  mc_warning("CPU affinity not supported; worker %u not pinned", w->id);
+#endif
+}
+
+static void *worker(void *ctx) {
+  mc_sched_worker *w = ctx;
+  char name[32];
+
+  snprintf(name, sizeof(name), "sched.%u", w->id);
+  mc_log_set_thread(name);
+  pin(w);
+
+  for (;;) {
+    mc_sched_task *t = find_work(w);
+    if (!t) {
+      if (!park(w->s)) break;
+      continue;
+    }
+    /* log as the task */
+    if (strcmp(mc_log_get_thread(), t->name)) mc_log_set_thread(t->name);
+    run(w, t);
+  }
+
+  return NULL;
+}
+
+/* Worker i is pinned to cpus[i % ncpus]; with no cpus the workers
+ * run anywhere.
+ */
+mc_sched *mc_sched_new(unsigned workers, const int *cpus, unsigned ncpus) {
+  if (!workers) jd_throw("Scheduler needs at least one worker");
+
+  mc_sched *s = mc_alloc(sizeof(*s));
+  s->nworkers = workers;
+  s->w = mc_alloc(sizeof(mc_sched_worker) * workers);
+  pthread_mutex_init(&s->mutex, NULL);
+  pthread_cond_init(&s->can_work, NULL);
+  pthread_cond_init(&s->done, NULL);
+
+  for (unsigned i = 0; i < workers; i++) {
+    mc_sched_worker *w = &s->w[i];
+    w->s = s;
+    w->id = i;
+    w->cpu = ncpus ? cpus[i % ncpus] : -1;
+    pthread_mutex_init(&w->mutex, NULL);
+  }
+
+  for (unsigned i = 0; i < workers; i++)
+    pthread_create(&s->w[i].t, NULL, worker, &s->w[i]);
+
+  return s;
+}
+
+/* Runs anything already queued then stops the workers. Tasks that
+ * are still waiting to be woken are abandoned; join them first.
+ */
+void mc_sched_free(mc_sched *s) {
+  if (s) {
+    pthread_mutex_lock(&s->mutex);
+    s->stop = 1;
+    pthread_cond_broadcast(&s->can_work);
+    pthread_mutex_unlock(&s->mutex);
+
+    /* the others may still steal from a worker that has stopped */
+    for (unsigned i = 0; i < s->nworkers; i++)
+      pthread_join(s->w[i].t, NULL);
+    for (unsigned i = 0; i < s->nworkers; i++)
+      pthread_mutex_destroy(&s->w[i].mutex);
+
+    pthread_mutex_destroy(&s->mutex);
+    pthread_cond_destroy(&s->can_work);
+    pthread_cond_destroy(&s->done);
+    free(s->w);
+    free(s);
+  }
+}
+
+/* The new task doesn't run until it's first woken */
+mc_sched_task *mc_sched_add(mc_sched *s, const char *name,
+                            mc_sched_step step, void *ctx) {
+  mc_sched_task *t = mc_alloc(sizeof(*t));
+  t->s = s;
+  t->name = mc_strdup(name);
+  t->step = step;
+  t->ctx = ctx;
+  t->state = IDLE;
+
+  pthread_mutex_lock(&s->mutex);
+  t->home = s->next_home++ % s->nworkers;
+  pthread_mutex_unlock(&s->mutex);
+
+  return t;
+}
+
+/* Safe from any thread; doesn't block */
+void mc_sched_wake(mc_sched_task *t) {
+  STAT_ADD(t->st.wakes, 1);
+  for (;;) {
+    switch (LOAD(t->state)) {
+    case IDLE:
+      if (CAS(t->state, IDLE, QUEUED)) {
+        push(&t->s->w[t->home], t, 0);
+        return;
+      }
+      break;
+    case RUNNING:
+      if (CAS(t->state, RUNNING, RERUN)) return;
+      break;
+    default:
+      return;
+    }
+  }
+}
+
+/* Wait for a task to finish */
+void mc_sched_join(mc_sched_task *t) {
+  mc_sched *s = t->s;
+  pthread_mutex_lock(&s->mutex);
+  while (LOAD(t->state) != DONE)
+    pthread_cond_wait(&s->done, &s->mutex);
+  pthread_mutex_unlock(&s->mutex);
+}
+
+/* The task must be finished or never have been woken */
+void mc_sched_task_free(mc_sched_task *t) {
+  if (t) {
+    free(t->name);
+    free(t);
+  }
+}
+
+mc_sched_task_stats *mc_sched_task_stats_get(mc_sched_task *t,
+                                             mc_sched_task_stats *st) {
+  st->runs = STAT_GET(t->st.runs);
+  st->wakes = STAT_GET(t->st.wakes);
+  st->run_ns = STAT_GET(t->st.run_ns);
+  st->max_run_ns = STAT_GET(t->st.max_run_ns);
+  return st;
+}
+
+mc_sched_stats *mc_sched_stats_get(mc_sched *s, mc_sched_stats *st) {
+  st->runs = STAT_GET(s->st.runs);
+  st->steals = STAT_GET(s->st.steals);
+  st->parks = STAT_GET(s->st.parks);
+  return st;
+}
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
@@ -0,0 +1,97 @@
+/* mc_sched.h */
+
+#ifndef MC_SCHED_H_
+#define MC_SCHED_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pthread.h>
+#include <stdint.h>
+
+  /* What a task wants after a step */
+  typedef enum {
+    MC_SCHED_WAIT,    /* nothing to do until woken */
+    MC_SCHED_YIELD,   /* more to do; let others run first */
+    MC_SCHED_DONE     /* finished; never run again */
+  }
+  mc_sched_result;
+
+  typedef mc_sched_result (*mc_sched_step)(void *ctx);
+
+  typedef struct {
+    uint64_t runs, wakes;
+    uint64_t run_ns, max_run_ns;
+  } mc_sched_task_stats;
+
+  typedef struct {
+    uint64_t runs, steals, parks;
+  } mc_sched_stats;
+
+  typedef struct mc_sched mc_sched;
+  typedef struct mc_sched_worker mc_sched_worker;
+
+  /* A resumable piece of work. Its step function is called whenever
+   * it has been woken and runs on one worker at a time; a wake that
+   * arrives while it's running gets it another step.
+   */
+  typedef struct mc_sched_task {
+    struct mc_sched_task *prev, *next;    /* in a worker's deque */
+    mc_sched *s;
+    char *name;
+    mc_sched_step step;
+    void *ctx;
+    unsigned home;                        /* worker that last ran it */
+    int state;
+    mc_sched_task_stats st;
+  } mc_sched_task;
+
+  struct mc_sched_worker {
+    pthread_t t;
+    mc_sched *s;
+    unsigned id;
+    int cpu;                              /* -1 for any */
+
+    pthread_mutex_t mutex;
+    mc_sched_task *head, *tail;           /* thieves take from head */
+  };
+
+  /* A fixed pool of workers that run tasks. Each worker has a deque
+   * of runnable tasks and steals from the others when its own is
+   * empty.
+   */
+  struct mc_sched {
+    mc_sched_worker *w;
+    unsigned nworkers;
+    unsigned next_home;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t can_work;
+    pthread_cond_t done;
+    int pending, sleepers, stop;
+
+    mc_sched_stats st;
+  };
+
+  mc_sched *mc_sched_new(unsigned workers, const int *cpus, unsigned ncpus);
+  void mc_sched_free(mc_sched *s);
+
+  mc_sched_task *mc_sched_add(mc_sched *s, const char *name,
+                              mc_sched_step step, void *ctx);
+  void mc_sched_wake(mc_sched_task *t);
+  void mc_sched_join(mc_sched_task *t);
+  void mc_sched_task_free(mc_sched_task *t);
+
+  mc_sched_task_stats *mc_sched_task_stats_get(mc_sched_task *t,
+                                               mc_sched_task_stats *st);
+  mc_sched_stats *mc_sched_stats_get(mc_sched *s, mc_sched_stats *st);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
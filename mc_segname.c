@@ -1,6 +1,5 @@
 /* mc_segname.c */
 
-#include <inttypes.h>
 #include <jd_pretty.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -9,19 +8,6 @@
 #include "mc_segname.h"
 #include "mc_util.h"
 
-static void freep(char **cp) {
-  if (*cp) {
-    free(*cp);
-    *cp = NULL;
-  }
-}
-
-static void free_names(mc_segname *sn) {
-  freep(&sn->uri);
-  freep(&sn->cur_name);
-  freep(&sn->tmp_name);
-}
-
 static unsigned push_field(mc_segname *sn, const char *frag,
                            unsigned frag_len, unsigned field_len, unsigned pos) {
   mc_segname_field *snf = mc_alloc(sizeof(*snf));
@@ -64,11 +50,42 @@ static unsigned parse_format(mc_segname *sn) {
   return push_field(sn, lp, fmt - lp, 0, pos);
 }
 
+static char *field_digits(mc_segname *sn, mc_segname_field *snf) {
+  return sn->uri + snf->pos + snf->frag_len;
+}
+
+/* Add one to a field's digits; true on overflow */
+static int bump_field(mc_segname *sn, mc_segname_field *snf) {
+  char *dp = field_digits(sn, snf);
+  for (unsigned i = snf->field_len; i-- > 0;) {
+    if (dp[i] != '9') {
+      dp[i]++;
+      return 0;
+    }
+    dp[i] = '0';
+  }
+  return 1;
+}
+
 mc_segname *mc_segname_new_prefixed(const char *fmt, const char *prefix) {
   mc_segname *sn = mc_alloc(sizeof(*sn));
   sn->fmt = fmt;
   sn->len = parse_format(sn);
   sn->prefix = mc_strdup(prefix);
+
+  /* lay out the first name; after this only the digits change */
+  char *uri = mc_alloc(sn->len + 1);
+  for (mc_segname_field *snf = sn->fld; snf; snf = snf->next) {
+    memcpy(uri + snf->pos, snf->frag, snf->frag_len);
+    memset(uri + snf->pos + snf->frag_len, '0', snf->field_len);
+  }
+  sn->cur_name = mc_prefix(uri, sn->prefix);
+  sn->uri = sn->cur_name + strlen(sn->cur_name) - sn->len;
+  free(uri);
+
+  const char *slash = strrchr(sn->cur_name, '/');
+  sn->dir_len = slash ? slash + 1 - sn->cur_name : 0;
+
   return sn;
 }
 
@@ -86,7 +103,8 @@ static void free_fields(mc_segname_field *snf) {
 void mc_segname_free(mc_segname *sn) {
   if (sn) {
     free_fields(sn->fld);
-    free_names(sn);
+    free(sn->cur_name);
+    free(sn->tmp_name);
     free(sn->prefix);
     free(sn);
   }
@@ -94,47 +112,45 @@ void mc_segname_free(mc_segname *sn) {
 
 int mc_segname_parse(mc_segname *sn, const char *name) {
   if (strlen(name) != sn->len) return 0;
-  free_names(sn);
+
   for (mc_segname_field *snf = sn->fld; snf; snf = snf->next) {
-    if (snf->field_len) {
-      char tmp[snf->field_len + 1];
-      if (memcmp(name + snf->pos, snf->frag, snf->frag_len)) return 0;
-      memcpy(tmp, name + snf->pos + snf->frag_len, snf->field_len);
-      tmp[snf->field_len] = '\0';
-      char *ep;
-      snf->seq = strtoul(tmp, &ep, 10);
-      if (ep - tmp != snf->field_len) return 0;
+    if (memcmp(name + snf->pos, snf->frag, snf->frag_len)) return 0;
+    for (unsigned i = 0; i < snf->field_len; i++) {
+      char c = name[snf->pos + snf->frag_len + i];
+      if (c < '0' || c > '9') return 0;
     }
   }
 
+  for (mc_segname_field *snf = sn->fld; snf; snf = snf->next) {
+    const char *dp = name + snf->pos + snf->frag_len;
+    snf->seq = 0;
+    for (unsigned i = 0; i < snf->field_len; i++)
+      snf->seq = snf->seq * 10 + dp[i] - '0';
+    memcpy(field_digits(sn, snf), dp, snf->field_len);
+  }
+
+  sn->tmp_valid = 0;
   return 1;
 }
 
+/* Odometer style: the last field counts and carries into the ones
+ * before it. Returns true when every field wraps to zero.
+ */
 int mc_segname_inc(mc_segname *sn) {
-  free_names(sn);
+  sn->tmp_valid = 0;
   for (mc_segname_field *snf = sn->fld; snf; snf = snf->next) {
-    uint64_t limit = 1;
-    for (unsigned i = 0; i < snf->field_len; i++) limit *= 10;
-    if (++snf->seq < limit) return 0;
+    if (!snf->field_len) continue;
+    if (!bump_field(sn, snf)) {
+      snf->seq++;
+      return 0;
+    }
     snf->seq = 0;
   }
   return 1;
 }
 
 char *mc_segname_format(mc_segname *sn) {
-  char *buf = mc_alloc(sn->len + 1);
-
-  for (mc_segname_field *snf = sn->fld; snf; snf = snf->next) {
-    memcpy(buf + snf->pos, snf->frag, snf->frag_len);
-    if (snf->field_len) {
-      char fmt[20], tmp[snf->field_len + 1];
-      sprintf(fmt, "%%0%u" PRIu64, snf->field_len);
-      sprintf(tmp, fmt, snf->seq);
-      memcpy(buf + snf->pos + snf->frag_len, tmp, snf->field_len);
-    }
-  }
-
-  return buf;
+  return mc_strdup(sn->uri);
 }
 
 char *mc_segname_next(mc_segname *sn) {
@@ -144,8 +160,6 @@ char *mc_segname_next(mc_segname *sn) {
 }
 
 char *mc_segname_uri(mc_segname *sn) {
-  if (!sn->uri)
-    sn->uri = mc_segname_format(sn);
   return sn->uri;
 }
 
@@ -154,14 +168,27 @@ char *mc_segname_prefix(mc_segname *sn, const char *name) {
 }
 
 char *mc_segname_name(mc_segname *sn) {
-  if (!sn->cur_name)
-    sn->cur_name = mc_segname_prefix(sn, mc_segname_uri(sn));
   return sn->cur_name;
 }
 
+/* A fresh temporary name for each name. The first is made by
+ * mc_tmp_name; later ones reuse its buffer with new random chars.
+ */
 char *mc_segname_temp(mc_segname *sn) {
-  if (!sn->tmp_name)
-    sn->tmp_name = mc_tmp_name(mc_segname_name(sn));
+  if (!sn->tmp_valid) {
+    if (!sn->tmp_name) {
+      sn->tmp_name = mc_tmp_name(sn->cur_name);
+    }
+    else {
+      size_t len = strlen(sn->cur_name);
+      size_t rnd = strlen(sn->tmp_name) - len - 1;
+      memcpy(sn->tmp_name, sn->cur_name, sn->dir_len);
+      mc_random_chars(sn->tmp_name + sn->dir_len, rnd);
+      memcpy(sn->tmp_name + sn->dir_len + rnd + 1, sn->cur_name + sn->dir_len,
+             len - sn->dir_len);
+    }
+    sn->tmp_valid = 1;
+  }
   return sn->tmp_name;
 }
 
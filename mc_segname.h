@@ -17,14 +17,20 @@ extern "C" {
     uint64_t seq;
   } mc_segname_field;
 
+  /* The current name is kept formatted and incremented in place, so
+   * moving to the next name doesn't allocate. The strings returned by
+   * mc_segname_uri, _name and _temp change when it does.
+   */
   typedef struct {
     mc_segname_field *fld;
     const char *fmt;
     unsigned len;
     char *prefix;
-    char *uri;
-    char *cur_name;
-    char *tmp_name;
+    char *cur_name;       /* prefix + uri */
+    char *uri;            /* points into cur_name */
+    char *tmp_name;       /* made on demand, then reused */
+    unsigned dir_len;     /* of cur_name up to and including the last '/' */
+    int tmp_valid;
   } mc_segname;
 
   mc_segname *mc_segname_new_prefixed(const char *fmt, const char *prefix);
@@ -0,0 +1,197 @@
+/* mc_slab.c */
+
+#include <jd_pretty.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mc_slab.h"
+#include "mc_util.h"
+
+#define STAT_ADD(v, n) __atomic_add_fetch(&(v), (n), __ATOMIC_RELAXED)
+#define STAT_GET(v)    __atomic_load_n(&(v), __ATOMIC_RELAXED)
+
+/* bytes per slab (at least one object) */
+#define SLAB_BYTES  65536
+/* per thread cache: flush down to CACHE_BATCH when it exceeds CACHE_MAX */
+#define CACHE_MAX   64
+#define CACHE_BATCH 32
+
+typedef struct {
+  mc_slab *s;
+  void *free;
+  unsigned count;
+} slab_cache;
+
+#define NEXT(obj) (*(void **) (obj))
+
+/* Move up to n objects from *from to *to; returns the number moved */
+static unsigned move_objects(void **from, void **to, unsigned n) {
+  unsigned moved;
+  for (moved = 0; moved < n && *from; moved++) {
+    void *obj = *from;
+    *from = NEXT(obj);
+    NEXT(obj) = *to;
+    *to = obj;
+  }
+  return moved;
+}
+
+static void flush_cache(slab_cache *c, unsigned n) {
+  mc_slab *s = c->s;
+  pthread_mutex_lock(&s->mutex);
+  c->count -= move_objects(&c->free, &s->free, n);
+  pthread_mutex_unlock(&s->mutex);
+}
+
+static void free_cache(void *ctx) {
+  slab_cache *c = ctx;
+  flush_cache(c, c->count);
+  free(c);
+}
+
+static slab_cache *get_cache(mc_slab *s) {
+  slab_cache *c = pthread_getspecific(s->key);
+  if (!c) {
+    c = mc_alloc(sizeof(*c));
+    c->s = s;
+    pthread_setspecific(s->key, c);
+  }
+  return c;
+}
+
+mc_slab *mc_slab_new(size_t size, size_t limit) {
+  mc_slab *s = mc_alloc(sizeof(*s));
+
+  if (size < sizeof(void *)) size = sizeof(void *);
+  s->size = (size + MC_SLAB_ALIGN - 1) & ~(size_t) (MC_SLAB_ALIGN - 1);
+  s->per_slab = s->size < SLAB_BYTES ? SLAB_BYTES / s->size : 1;
+  s->limit = limit;
+
+  s->st.size = s->size;
+  s->st.limit = limit;
+
+  pthread_mutex_init(&s->mutex, NULL);
+  pthread_key_create(&s->key, free_cache);
+
+  return s;
+}
+
+/* All other threads must be done with the pool */
+void mc_slab_free(mc_slab *s) {
+  if (s) {
+    free(pthread_getspecific(s->key));
+    pthread_key_delete(s->key);
+    for (size_t i = 0; i < s->nslab; i++)
+      free(s->slab[i]);
+    free(s->slab);
+    pthread_mutex_destroy(&s->mutex);
+    free(s);
+  }
+}
+
+void mc_slab_set_limit(mc_slab *s, size_t limit) {
+  pthread_mutex_lock(&s->mutex);
+  s->limit = limit;
+  __atomic_store_n(&s->st.limit, limit, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&s->mutex);
+}
+
+/* Called with the lock held. Adds a slab of count objects to the
+ * free list.
+ */
+static void add_slab(mc_slab *s, size_t count) {
+  size_t bytes = count * s->size;
+  char *slab;
+
+  if (posix_memalign((void **) &slab, MC_SLAB_ALIGN, bytes)) abort();
+  memset(slab, 0, bytes);
+
+  if (s->nslab == s->slab_size) {
+    s->slab_size = s->slab_size ? s->slab_size * 2 : 8;
+    s->slab = realloc(s->slab, s->slab_size * sizeof(void *));
+    if (!s->slab) abort();
+  }
+  s->slab[s->nslab++] = slab;
+
+  for (size_t i = count; i-- > 0;) {
+    void *obj = slab + i * s->size;
+    NEXT(obj) = s->free;
+    s->free = obj;
+  }
+
+  STAT_ADD(s->st.slabs, 1);
+  STAT_ADD(s->st.bytes, bytes);
+  STAT_ADD(s->st.objects, count);
+}
+
+/* Called with the lock held. Past the limit we grow by a single
+ * object so that a producer isn't failed by a burst.
+ */
+static void grow(mc_slab *s) {
+  if (s->limit && s->st.bytes + s->per_slab * s->size > s->limit) {
+    add_slab(s, 1);
+    STAT_ADD(s->st.over, 1);
+  }
+  else {
+    add_slab(s, s->per_slab);
+  }
+}
+
+static void refill_cache(slab_cache *c) {
+  mc_slab *s = c->s;
+  pthread_mutex_lock(&s->mutex);
+  if (!s->free) grow(s);
+  c->count += move_objects(&s->free, &c->free, CACHE_BATCH);
+  pthread_mutex_unlock(&s->mutex);
+}
+
+/* Objects from a new slab are zeroed; recycled objects are returned
+ * as they were put back apart from the first pointer sized word.
+ */
+void *mc_slab_get(mc_slab *s) {
+  slab_cache *c = get_cache(s);
+
+  if (!c->free) refill_cache(c);
+
+  void *obj = c->free;
+  c->free = NEXT(obj);
+  c->count--;
+  NEXT(obj) = NULL;
+
+  uint64_t used = STAT_ADD(s->st.in_use, 1);
+  uint64_t max = STAT_GET(s->st.max_in_use);
+  while (used > max &&
+         !__atomic_compare_exchange_n(&s->st.max_in_use, &max, used, 0,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+
+  return obj;
+}
+
+void mc_slab_put(mc_slab *s, void *obj) {
+  if (!obj) return;
+
+  slab_cache *c = get_cache(s);
+
+  NEXT(obj) = c->free;
+  c->free = obj;
+  if (++c->count > CACHE_MAX) flush_cache(c, CACHE_BATCH);
+
+  STAT_ADD(s->st.in_use, -1);
+}
+
+mc_slab_stats *mc_slab_stats_get(mc_slab *s, mc_slab_stats *st) {
+  st->size = s->size;
+  st->limit = STAT_GET(s->st.limit);
+  st->slabs = STAT_GET(s->st.slabs);
+  st->bytes = STAT_GET(s->st.bytes);
+  st->objects = STAT_GET(s->st.objects);
+  st->in_use = STAT_GET(s->st.in_use);
+  st->max_in_use = STAT_GET(s->st.max_in_use);
+  st->over = STAT_GET(s->st.over);
+  return st;
+}
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
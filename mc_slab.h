@@ -0,0 +1,63 @@
+/* mc_slab.h */
+
+#ifndef MC_SLAB_H_
+#define MC_SLAB_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define MC_SLAB_ALIGN 64
+
+  typedef struct {
+    size_t size;          /* object size after rounding */
+    size_t limit;         /* byte limit; 0 for unbounded */
+    uint64_t slabs;       /* slabs allocated */
+    uint64_t bytes;       /* bytes held in slabs */
+    uint64_t objects;     /* total object capacity */
+    uint64_t in_use;      /* objects handed out */
+    uint64_t max_in_use;
+    uint64_t over;        /* objects allocated past the limit */
+  } mc_slab_stats;
+
+  /* A pool of fixed size, cache line aligned objects carved from
+   * larger slabs. Slabs are never returned to the system until the
+   * pool is freed. Each thread keeps a small cache of free objects
+   * so get / put only take the pool lock to move a batch. The limit
+   * is soft: once it's reached objects are allocated one at a time
+   * and counted in over rather than failing the caller.
+   */
+  typedef struct mc_slab {
+    size_t size;
+    size_t per_slab;
+    size_t limit;
+
+    pthread_mutex_t mutex;
+    pthread_key_t key;
+
+    void *free;
+    void **slab;
+    size_t nslab, slab_size;
+
+    mc_slab_stats st;
+  } mc_slab;
+
+  mc_slab *mc_slab_new(size_t size, size_t limit);
+  void mc_slab_free(mc_slab *s);
+  void mc_slab_set_limit(mc_slab *s, size_t limit);
+  void *mc_slab_get(mc_slab *s);
+  void mc_slab_put(mc_slab *s, void *obj);
+  mc_slab_stats *mc_slab_stats_get(mc_slab *s, mc_slab_stats *st);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
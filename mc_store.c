@@ -0,0 +1,246 @@
+/* mc_store.c */
+
+#include <errno.h>
+#include <jd_pretty.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "mc_store.h"
+#include "mc_util.h"
+
+#define HASH_SIZE 1024
+
+static size_t hash_name(const char *name) {
+  uint32_t h = 2166136261u;
+  while (*name) {
+    h ^= (uint8_t) *name++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+mc_store *mc_store_new(size_t max_bytes) {
+  mc_store *st = mc_alloc(sizeof(*st));
+  st->hash_size = HASH_SIZE;
+  st->hash = mc_alloc(sizeof(mc_store_obj *) * st->hash_size);
+  st->max_bytes = max_bytes;
+  pthread_mutex_init(&st->mutex, NULL);
+  pthread_cond_init(&st->changed, NULL);
+  return st;
+}
+
+static void obj_free(mc_store_obj *obj) {
+  free(obj->name);
+  free(obj->data);
+  free(obj);
+}
+
+void mc_store_free(mc_store *st) {
+  if (st) {
+    for (mc_store_obj *obj = st->oldest, *next; obj; obj = next) {
+      next = obj->newer;
+      obj_free(obj);
+    }
+    pthread_mutex_destroy(&st->mutex);
+    pthread_cond_destroy(&st->changed);
+    free(st->hash);
+    free(st);
+  }
+}
+
+static mc_store_obj **find_slot(mc_store *st, const char *name) {
+  mc_store_obj **slot = &st->hash[hash_name(name) & (st->hash_size - 1)];
+  while (*slot && strcmp((*slot)->name, name))
+    slot = &(*slot)->hnext;
+  return slot;
+}
+
+/* Called with the lock held */
+static void release(mc_store_obj *obj) {
+  if (--obj->refcount == 0) obj_free(obj);
+}
+
+/* Called with the lock held */
+static void unlink_obj(mc_store *st, mc_store_obj *obj) {
+  mc_store_obj **slot = find_slot(st, obj->name);
+  *slot = obj->hnext;
+
+  if (obj->older) obj->older->newer = obj->newer;
+  else st->oldest = obj->newer;
+  if (obj->newer) obj->newer->older = obj->older;
+  else st->newest = obj->older;
+
+  st->st.objects--;
+  st->st.bytes -= obj->len;
+  release(obj);
+}
+
+/* Called with the lock held */
+static void insert(mc_store *st, mc_store_obj *obj) {
+  mc_store_obj **slot = find_slot(st, obj->name);
+  if (*slot) {
+    unlink_obj(st, *slot);
+    slot = find_slot(st, obj->name);
+  }
+  *slot = obj;
+
+  obj->older = st->newest;
+  if (st->newest) st->newest->newer = obj;
+  else st->oldest = obj;
+  st->newest = obj;
+
+  st->st.objects++;
+  st->st.bytes += obj->len;
+
+  /* playlists are only ever replaced; a root playlist is stored once */
+  for (mc_store_obj *old = st->oldest, *next;
+       old != obj && st->max_bytes && st->st.bytes > st->max_bytes;
+       old = next) {
+    next = old->newer;
+    if (old->pinned) continue;
+    unlink_obj(st, old);
+    st->st.evicted++;
+  }
+
+  pthread_cond_broadcast(&st->changed);
+}
+
+static int is_playlist(const char *name) {
+  size_t len = strlen(name);
+  return len >= 5 && !strcmp(name + len - 5, ".m3u8");
+}
+
+static mc_store_obj *new_obj(const char *name, void *data, size_t len) {
+  mc_store_obj *obj = mc_alloc(sizeof(*obj));
+  obj->pinned = is_playlist(name);
+  obj->refcount = 1;
+  obj->name = mc_strdup(name);
+  obj->data = data;
+  obj->len = len;
+  return obj;
+}
+
+/* Take ownership of data, which must have come from malloc. Readers
+ * waiting for at least this version are woken.
+ */
+void mc_store_adopt_version(mc_store *st, const char *name, void *data,
+                            size_t len, uint64_t version) {
+  mc_store_obj *obj = new_obj(name, data, len);
+  obj->version = version;
+
+  pthread_mutex_lock(&st->mutex);
+  insert(st, obj);
+  st->st.puts++;
+  pthread_mutex_unlock(&st->mutex);
+}
+
+void mc_store_adopt(mc_store *st, const char *name, void *data, size_t len) {
+  mc_store_adopt_version(st, name, data, len, 0);
+}
+
+/* Announce an object that will be stored soon; mc_store_wait blocks
+ * on it rather than reporting a miss.
+ */
+void mc_store_expect(mc_store *st, const char *name) {
+  mc_store_obj *obj = new_obj(name, NULL, 0);
+  obj->expected = 1;
+
+  pthread_mutex_lock(&st->mutex);
+  mc_store_obj *old = *find_slot(st, name);
+  if (old && !old->expected) obj_free(obj);
+  else insert(st, obj);
+  pthread_mutex_unlock(&st->mutex);
+}
+
+void mc_store_put(mc_store *st, const char *name, const void *data, size_t len) {
+  void *copy = mc_alloc(len ? len : 1);
+  memcpy(copy, data, len);
+  mc_store_adopt(st, name, copy, len);
+}
+
+void mc_store_remove(mc_store *st, const char *name) {
+  pthread_mutex_lock(&st->mutex);
+  mc_store_obj *obj = *find_slot(st, name);
+  if (obj) {
+    unlink_obj(st, obj);
+    pthread_cond_broadcast(&st->changed);
+  }
+  pthread_mutex_unlock(&st->mutex);
+}
+
+/* Returns a referenced object or NULL. Pass it to
+ * mc_store_release when done.
+ */
+mc_store_obj *mc_store_get(mc_store *st, const char *name) {
+  pthread_mutex_lock(&st->mutex);
+  mc_store_obj *obj = *find_slot(st, name);
+  if (obj && !obj->expected) {
+    obj->refcount++;
+    st->st.hits++;
+  }
+  else {
+    obj = NULL;
+    st->st.misses++;
+  }
+  pthread_mutex_unlock(&st->mutex);
+  return obj;
+}
+
+/* Like mc_store_get but waits up to timeout_ms for an expected object
+ * to arrive or for one with at least the given version. Missing
+ * objects that aren't expected are only waited for when a version
+ * is requested.
+ */
+mc_store_obj *mc_store_wait(mc_store *st, const char *name,
+                            uint64_t version, unsigned timeout_ms) {
+  struct timeval now;
+  struct timespec deadline;
+
+  gettimeofday(&now, NULL);
+  uint64_t ns = (uint64_t) now.tv_usec * 1000 + (uint64_t) timeout_ms * 1000000;
+  deadline.tv_sec = now.tv_sec + ns / 1000000000;
+  deadline.tv_nsec = ns % 1000000000;
+
+  pthread_mutex_lock(&st->mutex);
+  mc_store_obj *obj;
+  for (;;) {
+    obj = *find_slot(st, name);
+    if (obj && !obj->expected && obj->version >= version) break;
+    if (!obj && !version) break;
+    if (pthread_cond_timedwait(&st->changed, &st->mutex, &deadline) == ETIMEDOUT) {
+      obj = NULL;
+      break;
+    }
+  }
+
+  if (obj && !obj->expected && obj->version >= version) {
+    obj->refcount++;
+    st->st.hits++;
+  }
+  else {
+    obj = NULL;
+    st->st.misses++;
+  }
+  pthread_mutex_unlock(&st->mutex);
+  return obj;
+}
+
+void mc_store_release(mc_store *st, mc_store_obj *obj) {
+  if (obj) {
+    pthread_mutex_lock(&st->mutex);
+    release(obj);
+    pthread_mutex_unlock(&st->mutex);
+  }
+}
+
+mc_store_stats *mc_store_stats_get(mc_store *st, mc_store_stats *stats) {
+  pthread_mutex_lock(&st->mutex);
+  *stats = st->st;
+  pthread_mutex_unlock(&st->mutex);
+  return stats;
+}
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
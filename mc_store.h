@@ -0,0 +1,73 @@
+/* mc_store.h */
+
+#ifndef MC_STORE_H_
+#define MC_STORE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+  /* A named, immutable blob. Readers hold a reference while they
+   * use it so it can be replaced or evicted underneath them.
+   */
+  typedef struct mc_store_obj {
+    struct mc_store_obj *hnext;           /* hash chain */
+    struct mc_store_obj *older, *newer;   /* age order */
+    unsigned refcount;
+    char *name;
+    uint8_t *data;
+    size_t len;
+    uint64_t version;
+    int expected;                         /* placeholder, no data yet */
+    int pinned;                           /* never evicted */
+  } mc_store_obj;
+
+  typedef struct {
+    uint64_t objects, bytes;
+    uint64_t puts, hits, misses, evicted;
+  } mc_store_stats;
+
+  /* Recent segments and current playlists held in memory, keyed by
+   * the path they're served under. When max_bytes is exceeded the
+   * oldest segments are evicted; playlists (*.m3u8) stay until they
+   * are replaced or removed.
+   */
+  typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+    mc_store_obj **hash;
+    size_t hash_size;
+    mc_store_obj *oldest, *newest;
+    size_t max_bytes;
+    mc_store_stats st;
+  } mc_store;
+
+  mc_store *mc_store_new(size_t max_bytes);
+  void mc_store_free(mc_store *st);
+
+  void mc_store_put(mc_store *st, const char *name, const void *data, size_t len);
+  void mc_store_adopt(mc_store *st, const char *name, void *data, size_t len);
+  void mc_store_adopt_version(mc_store *st, const char *name, void *data,
+                              size_t len, uint64_t version);
+  void mc_store_expect(mc_store *st, const char *name);
+  void mc_store_remove(mc_store *st, const char *name);
+
+  mc_store_obj *mc_store_get(mc_store *st, const char *name);
+  mc_store_obj *mc_store_wait(mc_store *st, const char *name,
+                              uint64_t version, unsigned timeout_ms);
+  void mc_store_release(mc_store *st, mc_store_obj *obj);
+
+  mc_store_stats *mc_store_stats_get(mc_store *st, mc_store_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
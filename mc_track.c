@@ -0,0 +1,77 @@
+/* mc_track.c */
+
+#include <jd_pretty.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <libavformat/avformat.h>
+
+#include "mc_track.h"
+
+/* sel is a stream number (counting only streams of the type), a
+ * language or NULL for the best stream.
+ */
+mc_track *mc_track_parse(mc_track *t, enum AVMediaType type, jd_var *sel) {
+  memset(t, 0, sizeof(*t));
+  t->type = type;
+  t->nth = -1;
+
+  if (!sel || sel->type == VOID) return t;
+
+  if (sel->type == INTEGER) {
+    t->nth = jd_get_int(sel);
+    if (t->nth < 0) jd_throw("Bad track number: %V", sel);
+  }
+  else if (sel->type == STRING) {
+    size_t len;
+    const char *lang = jd_bytes(sel, &len);
+    if (len - 1 >= sizeof(t->language) || len == 1)
+      jd_throw("Bad track language: %V", sel);
+    strcpy(t->language, lang);
+  }
+  else {
+    jd_throw("Track must be a number or a language: %V", sel);
+  }
+
+  return t;
+}
+
+static const char *stream_language(AVStream *st) {
+  AVDictionaryEntry *e = av_dict_get(st->metadata, "language", NULL, 0);
+  return e ? e->value : NULL;
+}
+
+/* Returns the index of the selected stream in ic or -1 */
+int mc_track_find(AVFormatContext *ic, const mc_track *t) {
+  if (t->nth < 0 && !t->language[0]) {
+    int idx = av_find_best_stream(ic, t->type, -1, -1, NULL, 0);
+    return idx < 0 ? -1 : idx;
+  }
+
+  int nth = 0;
+  for (unsigned i = 0; i < ic->nb_streams; i++) {
+    AVStream *st = ic->streams[i];
+    if (st->codec->codec_type != t->type) continue;
+    if (t->language[0]) {
+      const char *lang = stream_language(st);
+      if (lang && !strcmp(lang, t->language)) return i;
+    }
+    else if (nth++ == t->nth) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* "eng audio", "audio 2", "best video" */
+char *mc_track_name(char *buf, size_t len, const mc_track *t) {
+  const char *kind = av_get_media_type_string(t->type);
+  if (!kind) kind = "data";
+  if (t->language[0]) snprintf(buf, len, "%s %s", t->language, kind);
+  else if (t->nth >= 0) snprintf(buf, len, "%s %d", kind, t->nth);
+  else snprintf(buf, len, "best %s", kind);
+  return buf;
+}
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
@@ -0,0 +1,35 @@
+/* mc_track.h */
+
+#ifndef MC_TRACK_H_
+#define MC_TRACK_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+#include <jd_pretty.h>
+#include <libavformat/avformat.h>
+
+  /* Picks one stream of an input: the nth stream of its type, the
+   * first one in a language or, with neither, the best one.
+   */
+  typedef struct {
+    enum AVMediaType type;
+    int nth;                /* -1 for any */
+    char language[16];      /* "" for any */
+  } mc_track;
+
+  mc_track *mc_track_parse(mc_track *t, enum AVMediaType type, jd_var *sel);
+  int mc_track_find(AVFormatContext *ic, const mc_track *t);
+  char *mc_track_name(char *buf, size_t len, const mc_track *t);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
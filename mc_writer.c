@@ -0,0 +1,748 @@
+/* mc_writer.c */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <jd_pretty.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libavformat/avformat.h>
+
+#include "multicoder.h"
+#include "mc_writer.h"
+
+#define AVIO_BUFFER 32768
+
+typedef enum {
+  JOB_OPEN,
+  JOB_WRITE,
+  JOB_CLOSE,
+  JOB_PART,
+  JOB_SAVE,
+  JOB_BATCH,
+  JOB_EXPECT,
+  JOB_UNLINK,
+  JOB_CALL
+} job_type;
+
+struct mc_writer_job {
+  mc_writer_job *next;
+  job_type type;
+  char *temp, *name, *uri;
+  void *data;
+  size_t len;
+  uint64_t version;
+  mc_writer_job *files;   /* JOB_BATCH: a list of JOB_SAVEs */
+  int written;            /* batched file's temp is in place */
+  mc_writer_fn call;      /* JOB_CALL */
+  void *ctx;
+  int rmdir;              /* JOB_UNLINK: remove the emptied directory */
+  int failed;             /* JOB_CLOSE, JOB_PART: the file isn't in place */
+  uint64_t reported;      /* the writer's reported count when submitted */
+};
+
+/****************************************************
+ *                                                  *
+ * Pool threads                                     *
+ *                                                  *
+ ****************************************************/
+
+static int write_all(int fd, const void *buf, size_t len, off_t pos) {
+  const char *bp = buf;
+  while (len) {
+    ssize_t got = pwrite(fd, bp, len, pos);
+    if (got < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    bp += got;
+    pos += got;
+    len -= got;
+  }
+  return 0;
+}
+
+static int open_file(const char *temp) {
+  int fd = -1;
+  scope {
+    try {
+      mc_mkfilepath(temp, 0777);
+      fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+      if (fd < 0) mc_error("Can't write %s: %m", temp);
+    }
+    catch (e) {
+      mc_error("%V", jd_get_ks(e, "message", 0));
+    }
+  }
+  return fd;
+}
+
+static int finish_file(mc_writer *w, int fd, const char *temp) {
+  int ok = 1;
+  if ((w->flags & MC_WRITER_FSYNC) && fsync(fd)) {
+    mc_error("Can't sync %s: %m", temp);
+    ok = 0;
+  }
+  if (close(fd)) {
+    mc_error("Can't close %s: %m", temp);
+    ok = 0;
+  }
+  return ok;
+}
+
+static int close_file(mc_writer *w, int fd, const char *temp, const char *name) {
+  if (!finish_file(w, fd, temp)) return 0;
+  if (rename(temp, name)) {
+    mc_error("Can't rename %s as %s: %m", temp, name);
+    return 0;
+  }
+  return 1;
+}
+
+/* Accumulate the current file for the store */
+static void buffer_data(mc_writer *w, const void *data, size_t len) {
+  if (w->len + len > w->size) {
+    size_t size = w->size ? w->size : 65536;
+    while (size < w->len + len) size *= 2;
+    if (w->buf = realloc(w->buf, size), !w->buf) abort();
+    w->size = size;
+  }
+  memcpy(w->buf + w->len, data, len);
+  w->len += len;
+}
+
+/* True if the file is in place */
+static int save_file(mc_writer *w, const void *data, size_t len,
+                     const char *temp, const char *name) {
+  int fd = open_file(temp);
+  if (fd < 0) return 0;
+  if (write_all(fd, data, len, 0)) {
+    mc_error("Can't write %s: %m", temp);
+    close(fd);
+    return 0;
+  }
+  return close_file(w, fd, temp, name);
+}
+
+/* Write a file as temp but don't rename it yet */
+static int write_temp(mc_writer *w, const void *data, size_t len,
+                      const char *temp) {
+  int fd = open_file(temp);
+  if (fd < 0) return 0;
+  if (write_all(fd, data, len, 0)) {
+    mc_error("Can't write %s: %m", temp);
+    close(fd);
+    return 0;
+  }
+  return finish_file(w, fd, temp);
+}
+
+static void sync_dir(const char *name) {
+  char *tmp = mc_strdup(name);
+  const char *dir = dirname(tmp);
+  int fd = open(dir, O_RDONLY);
+  if (fd < 0 || fsync(fd)) mc_error("Can't sync %s: %m", dir);
+  if (fd >= 0) close(fd);
+  free(tmp);
+}
+
+static int same_dir(const char *a, const char *b) {
+  const char *sa = strrchr(a, '/'), *sb = strrchr(b, '/');
+  size_t la = sa ? (size_t)(sa - a) : 0, lb = sb ? (size_t)(sb - b) : 0;
+  return la == lb && !memcmp(a, b, la);
+}
+
+/* All the files are written before any is renamed so they appear
+ * together; each directory is synced once at the end.
+ */
+static void save_batch(mc_writer *w, mc_writer_job *batch) {
+  for (mc_writer_job *f = batch->files; f; f = f->next)
+    f->written = write_temp(w, f->data, f->len, f->temp);
+
+  for (mc_writer_job *f = batch->files; f; f = f->next) {
+    if (!f->written) continue;
+    if (rename(f->temp, f->name))
+      mc_error("Can't rename %s as %s: %m", f->temp, f->name);
+    else
+      mc_info("Updated %s", f->name);
+  }
+
+  if (w->flags & MC_WRITER_FSYNC) {
+    for (mc_writer_job *f = batch->files; f; f = f->next) {
+      mc_writer_job *p;
+      for (p = batch->files; p != f && !same_dir(p->name, f->name); p = p->next)
+        ;
+      if (p == f) sync_dir(f->name);
+    }
+  }
+}
+
+static void disk_job(mc_writer *w, mc_writer_job *job) {
+  switch (job->type) {
+  case JOB_OPEN:
+    if (w->fd >= 0) close(w->fd);
+    w->fd = open_file(job->temp);
+    w->pos = 0;
+    break;
+
+  case JOB_WRITE:
+    if (w->fd < 0) break;
+    if (write_all(w->fd, job->data, job->len, w->pos)) {
+      mc_error("Write failed: %m");
+      close(w->fd);
+      w->fd = -1;
+      break;
+    }
+    w->pos += job->len;
+    break;
+
+  case JOB_CLOSE:
+    if (w->fd < 0) {
+      job->failed = 1;
+      break;
+    }
+    job->failed = !close_file(w, w->fd, job->temp, job->name);
+    w->fd = -1;
+    break;
+
+  case JOB_PART:
+    job->failed = !save_file(w, w->buf + w->part, w->len - w->part,
+                             job->temp, job->name);
+    break;
+
+  case JOB_SAVE:
+    if (save_file(w, job->data, job->len, job->temp, job->name))
+      mc_info("Updated %s", job->name);
+    break;
+
+  case JOB_BATCH:
+    save_batch(w, job);
+    break;
+
+  case JOB_EXPECT:
+  case JOB_CALL:
+    break;
+
+  case JOB_UNLINK:
+    if (!job->name) break;
+    if (w->wp->purger) {
+      mc_purger_add(w->wp->purger, job->name, job->rmdir);
+      break;
+    }
+    mc_info("Purging %s", job->name);
+    if (unlink(job->name)) mc_warning("Failed to delete %s: %m", job->name);
+    break;
+  }
+}
+
+/* Publish to the store after the disk copy (if any) is in place */
+static void store_job(mc_writer *w, mc_writer_job *job) {
+  char *key = job->uri ? mc_prefix(job->uri, w->space) : NULL;
+
+  switch (job->type) {
+  case JOB_OPEN:
+  case JOB_WRITE:
+    break;
+
+  case JOB_CLOSE:
+    if (key) {
+      mc_store_adopt(w->store, key, w->buf, w->len);
+      w->buf = NULL;
+      w->len = w->size = 0;
+    }
+    break;
+
+  case JOB_PART:
+    if (key)
+      mc_store_put(w->store, key, w->buf + w->part, w->len - w->part);
+    break;
+
+  case JOB_SAVE:
+    if (key) {
+      mc_store_adopt_version(w->store, key, job->data, job->len,
+                             job->version);
+      job->data = NULL;
+    }
+    break;
+
+  case JOB_BATCH:
+    for (mc_writer_job *f = job->files; f; f = f->next)
+      store_job(w, f);
+    break;
+
+  case JOB_EXPECT:
+    mc_store_expect(w->store, key);
+    break;
+
+  case JOB_UNLINK:
+    if (key) mc_store_remove(w->store, key);
+    break;
+
+  case JOB_CALL:
+    break;
+  }
+
+  free(key);
+}
+
+static int behind(mc_writer *w, mc_writer_job *job) {
+  return w->nfailed > job->reported;
+}
+
+static void run_job(mc_writer *w, mc_writer_job *job) {
+  if (job->type == JOB_CALL) {
+    job->call(job->ctx);
+    return;
+  }
+
+  /* a playlist made before its owner heard about a failed segment
+   * would list it; the next one will mark it as a gap instead.
+   */
+  if (job->type == JOB_SAVE && behind(w, job)) {
+    mc_warning("Not updating %s: it lists a file that failed",
+               job->name ? job->name : job->uri);
+    return;
+  }
+
+  /* the open file is buffered for the store and for parts */
+  if (w->store || (w->flags & MC_WRITER_PARTS)) {
+    if (job->type == JOB_OPEN) w->len = w->part = 0;
+    if (job->type == JOB_WRITE) buffer_data(w, job->data, job->len);
+  }
+
+  if (w->flags & MC_WRITER_DISK) disk_job(w, job);
+  if (w->store) store_job(w, job);
+
+  if (job->type == JOB_PART) w->part = w->len;
+}
+
+static void free_job(mc_writer_job *job) {
+  for (mc_writer_job *f = job->files, *next; f; f = next) {
+    next = f->next;
+    free_job(f);
+  }
+  free(job->temp);
+  free(job->name);
+  free(job->uri);
+  free(job->data);
+  free(job);
+}
+
+/* Keep a failed segment or part for mc_writer_failed */
+static void keep_failed(mc_writer *w, mc_writer_job *job) {
+  free(job->data);
+  job->data = NULL;
+  job->next = NULL;
+  w->nfailed++;
+
+  pthread_mutex_lock(&w->wp->mutex);
+  *w->failed_tail = job;
+  w->failed_tail = &job->next;
+  pthread_mutex_unlock(&w->wp->mutex);
+}
+
+static void ready_push(mc_writer_pool *wp, mc_writer *w) {
+  w->next = NULL;
+  if (wp->ready_tail) wp->ready_tail->next = w;
+  else wp->ready = w;
+  wp->ready_tail = w;
+  pthread_cond_signal(&wp->can_work);
+}
+
+/* Called with the lock held */
+static int has_room(mc_writer_pool *wp) {
+  return !wp->inflight || wp->inflight < wp->max_inflight;
+}
+
+/* Called with the lock held */
+static void wake_waiting(mc_writer_pool *wp) {
+  mc_writer *w = wp->waiting;
+  wp->waiting = NULL;
+  while (w) {
+    mc_writer *next = w->wnext;
+    w->waiting = 0;
+    w->wake(w->wake_ctx);
+    w = next;
+  }
+}
+
+static void *pool_thread(void *ctx) {
+  mc_writer_pool *wp = ctx;
+
+  mc_log_set_thread("writer");
+
+  pthread_mutex_lock(&wp->mutex);
+  for (;;) {
+    while (!wp->ready && !wp->stop)
+      pthread_cond_wait(&wp->can_work, &wp->mutex);
+    if (!wp->ready) break;
+
+    mc_writer *w = wp->ready;
+    if (!(wp->ready = w->next)) wp->ready_tail = NULL;
+
+    /* take the writer's whole backlog; it stays busy so no other
+     * thread picks it up meanwhile.
+     */
+    mc_writer_job *job = w->head;
+    w->head = w->tail = NULL;
+    pthread_mutex_unlock(&wp->mutex);
+
+    size_t written = 0;
+    while (job) {
+      mc_writer_job *next = job->next;
+      w->job = job;
+      run_job(w, job);
+      w->job = NULL;
+      if (job->type == JOB_WRITE) written += job->len;
+      if (job->failed) keep_failed(w, job);
+      else free_job(job);
+      job = next;
+    }
+
+    pthread_mutex_lock(&wp->mutex);
+    if (written) {
+      wp->inflight -= written;
+      pthread_cond_broadcast(&wp->can_write);
+      if (has_room(wp)) wake_waiting(wp);
+    }
+    if (w->head) {
+      ready_push(wp, w);
+    }
+    else {
+      w->busy = 0;
+      pthread_cond_broadcast(&wp->idle);
+    }
+  }
+  pthread_mutex_unlock(&wp->mutex);
+
+  return NULL;
+}
+
+mc_writer_pool *mc_writer_pool_new(unsigned threads, size_t max_inflight) {
+  if (!threads) jd_throw("Writer pool needs at least one thread");
+
+  mc_writer_pool *wp = mc_alloc(sizeof(*wp));
+  wp->max_inflight = max_inflight;
+  pthread_mutex_init(&wp->mutex, NULL);
+  pthread_cond_init(&wp->can_work, NULL);
+  pthread_cond_init(&wp->can_write, NULL);
+  pthread_cond_init(&wp->idle, NULL);
+
+  wp->thread = mc_alloc(sizeof(pthread_t) * threads);
+  for (wp->nthread = 0; wp->nthread < threads; wp->nthread++)
+    pthread_create(&wp->thread[wp->nthread], NULL, pool_thread, wp);
+
+  return wp;
+}
+
+/* Finishes any outstanding work */
+void mc_writer_pool_free(mc_writer_pool *wp) {
+  if (wp) {
+    pthread_mutex_lock(&wp->mutex);
+    wp->stop = 1;
+    pthread_cond_broadcast(&wp->can_work);
+    pthread_mutex_unlock(&wp->mutex);
+
+    for (unsigned i = 0; i < wp->nthread; i++)
+      pthread_join(wp->thread[i], NULL);
+
+    pthread_mutex_destroy(&wp->mutex);
+    pthread_cond_destroy(&wp->can_work);
+    pthread_cond_destroy(&wp->can_write);
+    pthread_cond_destroy(&wp->idle);
+    free(wp->thread);
+    free(wp);
+  }
+}
+
+/* Hand retired files to p. Set before any writers are made; p must
+ * outlive the pool.
+ */
+void mc_writer_pool_set_purger(mc_writer_pool *wp, mc_purger *p) {
+  wp->purger = p;
+}
+
+/****************************************************
+ *                                                  *
+ * Writers                                          *
+ *                                                  *
+ ****************************************************/
+
+/* With a store, closed files and saved playlists are published under
+ * their uri; MC_WRITER_DISK also writes them to disk.
+ */
+mc_writer *mc_writer_new(mc_writer_pool *wp, mc_store *store, unsigned flags) {
+  mc_writer *w = mc_alloc(sizeof(*w));
+  w->wp = wp;
+  w->store = store;
+  w->flags = flags;
+  w->fd = -1;
+  w->failed_tail = &w->failed;
+  return w;
+}
+
+/* Writers that share a store but not a namespace, such as those of
+ * different channels, keep their uris apart with a space: "one" puts
+ * "hd.m3u8" in the store as "one/hd.m3u8". Set before any jobs are
+ * submitted. Failures are still reported by bare uri.
+ */
+void mc_writer_set_space(mc_writer *w, const char *space) {
+  free(w->space);
+  w->space = mc_strdup(space);
+}
+
+/* Wait until all the jobs submitted so far are done */
+void mc_writer_sync(mc_writer *w) {
+  mc_writer_pool *wp = w->wp;
+  pthread_mutex_lock(&wp->mutex);
+  while (w->busy)
+    pthread_cond_wait(&wp->idle, &wp->mutex);
+  pthread_mutex_unlock(&wp->mutex);
+}
+
+/* For callers that mustn't block, such as scheduler tasks: true if
+ * there's room for more writes. If not, wake(ctx) is called once there
+ * is, on a pool thread with the pool locked, so it mustn't use the
+ * writer. Writers with MC_WRITER_NOWAIT don't wait in between, so a
+ * caller that checks before each unit of work overshoots the pool's
+ * limit by at most that unit.
+ */
+int mc_writer_ready(mc_writer *w, mc_writer_fn wake, void *ctx) {
+  mc_writer_pool *wp = w->wp;
+  pthread_mutex_lock(&wp->mutex);
+  int ready = has_room(wp);
+  if (!ready && !w->waiting) {
+    w->wake = wake;
+    w->wake_ctx = ctx;
+    w->waiting = 1;
+    w->wnext = wp->waiting;
+    wp->waiting = w;
+  }
+  pthread_mutex_unlock(&wp->mutex);
+  return ready;
+}
+
+/* Calls fn(uri, ctx) for each segment or part that couldn't be
+ * written since the last call and returns how many there were.
+ * Playlists saved before the owner has heard about a failure aren't
+ * written, so call this before making each one.
+ */
+unsigned mc_writer_failed(mc_writer *w, mc_writer_failed_fn fn, void *ctx) {
+  mc_writer_pool *wp = w->wp;
+  pthread_mutex_lock(&wp->mutex);
+  mc_writer_job *failed = w->failed;
+  w->failed = NULL;
+  w->failed_tail = &w->failed;
+  pthread_mutex_unlock(&wp->mutex);
+
+  unsigned count = 0;
+  for (mc_writer_job *job = failed, *next; job; job = next) {
+    next = job->next;
+    job->next = NULL;
+    if (fn) fn(job->uri ? job->uri : job->name, ctx);
+    free_job(job);
+    count++;
+  }
+  w->reported += count;
+  return count;
+}
+
+/* For mc_writer_call functions: true if a segment or part has failed
+ * that the owner hadn't heard about when it made the call.
+ */
+int mc_writer_behind(mc_writer *w) {
+  return w->job && behind(w, w->job);
+}
+
+/* Waits for the writer's jobs to complete */
+void mc_writer_free(mc_writer *w) {
+  if (w) {
+    mc_writer_sync(w);
+
+    mc_writer_pool *wp = w->wp;
+    pthread_mutex_lock(&wp->mutex);
+    for (mc_writer **wl = &wp->waiting; *wl; wl = &(*wl)->wnext)
+      if (*wl == w) {
+        *wl = w->wnext;
+        break;
+      }
+    pthread_mutex_unlock(&wp->mutex);
+
+    if (w->fd >= 0) close(w->fd);
+    mc_writer_failed(w, NULL, NULL);
+    free(w->buf);
+    free(w->space);
+    free(w);
+  }
+}
+
+static mc_writer_job *new_job(job_type type, const char *temp,
+                              const char *name, const char *uri) {
+  mc_writer_job *job = mc_alloc(sizeof(*job));
+  job->type = type;
+  job->temp = mc_strdup(temp);
+  job->name = mc_strdup(name);
+  job->uri = mc_strdup(uri);
+  return job;
+}
+
+static void submit(mc_writer *w, mc_writer_job *job) {
+  mc_writer_pool *wp = w->wp;
+  job->reported = w->reported;
+
+  pthread_mutex_lock(&wp->mutex);
+
+  if (job->type == JOB_WRITE) {
+    /* bound the data queued across all writers */
+    while (!(w->flags & MC_WRITER_NOWAIT) && wp->inflight
+           && wp->inflight + job->len > wp->max_inflight)
+      pthread_cond_wait(&wp->can_write, &wp->mutex);
+    wp->inflight += job->len;
+  }
+
+  if (w->tail) w->tail->next = job;
+  else w->head = job;
+  w->tail = job;
+
+  if (!w->busy) {
+    w->busy = 1;
+    ready_push(wp, w);
+  }
+
+  pthread_mutex_unlock(&wp->mutex);
+}
+
+void mc_writer_open(mc_writer *w, const char *temp) {
+  submit(w, new_job(JOB_OPEN, temp, NULL, NULL));
+}
+
+void mc_writer_write(mc_writer *w, const void *buf, size_t len) {
+  mc_writer_job *job = new_job(JOB_WRITE, NULL, NULL, NULL);
+  job->data = mc_alloc(len);
+  memcpy(job->data, buf, len);
+  job->len = len;
+  submit(w, job);
+}
+
+/* Close the current file and rename it from temp to name */
+void mc_writer_close(mc_writer *w, const char *temp, const char *name,
+                     const char *uri) {
+  submit(w, new_job(JOB_CLOSE, temp, name, uri));
+}
+
+/* Everything written to the open file since the last part (or the
+ * open) is also written to a file of its own. Needs MC_WRITER_PARTS
+ * or a store.
+ */
+void mc_writer_part(mc_writer *w, const char *temp, const char *name,
+                    const char *uri) {
+  submit(w, new_job(JOB_PART, temp, name, uri));
+}
+
+/* Write a whole file via temp */
+void mc_writer_save(mc_writer *w, const void *buf, size_t len,
+                    const char *temp, const char *name, const char *uri) {
+  mc_writer_save_version(w, buf, len, temp, name, uri, 0);
+}
+
+static mc_writer_job *save_job(const void *buf, size_t len,
+                               const char *temp, const char *name,
+                               const char *uri, uint64_t version) {
+  mc_writer_job *job = new_job(JOB_SAVE, temp, name, uri);
+  job->data = mc_alloc(len ? len : 1);
+  memcpy(job->data, buf, len);
+  job->len = len;
+  job->version = version;
+  return job;
+}
+
+/* As mc_writer_save; version is passed on to the store */
+void mc_writer_save_version(mc_writer *w, const void *buf, size_t len,
+                            const char *temp, const char *name,
+                            const char *uri, uint64_t version) {
+  submit(w, save_job(buf, len, temp, name, uri, version));
+}
+
+/* Save a number of files at once. They're all written before any is
+ * renamed into place and with MC_WRITER_FSYNC each directory is
+ * synced once for the batch rather than once per file.
+ */
+void mc_writer_save_batch(mc_writer *w, const mc_writer_file *files,
+                          unsigned nfiles) {
+  mc_writer_job *job = new_job(JOB_BATCH, NULL, NULL, NULL);
+  mc_writer_job **tail = &job->files;
+  for (unsigned i = 0; i < nfiles; i++) {
+    const mc_writer_file *f = &files[i];
+    *tail = save_job(f->buf, f->len, f->temp, f->name, f->uri, f->version);
+    tail = &(*tail)->next;
+  }
+  submit(w, job);
+}
+
+/* Call fn(ctx) on a pool thread once the jobs before it are done */
+void mc_writer_call(mc_writer *w, mc_writer_fn fn, void *ctx) {
+  mc_writer_job *job = new_job(JOB_CALL, NULL, NULL, NULL);
+  job->call = fn;
+  job->ctx = ctx;
+  submit(w, job);
+}
+
+/* Tell the store that uri is coming */
+void mc_writer_expect(mc_writer *w, const char *uri) {
+  if (w->store) submit(w, new_job(JOB_EXPECT, NULL, NULL, uri));
+}
+
+void mc_writer_unlink(mc_writer *w, const char *name, const char *uri) {
+  mc_writer_retire(w, name, uri, 0);
+}
+
+/* Delete a file that's dropped out of a playlist. With a purger the
+ * unlink happens there rather than on the pool thread; rmdir asks it
+ * to remove the file's directory once that's empty.
+ */
+void mc_writer_retire(mc_writer *w, const char *name, const char *uri,
+                      int rmdir) {
+  mc_writer_job *job = new_job(JOB_UNLINK, NULL, name, uri);
+  job->rmdir = rmdir;
+  submit(w, job);
+}
+
+/****************************************************
+ *                                                  *
+ * AVIOContext adaptor                              *
+ *                                                  *
+ ****************************************************/
+
+static int write_packet(void *opaque, uint8_t *buf, int size) {
+  mc_writer_write(opaque, buf, size);
+  return size;
+}
+
+AVIOContext *mc_writer_avio_open(mc_writer *w, const char *temp) {
+  unsigned char *buf = av_malloc(AVIO_BUFFER);
+  if (!buf) jd_throw("Can't allocate AVIO buffer");
+
+  AVIOContext *pb = avio_alloc_context(buf, AVIO_BUFFER, 1, w,
+                                       NULL, write_packet, NULL);
+  if (!pb) jd_throw("Can't allocate AVIO context");
+  pb->seekable = 0;
+
+  mc_writer_open(w, temp);
+  return pb;
+}
+
+void mc_writer_avio_close(AVIOContext *pb, const char *temp, const char *name,
+                          const char *uri) {
+  mc_writer *w = pb->opaque;
+  avio_flush(pb);
+  av_free(pb->buffer);
+  av_free(pb);
+  mc_writer_close(w, temp, name, uri);
+}
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
@@ -0,0 +1,132 @@
+/* mc_writer.h */
+
+#ifndef MC_WRITER_H_
+#define MC_WRITER_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <libavformat/avformat.h>
+
+#include "mc_purger.h"
+#include "mc_store.h"
+
+#define MC_WRITER_DISK  1   /* write files to disk */
+#define MC_WRITER_FSYNC 2   /* sync files before renaming them */
+#define MC_WRITER_PARTS 4   /* keep the open file in memory to cut parts */
+#define MC_WRITER_NOWAIT 8  /* never wait for room; see mc_writer_ready */
+
+  typedef struct mc_writer_job mc_writer_job;
+  typedef struct mc_writer mc_writer;
+
+  typedef void (*mc_writer_fn)(void *ctx);
+  typedef void (*mc_writer_failed_fn)(const char *uri, void *ctx);
+
+  /* One file of a batch */
+  typedef struct {
+    const void *buf;
+    size_t len;
+    const char *temp, *name, *uri;
+    uint64_t version;
+  } mc_writer_file;
+
+  /* A pool of threads that does the file I/O for any number of
+   * writers. Writers are serial - their jobs run in the order they
+   * were submitted - but different writers run in parallel.
+   */
+  typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t can_work;
+    pthread_cond_t can_write;
+    pthread_cond_t idle;
+
+    pthread_t *thread;
+    unsigned nthread;
+
+    mc_writer *ready, *ready_tail;
+    mc_writer *waiting;     /* to be told when there's room */
+    size_t inflight, max_inflight;
+    int stop;
+
+    mc_purger *purger;      /* deletes retired files if set */
+  } mc_writer_pool;
+
+  struct mc_writer {
+    mc_writer_pool *wp;
+    mc_writer *next;
+    mc_writer_job *head, *tail;
+    int busy;
+    unsigned flags;
+    mc_store *store;
+    char *space;            /* prefixes our uris in the store */
+
+    /* set by mc_writer_ready while we're on wp->waiting */
+    mc_writer *wnext;
+    mc_writer_fn wake;
+    void *wake_ctx;
+    int waiting;
+
+    /* segments and parts that couldn't be written, kept for
+     * mc_writer_failed
+     */
+    mc_writer_job *failed, **failed_tail;
+    uint64_t reported;      /* failures handed back so far */
+
+    /* only touched by the pool thread running our jobs */
+    int fd;
+    off_t pos;
+    uint8_t *buf;
+    size_t len, size, part;
+    uint64_t nfailed;
+    mc_writer_job *job;     /* the one being run */
+  };
+
+  mc_writer_pool *mc_writer_pool_new(unsigned threads, size_t max_inflight);
+  void mc_writer_pool_free(mc_writer_pool *wp);
+  void mc_writer_pool_set_purger(mc_writer_pool *wp, mc_purger *p);
+
+  mc_writer *mc_writer_new(mc_writer_pool *wp, mc_store *store, unsigned flags);
+  void mc_writer_free(mc_writer *w);
+  void mc_writer_set_space(mc_writer *w, const char *space);
+  void mc_writer_sync(mc_writer *w);
+  int mc_writer_ready(mc_writer *w, mc_writer_fn wake, void *ctx);
+  unsigned mc_writer_failed(mc_writer *w, mc_writer_failed_fn fn, void *ctx);
+  int mc_writer_behind(mc_writer *w);
+
+  void mc_writer_open(mc_writer *w, const char *temp);
+  void mc_writer_write(mc_writer *w, const void *buf, size_t len);
+  void mc_writer_close(mc_writer *w, const char *temp, const char *name,
+                       const char *uri);
+  void mc_writer_part(mc_writer *w, const char *temp, const char *name,
+                      const char *uri);
+  void mc_writer_save(mc_writer *w, const void *buf, size_t len,
+                      const char *temp, const char *name, const char *uri);
+  void mc_writer_save_version(mc_writer *w, const void *buf, size_t len,
+                              const char *temp, const char *name,
+                              const char *uri, uint64_t version);
+  void mc_writer_save_batch(mc_writer *w, const mc_writer_file *files,
+                            unsigned nfiles);
+  void mc_writer_expect(mc_writer *w, const char *uri);
+  void mc_writer_call(mc_writer *w, mc_writer_fn fn, void *ctx);
+  void mc_writer_unlink(mc_writer *w, const char *name, const char *uri);
+  void mc_writer_retire(mc_writer *w, const char *name, const char *uri,
+                        int rmdir);
+
+  AVIOContext *mc_writer_avio_open(mc_writer *w, const char *temp);
+  void mc_writer_avio_close(AVIOContext *pb, const char *temp, const char *name,
+                            const char *uri);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
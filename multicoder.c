@@ -1,25 +1,84 @@
 /* multicoder.c */
 
 #include <jd_pretty.h>
+#include <math.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 
 #include "hls.h"
+#include "mc_http.h"
 #include "multicoder.h"
 
+/* A stream's muxer; a task on the shared scheduler that runs
+ * whenever its input has packets ready and its writer has room.
+ */
 typedef struct {
-  pthread_t t;
+  mc_sched_task *task;
+  mc_hls_muxer *mx;
+  unsigned budget;        /* packets per run */
   jd_var cfg;
+  char *tname;
   AVFormatContext *ic;
   mc_queue_merger *in;
+  mc_writer_pool *wp;
+  mc_store *store;
+  mc_publisher *pub;
 } muxer_context;
 
+/* A decode or encode stage between the demuxer and the muxers. Its
+ * output is a head queue that consumers hook onto.
+ */
+typedef struct {
+  pthread_t t;
+  jd_var cfg;
+  char *tname;
+  const char *kind;
+  AVFormatContext *ic;
+  mc_queue *in;
+  mc_queue *out;
+  mc_queue *frames;       /* h264: its scaled frames, for smaller rungs */
+} stage_context;
+
+/* An input and the streams made from it. There's one channel unless
+ * the config lists several.
+ */
+typedef struct {
+  pthread_t t;
+  jd_var ctx;
+  AVFormatContext *ic;
+  mc_queue *aq, *vq;
+  mc_slab *entries;     /* for its queues; sized by global.entry_memory */
+
+  /* optional second copy of the input */
+  pthread_t bt;
+  AVFormatContext *bic;
+  mc_failover *fo;
+
+  int running;      /* set up and not yet shut down; see stats_mutex */
+} channel_context;
+
+/* An input stream picked by the "track" in a rendition's spec. The
+ * demuxer feeds its head queue; the renditions that use it hook on.
+ */
+typedef struct {
+  mc_track sel;
+  mc_queue *q;
+  int ended;        /* its eof has been sent */
+} track_context;
+
 static const char *kinds[] = { "audio", "video" };
 
+static volatile sig_atomic_t stats_wanted = 0;
+static volatile int stats_running = 1;
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t setup_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 static int dts_compare(mc_queue_entry *a, mc_queue_entry *b, void *ctx) {
   (void) ctx;
   return a->d.pkt.dts < b->d.pkt.dts ? -1 : a->d.pkt.dts > b->d.pkt.dts ? 1 : 0;
@@ -47,26 +106,194 @@ static jd_var *make_direct(jd_var *out, const char *kind) {
   return out;
 }
 
-static jd_var *get_queue(jd_var *ctx, const char *kind, jd_var *spec);
+/* Renditions of the same track with the same decode settings share
+ * a decoder.
+ */
+static jd_var *make_decode(jd_var *out, jd_var *spec) {
+  jd_var *dec = jd_get_ks(spec, "decode", 0);
+  jd_var *track = jd_get_ks(spec, "track", 0);
+  if (dec) jd_clone(out, dec, 1);
+  else jd_set_hash(out, 1);
+  jd_set_string(jd_get_ks(out, "type", 1), "decode");
+  if (track) jd_assign(jd_get_ks(out, "track", 1), track);
+  return out;
+}
 
-static jd_var *get_direct(jd_var *ctx, const char *kind) {
-  scope JD_RETURN(get_queue(ctx, kind, make_direct(jd_nv(), kind)));
-  return NULL;
+static enum AVMediaType media_type(const char *kind) {
+  if (!strcmp(kind, "audio")) return AVMEDIA_TYPE_AUDIO;
+  if (!strcmp(kind, "video")) return AVMEDIA_TYPE_VIDEO;
+  if (!strcmp(kind, "subtitle")) return AVMEDIA_TYPE_SUBTITLE;
+  jd_throw("Unknown stream kind: %s", kind);
+}
+
+/* A stream's audio and video specs then any subtitle specs */
+static unsigned spec_count(jd_var *stm) {
+  jd_var *subs = jd_get_ks(stm, "subtitles", 0);
+  return 2 + (subs ? jd_count(subs) : 0);
+}
+
+/* A null spec (e.g. "video": null over a default) means none */
+static jd_var *spec_at(jd_var *stm, unsigned i, const char **kind) {
+  jd_var *spec;
+  if (i < 2) {
+    *kind = kinds[i];
+    spec = jd_get_ks(stm, kinds[i], 0);
+  }
+  else {
+    *kind = "subtitle";
+    spec = jd_get_idx(jd_get_ks(stm, "subtitles", 0), i - 2);
+  }
+  return spec && spec->type != VOID ? spec : NULL;
 }
 
+static jd_var *get_queue(jd_var *ctx, const char *kind, jd_var *spec);
+
 static void queue_free(void *q) {
   mc_queue_free(q);
 }
 
+static void free_track_context(void *ctx) {
+  track_context *tcx = ctx;
+  mc_queue_free(tcx->q);
+  free(tcx);
+}
+
+/* Renditions that pick the same track share its head queue */
+static jd_var *get_track(jd_var *ctx, jd_var *out, const char *kind,
+                         jd_var *sel) {
+  scope {
+    jd_var *key = make_key(jd_nv(), kind, sel ? sel : jd_nv());
+    jd_var *slot = jd_get_key(jd_get_ks(ctx, "tracks", 0), key, 1);
+    if (slot->type == VOID) {
+      track_context *tcx = mc_alloc(sizeof(*tcx));
+      mc_track_parse(&tcx->sel, media_type(kind), sel);
+      tcx->q = mc_queue_new(0);
+      jd_set_object(slot, tcx, free_track_context);
+    }
+    track_context *tcx = jd_ptr(slot);
+    jd_set_object(out, tcx->q, NULL);
+  }
+  return out;
+}
+
+/* In multi-channel mode thread names start with the channel's */
+static char *thread_name(jd_var *ctx, jd_var *name) {
+  char *tn = NULL;
+  scope {
+    jd_var *chan = jd_get_ks(ctx, "name", 0);
+    if (chan) name = jd_sprintf(jd_nv(), "%V.%V", chan, name);
+    tn = mc_strdup(jd_bytes(name, NULL));
+  }
+  return tn;
+}
+
+static void free_stage_context(void *ctx) {
+  stage_context *scx = ctx;
+  free(scx->tname);
+  mc_queue_free(scx->in);
+  jd_release(&scx->cfg);
+  free(scx);
+}
+
+/* A stage reading from the head queue src. in buffers up to size
+ * packets or frames. The stage's output becomes out.
+ */
+static stage_context *make_stage(jd_var *ctx, jd_var *out, const char *kind,
+                                 jd_var *spec, jd_var *src, size_t size) {
+  stage_context *scx = mc_alloc(sizeof(*scx));
+  jd_clone(&scx->cfg, spec, 1);
+  scx->kind = kind;
+  scope {
+    scx->tname = thread_name(ctx, jd_sprintf(jd_nv(), "%V.%s",
+                                             jd_get_ks(spec, "type", 0), kind));
+  }
+  scx->in = mc_queue_new(size);
+  mc_queue_set_slab(scx->in, jd_ptr(jd_get_ks(ctx, "entries", 0)));
+  scx->out = mc_queue_new(0);
+  mc_queue_hook(jd_ptr(src), scx->in);
+  jd_set_object(jd_push(jd_get_ks(ctx, "stages", 0), 1), scx, free_stage_context);
+  jd_set_object(out, scx->out, queue_free);
+  return scx;
+}
+
+/* Pixels in an h264 rung; one without a size keeps the input's */
+static double rung_area(jd_var *spec) {
+  jd_int w = mc_model_get_int(spec, 0, "$.width");
+  jd_int h = mc_model_get_int(spec, 0, "$.height");
+  return w > 0 && h > 0 ? (double) w * h : INFINITY;
+}
+
+/* The smallest rung that's bigger than spec but still scaled and
+ * shares its decoder, copied to out; NULL if there's none.
+ */
+static jd_var *larger_rung(jd_var *ctx, jd_var *out, jd_var *spec) {
+  jd_var *found = NULL;
+  scope {
+    jd_var *dec = make_key(jd_nv(), "video", make_decode(jd_nv(), spec));
+    double area = rung_area(spec), best = INFINITY;
+    jd_var *streams = jd_get_ks(ctx, "streams", 0);
+    for (unsigned i = 0; i < jd_count(streams); i++) {
+      jd_var *vs = jd_get_ks(jd_get_idx(streams, i), "video", 0);
+      if (!vs || vs->type != HASH ||
+          strcmp("h264", mc_model_get_str(vs, "", "$.type")))
+        continue;
+      double va = rung_area(vs);
+      if (va <= area || va >= best) continue;
+      if (jd_compare(dec, make_key(jd_nv(), "video", make_decode(jd_nv(), vs))))
+        continue;
+      best = va;
+      found = jd_clone(out, vs, 1);
+    }
+    /* setup adds the source after the spec's queue is made */
+    if (found) jd_delete_ks(found, "source", NULL);
+  }
+  return found;
+}
+
+/* Transcoded renditions share a single decode of their input; each
+ * encodes on a thread of its own and scales from the next bigger
+ * rung's pictures rather than the full size ones.
+ */
 static jd_var *make_queue(jd_var *ctx, jd_var *out, const char *kind, jd_var *spec) {
   jd_var *type = jd_get_ks(spec, "type", 0);
   if (!type) jd_throw("Missing type in spec");
   const char *tn = jd_bytes(type, NULL);
 
   if (!strcmp(tn, "direct")) {
+    jd_var *track = jd_get_ks(spec, "track", 0);
     jd_var *src = jd_rv(ctx, "$.sources.%s", kind);
-    if (!src) jd_throw("Can't find %s source", kind);
-    jd_assign(out, src);
+    if (track || !src) get_track(ctx, out, kind, track);
+    else jd_assign(out, src);
+  }
+  else if (!strcmp(tn, "decode") && !strcmp(kind, "video")) {
+    scope {
+      jd_var *direct = make_direct(jd_nv(), kind);
+      jd_var *track = jd_get_ks(spec, "track", 0);
+      if (track) jd_assign(jd_get_ks(direct, "track", 1), track);
+      make_stage(ctx, out, kind, spec, get_queue(ctx, kind, direct),
+                 mc_model_get_int(ctx, 200, "$.config.global.transcode.packets"));
+    }
+  }
+  else if (!strcmp(tn, "h264") && !strcmp(kind, "video")) {
+    scope {
+      jd_var *src;
+      jd_var *larger = larger_rung(ctx, jd_nv(), spec);
+      if (larger) {
+        jd_var *key = make_key(jd_nv(), kind, larger);
+        get_queue(ctx, kind, larger);
+        src = jd_get_key(jd_get_ks(ctx, "frames", 0), key, 0);
+      }
+      else {
+        src = get_queue(ctx, kind, make_decode(jd_nv(), spec));
+      }
+      stage_context *scx = make_stage(
+        ctx, out, kind, spec, src,
+        mc_model_get_int(ctx, 8, "$.config.global.transcode.frames"));
+      scx->frames = mc_queue_new(0);
+      jd_set_object(jd_get_key(jd_get_ks(ctx, "frames", 0),
+                               make_key(jd_nv(), kind, spec), 1),
+                    scx->frames, queue_free);
+    }
   }
   else {
     jd_throw("Unhandled %s stream type: %V", kind, type);
@@ -75,18 +302,63 @@ static jd_var *make_queue(jd_var *ctx, jd_var *out, const char *kind, jd_var *sp
   return out;
 }
 
+/* Making a queue can add other inputs, so the slot is only looked up
+ * once it's made.
+ */
 static jd_var *get_queue(jd_var *ctx, const char *kind, jd_var *spec) {
   jd_var *slot = NULL;
   scope {
     jd_var *inputs = jd_get_ks(ctx, "inputs", 0);
     jd_var *key = make_key(jd_nv(), kind, spec);
-    slot = jd_get_key(inputs, key, 1);
-    if (slot->type == VOID)
-      make_queue(ctx, slot, kind, spec);
+    slot = jd_get_key(inputs, key, 0);
+    if (!slot) {
+      jd_var *q = make_queue(ctx, jd_nv(), kind, spec);
+      slot = jd_assign(jd_get_key(inputs, key, 1), q);
+    }
   }
   return slot;
 }
 
+static mc_queue_policy queue_policy(const char *name) {
+  if (!strcmp(name, "block")) return MC_QUEUE_BLOCK;
+  if (!strcmp(name, "drop")) return MC_QUEUE_DROP;
+  if (!strcmp(name, "resync")) return MC_QUEUE_RESYNC;
+  jd_throw("Unknown overflow policy: %s", name);
+}
+
+static mc_queue *new_queue(jd_var *ctx, jd_var *stm) {
+  const char *type = mc_model_get_str(ctx, "lock", "$.config.global.queue");
+  jd_int size = mc_model_get_int(stm, 200, "$.buffer.packets");
+  mc_queue *q;
+
+  if (!strcmp(type, "lock")) q = mc_queue_new(size);
+  else if (!strcmp(type, "spsc")) q = mc_queue_new_spsc(size);
+  else jd_throw("Unknown queue type: %s", type);
+
+  mc_queue_set_slab(q, jd_ptr(jd_get_ks(ctx, "entries", 0)));
+  mc_queue_set_budget(q, mc_model_get_int(stm, 0, "$.buffer.bytes"), 0);
+  mc_queue_set_policy(q, queue_policy(mc_model_get_str(stm, "block", "$.buffer.overflow")));
+  return q;
+}
+
+/* The duration budget is configured in seconds but the queue counts
+ * in the time base of the stream it carries, which we only know once
+ * the input is open.
+ */
+static void set_duration(jd_var *stm, const char *kind, jd_var *spec,
+                         mc_queue *q, AVFormatContext *ic) {
+  double duration = mc_model_get_real(stm, 0, "$.buffer.duration");
+  if (duration <= 0) return;
+
+  mc_track t;
+  int idx = mc_track_find(ic, mc_track_parse(&t, media_type(kind),
+                                             jd_get_ks(spec, "track", 0)));
+  if (idx < 0) return;
+
+  mc_queue_set_budget(q, q->max_bytes,
+                      duration / av_q2d(ic->streams[idx]->time_base));
+}
+
 static void setup(jd_var *ctx) {
   scope {
     jd_var *streams = jd_get_ks(ctx, "streams", 0);
@@ -99,13 +371,16 @@ static void setup(jd_var *ctx) {
       if (slot->type != VOID) jd_throw("%V already registered", name);
       jd_assign(slot, stm);
 
-      for (unsigned k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++) {
-        const char *kind = kinds[k];
-        jd_var *spec = jd_get_ks(stm, kind, 0);
+      for (unsigned k = 0; k < spec_count(stm); k++) {
+        const char *kind;
+        jd_var *spec = spec_at(stm, k, &kind);
         if (spec) {
+          /* subtitles can only be passed through */
+          if (!strcmp(kind, "subtitle") && !jd_get_ks(spec, "type", 0))
+            jd_set_string(jd_get_ks(spec, "type", 1), "direct");
           mc_debug("Configuring %V %s", jd_get_ks(stm, "name", 0), kind);
           mc_queue *head = jd_ptr(get_queue(ctx, kind, spec));
-          mc_queue *q = mc_queue_new(200);
+          mc_queue *q = new_queue(ctx, stm);
           mc_queue_hook(head, q);
           jd_set_object(jd_get_ks(spec, "source", 1), q, queue_free);
         }
@@ -114,32 +389,170 @@ static void setup(jd_var *ctx) {
   }
 }
 
-static void *muxer(void *ctx) {
+/* Never blocks: the muxer waits for its input and its writer by
+ * returning MC_SCHED_WAIT.
+ */
+static mc_sched_result muxer(void *ctx) {
   muxer_context *mcx = ctx;
+  mc_sched_result rc;
+  scope {
+    rc = mc_hls_muxer_run(mcx->mx, mcx->budget);
+  }
+  return rc;
+}
+
+static void muxer_wake(void *ctx) {
+  mc_sched_wake(ctx);
+}
+
+/* A failed stage ends its output and keeps taking its input, so the
+ * stages it shares that input with aren't held up.
+ */
+static void stage_failed(stage_context *scx, int decode) {
+  if (decode) {
+    AVPacket pkt;
+    mc_queue_frame_put(scx->out, NULL);
+    while (mc_queue_packet_get(scx->in, &pkt))
+      av_free_packet(&pkt);
+  }
+  else {
+    AVFrame frame;
+    mc_queue_packet_put(scx->out, NULL);
+    if (scx->frames) mc_queue_frame_put(scx->frames, NULL);
+    while (mc_queue_frame_get(scx->in, &frame))
+      av_frame_unref(&frame);
+  }
+}
+
+static void *stage(void *ctx) {
+  stage_context *scx = ctx;
+  mc_log_set_thread(scx->tname);
+  int decode = !strcmp(mc_model_get_str(&scx->cfg, "", "$.type"), "decode");
   scope {
-    jd_var *name = jd_sprintf(jd_nv(), "mux.%V", jd_get_ks(&mcx->cfg, "name", 0));
-    mc_log_set_thread(jd_bytes(name, NULL));
-    mc_mux_hls(mcx->ic, &mcx->cfg, mcx->in);
+    try {
+      if (decode) {
+        mc_queue_merger *qm = mc_queue_merger_new(nop_compare, NULL);
+        mc_queue_merger_add(qm, scx->in);
+        mc_h264_decode(scx->ic, &scx->cfg, qm, scx->out);
+        mc_queue_merger_free(qm);
+      }
+      else {
+        mc_h264_encode(scx->ic, &scx->cfg, scx->in, scx->out,
+                       mc_queue_hooked(scx->frames) ? scx->frames : NULL);
+      }
+    }
+    catch (e) {
+      mc_error("%V", jd_get_ks(e, "message", 0));
+      stage_failed(scx, decode);
+    }
   }
   return NULL;
 }
 
 static void free_muxer_context(void *ctx) {
   muxer_context *mcx = ctx;
+  mc_hls_muxer_free(mcx->mx);
+  mc_sched_task_free(mcx->task);
+  free(mcx->tname);
   mc_queue_merger_free(mcx->in);
   jd_release(&mcx->cfg);
 }
 
+/* Freeing a muxer waits for its writer, so its last playlist and
+ * its publisher leave are done before the publisher or the writer
+ * pool goes. Its task must be finished or never have run.
+ */
+static void free_muxers(jd_var *ctx) {
+  jd_var *workers = jd_get_ks(ctx, "workers", 0);
+  for (unsigned i = 0; i < jd_count(workers); i++) {
+    muxer_context *mcx = jd_ptr(jd_get_idx(workers, i));
+    mc_hls_muxer_free(mcx->mx);
+    mcx->mx = NULL;
+  }
+}
+
 static void join_workers(jd_var *ctx) {
   jd_var *workers = jd_get_ks(ctx, "workers", 0);
 
+  jd_var *stages = jd_get_ks(ctx, "stages", 0);
+
   mc_debug("Waiting for workers to terminate");
   for (unsigned i = 0; i < jd_count(workers); i++) {
     muxer_context *mcx = jd_ptr(jd_get_idx(workers, i));
-    pthread_join(mcx->t, NULL);
+    mc_sched_join(mcx->task);
+  }
+  free_muxers(ctx);
+  for (unsigned i = 0; i < jd_count(stages); i++) {
+    stage_context *scx = jd_ptr(jd_get_idx(stages, i));
+    pthread_join(scx->t, NULL);
   }
 }
 
+static mc_store *get_store(jd_var *ctx) {
+  jd_var *store = jd_get_ks(ctx, "store", 0);
+  return store ? jd_ptr(store) : NULL;
+}
+
+static mc_publisher *get_publisher(jd_var *ctx) {
+  jd_var *pub = jd_get_ks(ctx, "publisher", 0);
+  return pub ? jd_ptr(pub) : NULL;
+}
+
+static mc_sched *get_sched(jd_var *ctx) {
+  return jd_ptr(jd_get_ks(ctx, "sched", 0));
+}
+
+static mc_failover *get_failover(jd_var *ctx) {
+  jd_var *fo = jd_get_ks(ctx, "failover", 0);
+  return fo ? jd_ptr(fo) : NULL;
+}
+
+static mc_purger *get_purger(jd_var *ctx) {
+  jd_var *p = jd_get_ks(ctx, "purger", 0);
+  return p ? jd_ptr(p) : NULL;
+}
+
+/* Streams with LL-HLS parts publish each part as it's cut so they
+ * can't wait for the others.
+ */
+static int batched(jd_var *stm) {
+  return mc_model_get_real(stm, 0, "$.output.part_duration") <= 0;
+}
+
+/* Optionally publish the playlists of all the streams together at
+ * each segment boundary.
+ */
+static mc_publisher *new_publisher(jd_var *ctx, mc_writer_pool *wp,
+                                   mc_store *store) {
+  if (!mc_model_get_int(ctx, 0, "$.config.global.publish.batch"))
+    return NULL;
+
+  jd_var *streams = jd_get_ks(ctx, "streams", 0);
+  unsigned members = 0;
+  for (unsigned i = 0; i < jd_count(streams); i++) {
+    jd_var *stm = jd_get_idx(streams, i);
+    if (batched(stm)) members++;
+    else mc_warning("%V has parts; its playlist won't be batched",
+                      jd_get_ks(stm, "name", 0));
+  }
+  if (!members) return NULL;
+
+  unsigned flags = 0;
+  if (!store || mc_model_get_int(ctx, 1, "$.config.default.output.disk"))
+    flags |= MC_WRITER_DISK;
+  if (!strcmp("close", mc_model_get_str(ctx, "none",
+                                        "$.config.default.output.fsync")))
+    flags |= MC_WRITER_FSYNC;
+
+  mc_publisher *pub = mc_publisher_new(
+    wp, store, flags, members,
+    mc_model_get_int(ctx, 2, "$.config.global.publish.max_pending"));
+  mc_writer_set_space(pub->w, mc_model_get_str(ctx, NULL,
+                      "$.config.default.output.space"));
+  jd_set_object(jd_get_ks(ctx, "publisher", 1), pub, NULL);
+  return pub;
+}
+
 static void startup_workers(jd_var *ctx) {
   scope {
     jd_var *streams = jd_get_ks(ctx, "streams", 0);
@@ -148,19 +561,203 @@ static void startup_workers(jd_var *ctx) {
       muxer_context *mcx = mc_alloc(sizeof(*mcx));
       mcx->in = mc_queue_merger_new(dts_compare, NULL);
       mcx->ic = jd_ptr(jd_get_ks(ctx, "ic", 0));
+      mcx->wp = jd_ptr(jd_get_ks(ctx, "writer", 0));
+      mcx->store = get_store(ctx);
+      mcx->pub = batched(stm) ? get_publisher(ctx) : NULL;
+      mcx->tname = thread_name(ctx, jd_sprintf(jd_nv(), "mux.%V",
+                                               jd_get_ks(stm, "name", 0)));
+      mcx->budget = mc_model_get_int(ctx, 64, "$.config.global.scheduler.budget");
       jd_clone(&mcx->cfg, stm, 1);
-      for (unsigned k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++) {
-        const char *kind = kinds[k];
-        jd_var *spec = jd_get_ks(stm, kind, 0);
+      for (unsigned k = 0; k < spec_count(stm); k++) {
+        const char *kind;
+        jd_var *spec = spec_at(stm, k, &kind);
         if (!spec) continue;
         mc_queue *q = jd_ptr(jd_get_ks(spec, "source", 0));
-        mc_queue_merger_add(mcx->in, q);
+        set_duration(stm, kind, spec, q, mcx->ic);
+        /* subtitles can go minutes without a packet */
+        if (!strcmp(kind, "subtitle")) mc_queue_merger_add_sparse(mcx->in, q);
+        else mc_queue_merger_add(mcx->in, q);
       }
       jd_set_object(jd_push(jd_get_ks(ctx, "workers", 0), 1), mcx, free_muxer_context);
-      mc_debug("Starting worker for %V", jd_get_ks(stm, "name", 0));
-      pthread_create(&mcx->t, NULL, muxer, mcx);
+
+      /* loading an existing playlist may take a while so it's done
+       * here rather than on the scheduler.
+       */
+      mcx->mx = mc_hls_muxer_new(mcx->ic, &mcx->cfg, mcx->in, mcx->wp,
+                                 mcx->store, mcx->pub);
+    }
+
+    /* only once every muxer is made, so nothing runs if any fails */
+    jd_var *stages = jd_get_ks(ctx, "stages", 0);
+    for (unsigned i = 0; i < jd_count(stages); i++) {
+      stage_context *scx = jd_ptr(jd_get_idx(stages, i));
+      scx->ic = jd_ptr(jd_get_ks(ctx, "ic", 0));
+      mc_debug("Starting %V %s stage", jd_get_ks(&scx->cfg, "type", 0), scx->kind);
+      pthread_create(&scx->t, NULL, stage, scx);
+    }
+
+    jd_var *workers = jd_get_ks(ctx, "workers", 0);
+    for (unsigned i = 0; i < jd_count(workers); i++) {
+      muxer_context *mcx = jd_ptr(jd_get_idx(workers, i));
+      mc_debug("Starting worker for %V", jd_get_ks(&mcx->cfg, "name", 0));
+      mcx->task = mc_sched_add(get_sched(ctx), mcx->tname, muxer, mcx);
+      mc_queue_merger_set_notify(mcx->in, muxer_wake, mcx->task);
+      mc_hls_muxer_set_notify(mcx->mx, muxer_wake, mcx->task);
+      mc_sched_wake(mcx->task);
+    }
+  }
+}
+
+static void report_queue(jd_var *name, const char *kind, mc_queue *q) {
+  mc_queue_stats st;
+  mc_queue_stats_get(q, &st);
+  mc_info("%V.%s: %llu puts, %llu gets, %llu bytes, depth %llu (max %llu), "
+          "%llu bytes queued, put stall %.3fs, get stall %.3fs, selected %llu, "
+          "dropped %llu packets in %llu gops",
+          name, kind,
+          (unsigned long long) st.puts, (unsigned long long) st.gets,
+          (unsigned long long) st.bytes,
+          (unsigned long long) st.used, (unsigned long long) st.max_used,
+          (unsigned long long) st.queued,
+          st.put_stall_ns / 1e9, st.get_stall_ns / 1e9,
+          (unsigned long long) st.selected,
+          (unsigned long long) st.dropped, (unsigned long long) st.gops);
+}
+
+/* Stats for one channel's publisher, stages and muxers */
+static void report_channel(jd_var *ctx) {
+  jd_var *workers = jd_get_ks(ctx, "workers", 0);
+
+  jd_var *chan = jd_get_ks(ctx, "name", 0);
+  if (chan) mc_info("channel %V:", chan);
+
+  mc_publisher *pub = get_publisher(ctx);
+  if (pub) {
+    mc_publisher_stats ps;
+    mc_publisher_stats_get(pub, &ps);
+    mc_info("publisher: %llu batches, %llu files, %llu partial",
+            (unsigned long long) ps.batches, (unsigned long long) ps.files,
+            (unsigned long long) ps.partial);
+  }
+
+  mc_slab_stats es;
+  mc_slab_stats_get(jd_ptr(jd_get_ks(ctx, "entries", 0)), &es);
+  mc_info("queue entries: %llu of %llu in use (max %llu), %llu bytes in %llu slabs, "
+          "%llu over limit",
+          (unsigned long long) es.in_use, (unsigned long long) es.objects,
+          (unsigned long long) es.max_in_use, (unsigned long long) es.bytes,
+          (unsigned long long) es.slabs, (unsigned long long) es.over);
+
+  mc_failover *fo = get_failover(ctx);
+  if (fo) {
+    mc_failover_stats fs;
+    mc_failover_stats_get(fo, &fs);
+    mc_info("failover: input %u active, %llu switches, %llu stalls",
+            fs.active, (unsigned long long) fs.switches,
+            (unsigned long long) fs.stalls);
+    for (unsigned i = 0; i < fo->ninput; i++)
+      mc_info("input %u: %llu packets, %llu keyframes, %llu forwarded", i,
+              (unsigned long long) fs.in[i].packets,
+              (unsigned long long) fs.in[i].keyframes,
+              (unsigned long long) fs.in[i].forwarded);
+  }
+
+  jd_var *stages = jd_get_ks(ctx, "stages", 0);
+  for (unsigned i = 0; i < jd_count(stages); i++) {
+    stage_context *scx = jd_ptr(jd_get_idx(stages, i));
+    report_queue(jd_get_ks(&scx->cfg, "type", 0), scx->kind, scx->in);
+  }
+
+  for (unsigned i = 0; i < jd_count(workers); i++) {
+    muxer_context *mcx = jd_ptr(jd_get_idx(workers, i));
+    jd_var *name = jd_get_ks(&mcx->cfg, "name", 0);
+    mc_queue_merger_stats ms;
+
+    mc_queue_merger_stats_get(mcx->in, &ms);
+    mc_info("%V: %llu merged, %llu forced by full queue, %llu synthetic eof",
+            name, (unsigned long long) ms.gets,
+            (unsigned long long) ms.forced, (unsigned long long) ms.eofs);
+
+    mc_sched_task_stats ts;
+    mc_sched_task_stats_get(mcx->task, &ts);
+    mc_info("%V: %llu runs, %llu wakes, %.3fs running, longest run %.3fms",
+            name, (unsigned long long) ts.runs, (unsigned long long) ts.wakes,
+            ts.run_ns / 1e9, ts.max_run_ns / 1e6);
+
+    for (unsigned k = 0; k < spec_count(&mcx->cfg); k++) {
+      const char *kind;
+      jd_var *spec = spec_at(&mcx->cfg, k, &kind);
+      if (spec) report_queue(name, kind, jd_ptr(jd_get_ks(spec, "source", 0)));
+    }
+  }
+}
+
+/* Stats for the shared services and every running channel */
+static void report_stats(jd_var *app) {
+  mc_purger *purger = get_purger(app);
+  if (purger) {
+    mc_purger_stats ps;
+    mc_purger_stats_get(purger, &ps);
+    uint64_t done = ps.purged + ps.errors;
+    mc_info("purger: %llu queued, %llu purged, %llu dirs, %llu errors, "
+            "%llu stalls, lag %.3fs mean %.3fs max",
+            (unsigned long long) ps.queued, (unsigned long long) ps.purged,
+            (unsigned long long) ps.dirs, (unsigned long long) ps.errors,
+            (unsigned long long) ps.stalls,
+            done ? ps.lag_ns / 1e9 / done : 0.0,
+            ps.max_lag_ns / 1e9);
+  }
+
+  mc_sched_stats cs;
+  mc_sched_stats_get(get_sched(app), &cs);
+  mc_info("scheduler: %llu runs, %llu steals, %llu parks",
+          (unsigned long long) cs.runs, (unsigned long long) cs.steals,
+          (unsigned long long) cs.parks);
+
+  mc_store *store = get_store(app);
+  if (store) {
+    mc_store_stats ss;
+    mc_store_stats_get(store, &ss);
+    mc_info("store: %llu objects, %llu bytes, %llu hits, %llu misses, %llu evicted",
+            (unsigned long long) ss.objects, (unsigned long long) ss.bytes,
+            (unsigned long long) ss.hits, (unsigned long long) ss.misses,
+            (unsigned long long) ss.evicted);
+  }
+
+  pthread_mutex_lock(&stats_mutex);
+  jd_var *channels = jd_get_ks(app, "channels", 0);
+  for (unsigned i = 0; i < jd_count(channels); i++) {
+    channel_context *ch = jd_ptr(jd_get_idx(channels, i));
+    if (ch->running) report_channel(&ch->ctx);
+  }
+  pthread_mutex_unlock(&stats_mutex);
+}
+
+static void stats_signal(int sig) {
+  (void) sig;
+  stats_wanted = 1;
+}
+
+/* Dump queue stats every $.global.stats_interval seconds (if set)
+ * and whenever we get SIGUSR1.
+ */
+static void *stats_reporter(void *ctx) {
+  jd_int interval = mc_model_get_int(ctx, 0, "$.config.global.stats_interval");
+  jd_int elapsed = 0;
+
+  mc_log_set_thread("stats");
+
+  while (stats_running) {
+    mc_usleep(1000000);
+    elapsed++;
+    if (stats_wanted || (interval && elapsed >= interval)) {
+      stats_wanted = 0;
+      elapsed = 0;
+      report_stats(ctx);
     }
   }
+
+  return NULL;
 }
 
 static jd_var *merge_default(jd_var *out, jd_var *cfg) {
@@ -187,7 +784,10 @@ static jd_var *build_context(jd_var *ctx, jd_var *cfg,
     merge_default(jd_get_ks(ctx, "streams", 1), cfg);
     jd_set_hash(jd_get_ks(ctx, "inputs", 1), 10);
     jd_set_array(jd_get_ks(ctx, "workers", 1), 10);
+    jd_set_array(jd_get_ks(ctx, "stages", 1), 10);
+    jd_set_hash(jd_get_ks(ctx, "frames", 1), 10);
     jd_set_hash(jd_get_ks(ctx, "by_name", 1), 10);
+    jd_set_hash(jd_get_ks(ctx, "tracks", 1), 10);
     jd_var *sources = jd_set_hash(jd_get_ks(ctx, "sources", 1), 10);
     jd_set_object(jd_get_ks(sources, "audio", 1), aq, NULL);
     jd_set_object(jd_get_ks(sources, "video", 1), vq, NULL);
@@ -213,68 +813,473 @@ static void make_roots(jd_var *ctx) {
         jd_bytes(jd_get_ks(spec, "playlist", 0), NULL),
         jd_bytes(prefix, NULL));
 
-      const char *fn = mc_segname_temp(sn);
-      mc_mkfilepath(fn, 0777);
-      hls_m3u8_save(m3u8, fn);
-      mc_segname_rename(sn);
-      mc_info("Updated %s", mc_segname_name(sn));
+      /* with a publisher roots appear along with the first playlists */
+      mc_publisher *pub = get_publisher(ctx);
+      mc_store *store = get_store(ctx);
+      if (pub) {
+        size_t len;
+        const char *buf = jd_bytes(hls_m3u8_format(jd_nv(), m3u8), &len);
+        mc_publisher_add(pub, buf, len - 1, mc_segname_temp(sn),
+                         mc_segname_name(sn), mc_segname_uri(sn));
+      }
+      else if (store) {
+        size_t len;
+        const char *buf = jd_bytes(hls_m3u8_format(jd_nv(), m3u8), &len);
+        char *key = mc_prefix(mc_segname_uri(sn), mc_model_get_str(
+                                ctx, NULL, "$.config.default.output.space"));
+        mc_store_put(store, key, buf, len - 1);
+        free(key);
+      }
+
+      if (!pub && (!store ||
+                   mc_model_get_int(ctx, 1, "$.config.default.output.disk"))) {
+        const char *fn = mc_segname_temp(sn);
+        mc_mkfilepath(fn, 0777);
+        hls_m3u8_save(m3u8, fn);
+        mc_segname_rename(sn);
+        mc_info("Updated %s", mc_segname_name(sn));
+      }
+
+      mc_segname_free(sn);
     }
   }
 }
 
+/* A channel's config is the top level config with the channel's own
+ * settings merged over it. Channels share the origin store, so unless
+ * it says otherwise a channel's files live in the store under its
+ * name.
+ */
+static jd_var *channel_config(jd_var *out, jd_var *cfg, jd_var *chan) {
+  scope {
+    jd_var *base = jd_clone(jd_nv(), cfg, 1);
+    jd_delete_ks(base, "channels", NULL);
+    jd_clone(out, mc_hash_merge(jd_nv(), base, chan), 1);
+    jd_var *space = jd_lv(out, "$.default.output.space");
+    if (space->type == VOID) jd_assign(space, jd_get_ks(chan, "name", 0));
+  }
+  return out;
+}
+
+static void free_channel_context(void *ctx) {
+  channel_context *ch = ctx;
+  jd_release(&ch->ctx);
+  mc_queue_free(ch->aq);
+  mc_queue_free(ch->vq);
+  mc_slab_free(ch->entries);
+  mc_failover_free(ch->fo);
+  avformat_close_input(&ch->ic);
+  avformat_close_input(&ch->bic);
+  free(ch);
+}
+
+static int start_streams(channel_context *ch) {
+  jd_var *cx = &ch->ctx;
+  int ok = 0;
+  try {
+    jd_set_object(jd_get_ks(cx, "ic", 1), ch->ic, NULL);
+    new_publisher(cx, jd_ptr(jd_get_ks(cx, "writer", 0)), get_store(cx));
+    mc_info("Active context:\n%lJ", cx);
+    make_roots(cx);
+    startup_workers(cx);
+    ok = 1;
+  }
+  catch (e) {
+    mc_error("%V", jd_get_ks(e, "message", 0));
+    free_muxers(cx);
+    mc_publisher_free(get_publisher(cx));
+    jd_delete_ks(cx, "publisher", NULL);
+  }
+  return ok;
+}
+
+/* The tracks the channel's streams pick; free the list */
+static track_context **list_tracks(jd_var *ctx, unsigned *count) {
+  track_context **list = NULL;
+  scope {
+    jd_var *tracks = jd_get_ks(ctx, "tracks", 0);
+    jd_var *keys = jd_keys(jd_nv(), tracks);
+    *count = jd_count(keys);
+    list = mc_alloc(sizeof(*list) * (*count + 1));
+    for (unsigned i = 0; i < *count; i++)
+      list[i] = jd_ptr(jd_get_key(tracks, jd_get_idx(keys, i), 0));
+  }
+  return list;
+}
+
+/* A track that won't be fed ends straight away so the muxers that
+ * merge it with others aren't held up waiting for it.
+ */
+static void end_track(track_context *tcx) {
+  if (!tcx->ended) {
+    tcx->ended = 1;
+    mc_queue_packet_put(tcx->q, NULL);
+  }
+}
+
+/* Only the streams something reads are demuxed */
+static void read_only(AVFormatContext *ic, const int *streams, unsigned n) {
+  for (unsigned i = 0; i < ic->nb_streams; i++)
+    ic->streams[i]->discard = AVDISCARD_ALL;
+  for (unsigned i = 0; i < n; i++)
+    if (streams[i] >= 0) ic->streams[streams[i]]->discard = AVDISCARD_NONE;
+}
+
+static AVFormatContext *open_input(const char *name) {
+  AVFormatContext *ic = NULL;
+  if (avformat_open_input(&ic, name, NULL, NULL) < 0) return NULL;
+  if (avformat_find_stream_info(ic, NULL) < 0) {
+    mc_error("Can't read stream info for %s", name);
+    avformat_close_input(&ic);
+  }
+  return ic;
+}
+
+/* With a backup both copies of the input are open; the primary's
+ * streams are what the muxers see. If only one opens it's used on
+ * its own.
+ */
+static void open_inputs(channel_context *ch) {
+  jd_var *cx = &ch->ctx;
+  const char *input = jd_bytes(jd_get_ks(cx, "input", 0), NULL);
+  jd_var *bv = jd_get_ks(cx, "backup", 0);
+  const char *backup = bv ? jd_bytes(bv, NULL) : NULL;
+
+  ch->ic = open_input(input);
+  if (backup) {
+    ch->bic = open_input(backup);
+    if (!ch->bic) mc_warning("Can't open backup %s", backup);
+    if (!ch->ic && ch->bic) {
+      mc_warning("Can't open %s; using backup", input);
+      ch->ic = ch->bic;
+      ch->bic = NULL;
+    }
+  }
+  if (!ch->ic) jd_throw("Can't open %s", input);
+
+  if (ch->bic) {
+    ch->fo = mc_failover_new(ch->ic, ch->aq, ch->vq,
+                             mc_model_get_real(cx, 2, "$.config.global.failover.timeout"),
+                             mc_model_get_real(cx, 10, "$.config.global.failover.align"));
+    jd_set_object(jd_get_ks(cx, "failover", 1), ch->fo, NULL);
+
+    unsigned nt;
+    track_context **tracks = list_tracks(cx, &nt);
+    for (unsigned i = 0; i < nt; i++) {
+      if (i + 2 < MC_FAILOVER_TRACKS) {
+        unsigned tn = mc_failover_track_add(ch->fo, &tracks[i]->sel,
+                                            tracks[i]->q);
+        if (ch->fo->track[tn].ref >= 0) continue;
+      }
+      end_track(tracks[i]);
+    }
+    if (nt + 2 > MC_FAILOVER_TRACKS)
+      mc_warning("Only %d tracks can fail over", MC_FAILOVER_TRACKS - 2);
+    free(tracks);
+
+    mc_failover_add(ch->fo, ch->ic);
+    mc_failover_add(ch->fo, ch->bic);
+    for (unsigned i = 0; i < ch->fo->ninput; i++)
+      read_only(ch->fo->in[i].ic, ch->fo->in[i].stream, ch->fo->ntrack);
+  }
+}
+
+static unsigned add_route(mc_demux_route *routes, unsigned nr,
+                          AVFormatContext *ic, const mc_track *t,
+                          mc_queue *q) {
+  int idx = mc_track_find(ic, t);
+  if (idx < 0) {
+    char name[64];
+    mc_warning("No %s in %s", mc_track_name(name, sizeof(name), t),
+               ic->filename);
+    return nr;
+  }
+  routes[nr].stream = idx;
+  routes[nr].q = q;
+  return nr + 1;
+}
+
+/* Without a backup packets go straight from the input to the best
+ * audio and video queues and to the queue of each track. A best
+ * audio or video queue nothing is hooked onto (e.g. when every
+ * rendition is audio only) isn't fed, so its stream is discarded.
+ */
+static void demux(channel_context *ch) {
+  unsigned nt, nr = 0;
+  track_context **tracks = list_tracks(&ch->ctx, &nt);
+  mc_demux_route *routes = mc_alloc(sizeof(*routes) * (nt + 2));
+  int *streams = mc_alloc(sizeof(int) * (nt + 2));
+  mc_track t;
+
+  if (mc_queue_hooked(ch->aq))
+    nr = add_route(routes, nr, ch->ic,
+                   mc_track_parse(&t, AVMEDIA_TYPE_AUDIO, NULL), ch->aq);
+  if (mc_queue_hooked(ch->vq))
+    nr = add_route(routes, nr, ch->ic,
+                   mc_track_parse(&t, AVMEDIA_TYPE_VIDEO, NULL), ch->vq);
+  for (unsigned i = 0; i < nt; i++) {
+    unsigned before = nr;
+    nr = add_route(routes, nr, ch->ic, &tracks[i]->sel, tracks[i]->q);
+    if (nr == before) end_track(tracks[i]);
+  }
+  free(tracks);
+
+  for (unsigned i = 0; i < nr; i++)
+    streams[i] = routes[i].stream;
+  read_only(ch->ic, streams, nr);
+  free(streams);
+
+  mc_demux(ch->ic, routes, nr);
+  free(routes);
+}
+
+static void *backup_demux(void *ctx) {
+  channel_context *ch = ctx;
+  scope {
+    char *tn = thread_name(&ch->ctx, jd_set_string(jd_nv(), "demux.backup"));
+    mc_log_set_thread(tn);
+    free(tn);
+    mc_failover_demux(ch->fo, 1);
+  }
+  return NULL;
+}
+
+static void end_tracks(jd_var *ctx) {
+  unsigned nt;
+  track_context **tracks = list_tracks(ctx, &nt);
+  for (unsigned i = 0; i < nt; i++)
+    end_track(tracks[i]);
+  free(tracks);
+}
+
+/* Opens the channel's input, starts its streams and demuxes until
+ * the input ends. A channel that fails stops on its own.
+ */
+static void *channel(void *ctx) {
+  channel_context *ch = ctx;
+  jd_var *cx = &ch->ctx;
+  volatile int started = 0;
+
+  scope {
+    char *tn = thread_name(cx, jd_set_string(jd_nv(), "demux"));
+    mc_log_set_thread(tn);
+    free(tn);
+
+    try {
+      open_inputs(ch);
+
+      /* the channels' contexts share config, so set up one at a time */
+      pthread_mutex_lock(&setup_mutex);
+      started = start_streams(ch);
+      pthread_mutex_unlock(&setup_mutex);
+      if (!started) jd_throw("Can't start streams");
+
+      pthread_mutex_lock(&stats_mutex);
+      ch->running = 1;
+      pthread_mutex_unlock(&stats_mutex);
+
+      if (ch->fo) {
+        pthread_create(&ch->bt, NULL, backup_demux, ch);
+        mc_failover_demux(ch->fo, 0);
+        pthread_join(ch->bt, NULL);
+      }
+      else {
+        demux(ch);
+      }
+    }
+    catch (e) {
+      mc_error("%V", jd_get_ks(e, "message", 0));
+    }
+
+    mc_queue_packet_put(ch->aq, NULL);
+    mc_queue_packet_put(ch->vq, NULL);
+    end_tracks(cx);
+
+    if (started) {
+      join_workers(cx);
+
+      pthread_mutex_lock(&stats_mutex);
+      ch->running = 0;
+      pthread_mutex_unlock(&stats_mutex);
+
+      report_channel(cx);
+      mc_publisher_free(get_publisher(cx));
+    }
+  }
+
+  return NULL;
+}
+
+static void start_channel(jd_var *app, jd_var *cfg, const char *input) {
+  channel_context *ch = mc_alloc(sizeof(*ch));
+  ch->aq = mc_queue_new(0);
+  ch->vq = mc_queue_new(0);
+
+  jd_var *cx = build_context(&ch->ctx, cfg, ch->aq, ch->vq);
+
+  /* each channel's queues have their own entry budget */
+  ch->entries = mc_slab_new(sizeof(mc_queue_entry),
+                            mc_model_get_int(cx, 0, "$.config.global.entry_memory"));
+  jd_set_object(jd_get_ks(cx, "entries", 1), ch->entries, NULL);
+  jd_var *name = jd_get_ks(cfg, "name", 0);
+  if (name) jd_assign(jd_get_ks(cx, "name", 1), name);
+  if (!input) input = mc_model_get_str(cfg, NULL, "$.input");
+  if (!input) jd_throw("No input for channel %V", name);
+  jd_set_string(jd_get_ks(cx, "input", 1), input);
+  const char *backup = mc_model_get_str(cfg, NULL, "$.backup");
+  if (backup) jd_set_string(jd_get_ks(cx, "backup", 1), backup);
+
+  jd_assign(jd_get_ks(cx, "writer", 1), jd_get_ks(app, "writer", 0));
+  jd_assign(jd_get_ks(cx, "sched", 1), jd_get_ks(app, "sched", 0));
+  jd_var *store = jd_get_ks(app, "store", 0);
+  if (store) jd_assign(jd_get_ks(cx, "store", 1), store);
+
+  jd_set_object(jd_push(jd_get_ks(app, "channels", 0), 1), ch,
+                free_channel_context);
+
+  setup(cx);
+
+  mc_debug("Starting channel %V", name);
+  pthread_create(&ch->t, NULL, channel, ch);
+}
+
+static unsigned cpu_count(void) {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? n : 1;
+}
+
+/* Muxers run on a pool of workers, one per core by default. The
+ * workers can be pinned to CPUs: "spread" pins worker n to CPU n, or
+ * give a list of CPUs to use in turn.
+ */
+static mc_sched *new_sched(jd_var *app) {
+  mc_sched *sched = NULL;
+  scope {
+    unsigned ncpu = cpu_count();
+    int threads = mc_model_get_int(app, 0, "$.config.global.scheduler.threads");
+    jd_var *aff = jd_rv(app, "$.config.global.scheduler.affinity");
+    unsigned ncpus = 0;
+    int *cpus = NULL;
+
+    if (aff && aff->type == ARRAY) {
+      ncpus = jd_count(aff);
+      cpus = mc_alloc(sizeof(int) * (ncpus ? ncpus : 1));
+      for (unsigned i = 0; i < ncpus; i++)
+        cpus[i] = jd_get_int(jd_get_idx(aff, i));
+    }
+    else if (aff && !strcmp(jd_bytes(aff, NULL), "spread")) {
+      ncpus = ncpu;
+      cpus = mc_alloc(sizeof(int) * ncpus);
+      for (unsigned i = 0; i < ncpus; i++) cpus[i] = i;
+    }
+    else if (aff && strcmp(jd_bytes(aff, NULL), "none")) {
+      jd_throw("Unknown scheduler affinity: %V", aff);
+    }
+
+    sched = mc_sched_new(threads > 0 ? (unsigned) threads : ncpu, cpus, ncpus);
+    free(cpus);
+  }
+  return sched;
+}
+
 int main(int argc, char *argv[]) {
   srand((unsigned) time(NULL));
   scope {
-    AVFormatContext *ic = NULL;
-
     av_log_set_callback(mc_log_avutil);
     av_register_all();
     avcodec_register_all();
     avformat_network_init();
 
-    if (argc != 3) jd_throw("Syntax: multicoder <config.json> <input>");
+    if (argc < 2 || argc > 3)
+      jd_throw("Syntax: multicoder <config.json> [<input>]");
 
     mc_log_set_thread("main");
     jd_var *cfg = mc_model_load_file(jd_nv(), argv[1]);
     mc_log_level = mc_log_decode_level(
       mc_model_get_str(cfg, "INFO", "$.global.log_level"));
 
-    mc_info("Starting multicoder");
-
-    mc_queue *aq = mc_queue_new(0);
-    mc_queue *vq = mc_queue_new(0);
-
-    jd_var *ctx = build_context(jd_nv(), cfg, aq, vq);
-    setup(ctx);
+    /* with a list of channels each names its own input */
+    jd_var *chans = jd_get_ks(cfg, "channels", 0);
+    if (chans && argc != 2)
+      jd_throw("%s lists channels; no input needed", argv[1]);
+    if (!chans && argc != 3)
+      jd_throw("Syntax: multicoder <config.json> <input>");
 
-    if (avformat_open_input(&ic, argv[2], NULL, NULL) < 0)
-      jd_throw("Can't open %s", argv[2]);
+    mc_info("Starting multicoder");
 
-    if (avformat_find_stream_info(ic, NULL) < 0)
-      jd_throw("Can't read stream info");
+    jd_var *app = jd_nhv(5);
+    jd_assign(jd_get_ks(app, "config", 1), cfg);
+    jd_set_array(jd_get_ks(app, "channels", 1), 10);
 
-    /* add ic to context */
-    jd_set_object(jd_get_ks(ctx, "ic", 1), ic, NULL);
+    /* shared by every channel */
+    int threads = mc_model_get_int(app, 0, "$.config.global.writer.threads");
+    mc_writer_pool *wp = mc_writer_pool_new(
+      threads > 0 ? (unsigned) threads : cpu_count(),
+      mc_model_get_int(app, 16777216, "$.config.global.writer.max_inflight"));
+    jd_set_object(jd_get_ks(app, "writer", 1), wp, NULL);
 
-    mc_info("Active context:\n%lJ", ctx);
+    mc_sched *sched = new_sched(app);
+    jd_set_object(jd_get_ks(app, "sched", 1), sched, NULL);
 
-    make_roots(ctx);
+    /* retired segments are deleted off the writer threads */
+    mc_purger *purger = NULL;
+    int purge_queue = mc_model_get_int(app, 4096,
+                                       "$.config.global.purge.queue_size");
+    if (purge_queue > 0) {
+      purger = mc_purger_new(purge_queue);
+      jd_set_object(jd_get_ks(app, "purger", 1), purger, NULL);
+      mc_writer_pool_set_purger(wp, purger);
+    }
 
-    startup_workers(ctx);
+    /* optional in-memory origin */
+    mc_store *store = NULL;
+    mc_http *http = NULL;
+    if (mc_model_get_int(app, 0, "$.config.global.origin.enabled")) {
+      store = mc_store_new(mc_model_get_int(app, 256 * 1024 * 1024,
+                                            "$.config.global.origin.max_bytes"));
+      jd_set_object(jd_get_ks(app, "store", 1), store, NULL);
+      http = mc_http_new(store,
+                         mc_model_get_str(app, NULL, "$.config.global.origin.listen"),
+                         mc_model_get_int(app, 8080, "$.config.global.origin.port"));
+      mc_http_set_block_timeout(http, 1000 * mc_model_get_real(app, 12,
+                                "$.config.global.origin.block_timeout"));
+      mc_info("Serving on port %d", mc_http_port(http));
+    }
 
-    mc_demux(ic, NULL, aq, vq);
+    if (chans) {
+      for (unsigned i = 0; i < jd_count(chans); i++) {
+        jd_var *chan = jd_get_idx(chans, i);
+        if (!jd_get_ks(chan, "name", 0)) jd_throw("Missing name for channel");
+        if (mc_model_get_int(chan, 1, "$.enabled"))
+          start_channel(app, channel_config(jd_nv(), cfg, chan), NULL);
+      }
+    }
+    else {
+      start_channel(app, cfg, argv[2]);
+    }
 
-    mc_queue_packet_put(aq, NULL);
-    mc_queue_packet_put(vq, NULL);
+    pthread_t stats;
+    signal(SIGUSR1, stats_signal);
+    pthread_create(&stats, NULL, stats_reporter, app);
 
-    join_workers(ctx);
+    jd_var *channels = jd_get_ks(app, "channels", 0);
+    for (unsigned i = 0; i < jd_count(channels); i++) {
+      channel_context *ch = jd_ptr(jd_get_idx(channels, i));
+      pthread_join(ch->t, NULL);
+    }
 
-    mc_queue_free(aq);
-    mc_queue_free(vq);
+    mc_writer_pool_free(wp);
+    if (purger) mc_purger_sync(purger);
+    mc_http_free(http);
 
-    avformat_close_input(&ic);
+    stats_running = 0;
+    pthread_join(stats, NULL);
+    report_stats(app);
+    mc_sched_free(sched);
+    mc_purger_free(purger);
+    mc_store_free(store);
 
-    av_free(ic);
+    jd_release(channels);
 
     avformat_network_deinit();
   }
@@ -11,11 +11,18 @@
 
 #include "jd_pretty.h"
 
+#include "mc_failover.h"
 #include "mc_hls.h"
 #include "mc_model.h"
+#include "mc_publisher.h"
+#include "mc_purger.h"
 #include "mc_queue.h"
+#include "mc_sched.h"
 #include "mc_segname.h"
+#include "mc_store.h"
+#include "mc_track.h"
 #include "mc_util.h"
+#include "mc_writer.h"
 
 #define MC_ERROR_LEVELS \
   X(FATAL)    \
@@ -47,9 +54,28 @@ void mc_warning(const char *msg, ...);
 void mc_error(const char *msg, ...);
 void mc_fatal(const char *msg, ...);
 
+/* Where mc_demux sends the packets of one input stream */
+typedef struct {
+  int stream;
+  mc_queue *q;
+} mc_demux_route;
+
 void mc_h264_decode(AVFormatContext *fcx, jd_var *cfg, mc_queue_merger *qi, mc_queue *qo);
-void mc_demux(AVFormatContext *fcx, jd_var *cfg, mc_queue *aq, mc_queue *vq);
-void mc_mux_hls(AVFormatContext *fcx, jd_var *cfg, mc_queue_merger *qm);
+void mc_h264_encode(AVFormatContext *fcx, jd_var *cfg, mc_queue *qi, mc_queue *qo,
+                    mc_queue *qf);
+void mc_demux(AVFormatContext *fcx, const mc_demux_route *routes,
+              unsigned nroute);
+void mc_mux_hls(AVFormatContext *fcx, jd_var *cfg, mc_queue_merger *qm,
+                mc_writer_pool *wp, mc_store *store, mc_publisher *pub);
+
+typedef struct mc_hls_muxer mc_hls_muxer;
+
+mc_hls_muxer *mc_hls_muxer_new(AVFormatContext *fcx, jd_var *cfg,
+                               mc_queue_merger *qm, mc_writer_pool *wp,
+                               mc_store *store, mc_publisher *pub);
+void mc_hls_muxer_set_notify(mc_hls_muxer *mx, mc_writer_fn wake, void *ctx);
+mc_sched_result mc_hls_muxer_run(mc_hls_muxer *mx, unsigned budget);
+void mc_hls_muxer_free(mc_hls_muxer *mx);
 
 #endif
 
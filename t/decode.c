@@ -0,0 +1,181 @@
+/* decode.t */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/opt.h>
+
+#include "framework.h"
+#include "tap.h"
+
+#include "jd_pretty.h"
+
+#include "multicoder.h"
+
+#define CLIP_FRAMES 120
+#define CLIP_WIDTH  1280
+#define CLIP_HEIGHT 720
+
+typedef struct {
+  AVPacket pkt[CLIP_FRAMES * 2];
+  unsigned npkt;
+} clip;
+
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static int nop_compare(mc_queue_entry *a, mc_queue_entry *b, void *ctx) {
+  (void) a;
+  (void) b;
+  (void) ctx;
+  return 0;
+}
+
+static void paint(AVFrame *frame, unsigned n) {
+  for (int y = 0; y < frame->height; y++)
+    for (int x = 0; x < frame->width; x++)
+      frame->data[0][y * frame->linesize[0] + x] = x + y + n * 3;
+  for (int y = 0; y < frame->height / 2; y++) {
+    memset(frame->data[1] + y * frame->linesize[1], 128 + n, frame->width / 2);
+    memset(frame->data[2] + y * frame->linesize[2], 128 - n, frame->width / 2);
+  }
+}
+
+static void add_packet(clip *cl, AVPacket *pkt) {
+  if (cl->npkt == sizeof(cl->pkt) / sizeof(cl->pkt[0])) die("Clip too long");
+  cl->pkt[cl->npkt++] = *pkt;
+}
+
+/* The test clip is made here rather than shipped in the tree */
+static int make_clip(clip *cl) {
+  AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_H264);
+  if (!codec) return 0;
+
+  AVCodecContext *c = avcodec_alloc_context3(codec);
+  c->width = CLIP_WIDTH;
+  c->height = CLIP_HEIGHT;
+  c->pix_fmt = AV_PIX_FMT_YUV420P;
+  c->time_base = (AVRational) { 1, 50 };
+  c->gop_size = 50;
+  c->bit_rate = 4000000;
+  av_opt_set(c->priv_data, "preset", "ultrafast", 0);
+  if (avcodec_open2(c, codec, NULL) < 0) die("Can't open encoder");
+
+  AVFrame *frame = av_frame_alloc();
+  frame->width = c->width;
+  frame->height = c->height;
+  frame->format = c->pix_fmt;
+  if (av_frame_get_buffer(frame, 32) < 0) die("Can't allocate frame");
+
+  AVPacket pkt;
+  int got;
+  cl->npkt = 0;
+
+  for (unsigned i = 0; i <= CLIP_FRAMES; i++) {
+    av_init_packet(&pkt);
+    pkt.data = NULL;
+    pkt.size = 0;
+    if (i < CLIP_FRAMES) {
+      paint(frame, i);
+      frame->pts = i;
+      avcodec_encode_video2(c, &pkt, frame, &got);
+      if (got) add_packet(cl, &pkt);
+    }
+    else {
+      while (avcodec_encode_video2(c, &pkt, NULL, &got) == 0 && got) {
+        add_packet(cl, &pkt);
+        av_init_packet(&pkt);
+        pkt.data = NULL;
+        pkt.size = 0;
+      }
+    }
+  }
+
+  av_frame_free(&frame);
+  avcodec_close(c);
+  av_free(c);
+  return 1;
+}
+
+static void free_clip(clip *cl) {
+  for (unsigned i = 0; i < cl->npkt; i++)
+    av_free_packet(&cl->pkt[i]);
+}
+
+static void *count_frames(void *ctx) {
+  mc_queue *q = ctx;
+  AVFrame frame;
+  unsigned *count = mc_alloc(sizeof(*count));
+  while (mc_queue_frame_get(q, &frame)) {
+    if (frame.width == CLIP_WIDTH && frame.height == CLIP_HEIGHT) (*count)++;
+    av_frame_unref(&frame);
+  }
+  return count;
+}
+
+static void bench(clip *cl, int threads, const char *type) {
+  scope {
+    jd_var *cfg = jd_nhv(2);
+    jd_set_int(jd_get_ks(cfg, "thread_count", 1), threads);
+    jd_set_string(jd_get_ks(cfg, "thread_type", 1), type);
+
+    mc_queue *in = mc_queue_new(cl->npkt + 1);
+    mc_queue *out = mc_queue_new(16);
+    mc_queue_merger *qm = mc_queue_merger_new(nop_compare, NULL);
+    mc_queue_merger_add(qm, in);
+
+    for (unsigned i = 0; i < cl->npkt; i++)
+      mc_queue_packet_put(in, &cl->pkt[i]);
+    mc_queue_packet_put(in, NULL);
+
+    pthread_t t;
+    void *rv;
+    double start = now();
+    pthread_create(&t, NULL, count_frames, out);
+    mc_h264_decode(NULL, cfg, qm, out);
+    pthread_join(t, &rv);
+    double elapsed = now() - start;
+
+    unsigned *count = rv;
+    ok(*count == CLIP_FRAMES, "%d %s threads: decoded %u frames",
+       threads, type, *count);
+    diag("%d %s threads: %.1f frames/sec", threads, type, *count / elapsed);
+    free(count);
+
+    mc_queue_merger_free(qm);
+    mc_queue_free(in);
+    mc_queue_free(out);
+  }
+}
+
+static void test_decode(void) {
+  clip cl;
+
+  avcodec_register_all();
+  if (!make_clip(&cl)) {
+    skip("no H.264 encoder");
+    return;
+  }
+
+  bench(&cl, 1, "frame");
+  bench(&cl, 0, "slice");
+  bench(&cl, 0, "frame");
+  bench(&cl, 0, "auto");
+
+  free_clip(&cl);
+}
+
+void test_main(void) {
+  scope {
+    test_decode();
+  }
+}
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
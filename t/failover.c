@@ -0,0 +1,252 @@
+/* failover.t */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <libavformat/avformat.h>
+
+#include "framework.h"
+#include "tap.h"
+
+#include "jd_pretty.h"
+
+#include "mc_failover.h"
+#include "mc_queue.h"
+
+#define VIDEO 0
+#define AUDIO 1
+
+static void add_stream(AVFormatContext *ic, enum AVMediaType type,
+                       AVRational tb, const char *lang) {
+  AVStream *st = avformat_new_stream(ic, NULL);
+  st->codec->codec_type = type;
+  st->time_base = tb;
+  if (lang) av_dict_set(&st->metadata, "language", lang, 0);
+}
+
+/* An input with a video and an audio stream and no demuxer behind it */
+static AVFormatContext *fake_input(const char *name, AVRational tb) {
+  AVFormatContext *ic = avformat_alloc_context();
+  snprintf(ic->filename, sizeof(ic->filename), "%s", name);
+  add_stream(ic, AVMEDIA_TYPE_VIDEO, tb, NULL);
+  add_stream(ic, AVMEDIA_TYPE_AUDIO, tb, NULL);
+  return ic;
+}
+
+/* Stalls are timed by this rather than the wall clock */
+static uint64_t fake_ns;
+
+static uint64_t fake_clock(void) {
+  return fake_ns;
+}
+
+static void free_input(AVFormatContext *ic) {
+  avformat_free_context(ic);
+}
+
+static void offer(mc_failover *fo, unsigned idx, int stream, int64_t ts,
+                  int key) {
+  AVPacket pkt;
+  av_init_packet(&pkt);
+  pkt.data = NULL;
+  pkt.size = 0;
+  pkt.stream_index = stream;
+  pkt.pts = pkt.dts = ts;
+  pkt.duration = stream == VIDEO ? 40 : 20;
+  if (key) pkt.flags |= AV_PKT_FLAG_KEY;
+  mc_failover_put(fo, idx, &pkt);
+}
+
+/* Offer video frames from..to (in ms) with a keyframe every 10 */
+static void offer_video(mc_failover *fo, unsigned idx, int64_t scale,
+                        int64_t from, int64_t to) {
+  for (int64_t t = from; t < to; t += 40)
+    offer(fo, idx, VIDEO, t * scale, t % 400 == 0);
+}
+
+static unsigned drain(mc_queue *q, int64_t *first, int64_t *last, int *mono) {
+  AVPacket pkt;
+  unsigned count = 0;
+  *mono = 1;
+  while (mc_queue_peek(q)) {
+    mc_queue_packet_get(q, &pkt);
+    if (!count) *first = pkt.dts;
+    else if (pkt.dts <= *last) *mono = 0;
+    *last = pkt.dts;
+    count++;
+  }
+  return count;
+}
+
+static void test_aligned(void) {
+  AVRational ms = { 1, 1000 };
+  AVFormatContext *a = fake_input("primary", ms);
+  AVFormatContext *b = fake_input("backup", ms);
+  mc_queue *aq = mc_queue_new(1000);
+  mc_queue *vq = mc_queue_new(1000);
+  mc_failover_stats st;
+  int64_t first, last;
+  int mono;
+
+  mc_failover *fo = mc_failover_new(a, aq, vq, 0.05, 10);
+  fo->clock = fake_clock;
+  mc_failover_add(fo, a);
+  mc_failover_add(fo, b);
+
+  /* both healthy: only the primary gets through */
+  for (int64_t t = 0; t < 800; t += 40) {
+    offer(fo, 0, VIDEO, t, t % 400 == 0);
+    offer(fo, 1, VIDEO, t, t % 400 == 0);
+  }
+  unsigned n = drain(vq, &first, &last, &mono);
+  ok(n == 20 && first == 0 && last == 760, "primary forwarded (%u)", n);
+
+  /* primary stalls; backup is a little behind */
+  fake_ns += 100000000;
+  offer_video(fo, 1, 1, 400, 800);
+  mc_failover_stats_get(fo, &st);
+  ok(st.active == 0, "no switch until a keyframe after what's been sent");
+  offer_video(fo, 1, 1, 800, 1200);
+  mc_failover_stats_get(fo, &st);
+  ok(st.active == 1 && st.switches == 1 && st.stalls == 1,
+     "switched to backup");
+
+  n = drain(vq, &first, &last, &mono);
+  ok(n == 10 && first == 800 && last == 1160 && mono,
+     "resumed at backup keyframe");
+
+  /* the primary coming back doesn't switch us back */
+  offer_video(fo, 0, 1, 1200, 1600);
+  offer_video(fo, 1, 1, 1200, 1600);
+  n = drain(vq, &first, &last, &mono);
+  ok(n == 10 && first == 1200, "stayed with backup");
+
+  mc_failover_free(fo);
+  mc_queue_free(aq);
+  mc_queue_free(vq);
+  free_input(a);
+  free_input(b);
+}
+
+static void test_unaligned(void) {
+  AVRational ms = { 1, 1000 };
+  AVRational ticks = { 1, 90000 };
+  AVFormatContext *a = fake_input("primary", ms);
+  AVFormatContext *b = fake_input("backup", ticks);
+  mc_queue *aq = mc_queue_new(1000);
+  mc_queue *vq = mc_queue_new(1000);
+  mc_failover_stats st;
+  int64_t first, last;
+  int mono;
+
+  mc_failover *fo = mc_failover_new(a, aq, vq, 10, 10);
+  mc_failover_add(fo, a);
+  mc_failover_add(fo, b);
+
+  offer_video(fo, 0, 1, 0, 800);
+  offer(fo, 0, AUDIO, 780, 1);
+  drain(vq, &first, &last, &mono);
+  drain(aq, &first, &last, &mono);
+  mc_failover_end(fo, 0);
+
+  /* the backup is an hour ahead and counts in 90kHz ticks */
+  offer_video(fo, 1, 90, 3600000 + 200, 3600000 + 400);
+  offer(fo, 1, AUDIO, (3600000 + 380) * 90, 1);
+  mc_failover_stats_get(fo, &st);
+  ok(st.active == 0, "waits for a keyframe");
+
+  offer_video(fo, 1, 90, 3600000 + 400, 3600000 + 800);
+  offer(fo, 1, AUDIO, (3600000 + 420) * 90, 1);
+  mc_failover_stats_get(fo, &st);
+  ok(st.active == 1 && st.switches == 1 && st.stalls == 0,
+     "switched after primary ended");
+
+  unsigned n = drain(vq, &first, &last, &mono);
+  ok(n == 10 && first == 800 && last == 1160 && mono,
+     "backup follows on in primary's time base (%lld..%lld)",
+     (long long) first, (long long) last);
+  n = drain(aq, &first, &last, &mono);
+  ok(n == 1 && first == 820, "audio moved too (%lld)", (long long) first);
+
+  mc_failover_stats_get(fo, &st);
+  ok(st.in[0].forwarded == 21 && st.in[1].forwarded == 11,
+     "forwarded %llu, %llu", (unsigned long long) st.in[0].forwarded,
+     (unsigned long long) st.in[1].forwarded);
+
+  mc_failover_free(fo);
+  mc_queue_free(aq);
+  mc_queue_free(vq);
+  free_input(a);
+  free_input(b);
+}
+
+/* Count what's in q; all of it should be from stream */
+static unsigned drain_stream(mc_queue *q, int stream, int64_t *first) {
+  AVPacket pkt;
+  unsigned count = 0;
+  while (mc_queue_peek(q)) {
+    mc_queue_packet_get(q, &pkt);
+    if (pkt.stream_index != stream) return 0;
+    if (!count) *first = pkt.dts;
+    count++;
+  }
+  return count;
+}
+
+/* An extra track follows the switch even though the backup has it
+ * at a different index.
+ */
+static void test_tracks(void) {
+  AVRational ms = { 1, 1000 };
+  AVFormatContext *a = fake_input("primary", ms);
+  AVFormatContext *b = fake_input("backup", ms);
+  add_stream(a, AVMEDIA_TYPE_AUDIO, ms, "fra");
+  add_stream(b, AVMEDIA_TYPE_AUDIO, ms, "deu");
+  add_stream(b, AVMEDIA_TYPE_AUDIO, ms, "fra");
+  mc_queue *aq = mc_queue_new(1000);
+  mc_queue *vq = mc_queue_new(1000);
+  mc_queue *fq = mc_queue_new(1000);
+  int64_t first, last;
+  int mono;
+  mc_track fra;
+
+  mc_failover *fo = mc_failover_new(a, aq, vq, 10, 10);
+  memset(&fra, 0, sizeof(fra));
+  fra.type = AVMEDIA_TYPE_AUDIO;
+  fra.nth = -1;
+  strcpy(fra.language, "fra");
+  ok(mc_failover_track_add(fo, &fra, fq) == 2, "extra track added");
+  mc_failover_add(fo, a);
+  mc_failover_add(fo, b);
+
+  offer_video(fo, 0, 1, 0, 400);
+  offer(fo, 0, 2, 20, 1);
+  drain(vq, &first, &last, &mono);
+  ok(drain_stream(fq, 2, &first) == 1 && first == 20, "primary's track");
+  mc_failover_end(fo, 0);
+
+  offer_video(fo, 1, 1, 400, 800);
+  offer(fo, 1, 3, 420, 1);
+  offer(fo, 1, 2, 440, 1);
+  ok(drain_stream(fq, 2, &first) == 1 && first == 420,
+     "backup's track in its place");
+  ok(drain(aq, &first, &last, &mono) == 0, "other languages ignored");
+
+  mc_failover_free(fo);
+  mc_queue_free(aq);
+  mc_queue_free(vq);
+  mc_queue_free(fq);
+  free_input(a);
+  free_input(b);
+}
+
+void test_main(void) {
+  scope {
+    test_aligned();
+    test_unaligned();
+    test_tracks();
+  }
+}
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
@@ -0,0 +1,153 @@
+/* http.t */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "framework.h"
+#include "tap.h"
+
+#include "jd_pretty.h"
+
+#include "mc_http.h"
+#include "mc_store.h"
+#include "mc_util.h"
+
+static int connect_to(int port) {
+  struct sockaddr_in sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons(port);
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *) &sa, sizeof(sa)))
+    die("Can't connect to port %d", port);
+  return fd;
+}
+
+/* Send a request and read one response; returns the body via buf */
+static int request(int fd, const char *req, char *buf, size_t size) {
+  if (send(fd, req, strlen(req), 0) < 0) die("Send failed");
+
+  size_t have = 0;
+  char *body;
+  buf[0] = '\0';
+  while (!(body = strstr(buf, "\r\n\r\n"))) {
+    ssize_t got = recv(fd, buf + have, size - have - 1, 0);
+    if (got <= 0) return -1;
+    have += got;
+    buf[have] = '\0';
+  }
+  body += 4;
+
+  int status = atoi(buf + 9);
+  const char *cl = strstr(buf, "Content-Length: ");
+  size_t len = cl ? strtoul(cl + 16, NULL, 10) : 0;
+  if (!strncmp(req, "HEAD", 4)) len = 0;
+
+  while ((size_t) (buf + have - body) < len) {
+    ssize_t got = recv(fd, buf + have, size - have - 1, 0);
+    if (got <= 0) return -1;
+    have += got;
+  }
+
+  memmove(buf, body, len);
+  buf[len] = '\0';
+  return status;
+}
+
+static void test_http(void) {
+  char buf[4096];
+  mc_store *st = mc_store_new(0);
+  mc_store_put(st, "hd.m3u8", "#EXTM3U\n", 8);
+  mc_store_put(st, "hd/0001.ts", "segment", 7);
+
+  mc_http *h = mc_http_new(st, "127.0.0.1", 0);
+  int port = mc_http_port(h);
+  ok(port > 0, "listening on %d", port);
+
+  int fd = connect_to(port);
+  ok(request(fd, "GET /hd.m3u8 HTTP/1.1\r\nHost: x\r\n\r\n", buf, sizeof(buf)) == 200,
+     "playlist found");
+  ok(!strcmp(buf, "#EXTM3U\n"), "playlist body");
+  ok(request(fd, "GET /hd/0001.ts?x=1 HTTP/1.1\r\nHost: x\r\n\r\n", buf, sizeof(buf)) == 200,
+     "segment found on same connection");
+  ok(!strcmp(buf, "segment"), "segment body");
+  ok(request(fd, "HEAD /hd/0001.ts HTTP/1.1\r\n\r\n", buf, sizeof(buf)) == 200,
+     "HEAD");
+  ok(request(fd, "GET /nope.ts HTTP/1.1\r\n\r\n", buf, sizeof(buf)) == 404,
+     "missing object");
+  ok(request(fd, "POST /hd.m3u8 HTTP/1.1\r\n\r\n", buf, sizeof(buf)) == 405,
+     "bad method");
+  ok(request(fd, "GET /hd.m3u8 HTTP/1.1\r\nConnection: close\r\n\r\n", buf, sizeof(buf)) == 200,
+     "close requested");
+  ok(recv(fd, buf, sizeof(buf), 0) == 0, "server closed connection");
+  close(fd);
+
+  /* an idle connection doesn't hold up shutdown */
+  fd = connect_to(port);
+  mc_http_stats hs;
+  mc_http_stats_get(h, &hs);
+  ok(hs.requests == 6 && hs.not_found == 1, "stats counted");
+
+  mc_http_free(h);
+  close(fd);
+  mc_store_free(st);
+}
+
+static void *publisher(void *ctx) {
+  mc_store *st = ctx;
+  usleep(20000);
+  mc_store_adopt_version(st, "ll.m3u8", mc_strdup("v1"), 2, MC_HTTP_VERSION(10, 1));
+  usleep(20000);
+  mc_store_adopt_version(st, "ll.m3u8", mc_strdup("v2"), 2, MC_HTTP_VERSION(11, 0));
+  return NULL;
+}
+
+/* LL-HLS blocking playlist reload */
+static void test_blocking(void) {
+  char buf[4096];
+  pthread_t t;
+  mc_store *st = mc_store_new(0);
+  mc_store_adopt_version(st, "ll.m3u8", mc_strdup("v0"), 2, MC_HTTP_VERSION(10, 0));
+
+  mc_http *h = mc_http_new(st, "127.0.0.1", 0);
+  mc_http_set_block_timeout(h, 100);
+  int fd = connect_to(mc_http_port(h));
+
+  ok(request(fd, "GET /ll.m3u8?_HLS_msn=9 HTTP/1.1\r\n\r\n", buf, sizeof(buf)) == 200 &&
+     !strcmp(buf, "v0"), "segment already there");
+  ok(request(fd, "GET /ll.m3u8?_HLS_msn=20 HTTP/1.1\r\n\r\n", buf, sizeof(buf)) == 400,
+     "too far ahead");
+  ok(request(fd, "GET /ll.m3u8?_HLS_part=1 HTTP/1.1\r\n\r\n", buf, sizeof(buf)) == 400,
+     "part without msn");
+  ok(request(fd, "GET /ll.m3u8?_HLS_msn=10&_HLS_part=0 HTTP/1.1\r\n\r\n", buf, sizeof(buf)) == 503,
+     "timed out");
+
+  mc_http_set_block_timeout(h, 5000);
+  pthread_create(&t, NULL, publisher, st);
+  ok(request(fd, "GET /ll.m3u8?_HLS_msn=10&_HLS_part=0 HTTP/1.1\r\n\r\n", buf, sizeof(buf)) == 200 &&
+     !strcmp(buf, "v1"), "held until part published");
+  ok(request(fd, "GET /ll.m3u8?_HLS_msn=10 HTTP/1.1\r\n\r\n", buf, sizeof(buf)) == 200 &&
+     !strcmp(buf, "v2"), "held until segment published");
+  pthread_join(t, NULL);
+
+  close(fd);
+  mc_http_free(h);
+  mc_store_free(st);
+}
+
+void test_main(void) {
+  scope {
+    test_http();
+    test_blocking();
+  }
+}
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
@@ -0,0 +1,144 @@
+/* publisher.t */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "framework.h"
+#include "tap.h"
+
+#include "jd_pretty.h"
+
+#include "mc_publisher.h"
+#include "mc_store.h"
+#include "mc_util.h"
+
+static int has(mc_store *st, const char *name, const char *want) {
+  mc_store_obj *obj = mc_store_get(st, name);
+  if (!obj) return want == NULL;
+  int match = want && obj->len == strlen(want) && !memcmp(obj->data, want, obj->len);
+  mc_store_release(st, obj);
+  return match;
+}
+
+static void submit(mc_publisher *pub, mc_writer *w, double time,
+                   const char *uri, const char *body) {
+  mc_publisher_submit(pub, w, time, body, strlen(body), "/nonexistent/pl.tmp",
+                      "/nonexistent/pl.m3u8", uri, (uint64_t) time << 16);
+  mc_writer_sync(w);
+  mc_publisher_sync(pub);
+}
+
+static void test_batch(void) {
+  mc_publisher_stats ps;
+  mc_writer_pool *wp = mc_writer_pool_new(2, 1024);
+  mc_store *st = mc_store_new(0);
+  mc_publisher *pub = mc_publisher_new(wp, st, 0, 2, 2);
+  mc_writer *wa = mc_writer_new(wp, st, 0);
+  mc_writer *wb = mc_writer_new(wp, st, 0);
+
+  mc_publisher_add(pub, "root", 4, "/nonexistent/root.tmp",
+                   "/nonexistent/root.m3u8", "root.m3u8");
+
+  submit(pub, wa, 8, "a.m3u8", "a8");
+  ok(has(st, "a.m3u8", NULL), "waiting for b");
+  ok(has(st, "root.m3u8", NULL), "root waiting for first batch");
+
+  submit(pub, wb, 8, "b.m3u8", "b8");
+  ok(has(st, "a.m3u8", "a8"), "a published");
+  ok(has(st, "b.m3u8", "b8"), "b published");
+  ok(has(st, "root.m3u8", "root"), "root published");
+
+  mc_store_obj *obj = mc_store_get(st, "b.m3u8");
+  ok(obj && obj->version == 8 << 16, "version passed on");
+  mc_store_release(st, obj);
+
+  /* b has twice as many segments */
+  submit(pub, wb, 12, "b.m3u8", "b12");
+  ok(has(st, "b.m3u8", "b8"), "b waits for a");
+  submit(pub, wb, 16, "b.m3u8", "b16");
+  submit(pub, wa, 16, "a.m3u8", "a16");
+  ok(has(st, "a.m3u8", "a16"), "a in step");
+  ok(has(st, "b.m3u8", "b16"), "b in step");
+
+  /* b falls behind */
+  submit(pub, wa, 24, "a.m3u8", "a24");
+  submit(pub, wa, 32, "a.m3u8", "a32");
+  submit(pub, wa, 40, "a.m3u8", "a40");
+  ok(has(st, "a.m3u8", "a16"), "two segments can wait");
+  submit(pub, wa, 48, "a.m3u8", "a48");
+  ok(has(st, "a.m3u8", "a24"), "oldest forced out");
+
+  /* and catches up */
+  submit(pub, wb, 40, "b.m3u8", "b40");
+  ok(has(st, "a.m3u8", "a40"), "a in step again");
+  ok(has(st, "b.m3u8", "b40"), "b in step again");
+
+  mc_publisher_leave(pub, wb);
+  mc_writer_sync(wb);
+  mc_publisher_sync(pub);
+  ok(has(st, "a.m3u8", "a48"), "no waiting for b once it's left");
+
+  mc_publisher_stats_get(pub, &ps);
+  ok(ps.batches == 5, "%llu batches", (unsigned long long) ps.batches);
+  ok(ps.partial == 1, "%llu partial", (unsigned long long) ps.partial);
+  ok(ps.files == 9, "%llu files", (unsigned long long) ps.files);
+
+  mc_writer_free(wa);
+  mc_writer_free(wb);
+  mc_publisher_free(pub);
+  mc_store_free(st);
+  mc_writer_pool_free(wp);
+}
+
+static char *path(const char *dir, const char *name) {
+  char *p = mc_alloc(strlen(dir) + strlen(name) + 2);
+  sprintf(p, "%s/%s", dir, name);
+  return p;
+}
+
+static void test_disk(void) {
+  char dir[] = "/tmp/mc-publisher-XXXXXX";
+  if (!mkdtemp(dir)) die("Can't make temp dir");
+
+  char *names[] = {
+    path(dir, "a.tmp"), path(dir, "a.m3u8"),
+    path(dir, "sub/b.tmp"), path(dir, "sub/b.m3u8")
+  };
+
+  mc_writer_pool *wp = mc_writer_pool_new(1, 1024);
+  mc_publisher *pub = mc_publisher_new(wp, NULL, MC_WRITER_DISK | MC_WRITER_FSYNC,
+                                       2, 2);
+  mc_writer *w = mc_writer_new(wp, NULL, MC_WRITER_DISK);
+
+  mc_publisher_submit(pub, w, 1, "a", 1, names[0], names[1], NULL, 0);
+  mc_publisher_submit(pub, w, 1, "b", 1, names[2], names[3], NULL, 0);
+  mc_writer_free(w);
+  mc_publisher_free(pub);
+  mc_writer_pool_free(wp);
+
+  ok(access(names[1], F_OK) == 0, "a written");
+  ok(access(names[3], F_OK) == 0, "b written");
+  ok(access(names[0], F_OK) != 0 && access(names[2], F_OK) != 0,
+     "temp files renamed");
+
+  for (unsigned i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    unlink(names[i]);
+    free(names[i]);
+  }
+  char *sub = path(dir, "sub");
+  rmdir(sub);
+  free(sub);
+  rmdir(dir);
+}
+
+void test_main(void) {
+  scope {
+    test_batch();
+    test_disk();
+  }
+}
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
@@ -0,0 +1,126 @@
+/* purger.t */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "framework.h"
+#include "tap.h"
+
+#include "jd_pretty.h"
+
+#include "mc_purger.h"
+#include "mc_util.h"
+#include "mc_writer.h"
+
+static char *path(const char *dir, const char *name) {
+  char *p = mc_alloc(strlen(dir) + strlen(name) + 2);
+  sprintf(p, "%s/%s", dir, name);
+  return p;
+}
+
+static char *touch(const char *dir, const char *name) {
+  char *p = path(dir, name);
+  FILE *fh = fopen(p, "w");
+  if (!fh) die("Can't write %s", p);
+  fclose(fh);
+  return p;
+}
+
+static char *subdir(const char *dir, const char *name) {
+  char *p = path(dir, name);
+  if (mkdir(p, 0777)) die("Can't make %s", p);
+  return p;
+}
+
+static int exists(const char *name) {
+  return access(name, F_OK) == 0;
+}
+
+static void test_purge(void) {
+  char dir[] = "/tmp/mc-purger-XXXXXX";
+  if (!mkdtemp(dir)) die("Can't make temp dir");
+
+  char *d0 = subdir(dir, "00000000");
+  char *d1 = subdir(dir, "00000001");
+  char *f[] = {
+    touch(d0, "0000.ts"), touch(d0, "0001.ts"),
+    touch(d1, "0002.ts"), touch(d1, "0003.ts")
+  };
+
+  mc_purger_stats ps;
+  mc_purger *p = mc_purger_new(2);
+
+  /* more than fit in the queue at once */
+  mc_purger_add(p, f[0], 1);
+  mc_purger_add(p, f[2], 1);
+  mc_purger_add(p, f[1], 1);
+  mc_purger_sync(p);
+
+  ok(!exists(f[0]) && !exists(f[1]) && !exists(f[2]), "files purged");
+  ok(exists(f[3]), "others left alone");
+  ok(!exists(d0), "emptied directory removed");
+  ok(exists(d1), "directory in use kept");
+
+  mc_purger_add(p, f[3], 0);
+  mc_purger_add(p, f[3], 0);
+  mc_purger_sync(p);
+  ok(exists(d1), "directory kept without rmdir");
+
+  mc_purger_stats_get(p, &ps);
+  ok(ps.queued == 5, "%llu queued", (unsigned long long) ps.queued);
+  ok(ps.purged == 4, "%llu purged", (unsigned long long) ps.purged);
+  ok(ps.errors == 1, "%llu errors", (unsigned long long) ps.errors);
+  ok(ps.dirs == 1, "%llu dirs", (unsigned long long) ps.dirs);
+  ok(ps.max_lag_ns > 0 && ps.lag_ns >= ps.max_lag_ns, "lag recorded");
+
+  mc_purger_free(p);
+
+  for (unsigned i = 0; i < sizeof(f) / sizeof(f[0]); i++) free(f[i]);
+  rmdir(d1);
+  free(d0);
+  free(d1);
+  rmdir(dir);
+}
+
+static void test_writer(void) {
+  char dir[] = "/tmp/mc-purger-XXXXXX";
+  if (!mkdtemp(dir)) die("Can't make temp dir");
+
+  char *d0 = subdir(dir, "00000000");
+  char *seg = touch(d0, "0000.ts");
+  char *old = touch(dir, "old.ts");
+
+  mc_purger *p = mc_purger_new(16);
+  mc_writer_pool *wp = mc_writer_pool_new(1, 1024);
+  mc_writer_pool_set_purger(wp, p);
+  mc_writer *w = mc_writer_new(wp, NULL, MC_WRITER_DISK);
+
+  mc_writer_retire(w, seg, NULL, 1);
+  mc_writer_unlink(w, old, NULL);
+  mc_writer_free(w);
+  mc_writer_pool_free(wp);
+  mc_purger_free(p);
+
+  ok(!exists(seg), "segment retired");
+  ok(!exists(d0), "its directory removed");
+  ok(!exists(old), "unlink goes via purger");
+  ok(exists(dir), "parent kept");
+
+  free(seg);
+  free(old);
+  free(d0);
+  rmdir(dir);
+}
+
+void test_main(void) {
+  scope {
+    test_purge();
+    test_writer();
+  }
+}
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
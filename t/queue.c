@@ -1,6 +1,9 @@
 /* queue.c */
 
 #include <pthread.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
 #include <libavformat/avformat.h>
 
 #include "framework.h"
@@ -55,8 +58,14 @@ static void test_multi(void) {
   mc_queue *q1 = mc_queue_new(10);
   mc_queue *q2 = mc_queue_new(10);
 
+  av_init_packet(&pkt);
+  pkt.data = NULL;
+  pkt.size = 0;
+
+  ok(!mc_queue_hooked(head), "nothing hooked");
   mc_queue_hook(head, q1);
   mc_queue_hook(head, q2);
+  ok(mc_queue_hooked(head), "queues hooked");
 
   for (unsigned i = 0; i < 5; i++)
     mc_queue_packet_put(head, &pkt);
@@ -71,10 +80,463 @@ static void test_multi(void) {
   mc_queue_free(q2);
 }
 
+static void test_shared(void) {
+  AVPacket pkt, got;
+  mc_queue *head = mc_queue_new(0);
+  mc_queue *q[3];
+
+  for (unsigned i = 0; i < sizeof(q) / sizeof(q[0]); i++)
+    mc_queue_hook(head, q[i] = mc_queue_new(10));
+
+  if (av_new_packet(&pkt, 1024)) die("Can't allocate packet");
+  memset(pkt.data, 0x5a, pkt.size);
+
+  mc_queue_packet_put(head, &pkt);
+
+  if (!ok(av_buffer_get_ref_count(pkt.buf) == 4, "one reference per queue"))
+    diag("refs = %d", av_buffer_get_ref_count(pkt.buf));
+
+  for (unsigned i = 0; i < sizeof(q) / sizeof(q[0]); i++) {
+    mc_queue_packet_get(q[i], &got);
+    ok(got.data == pkt.data, "q%u shares payload", i);
+    ok(got.size == pkt.size, "q%u size matches", i);
+    av_free_packet(&got);
+  }
+
+  if (!ok(av_buffer_get_ref_count(pkt.buf) == 1, "queue references released"))
+    diag("refs = %d", av_buffer_get_ref_count(pkt.buf));
+
+  av_free_packet(&pkt);
+
+  mc_queue_free(head);
+  for (unsigned i = 0; i < sizeof(q) / sizeof(q[0]); i++)
+    mc_queue_free(q[i]);
+}
+
+static void test_spsc(void) {
+  AVPacket pkt;
+  mc_queue *head = mc_queue_new(0);
+  mc_queue *q1 = mc_queue_new_spsc(10);
+  mc_queue *q2 = mc_queue_new_spsc(10);
+
+  av_init_packet(&pkt);
+  pkt.data = NULL;
+  pkt.size = 0;
+
+  mc_queue_hook(head, q1);
+  mc_queue_hook(head, q2);
+
+  for (unsigned t = 0; t < 5; t++) {
+    for (unsigned i = 0; i < 7; i++)
+      mc_queue_packet_put(head, &pkt);
+
+    ok(drain(q1) == 7, "try %d: 7 in q1", t);
+    ok(drain(q2) == 7, "try %d: 7 in q2", t);
+  }
+
+  mc_queue_free(head);
+  mc_queue_free(q1);
+  mc_queue_free(q2);
+}
+
+static int dts_compare(mc_queue_entry *a, mc_queue_entry *b, void *ctx) {
+  (void) ctx;
+  return a->d.pkt.dts < b->d.pkt.dts ? -1 : a->d.pkt.dts > b->d.pkt.dts ? 1 : 0;
+}
+
+static void put_dts(mc_queue *q, int64_t dts) {
+  AVPacket pkt;
+  av_init_packet(&pkt);
+  pkt.data = NULL;
+  pkt.size = 0;
+  pkt.dts = dts;
+  mc_queue_only_packet_put(q, &pkt);
+}
+
+static void test_merger(mc_queue * (*qnew)(size_t), const char *name) {
+  AVPacket pkt;
+  mc_queue *q1 = qnew(20);
+  mc_queue *q2 = qnew(20);
+  mc_queue_merger *qm = mc_queue_merger_new(dts_compare, NULL);
+
+  mc_queue_merger_add(qm, q1);
+  mc_queue_merger_add(qm, q2);
+
+  for (unsigned i = 0; i < 10; i++)
+    put_dts(i & 1 ? q1 : q2, i);
+  mc_queue_only_packet_put(q1, NULL);
+  mc_queue_only_packet_put(q2, NULL);
+
+  int64_t want = 0;
+  unsigned order = 1;
+  while (mc_queue_merger_packet_get(qm, &pkt))
+    if (pkt.dts != want++) order = 0;
+
+  ok(order, "%s: merged in dts order", name);
+  if (!ok(want == 10, "%s: got all packets", name))
+    diag("got %d packets", (int) want);
+  ok(!mc_queue_merger_packet_get(qm, &pkt), "%s: still at eof", name);
+
+  mc_queue_merger_free(qm);
+  mc_queue_free(q1);
+  mc_queue_free(q2);
+}
+
+static void test_stats(mc_queue * (*qnew)(size_t), const char *name) {
+  AVPacket pkt;
+  mc_queue_stats st;
+  mc_queue_merger_stats ms;
+  mc_queue *q1 = qnew(20);
+  mc_queue *q2 = qnew(20);
+  mc_queue_merger *qm = mc_queue_merger_new(dts_compare, NULL);
+
+  mc_queue_merger_add(qm, q1);
+  mc_queue_merger_add(qm, q2);
+
+  for (unsigned i = 0; i < 6; i++) {
+    av_new_packet(&pkt, 10);
+    pkt.dts = i;
+    mc_queue_only_packet_put(i < 4 ? q1 : q2, &pkt);
+    av_free_packet(&pkt);
+  }
+  mc_queue_only_packet_put(q1, NULL);
+  mc_queue_only_packet_put(q2, NULL);
+
+  mc_queue_stats_get(q1, &st);
+  ok(st.puts == 5, "%s: counted puts (including eof)", name);
+  ok(st.bytes == 40, "%s: counted bytes", name);
+  ok(st.used == 5 && st.max_used == 5, "%s: tracked depth", name);
+
+  while (mc_queue_merger_packet_get(qm, &pkt))
+    av_free_packet(&pkt);
+
+  mc_queue_stats_get(q1, &st);
+  ok(st.gets == 5 && st.used == 0, "%s: counted gets", name);
+  ok(st.selected == 4, "%s: counted selections", name);
+  mc_queue_merger_stats_get(qm, &ms);
+  if (!ok(ms.gets == 6 && ms.eofs == 1, "%s: merger stats", name))
+    diag("gets = %llu, eofs = %llu",
+         (unsigned long long) ms.gets, (unsigned long long) ms.eofs);
+
+  mc_queue_merger_free(qm);
+  mc_queue_free(q1);
+  mc_queue_free(q2);
+}
+
+static void *budget_producer(void *ctx) {
+  mc_queue *q = ctx;
+  AVPacket pkt;
+  for (unsigned i = 0; i < 30; i++) {
+    av_new_packet(&pkt, 10);
+    pkt.dts = i * 10;
+    mc_queue_only_packet_put(q, &pkt);
+    av_free_packet(&pkt);
+  }
+  mc_queue_only_packet_put(q, NULL);
+  return NULL;
+}
+
+/* How many entries does the producer manage to queue before
+ * stalling? Lets it queue up to want (or everything) before draining
+ * and reports the deepest the queue got.
+ */
+static unsigned budget_depth(mc_queue *q, unsigned want) {
+  AVPacket pkt;
+  mc_queue_stats st;
+  pthread_t t;
+  unsigned count = 0;
+
+  pthread_create(&t, NULL, budget_producer, q);
+  for (unsigned tries = 0; tries < 10000; tries++) {
+    mc_queue_stats_get(q, &st);
+    if (st.used >= want || st.puts == 31) break;
+    usleep(1000);
+  }
+  while (mc_queue_packet_get(q, &pkt)) {
+    av_free_packet(&pkt);
+    count++;
+  }
+  pthread_join(t, NULL);
+  mc_queue_stats_get(q, &st);
+  mc_queue_free(q);
+
+  if (count != 30) diag("got %u packets", count);
+  return (unsigned) st.max_used;
+}
+
+static void test_budget(mc_queue * (*qnew)(size_t), const char *name) {
+  AVPacket pkt;
+  mc_queue_stats st;
+  unsigned depth;
+  mc_queue *q;
+
+  q = qnew(20);
+  if (!ok((depth = budget_depth(q, 20)) == 20, "%s: count limited", name))
+    diag("depth = %u", depth);
+
+  q = qnew(20);
+  mc_queue_set_budget(q, 100, 0);
+  if (!ok((depth = budget_depth(q, 10)) == 10, "%s: bytes limited", name))
+    diag("depth = %u", depth);
+
+  q = qnew(20);
+  mc_queue_set_budget(q, 0, 50);
+  if (!ok((depth = budget_depth(q, 6)) == 6, "%s: duration limited", name))
+    diag("depth = %u", depth);
+
+  /* a packet bigger than the budget still gets through */
+  q = qnew(20);
+  mc_queue_set_budget(q, 5, 0);
+  av_new_packet(&pkt, 10);
+  mc_queue_only_packet_put(q, &pkt);
+  av_free_packet(&pkt);
+  mc_queue_stats_get(q, &st);
+  ok(st.used == 1 && st.queued == 10, "%s: oversized packet queued", name);
+  ok(mc_queue_packet_get(q, &pkt), "%s: oversized packet read", name);
+  av_free_packet(&pkt);
+  mc_queue_stats_get(q, &st);
+  ok(st.queued == 0, "%s: bytes released", name);
+  mc_queue_free(q);
+}
+
+static void put_key(mc_queue *q, int64_t dts) {
+  AVPacket pkt;
+  av_init_packet(&pkt);
+  pkt.data = NULL;
+  pkt.size = 0;
+  pkt.dts = dts;
+  if (dts % 3 == 0) pkt.flags |= AV_PKT_FLAG_KEY;
+  mc_queue_only_packet_put(q, &pkt);
+}
+
+static int64_t get_dts(mc_queue *q) {
+  AVPacket pkt;
+  if (!mc_queue_packet_get(q, &pkt)) return -1;
+  return pkt.dts;
+}
+
+static void test_policy(mc_queue * (*qnew)(size_t), const char *name) {
+  mc_queue_stats st;
+  mc_queue *q;
+
+  /* keyframes at 0, 3, 6, 9; the queue is full after 0..3 */
+  q = qnew(4);
+  mc_queue_set_policy(q, MC_QUEUE_DROP);
+  for (int64_t i = 0; i < 7; i++) put_key(q, i);
+  get_dts(q);
+  get_dts(q);
+  for (int64_t i = 7; i < 10; i++) put_key(q, i);
+  mc_queue_stats_get(q, &st);
+  ok(st.dropped == 5 && st.gops == 2,
+     "%s drop: dropped %d packets, %d gops", name, (int) st.dropped, (int) st.gops);
+  ok(get_dts(q) == 2 && get_dts(q) == 3 && get_dts(q) == 9,
+     "%s drop: resumed at keyframe", name);
+  mc_queue_free(q);
+
+  q = qnew(4);
+  mc_queue_set_policy(q, MC_QUEUE_RESYNC);
+  for (int64_t i = 0; i < 7; i++) put_key(q, i);
+  get_dts(q);
+  get_dts(q);
+  for (int64_t i = 7; i < 10; i++) put_key(q, i);
+  get_dts(q);
+  get_dts(q);
+  for (int64_t i = 10; i < 13; i++) put_key(q, i);
+  mc_queue_stats_get(q, &st);
+  ok(st.dropped == 8 && st.gops == 3,
+     "%s resync: dropped %d packets, %d gops", name, (int) st.dropped, (int) st.gops);
+  ok(get_dts(q) == 12, "%s resync: resumed once drained", name);
+  mc_queue_free(q);
+}
+
+typedef struct {
+  mc_queue *q1, *q2;
+} full_ctx;
+
+static void *full_producer(void *ctx) {
+  full_ctx *fc = ctx;
+  /* q2 stays empty so the merger can only make progress when q1 is full */
+  for (unsigned i = 0; i < 100; i++)
+    put_dts(fc->q1, i);
+  mc_queue_only_packet_put(fc->q1, NULL);
+  mc_queue_only_packet_put(fc->q2, NULL);
+  return NULL;
+}
+
+static void test_merger_full(mc_queue * (*qnew)(size_t), const char *name) {
+  AVPacket pkt;
+  pthread_t t;
+  full_ctx fc;
+  unsigned count = 0;
+
+  fc.q1 = qnew(4);
+  fc.q2 = qnew(4);
+  mc_queue_merger *qm = mc_queue_merger_new(dts_compare, NULL);
+  mc_queue_merger_add(qm, fc.q1);
+  mc_queue_merger_add(qm, fc.q2);
+
+  pthread_create(&t, NULL, full_producer, &fc);
+  while (mc_queue_merger_packet_get(qm, &pkt)) count++;
+  pthread_join(t, NULL);
+
+  if (!ok(count == 100, "%s: full queue drained", name))
+    diag("count = %u", count);
+
+  mc_queue_merger_free(qm);
+  mc_queue_free(fc.q1);
+  mc_queue_free(fc.q2);
+}
+
+static void count_notify(void *ctx) {
+  (*(unsigned *) ctx)++;
+}
+
+static void test_merger_poll(mc_queue * (*qnew)(size_t), const char *name) {
+  AVPacket pkt;
+  unsigned notified = 0;
+  mc_queue *q1 = qnew(20);
+  mc_queue *q2 = qnew(20);
+  mc_queue_merger *qm = mc_queue_merger_new(dts_compare, NULL);
+
+  mc_queue_merger_add(qm, q1);
+  mc_queue_merger_add(qm, q2);
+  mc_queue_merger_set_notify(qm, count_notify, &notified);
+
+  ok(mc_queue_merger_packet_poll(qm, &pkt) < 0, "%s: nothing to poll", name);
+
+  put_dts(q1, 0);
+  ok(notified == 1, "%s: notified when q1 ready", name);
+  ok(mc_queue_merger_packet_poll(qm, &pkt) < 0, "%s: waits for q2", name);
+
+  put_dts(q2, 1);
+  put_dts(q2, 2);
+  ok(notified == 2, "%s: notified when q2 ready", name);
+  ok(mc_queue_merger_packet_poll(qm, &pkt) == 1 && pkt.dts == 0,
+     "%s: polled first packet", name);
+  ok(mc_queue_merger_packet_poll(qm, &pkt) < 0, "%s: waits for q1 again", name);
+
+  mc_queue_only_packet_put(q1, NULL);
+  mc_queue_only_packet_put(q2, NULL);
+  int64_t want = 1;
+  int rc;
+  while ((rc = mc_queue_merger_packet_poll(qm, &pkt)) > 0)
+    if (pkt.dts == want) want++;
+  ok(rc == 0 && want == 3, "%s: polled to eof", name);
+
+  mc_queue_merger_free(qm);
+  mc_queue_free(q1);
+  mc_queue_free(q2);
+}
+
+/* an empty sparse queue doesn't hold the others up */
+static void test_merger_sparse(mc_queue * (*qnew)(size_t), const char *name) {
+  AVPacket pkt;
+  mc_queue *av = qnew(20);
+  mc_queue *subs = qnew(20);
+  mc_queue_merger *qm = mc_queue_merger_new(dts_compare, NULL);
+
+  mc_queue_merger_add(qm, av);
+  mc_queue_merger_add_sparse(qm, subs);
+
+  put_dts(av, 0);
+  put_dts(av, 2);
+  ok(mc_queue_merger_packet_poll(qm, &pkt) == 1 && pkt.dts == 0,
+     "%s: merged without subtitles", name);
+
+  put_dts(subs, 1);
+  ok(mc_queue_merger_packet_poll(qm, &pkt) == 1 && pkt.dts == 1,
+     "%s: subtitle in order", name);
+  ok(mc_queue_merger_packet_poll(qm, &pkt) == 1 && pkt.dts == 2,
+     "%s: then the rest", name);
+  ok(mc_queue_merger_packet_poll(qm, &pkt) < 0, "%s: waits for av", name);
+
+  mc_queue_only_packet_put(subs, NULL);
+  put_dts(av, 3);
+  ok(mc_queue_merger_packet_poll(qm, &pkt) == 1 && pkt.dts == 3,
+     "%s: subtitles ended", name);
+  ok(mc_queue_merger_packet_poll(qm, &pkt) < 0, "%s: still waits for av", name);
+
+  mc_queue_only_packet_put(av, NULL);
+  ok(mc_queue_merger_packet_poll(qm, &pkt) == 0, "%s: eof", name);
+
+  mc_queue_merger_free(qm);
+  mc_queue_free(av);
+  mc_queue_free(subs);
+}
+
+#define BENCH_PACKETS 200000
+
+static void *bench_producer(void *ctx) {
+  mc_queue *q = ctx;
+  AVPacket pkt;
+
+  av_init_packet(&pkt);
+  pkt.data = NULL;
+  pkt.size = 0;
+
+  for (unsigned i = 0; i < BENCH_PACKETS; i++) {
+    pkt.dts = i;
+    mc_queue_only_packet_put(q, &pkt);
+  }
+
+  mc_queue_only_packet_put(q, NULL);
+  return NULL;
+}
+
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void bench(const char *name, mc_queue *q) {
+  AVPacket pkt;
+  pthread_t t;
+  unsigned count = 0, order = 1;
+  double start = now();
+
+  pthread_create(&t, NULL, bench_producer, q);
+  while (mc_queue_packet_get(q, &pkt)) {
+    if (pkt.dts != count) order = 0;
+    count++;
+  }
+  pthread_join(t, NULL);
+
+  double elapsed = now() - start;
+
+  ok(count == BENCH_PACKETS, "%s: got %u packets", name, count);
+  ok(order, "%s: packets in order", name);
+  diag("%s: %.0f packets/sec", name, count / elapsed);
+
+  mc_queue_free(q);
+}
+
+static void test_bench(void) {
+  bench("locked", mc_queue_new(200));
+  bench("spsc", mc_queue_new_spsc(200));
+}
+
 void test_main(void) {
   scope {
     test_non_full();
     test_multi();
+    test_shared();
+    test_spsc();
+    test_merger(mc_queue_new, "locked");
+    test_merger(mc_queue_new_spsc, "spsc");
+    test_merger_full(mc_queue_new, "locked");
+    test_merger_full(mc_queue_new_spsc, "spsc");
+    test_merger_poll(mc_queue_new, "locked");
+    test_merger_poll(mc_queue_new_spsc, "spsc");
+    test_merger_sparse(mc_queue_new, "locked");
+    test_merger_sparse(mc_queue_new_spsc, "spsc");
+    test_stats(mc_queue_new, "locked");
+    test_stats(mc_queue_new_spsc, "spsc");
+    test_budget(mc_queue_new, "locked");
+    test_budget(mc_queue_new_spsc, "spsc");
+    test_policy(mc_queue_new, "locked");
+    test_policy(mc_queue_new_spsc, "spsc");
+    test_bench();
   }
 }
 
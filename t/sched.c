@@ -0,0 +1,228 @@
+/* sched.t */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "framework.h"
+#include "tap.h"
+
+#include "jd_pretty.h"
+
+#include "mc_sched.h"
+#include "mc_util.h"
+
+typedef struct {
+  mc_sched_task *task;
+  unsigned posted;        /* items made available by the producer */
+  unsigned taken;         /* items consumed by the task */
+  unsigned total;         /* done after this many */
+  unsigned budget;        /* items per step */
+  unsigned overlap;       /* ran on two workers at once */
+  int busy;
+  int cpu;                /* last CPU the task ran on */
+} counter;
+
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static mc_sched_result count_step(void *ctx) {
+  counter *c = ctx;
+
+  if (__sync_lock_test_and_set(&c->busy, 1)) c->overlap++;
+#ifdef CPU_SET
+  c->cpu = sched_getcpu();
+#endif
+
+  mc_sched_result rc = MC_SCHED_WAIT;
+  for (unsigned n = 0; !c->budget || n < c->budget; n++) {
+    if (c->taken == c->total) {
+      rc = MC_SCHED_DONE;
+      break;
+    }
+    if (c->taken == __atomic_load_n(&c->posted, __ATOMIC_ACQUIRE)) {
+      rc = MC_SCHED_WAIT;
+      break;
+    }
+    c->taken++;
+    rc = MC_SCHED_YIELD;
+  }
+
+  __sync_lock_release(&c->busy);
+  return rc;
+}
+
+static void post(counter *c) {
+  __atomic_add_fetch(&c->posted, 1, __ATOMIC_RELEASE);
+  mc_sched_wake(c->task);
+}
+
+static counter *new_counter(mc_sched *s, unsigned total, unsigned budget) {
+  counter *c = mc_alloc(sizeof(*c));
+  c->total = total;
+  c->budget = budget;
+  c->cpu = -1;
+  c->task = mc_sched_add(s, "counter", count_step, c);
+  return c;
+}
+
+static void free_counter(counter *c) {
+  mc_sched_task_free(c->task);
+  free(c);
+}
+
+static void test_basic(void) {
+  mc_sched_task_stats ts;
+  mc_sched *s = mc_sched_new(2, NULL, 0);
+  counter *c = new_counter(s, 3, 0);
+
+  mc_sched_wake(c->task);
+  post(c);
+  post(c);
+  post(c);
+  mc_sched_wake(c->task);
+  mc_sched_join(c->task);
+
+  ok(c->taken == 3, "task saw everything posted");
+  ok(!c->overlap, "task never ran twice at once");
+
+  mc_sched_task_stats_get(c->task, &ts);
+  ok(ts.wakes == 5, "%llu wakes", (unsigned long long) ts.wakes);
+  ok(ts.runs >= 1 && ts.runs <= 5, "%llu runs", (unsigned long long) ts.runs);
+  ok(ts.max_run_ns <= ts.run_ns, "run time recorded");
+
+  /* a finished task ignores wakes */
+  mc_sched_wake(c->task);
+  mc_sched_task_stats_get(c->task, &ts);
+  ok(ts.runs <= 5, "no run after done");
+
+  free_counter(c);
+  mc_sched_free(s);
+}
+
+typedef struct {
+  counter **c;
+  unsigned nc, per;
+} producer_ctx;
+
+static void *producer(void *ctx) {
+  producer_ctx *pc = ctx;
+  for (unsigned i = 0; i < pc->per; i++)
+    for (unsigned j = 0; j < pc->nc; j++)
+      post(pc->c[j]);
+  return NULL;
+}
+
+static void run_many(unsigned workers, unsigned ntasks, unsigned per,
+                     unsigned budget, int verbose) {
+  mc_sched_stats ss;
+  mc_sched *s = mc_sched_new(workers, NULL, 0);
+  counter **c = mc_alloc(sizeof(counter *) * ntasks);
+  producer_ctx pc[2];
+  pthread_t t[2];
+
+  for (unsigned i = 0; i < ntasks; i++) {
+    c[i] = new_counter(s, per, budget);
+    mc_sched_wake(c[i]->task);
+  }
+
+  /* two producers, each feeding half of the tasks */
+  double start = now();
+  for (unsigned p = 0; p < 2; p++) {
+    pc[p].c = c + p * (ntasks / 2);
+    pc[p].nc = p ? ntasks - ntasks / 2 : ntasks / 2;
+    pc[p].per = per;
+    pthread_create(&t[p], NULL, producer, &pc[p]);
+  }
+  for (unsigned p = 0; p < 2; p++)
+    pthread_join(t[p], NULL);
+  for (unsigned i = 0; i < ntasks; i++)
+    mc_sched_join(c[i]->task);
+  double elapsed = now() - start;
+
+  unsigned taken = 0, overlap = 0;
+  for (unsigned i = 0; i < ntasks; i++) {
+    taken += c[i]->taken;
+    overlap += c[i]->overlap;
+    free_counter(c[i]);
+  }
+  free(c);
+
+  mc_sched_stats_get(s, &ss);
+  mc_sched_free(s);
+
+  ok(taken == ntasks * per, "%u workers, %u tasks: all %u items taken",
+     workers, ntasks, taken);
+  ok(!overlap, "%u workers, %u tasks: no task ran twice at once",
+     workers, ntasks);
+  if (verbose)
+    diag("%u workers, %u tasks: %.0f items/sec, %llu runs, %llu steals, %llu parks",
+         workers, ntasks, taken / elapsed, (unsigned long long) ss.runs,
+         (unsigned long long) ss.steals, (unsigned long long) ss.parks);
+}
+
+static void test_many(void) {
+  run_many(1, 10, 1000, 0, 0);
+  run_many(4, 10, 1000, 7, 0);
+  run_many(4, 200, 500, 16, 1);
+}
+
+/* With one worker a task that yields lets the others run */
+static void test_yield(void) {
+  mc_sched *s = mc_sched_new(1, NULL, 0);
+  counter *a = new_counter(s, 100, 1);
+  counter *b = new_counter(s, 100, 1);
+
+  a->posted = b->posted = 100;
+  mc_sched_wake(a->task);
+  mc_sched_wake(b->task);
+  mc_sched_join(a->task);
+  mc_sched_join(b->task);
+
+  mc_sched_task_stats ts;
+  mc_sched_task_stats_get(a->task, &ts);
+  ok(a->taken == 100 && b->taken == 100, "both tasks finished");
+  ok(ts.runs == 101, "one item per run (%llu runs)",
+     (unsigned long long) ts.runs);
+
+  free_counter(a);
+  free_counter(b);
+  mc_sched_free(s);
+}
+
+static void test_affinity(void) {
+#ifdef CPU_SET
+  int cpus[] = { 0 };
+  mc_sched *s = mc_sched_new(2, cpus, 1);
+  counter *c = new_counter(s, 1, 0);
+
+  mc_sched_wake(c->task);
+  post(c);
+  mc_sched_join(c->task);
+  ok(c->cpu == 0, "pinned worker ran on CPU 0 (%d)", c->cpu);
+
+  free_counter(c);
+  mc_sched_free(s);
+#else
+  skip("no CPU affinity");
+#endif
+}
+
+void test_main(void) {
+  scope {
+    test_basic();
+    test_many();
+    test_yield();
+    test_affinity();
+  }
+}
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
@@ -2,12 +2,14 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <sys/time.h>
 #include <jd_pretty.h>
 
 #include "framework.h"
 #include "tap.h"
 
 #include "mc_segname.h"
+#include "mc_util.h"
 
 static int expect_next(mc_segname *s, const char *want) {
   char *got = mc_segname_format(s);
@@ -62,9 +64,66 @@ static void test_segname(void) {
   }
 }
 
+static void test_names(void) {
+  mc_segname *s = mc_segname_new_prefixed("hd/%4d/%2d.ts", "out");
+
+  ok(!strcmp(mc_segname_uri(s), "hd/0000/00.ts"), "uri");
+  ok(!strcmp(mc_segname_name(s), "out/hd/0000/00.ts"), "name");
+
+  char *t1 = mc_strdup(mc_segname_temp(s));
+  ok(!strcmp(mc_segname_temp(s), t1), "temp stable until inc");
+  ok(!strncmp(t1, "out/hd/0000/", 12) && strlen(t1) > 18 &&
+     !strcmp(t1 + strlen(t1) - 6, ".00.ts"), "temp next to name");
+
+  ok(!mc_segname_parse(s, "hd/00x0/99.ts"), "bad digits rejected");
+  ok(!strcmp(mc_segname_uri(s), "hd/0000/00.ts"), "unchanged by bad parse");
+
+  ok(mc_segname_parse(s, "hd/0012/99.ts"), "parsed");
+  mc_segname_inc(s);
+  ok(!strcmp(mc_segname_name(s), "out/hd/0013/00.ts"), "carried");
+
+  char *t2 = mc_segname_temp(s);
+  ok(strcmp(t1, t2) != 0, "new temp after inc");
+  ok(!strncmp(t2, "out/hd/0013/", 12) &&
+     !strcmp(t2 + strlen(t2) - 6, ".00.ts"), "temp follows name");
+
+  free(t1);
+  mc_segname_free(s);
+}
+
+#define BENCH_NAMES 1000000
+
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void test_bench(void) {
+  mc_segname *s = mc_segname_new_prefixed("hd/%8d/%4d.ts", "/var/www/live");
+  size_t sum = 0;
+  double start = now();
+
+  for (unsigned i = 0; i < BENCH_NAMES; i++) {
+    sum += strlen(mc_segname_name(s)) + strlen(mc_segname_temp(s));
+    mc_segname_inc(s);
+  }
+
+  double elapsed = now() - start;
+
+  ok(!strcmp(mc_segname_uri(s), "hd/00000100/0000.ts"), "counted to %s",
+     mc_segname_uri(s));
+  ok(sum > 0, "names made");
+  diag("%.0f names/sec", BENCH_NAMES / elapsed);
+
+  mc_segname_free(s);
+}
+
 void test_main(void) {
   scope {
     test_segname();
+    test_names();
+    test_bench();
   }
 }
 
@@ -0,0 +1,159 @@
+/* slab.t */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "framework.h"
+#include "tap.h"
+
+#include "jd_pretty.h"
+
+#include "mc_slab.h"
+
+static void test_basic(void) {
+  mc_slab_stats st;
+  mc_slab *s = mc_slab_new(100, 0);
+  void *obj[200];
+
+  for (unsigned i = 0; i < 200; i++) {
+    obj[i] = mc_slab_get(s);
+    memset(obj[i], i, 100);
+  }
+
+  unsigned aligned = 1;
+  for (unsigned i = 0; i < 200; i++)
+    if ((uintptr_t) obj[i] % MC_SLAB_ALIGN) aligned = 0;
+  ok(aligned, "objects are cache line aligned");
+
+  mc_slab_stats_get(s, &st);
+  ok(st.size == 128, "size rounded to %lu", (unsigned long) st.size);
+  ok(st.in_use == 200, "200 objects in use");
+  ok(st.objects >= 200, "capacity %lu", (unsigned long) st.objects);
+
+  unsigned intact = 1;
+  for (unsigned i = 0; i < 200; i++) {
+    unsigned char *p = obj[i];
+    for (unsigned j = 0; j < 100; j++)
+      if (p[j] != (unsigned char) i) intact = 0;
+  }
+  ok(intact, "objects don't overlap");
+
+  for (unsigned i = 0; i < 200; i++)
+    mc_slab_put(s, obj[i]);
+
+  uint64_t bytes = st.bytes;
+  mc_slab_stats_get(s, &st);
+  ok(st.in_use == 0, "all objects returned");
+  ok(st.max_in_use == 200, "peak use recorded");
+
+  for (unsigned i = 0; i < 200; i++)
+    obj[i] = mc_slab_get(s);
+  mc_slab_stats_get(s, &st);
+  ok(st.bytes == bytes, "objects recycled");
+
+  for (unsigned i = 0; i < 200; i++)
+    mc_slab_put(s, obj[i]);
+
+  mc_slab_free(s);
+}
+
+typedef struct {
+  mc_slab *s;
+  void *obj[2048];
+  unsigned got;
+} limit_ctx;
+
+static void fill(void *ctx) {
+  limit_ctx *lc = ctx;
+  while (lc->got < 2048) {
+    void *obj = mc_slab_get(lc->s);
+    lc->obj[lc->got++] = obj;
+  }
+}
+
+static void test_limit(void) {
+  limit_ctx *lc = malloc(sizeof(*lc));
+  mc_slab_stats st;
+
+  lc->s = mc_slab_new(64, 65536);
+  lc->got = 0;
+
+  fill(lc);
+  mc_slab_stats_get(lc->s, &st);
+  ok(lc->got == 2048, "got %u objects past the limit", lc->got);
+  ok(st.slabs == 1025 && st.over == 1024,
+     "one slab then single objects (%llu slabs, %llu over)",
+     (unsigned long long) st.slabs, (unsigned long long) st.over);
+
+  for (unsigned i = 0; i < lc->got; i++)
+    mc_slab_put(lc->s, lc->obj[i]);
+  lc->got = 0;
+  fill(lc);
+  mc_slab_stats_get(lc->s, &st);
+  ok(st.slabs == 1025, "objects past the limit are reused");
+
+  for (unsigned i = 0; i < lc->got; i++)
+    mc_slab_put(lc->s, lc->obj[i]);
+
+  mc_slab_free(lc->s);
+  free(lc);
+}
+
+#define XFER 100000
+
+typedef struct {
+  mc_slab *s;
+  void *slot[16];
+  unsigned rd, wr;
+} xfer_ctx;
+
+static void *xfer_producer(void *ctx) {
+  xfer_ctx *xc = ctx;
+  for (unsigned i = 0; i < XFER; i++) {
+    while (__atomic_load_n(&xc->wr, __ATOMIC_ACQUIRE) -
+           __atomic_load_n(&xc->rd, __ATOMIC_ACQUIRE) == 16)
+      ;
+    xc->slot[xc->wr & 15] = mc_slab_get(xc->s);
+    __atomic_store_n(&xc->wr, xc->wr + 1, __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
+
+/* objects allocated on one thread and freed on another */
+static void test_threads(void) {
+  xfer_ctx xc;
+  mc_slab_stats st;
+  pthread_t t;
+
+  memset(&xc, 0, sizeof(xc));
+  xc.s = mc_slab_new(200, 0);
+
+  pthread_create(&t, NULL, xfer_producer, &xc);
+  for (unsigned i = 0; i < XFER; i++) {
+    while (__atomic_load_n(&xc.wr, __ATOMIC_ACQUIRE) == xc.rd)
+      ;
+    mc_slab_put(xc.s, xc.slot[xc.rd & 15]);
+    __atomic_store_n(&xc.rd, xc.rd + 1, __ATOMIC_RELEASE);
+  }
+  pthread_join(t, NULL);
+
+  mc_slab_stats_get(xc.s, &st);
+  ok(st.in_use == 0, "cross thread: all returned");
+  if (!ok(st.slabs <= 2, "cross thread: memory bounded"))
+    diag("%lu slabs", (unsigned long) st.slabs);
+
+  mc_slab_free(xc.s);
+}
+
+void test_main(void) {
+  scope {
+    test_basic();
+    test_limit();
+    test_threads();
+  }
+}
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
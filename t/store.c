@@ -0,0 +1,145 @@
+/* store.t */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "framework.h"
+#include "tap.h"
+
+#include "jd_pretty.h"
+
+#include "mc_store.h"
+#include "mc_util.h"
+
+static int has(mc_store *st, const char *name, const char *want) {
+  mc_store_obj *obj = mc_store_get(st, name);
+  if (!obj) return want == NULL;
+  int match = want && obj->len == strlen(want) && !memcmp(obj->data, want, obj->len);
+  mc_store_release(st, obj);
+  return match;
+}
+
+static void test_basic(void) {
+  mc_store_stats ss;
+  mc_store *st = mc_store_new(0);
+
+  mc_store_put(st, "a.ts", "alpha", 5);
+  mc_store_put(st, "b.ts", "beta", 4);
+  ok(has(st, "a.ts", "alpha"), "got a.ts");
+  ok(has(st, "b.ts", "beta"), "got b.ts");
+  ok(has(st, "c.ts", NULL), "no c.ts");
+
+  mc_store_put(st, "a.ts", "aleph", 5);
+  ok(has(st, "a.ts", "aleph"), "a.ts replaced");
+
+  mc_store_remove(st, "b.ts");
+  ok(has(st, "b.ts", NULL), "b.ts removed");
+
+  mc_store_stats_get(st, &ss);
+  ok(ss.objects == 1 && ss.bytes == 5, "stats track contents");
+  ok(ss.hits == 3 && ss.misses == 2, "stats track lookups");
+
+  mc_store_free(st);
+}
+
+/* a reader's reference survives replacement */
+static void test_refs(void) {
+  mc_store *st = mc_store_new(0);
+
+  mc_store_put(st, "pl.m3u8", "one", 3);
+  mc_store_obj *obj = mc_store_get(st, "pl.m3u8");
+  mc_store_put(st, "pl.m3u8", "two", 3);
+  mc_store_remove(st, "pl.m3u8");
+
+  ok(obj->len == 3 && !memcmp(obj->data, "one", 3), "old version still readable");
+  mc_store_release(st, obj);
+
+  mc_store_free(st);
+}
+
+static void test_evict(void) {
+  mc_store_stats ss;
+  mc_store *st = mc_store_new(10);
+  char name[20];
+
+  for (unsigned i = 0; i < 5; i++) {
+    sprintf(name, "%u.ts", i);
+    mc_store_put(st, name, "xxxx", 4);
+  }
+
+  ok(has(st, "0.ts", NULL) && has(st, "2.ts", NULL), "oldest evicted");
+  ok(has(st, "3.ts", "xxxx") && has(st, "4.ts", "xxxx"), "newest kept");
+
+  mc_store_stats_get(st, &ss);
+  ok(ss.bytes <= 10 && ss.evicted == 3, "within budget");
+
+  /* a single object larger than the budget is still stored */
+  mc_store_put(st, "big.ts", "0123456789abcdef", 16);
+  ok(has(st, "big.ts", "0123456789abcdef"), "oversized object kept");
+
+  mc_store_free(st);
+
+  /* playlists outlive the segments around them */
+  st = mc_store_new(10);
+  mc_store_put(st, "root.m3u8", "root", 4);
+  for (unsigned i = 0; i < 5; i++) {
+    sprintf(name, "%u.ts", i);
+    mc_store_put(st, name, "xxxx", 4);
+  }
+  ok(has(st, "root.m3u8", "root"), "playlist not evicted");
+  ok(has(st, "3.ts", NULL) && has(st, "4.ts", "xxxx"), "segments evicted");
+
+  mc_store_free(st);
+}
+
+static void *publisher(void *ctx) {
+  mc_store *st = ctx;
+  usleep(20000);
+  mc_store_put(st, "0.ts", "part", 4);
+  for (unsigned v = 1; v <= 3; v++) {
+    usleep(10000);
+    mc_store_adopt_version(st, "pl.m3u8", mc_strdup("pl"), 2, v);
+  }
+  return NULL;
+}
+
+static void test_wait(void) {
+  mc_store *st = mc_store_new(0);
+  pthread_t t;
+
+  ok(!mc_store_wait(st, "none.ts", 0, 1000), "unexpected miss doesn't wait");
+
+  mc_store_adopt_version(st, "pl.m3u8", mc_strdup("pl"), 2, 0);
+  mc_store_expect(st, "0.ts");
+  ok(has(st, "0.ts", NULL), "expected object isn't there yet");
+
+  pthread_create(&t, NULL, publisher, st);
+
+  mc_store_obj *obj = mc_store_wait(st, "0.ts", 0, 5000);
+  ok(obj && obj->len == 4, "waited for expected object");
+  mc_store_release(st, obj);
+
+  obj = mc_store_wait(st, "pl.m3u8", 3, 5000);
+  ok(obj && obj->version == 3, "waited for version");
+  mc_store_release(st, obj);
+
+  pthread_join(t, NULL);
+
+  ok(!mc_store_wait(st, "pl.m3u8", 4, 10), "wait times out");
+
+  mc_store_free(st);
+}
+
+void test_main(void) {
+  scope {
+    test_basic();
+    test_refs();
+    test_evict();
+    test_wait();
+  }
+}
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
@@ -16,6 +16,7 @@ int nest_out(void);
 int ok(int flag, const char *msg, ...);
 int pass(const char *msg, ...);
 int fail(const char *msg, ...);
+int skip(const char *why, ...);
 int is(long long got, long long want, const char *msg, ...);
 int not_null(const void *p, const char *msg, ...);
 int null(const void *p, const char *msg, ...);
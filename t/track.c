@@ -0,0 +1,86 @@
+/* track.t */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <libavformat/avformat.h>
+
+#include "framework.h"
+#include "jd_test.h"
+#include "tap.h"
+
+#include "jd_pretty.h"
+
+#include "mc_track.h"
+
+static void add_stream(AVFormatContext *ic, enum AVMediaType type,
+                       const char *lang) {
+  AVStream *st = avformat_new_stream(ic, NULL);
+  st->codec->codec_type = type;
+  if (lang) av_dict_set(&st->metadata, "language", lang, 0);
+}
+
+/* video, eng audio, fra audio, eng subtitles, audio */
+static AVFormatContext *fake_input(void) {
+  AVFormatContext *ic = avformat_alloc_context();
+  add_stream(ic, AVMEDIA_TYPE_VIDEO, NULL);
+  add_stream(ic, AVMEDIA_TYPE_AUDIO, "eng");
+  add_stream(ic, AVMEDIA_TYPE_AUDIO, "fra");
+  add_stream(ic, AVMEDIA_TYPE_SUBTITLE, "eng");
+  add_stream(ic, AVMEDIA_TYPE_AUDIO, NULL);
+  return ic;
+}
+
+static int find(AVFormatContext *ic, enum AVMediaType type, jd_var *sel) {
+  mc_track t;
+  return mc_track_find(ic, mc_track_parse(&t, type, sel));
+}
+
+static void test_find(void) {
+  AVFormatContext *ic = fake_input();
+
+  ok(find(ic, AVMEDIA_TYPE_VIDEO, NULL) == 0, "best video");
+  ok(find(ic, AVMEDIA_TYPE_AUDIO, jd_niv(0)) == 1, "audio 0");
+  ok(find(ic, AVMEDIA_TYPE_AUDIO, jd_niv(2)) == 4, "audio 2");
+  ok(find(ic, AVMEDIA_TYPE_AUDIO, jd_niv(3)) == -1, "no audio 3");
+  ok(find(ic, AVMEDIA_TYPE_AUDIO, jd_nsv("fra")) == 2, "fra audio");
+  ok(find(ic, AVMEDIA_TYPE_SUBTITLE, jd_nsv("eng")) == 3, "eng subtitles");
+  ok(find(ic, AVMEDIA_TYPE_SUBTITLE, jd_nsv("fra")) == -1, "no fra subtitles");
+  ok(find(ic, AVMEDIA_TYPE_SUBTITLE, jd_niv(0)) == 3, "subtitle 0");
+
+  avformat_free_context(ic);
+}
+
+static void check_name(enum AVMediaType type, jd_var *sel, const char *want) {
+  mc_track t;
+  char buf[64];
+  mc_track_name(buf, sizeof(buf), mc_track_parse(&t, type, sel));
+  ok(!strcmp(buf, want), "name: %s", buf);
+}
+
+static void test_name(void) {
+  check_name(AVMEDIA_TYPE_VIDEO, NULL, "best video");
+  check_name(AVMEDIA_TYPE_AUDIO, jd_niv(1), "audio 1");
+  check_name(AVMEDIA_TYPE_SUBTITLE, jd_nsv("deu"), "deu subtitle");
+}
+
+static void parse(void *ctx) {
+  mc_track t;
+  mc_track_parse(&t, AVMEDIA_TYPE_AUDIO, ctx);
+}
+
+static void test_bad(void) {
+  jdt_throws(parse, jd_niv(-1), "Bad track number: -1", "negative track");
+  jdt_throws(parse, jd_nsv(""), "Bad track language: ", "empty language");
+}
+
+void test_main(void) {
+  scope {
+    test_find();
+    test_name();
+    test_bad();
+  }
+}
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
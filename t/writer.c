@@ -0,0 +1,320 @@
+/* writer.t */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "framework.h"
+#include "tap.h"
+
+#include "jd_pretty.h"
+
+#include "mc_util.h"
+#include "mc_writer.h"
+
+static char *path(const char *dir, const char *name) {
+  char *p = mc_alloc(strlen(dir) + strlen(name) + 2);
+  sprintf(p, "%s/%s", dir, name);
+  return p;
+}
+
+static char *slurp(const char *name, size_t *lenp) {
+  FILE *fl = fopen(name, "r");
+  if (!fl) return NULL;
+  fseek(fl, 0, SEEK_END);
+  size_t len = ftell(fl);
+  rewind(fl);
+  char *buf = mc_alloc(len + 1);
+  if (fread(buf, 1, len, fl) != len) die("Short read on %s", name);
+  fclose(fl);
+  *lenp = len;
+  return buf;
+}
+
+static void test_writer(void) {
+  char dir[] = "/tmp/mc-writer-XXXXXX";
+  if (!mkdtemp(dir)) die("Can't make temp dir");
+
+  char *temp = path(dir, "sub/seg.tmp");
+  char *name = path(dir, "sub/seg.ts");
+  char *pl_temp = path(dir, "pl.tmp");
+  char *pl_name = path(dir, "pl.m3u8");
+  char *old = path(dir, "old.ts");
+  char chunk[10];
+  size_t len;
+
+  FILE *fl = fopen(old, "w");
+  fclose(fl);
+
+  /* tiny in-flight limit so the producer has to wait for the pool */
+  mc_writer_pool *wp = mc_writer_pool_new(2, 64);
+  mc_writer *w = mc_writer_new(wp, NULL, MC_WRITER_DISK | MC_WRITER_FSYNC);
+
+  mc_writer_open(w, temp);
+  for (unsigned i = 0; i < 100; i++) {
+    memset(chunk, 'a' + i % 26, sizeof(chunk));
+    mc_writer_write(w, chunk, sizeof(chunk));
+  }
+  mc_writer_close(w, temp, name, NULL);
+  mc_writer_save(w, "#EXTM3U\n", 8, pl_temp, pl_name, NULL);
+  mc_writer_unlink(w, old, NULL);
+
+  mc_writer_free(w);
+  mc_writer_pool_free(wp);
+
+  char *got = slurp(name, &len);
+  ok(got != NULL, "segment renamed into place");
+  ok(access(temp, F_OK) != 0, "temp file gone");
+  if (got) {
+    unsigned good = len == 1000;
+    for (unsigned i = 0; good && i < len; i++)
+      if (got[i] != (char) ('a' + (i / 10) % 26)) good = 0;
+    ok(good, "segment contents intact");
+    free(got);
+  }
+
+  got = slurp(pl_name, &len);
+  ok(got && len == 8 && !memcmp(got, "#EXTM3U\n", 8), "playlist saved");
+  free(got);
+
+  ok(access(old, F_OK) != 0, "old segment purged");
+
+  char *sub = mc_dirname(name);
+  unlink(name);
+  unlink(pl_name);
+  rmdir(sub);
+  rmdir(dir);
+
+  free(sub);
+  free(temp);
+  free(name);
+  free(pl_temp);
+  free(pl_name);
+  free(old);
+}
+
+/* memory only: nothing touches the disk */
+static void test_store(void) {
+  mc_writer_pool *wp = mc_writer_pool_new(1, 1024);
+  mc_store *st = mc_store_new(0);
+  mc_writer *w = mc_writer_new(wp, st, 0);
+  const char *temp = "/nonexistent/seg.tmp";
+  const char *name = "/nonexistent/seg.ts";
+
+  mc_writer_open(w, temp);
+  mc_writer_write(w, "hello, ", 7);
+  mc_writer_write(w, "world", 5);
+  mc_writer_close(w, temp, name, "seg.ts");
+  mc_writer_save(w, "#EXTM3U\n", 8, temp, name, "pl.m3u8");
+  mc_writer_open(w, temp);
+  mc_writer_write(w, "gone", 4);
+  mc_writer_close(w, temp, name, "old.ts");
+  mc_writer_unlink(w, name, "old.ts");
+  mc_writer_free(w);
+
+  mc_store_obj *obj = mc_store_get(st, "seg.ts");
+  ok(obj && obj->len == 12 && !memcmp(obj->data, "hello, world", 12),
+     "segment published");
+  mc_store_release(st, obj);
+
+  obj = mc_store_get(st, "pl.m3u8");
+  ok(obj && obj->len == 8, "playlist published");
+  mc_store_release(st, obj);
+
+  ok(!mc_store_get(st, "old.ts"), "purged segment removed");
+  ok(access(name, F_OK) != 0, "nothing written to disk");
+
+  mc_store_free(st);
+  mc_writer_pool_free(wp);
+}
+
+/* writers sharing a store keep their files apart by space */
+static void test_space(void) {
+  mc_writer_pool *wp = mc_writer_pool_new(1, 1024);
+  mc_store *st = mc_store_new(0);
+  mc_writer *one = mc_writer_new(wp, st, 0);
+  mc_writer *two = mc_writer_new(wp, st, 0);
+  mc_writer_set_space(one, "one");
+  mc_writer_set_space(two, "two");
+
+  mc_writer_save(one, "one", 3, NULL, NULL, "hd.m3u8");
+  mc_writer_save(two, "two", 3, NULL, NULL, "hd.m3u8");
+  mc_writer_save(two, "old", 3, NULL, NULL, "old.ts");
+  mc_writer_unlink(two, NULL, "old.ts");
+  mc_writer_free(one);
+  mc_writer_free(two);
+
+  ok(!mc_store_get(st, "hd.m3u8"), "nothing outside a space");
+
+  mc_store_obj *obj = mc_store_get(st, "one/hd.m3u8");
+  ok(obj && obj->len == 3 && !memcmp(obj->data, "one", 3), "first space");
+  mc_store_release(st, obj);
+
+  obj = mc_store_get(st, "two/hd.m3u8");
+  ok(obj && obj->len == 3 && !memcmp(obj->data, "two", 3), "second space");
+  mc_store_release(st, obj);
+
+  ok(!mc_store_get(st, "two/old.ts"), "removed from its space");
+
+  mc_store_free(st);
+  mc_writer_pool_free(wp);
+}
+
+/* parts are cut from the open file without disturbing it */
+static void test_parts(void) {
+  mc_writer_pool *wp = mc_writer_pool_new(1, 1024);
+  mc_store *st = mc_store_new(0);
+  mc_writer *w = mc_writer_new(wp, st, MC_WRITER_PARTS);
+  const char *temp = "/nonexistent/seg.tmp";
+  const char *name = "/nonexistent/seg.ts";
+
+  mc_writer_expect(w, "seg.0.ts");
+  mc_writer_open(w, temp);
+  mc_writer_write(w, "abc", 3);
+  mc_writer_part(w, temp, name, "seg.0.ts");
+  mc_writer_write(w, "de", 2);
+  mc_writer_write(w, "f", 1);
+  mc_writer_part(w, temp, name, "seg.1.ts");
+  mc_writer_close(w, temp, name, "seg.ts");
+  mc_writer_save_version(w, "#EXTM3U\n", 8, temp, name, "pl.m3u8", 42);
+  mc_writer_free(w);
+
+  mc_store_obj *obj = mc_store_get(st, "seg.0.ts");
+  ok(obj && obj->len == 3 && !memcmp(obj->data, "abc", 3), "first part");
+  mc_store_release(st, obj);
+
+  obj = mc_store_get(st, "seg.1.ts");
+  ok(obj && obj->len == 3 && !memcmp(obj->data, "def", 3), "second part");
+  mc_store_release(st, obj);
+
+  obj = mc_store_get(st, "seg.ts");
+  ok(obj && obj->len == 6 && !memcmp(obj->data, "abcdef", 6), "whole segment");
+  mc_store_release(st, obj);
+
+  obj = mc_store_get(st, "pl.m3u8");
+  ok(obj && obj->version == 42, "playlist version");
+  mc_store_release(st, obj);
+
+  mc_store_free(st);
+  mc_writer_pool_free(wp);
+}
+
+static volatile int held;
+
+static void hold(void *ctx) {
+  (void) ctx;
+  while (held) usleep(1000);
+}
+
+static void woken(void *ctx) {
+  (*(int *) ctx)++;
+}
+
+/* a writer that mustn't block is told when there's room instead */
+static void test_ready(void) {
+  char dir[] = "/tmp/mc-writer-XXXXXX";
+  if (!mkdtemp(dir)) die("Can't make temp dir");
+  char *temp = path(dir, "seg.tmp");
+  char chunk[20];
+  int wakes = 0;
+
+  mc_writer_pool *wp = mc_writer_pool_new(1, 16);
+  mc_writer *busy = mc_writer_new(wp, NULL, MC_WRITER_DISK);
+  mc_writer *w = mc_writer_new(wp, NULL, MC_WRITER_DISK | MC_WRITER_NOWAIT);
+
+  /* keep the only pool thread busy */
+  held = 1;
+  mc_writer_call(busy, hold, NULL);
+
+  ok(mc_writer_ready(w, woken, &wakes), "room to start with");
+  memset(chunk, 'x', sizeof(chunk));
+  mc_writer_open(w, temp);
+  mc_writer_write(w, chunk, sizeof(chunk));
+  mc_writer_write(w, chunk, sizeof(chunk));
+  ok(1, "writes over the limit don't wait");
+  ok(!mc_writer_ready(w, woken, &wakes), "no room while the pool is busy");
+  ok(!mc_writer_ready(w, woken, &wakes), "still no room");
+
+  held = 0;
+  mc_writer_close(w, temp, temp, NULL);
+  mc_writer_sync(w);
+  ok(wakes == 1, "woken once there's room (%d)", wakes);
+  ok(mc_writer_ready(w, woken, &wakes), "room again");
+
+  mc_writer_free(w);
+  mc_writer_free(busy);
+  mc_writer_pool_free(wp);
+
+  unlink(temp);
+  rmdir(dir);
+  free(temp);
+}
+
+static void note_failed(const char *uri, void *ctx) {
+  snprintf(ctx, 32, "%s", uri);
+}
+
+/* a playlist isn't saved until its owner has heard that a segment it
+ * lists failed
+ */
+static void test_failed(void) {
+  char dir[] = "/tmp/mc-writer-XXXXXX";
+  if (!mkdtemp(dir)) die("Can't make temp dir");
+
+  /* a file where the segment's directory should be */
+  char *block = path(dir, "sub");
+  char *temp = path(dir, "sub/seg.tmp");
+  char *name = path(dir, "sub/seg.ts");
+  char *pl_temp = path(dir, "pl.tmp");
+  char *pl_name = path(dir, "pl.m3u8");
+  char failed[32] = "";
+
+  FILE *fl = fopen(block, "w");
+  fclose(fl);
+
+  mc_writer_pool *wp = mc_writer_pool_new(1, 1024);
+  mc_writer *w = mc_writer_new(wp, NULL, MC_WRITER_DISK);
+
+  mc_writer_open(w, temp);
+  mc_writer_write(w, "seg", 3);
+  mc_writer_close(w, temp, name, "seg.ts");
+  mc_writer_save(w, "#EXTM3U\n", 8, pl_temp, pl_name, "pl.m3u8");
+  mc_writer_sync(w);
+
+  ok(access(pl_name, F_OK) != 0, "stale playlist not saved");
+  ok(mc_writer_failed(w, note_failed, failed) == 1, "one failure");
+  ok(!strcmp(failed, "seg.ts"), "failed segment reported");
+  ok(mc_writer_failed(w, note_failed, failed) == 0, "reported once");
+
+  mc_writer_save(w, "#EXTM3U\n", 8, pl_temp, pl_name, "pl.m3u8");
+  mc_writer_sync(w);
+  ok(access(pl_name, F_OK) == 0, "next playlist saved");
+
+  mc_writer_free(w);
+  mc_writer_pool_free(wp);
+
+  unlink(block);
+  unlink(pl_name);
+  rmdir(dir);
+  free(block);
+  free(temp);
+  free(name);
+  free(pl_temp);
+  free(pl_name);
+}
+
+void test_main(void) {
+  scope {
+    test_writer();
+    test_store();
+    test_space();
+    test_parts();
+    test_ready();
+    test_failed();
+  }
+}
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */